@@ -0,0 +1,481 @@
+#define _POSIX_C_SOURCE 200112L
+#include <malloc.h>
+#include <math.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SPIndex.h"
+
+#define SP_INDEX_MANIFEST_MAGIC 0x58495053 // "SPIX"
+#define SP_INDEX_SHARD_MAGIC 0x53495053    // "SPIS"
+#define SP_INDEX_CHECKPOINT_MAGIC 0x43495053 // "SPIC"
+#define SP_INDEX_VERSION 7
+#define SP_INDEX_MANIFEST_SIZE 17 // 4 byte fields of a manifest, including magic and version
+#define SP_INDEX_PARAMS_SIZE 16   // of which the build parameters (compared by spIndexManifestEqual)
+#define SP_INDEX_SHARD_HEADER_SIZE 6
+#define SP_INDEX_DEFAULT_DIM 128
+#define SP_INDEX_PAGE_SIZE 4096
+
+struct sp_index_shard_t {
+	void *map;         // mapped file
+	size_t mapSize;    // size of mapped file
+	int firstImage;
+	int numOfImages;
+	int numOfBins;
+	int dim;
+	int *nFeatures;    // number of features of each image (0 for skipped images)
+	char *skipped;     // 1 for each image skipped by preprocessing
+	const float *hists;
+	const float *features;
+	long *offsets;     // offset of the first feature of each image in features
+};
+
+//Inner function storing a manifest in 4 byte fields (after the magic and version)
+static void manifestToData(const SPIndexManifest *manifest, int32_t *data) {
+	data[2] = manifest->numOfImages;
+	data[3] = manifest->numOfBins;
+	data[4] = manifest->nFeaturesToExtract;
+	data[5] = manifest->shardSize;
+	data[6] = manifest->numOfShards;
+	data[7] = manifest->siftMaxSide;
+	data[8] = manifest->siftTileThreads;
+	data[9] = manifest->siftTileOverlap;
+	data[10] = manifest->histStride;
+	data[11] = manifest->histJitter;
+	data[12] = manifest->histReduction;
+	data[13] = manifest->histDecodedReduction;
+	data[14] = (int32_t) (uint32_t) manifest->sourceHash;
+	data[15] = (int32_t) (uint32_t) (manifest->sourceHash >> 32);
+	data[16] = manifest->numOfSkipped;
+}
+
+//Inner function reading a manifest stored by manifestToData
+static void manifestFromData(const int32_t *data, SPIndexManifest *manifest) {
+	manifest->numOfImages = data[2];
+	manifest->numOfBins = data[3];
+	manifest->nFeaturesToExtract = data[4];
+	manifest->shardSize = data[5];
+	manifest->numOfShards = data[6];
+	manifest->siftMaxSide = data[7];
+	manifest->siftTileThreads = data[8];
+	manifest->siftTileOverlap = data[9];
+	manifest->histStride = data[10];
+	manifest->histJitter = data[11];
+	manifest->histReduction = data[12];
+	manifest->histDecodedReduction = data[13];
+	manifest->sourceHash = (uint64_t) (uint32_t) data[14] | (uint64_t) (uint32_t) data[15] << 32;
+	manifest->numOfSkipped = data[16];
+}
+
+SP_INDEX_MSG spIndexWriteManifest(const char *path, const SPIndexManifest *manifest) {
+	if (path == NULL || manifest == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+
+	int32_t data[SP_INDEX_MANIFEST_SIZE] = {SP_INDEX_MANIFEST_MAGIC, SP_INDEX_VERSION};
+	manifestToData(manifest, data);
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return SP_INDEX_IO_ERROR;
+	size_t written = fwrite(data, sizeof(int32_t), SP_INDEX_MANIFEST_SIZE, file);
+	if (fclose(file) != 0 || written != SP_INDEX_MANIFEST_SIZE)
+		return SP_INDEX_IO_ERROR;
+	return SP_INDEX_SUCCESS;
+}
+
+SP_INDEX_MSG spIndexReadManifest(const char *path, SPIndexManifest *manifest) {
+	if (path == NULL || manifest == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+
+	int32_t data[SP_INDEX_MANIFEST_SIZE];
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return SP_INDEX_IO_ERROR;
+	size_t read = fread(data, sizeof(int32_t), SP_INDEX_MANIFEST_SIZE, file);
+	fclose(file);
+	if (read >= 2 && (data[0] != SP_INDEX_MANIFEST_MAGIC || data[1] != SP_INDEX_VERSION))
+		return SP_INDEX_INVALID_FORMAT;
+	if (read != SP_INDEX_MANIFEST_SIZE)
+		return SP_INDEX_IO_ERROR;
+	manifestFromData(data, manifest);
+	return SP_INDEX_SUCCESS;
+}
+
+bool spIndexManifestEqual(const SPIndexManifest *manifest, const SPIndexManifest *other) {
+	if (manifest == NULL || other == NULL)
+		return false;
+	int32_t data[SP_INDEX_MANIFEST_SIZE], otherData[SP_INDEX_MANIFEST_SIZE];
+	manifestToData(manifest, data);
+	manifestToData(other, otherData);
+	return memcmp(data + 2, otherData + 2, (SP_INDEX_PARAMS_SIZE - 2)*sizeof(int32_t)) == 0;
+}
+
+SP_INDEX_MSG spIndexWriteCheckpoint(const char *path, const SPIndexManifest *manifest,
+		int completedShards) {
+	if (path == NULL || manifest == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+
+	// written to a temporary file and renamed, so a checkpoint is never partial
+	char *tmpPath = (char*) malloc(strlen(path) + 5);
+	if (tmpPath == NULL)
+		return SP_INDEX_OUT_OF_MEMORY;
+	sprintf(tmpPath, "%s.tmp", path);
+	int32_t data[SP_INDEX_MANIFEST_SIZE + 1] = {SP_INDEX_CHECKPOINT_MAGIC, SP_INDEX_VERSION};
+	manifestToData(manifest, data);
+	data[SP_INDEX_MANIFEST_SIZE] = completedShards;
+	FILE *file = fopen(tmpPath, "wb");
+	if (file == NULL) {
+		free(tmpPath);
+		return SP_INDEX_IO_ERROR;
+	}
+	size_t written = fwrite(data, sizeof(int32_t), SP_INDEX_MANIFEST_SIZE + 1, file);
+	bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+	if (fclose(file) != 0 || !ok || written != SP_INDEX_MANIFEST_SIZE + 1 ||
+			rename(tmpPath, path) != 0) {
+		remove(tmpPath);
+		free(tmpPath);
+		return SP_INDEX_IO_ERROR;
+	}
+	free(tmpPath);
+	return SP_INDEX_SUCCESS;
+}
+
+SP_INDEX_MSG spIndexReadCheckpoint(const char *path, SPIndexManifest *manifest,
+		int *completedShards) {
+	if (path == NULL || manifest == NULL || completedShards == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+
+	int32_t data[SP_INDEX_MANIFEST_SIZE + 1];
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return SP_INDEX_IO_ERROR;
+	size_t read = fread(data, sizeof(int32_t), SP_INDEX_MANIFEST_SIZE + 1, file);
+	fclose(file);
+	if (read >= 2 && (data[0] != SP_INDEX_CHECKPOINT_MAGIC || data[1] != SP_INDEX_VERSION))
+		return SP_INDEX_INVALID_FORMAT;
+	if (read != SP_INDEX_MANIFEST_SIZE + 1)
+		return SP_INDEX_IO_ERROR;
+	manifestFromData(data, manifest);
+	*completedShards = data[SP_INDEX_MANIFEST_SIZE];
+	return SP_INDEX_SUCCESS;
+}
+
+void spIndexShardPath(char *dest, const char *path, int shard) {
+	sprintf(dest, "%s.%d", path, shard);
+}
+
+void spIndexCheckpointPath(char *dest, const char *path) {
+	sprintf(dest, "%s.checkpoint", path);
+}
+
+//Inner function writing a point as an array of floats
+static bool writePoint(FILE *file, SPPoint *point) {
+	int dim = spPointGetDimension(point);
+	for (int i=0; i<dim; i++) {
+		float val = (float) spPointGetAxisCoor(point, i);
+		if (fwrite(&val, sizeof(float), 1, file) != 1)
+			return false;
+	}
+	return true;
+}
+
+SP_INDEX_MSG spIndexWriteShard(const char *path, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, const char *skipped, int firstImage, int numOfImages, int numOfBins) {
+	if (path == NULL || histDB == NULL || siftDB == NULL || nFeatures == NULL || numOfImages <= 0)
+		return SP_INDEX_INVALID_ARGUMENT;
+
+	// feature dimension is taken from the first feature in the shard
+	int dim = SP_INDEX_DEFAULT_DIM;
+	for (int i=numOfImages-1; i>=0; i--)
+		if (nFeatures[i] > 0)
+			dim = spPointGetDimension(siftDB[i][0]);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return SP_INDEX_IO_ERROR;
+
+	// header and number of features
+	bool ok = true;
+	int32_t header[SP_INDEX_SHARD_HEADER_SIZE] = {SP_INDEX_SHARD_MAGIC, SP_INDEX_VERSION,
+			firstImage, numOfImages, numOfBins, dim};
+	ok = ok && fwrite(header, sizeof(int32_t), SP_INDEX_SHARD_HEADER_SIZE, file) == SP_INDEX_SHARD_HEADER_SIZE;
+	for (int i=0; ok && i<numOfImages; i++) {
+		int32_t n = skipped != NULL && skipped[i] ? SP_INDEX_SKIPPED_IMAGE : nFeatures[i];
+		ok = fwrite(&n, sizeof(int32_t), 1, file) == 1;
+	}
+
+	// histograms
+	for (int i=0; ok && i<numOfImages; i++)
+		for (int j=0; ok && j<3; j++)
+			ok = writePoint(file, histDB[i][j]);
+
+	// sift features
+	for (int i=0; ok && i<numOfImages; i++)
+		for (int j=0; ok && (skipped == NULL || !skipped[i]) && j<nFeatures[i]; j++)
+			ok = writePoint(file, siftDB[i][j]);
+
+	if (fclose(file) != 0 || !ok)
+		return SP_INDEX_IO_ERROR;
+	return SP_INDEX_SUCCESS;
+}
+
+SPIndexShard* spIndexShardOpen(const char *path) {
+	if (path == NULL)
+		return NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < SP_INDEX_SHARD_HEADER_SIZE*sizeof(int32_t)) {
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // mapping stays valid after closing the descriptor
+	if (map == MAP_FAILED)
+		return NULL;
+
+	SPIndexShard *res = (SPIndexShard*) malloc(sizeof(*res));
+	if (res == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	res->map = map;
+	res->mapSize = st.st_size;
+	res->nFeatures = NULL;
+	res->skipped = NULL;
+	res->offsets = NULL;
+
+	// parse and validate header
+	const int32_t *header = (const int32_t*) map;
+	res->firstImage = header[2];
+	res->numOfImages = header[3];
+	res->numOfBins = header[4];
+	res->dim = header[5];
+	if (header[0] != SP_INDEX_SHARD_MAGIC || header[1] != SP_INDEX_VERSION ||
+			res->numOfImages <= 0 || res->numOfBins <= 0 || res->dim <= 0 ||
+			res->mapSize < (SP_INDEX_SHARD_HEADER_SIZE + (size_t) res->numOfImages*(1 + 3*res->numOfBins))*4) {
+		spIndexShardClose(res);
+		return NULL;
+	}
+	const int32_t *counts = header + SP_INDEX_SHARD_HEADER_SIZE;
+	res->hists = (const float*) (counts + res->numOfImages);
+	res->features = res->hists + (size_t) res->numOfImages*3*res->numOfBins;
+
+	// compute number of features, skipped flag and feature offsets of each image
+	res->nFeatures = (int*) malloc(res->numOfImages * sizeof(int));
+	res->skipped = (char*) malloc(res->numOfImages * sizeof(char));
+	res->offsets = (long*) malloc(res->numOfImages * sizeof(long));
+	if (res->nFeatures == NULL || res->skipped == NULL || res->offsets == NULL) {
+		spIndexShardClose(res);
+		return NULL;
+	}
+	long total = 0;
+	for (int i=0; i<res->numOfImages; i++) {
+		if (counts[i] < 0 && counts[i] != SP_INDEX_SKIPPED_IMAGE) {
+			spIndexShardClose(res);
+			return NULL;
+		}
+		res->skipped[i] = counts[i] == SP_INDEX_SKIPPED_IMAGE;
+		res->nFeatures[i] = res->skipped[i] ? 0 : counts[i];
+		res->offsets[i] = total;
+		total += res->nFeatures[i];
+	}
+	if ((size_t) ((const char*) (res->features + total*res->dim) - (const char*) map) > res->mapSize) {
+		spIndexShardClose(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+void spIndexShardClose(SPIndexShard *shard) {
+	if (shard != NULL) {
+		munmap(shard->map, shard->mapSize);
+		free(shard->nFeatures);
+		free(shard->skipped);
+		free(shard->offsets);
+		free(shard);
+	}
+}
+
+int spIndexShardFirstImage(SPIndexShard *shard) {
+	assert(shard != NULL);
+	return shard->firstImage;
+}
+
+int spIndexShardNumOfImages(SPIndexShard *shard) {
+	assert(shard != NULL);
+	return shard->numOfImages;
+}
+
+int spIndexShardNumOfFeatures(SPIndexShard *shard, int image) {
+	assert(shard != NULL);
+	assert(image >= 0 && image < shard->numOfImages);
+	return shard->nFeatures[image];
+}
+
+//Inner function creating a point from an array of floats
+static SPPoint* readPoint(const float *data, double *buf, int dim, int index) {
+	for (int i=0; i<dim; i++)
+		buf[i] = (double) data[i];
+	return spPointCreate(buf, dim, index);
+}
+
+SP_INDEX_MSG spIndexShardLoad(SPIndexShard *shard, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, char *skipped) {
+	if (shard == NULL || histDB == NULL || siftDB == NULL || nFeatures == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+	if (skipped != NULL)
+		memcpy(skipped, shard->skipped, shard->numOfImages * sizeof(char));
+
+	int dim = shard->dim > shard->numOfBins ? shard->dim : shard->numOfBins;
+	double *buf = (double*) malloc(dim*sizeof(double));
+	if (buf == NULL)
+		return SP_INDEX_OUT_OF_MEMORY;
+	for (int i=0; i<shard->numOfImages; i++) {
+		histDB[i] = NULL;
+		siftDB[i] = NULL;
+		nFeatures[i] = 0;
+	}
+
+	bool ok = true;
+	for (int i=0; ok && i<shard->numOfImages; i++) {
+		int index = shard->firstImage + i;
+		// histogram (allocated with calloc, so a partial one can be destroyed)
+		histDB[i] = (SPPoint**) calloc(3, sizeof(SPPoint*));
+		ok = histDB[i] != NULL;
+		for (int c=0; ok && c<3; c++) {
+			histDB[i][c] = readPoint(shard->hists + ((size_t) i*3 + c)*shard->numOfBins,
+					buf, shard->numOfBins, index);
+			ok = histDB[i][c] != NULL;
+		}
+		// sift features (at least one slot, so an image without features is not NULL)
+		int n = shard->nFeatures[i];
+		siftDB[i] = (SPPoint**) calloc(n > 0 ? n : 1, sizeof(SPPoint*));
+		ok = ok && siftDB[i] != NULL;
+		for (int j=0; ok && j<n; j++) {
+			siftDB[i][j] = readPoint(shard->features + (shard->offsets[i] + j)*shard->dim,
+					buf, shard->dim, index);
+			ok = siftDB[i][j] != NULL;
+			if (ok)
+				nFeatures[i]++;
+		}
+	}
+
+	free(buf);
+	return ok ? SP_INDEX_SUCCESS : SP_INDEX_OUT_OF_MEMORY;
+}
+
+//Inner function advising the kernel that a range of the mapped shard will be read
+static void adviseRange(SPIndexShard *shard, const void *start, size_t size, bool sequential) {
+	// ranges are extended to page boundaries (the mapping itself is page aligned)
+	if (size == 0)
+		return;
+	size_t begin = (size_t) ((const char*) start - (const char*) shard->map);
+	size_t end = begin + size;
+	begin -= begin % SP_INDEX_PAGE_SIZE;
+	if (end > shard->mapSize)
+		end = shard->mapSize;
+	char *base = (char*) shard->map + begin;
+	if (sequential)
+		posix_madvise(base, end - begin, POSIX_MADV_SEQUENTIAL);
+	posix_madvise(base, end - begin, POSIX_MADV_WILLNEED);
+}
+
+long spIndexShardWarmUp(SPIndexShard *shard) {
+	if (shard == NULL)
+		return 0;
+	adviseRange(shard, shard->map, shard->mapSize, true);
+	// read one byte of every page so the pages are mapped before the first search
+	const volatile char *data = (const volatile char*) shard->map;
+	char sum = 0;
+	for (size_t offset=0; offset<shard->mapSize; offset+=SP_INDEX_PAGE_SIZE)
+		sum ^= data[offset];
+	(void) sum;
+	return (long) shard->mapSize;
+}
+
+SP_INDEX_MSG spIndexShardHistDistances(SPIndexShard *shard, SPPoint **qhist, double *dists) {
+	if (shard == NULL || qhist == NULL || dists == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+	for (int c=0; c<3; c++)
+		if (spPointGetDimension(qhist[c]) != shard->numOfBins)
+			return SP_INDEX_INVALID_ARGUMENT;
+
+	// only the histograms are read - fault in just their pages
+	adviseRange(shard, shard->hists, (size_t) shard->numOfImages*3*shard->numOfBins*sizeof(float), false);
+
+	// same summation order as spRGBHistL2Distance
+	for (int i=0; i<shard->numOfImages; i++) {
+		if (shard->skipped[i]) {
+			dists[i] = HUGE_VAL;
+			continue;
+		}
+		const float *hist = shard->hists + (size_t) i*3*shard->numOfBins;
+		double dist = 0;
+		for (int c=0; c<3; c++) {
+			double channelDist = 0;
+			for (int j=0; j<shard->numOfBins; j++) {
+				double diff = spPointGetAxisCoor(qhist[c], j) - (double) hist[c*shard->numOfBins + j];
+				channelDist = channelDist + diff*diff;
+			}
+			dist += 0.33*channelDist;
+		}
+		dists[i] = dist;
+	}
+	return SP_INDEX_SUCCESS;
+}
+
+SP_INDEX_MSG spIndexShardSearch(SPIndexShard *shard, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected) {
+	if (shard == NULL || queries == NULL || queues == NULL)
+		return SP_INDEX_INVALID_ARGUMENT;
+	int dim = shard->dim;
+	for (int q=0; q<numOfQueries; q++)
+		if (spPointGetDimension(queries[q]) != dim)
+			return SP_INDEX_INVALID_ARGUMENT;
+
+	// copy query coordinates once instead of once per compared feature
+	double *qdata = (double*) malloc((size_t) numOfQueries*dim*sizeof(double));
+	if (qdata == NULL && numOfQueries > 0)
+		return SP_INDEX_OUT_OF_MEMORY;
+	for (int q=0; q<numOfQueries; q++)
+		for (int j=0; j<dim; j++)
+			qdata[(size_t) q*dim + j] = spPointGetAxisCoor(queries[q], j);
+
+	// features are scanned front to back - ask for aggressive readahead
+	// of all features, or of the features of each selected image
+	long numOfFeatures = shard->offsets[shard->numOfImages-1] + shard->nFeatures[shard->numOfImages-1];
+	if (selected == NULL)
+		adviseRange(shard, shard->features, (size_t) numOfFeatures*dim*sizeof(float), true);
+
+	for (int i=0; i<shard->numOfImages; i++) {
+		int index = shard->firstImage + i;
+		if (selected != NULL && !selected[index])
+			continue;
+		if (selected != NULL)
+			adviseRange(shard, shard->features + shard->offsets[i]*dim,
+					(size_t) shard->nFeatures[i]*dim*sizeof(float), true);
+		const float *features = shard->features + shard->offsets[i]*dim;
+		for (int f=0; f<shard->nFeatures[i]; f++) {
+			const float *feature = features + (size_t) f*dim;
+			for (int q=0; q<numOfQueries; q++) {
+				// same summation order as spPointL2SquaredDistance
+				const double *query = qdata + (size_t) q*dim;
+				double dist = 0;
+				for (int j=0; j<dim; j++)
+					dist = dist + (query[j] - (double) feature[j])*(query[j] - (double) feature[j]);
+				spBPQueueEnqueue(queues[q], index, dist);
+			}
+		}
+	}
+
+	free(qdata);
+	return SP_INDEX_SUCCESS;
+}
@@ -0,0 +1,306 @@
+#ifndef SPINDEX_H_
+#define SPINDEX_H_
+#include <stdint.h>
+#include "SPPoint.h"
+#include "SPBPriorityQueue.h"
+
+/**
+ * SP Index summary
+ * On-disk storage of image descriptors (RGB histograms and sift features),
+ * used to search databases which do not fit in memory.
+ *
+ * An index is made of a manifest file holding the build parameters, and of
+ * shard files, each holding the descriptors of a consecutive range of images.
+ * Shard i of the index "path" is stored in the file "path.i".
+ * Descriptors are stored as floats (the type OpenCV computes them in) so
+ * distances computed from a shard are identical to the in-memory ones.
+ *
+ * Shard file layout (all fields are 4 bytes wide):
+ *   header     - magic, version, firstImage, numOfImages, numOfBins, dim
+ *   nFeatures  - number of sift features of each image (SP_INDEX_SKIPPED_IMAGE
+ *                for an image skipped by preprocessing, which has no features)
+ *   histograms - 3 * numOfBins values for each image (R, G, B channels)
+ *   features   - dim values for each feature, images are stored consecutively
+ *
+ * Shards are memory mapped when opened, and pages are only faulted in when a
+ * search reads them: histogram distances read the histograms only, and the
+ * sift search reads (with sequential readahead advice) the features of the
+ * searched images only. Opening a shard reads just its header and the number
+ * of features of each image, from which per-image feature offsets are computed.
+ *
+ * The following functions are supported:
+ *
+ * spIndexWriteManifest      - Writes the index manifest
+ * spIndexReadManifest       - Reads the index manifest
+ * spIndexManifestEqual      - Compares the build parameters of two indexes
+ * spIndexWriteCheckpoint    - Writes the progress of an index build
+ * spIndexReadCheckpoint     - Reads the progress of an index build
+ * spIndexShardPath          - Builds the file name of a shard
+ * spIndexCheckpointPath     - Builds the file name of the build checkpoint
+ * spIndexWriteShard         - Writes the descriptors of a range of images to a shard
+ * spIndexShardOpen          - Maps a shard file into memory
+ * spIndexShardClose         - Unmaps a shard and frees its resources
+ * spIndexShardFirstImage    - A getter of the index of the first image in a shard
+ * spIndexShardNumOfImages   - A getter of the number of images in a shard
+ * spIndexShardNumOfFeatures - A getter of the number of sift features of an image
+ * spIndexShardWarmUp        - Faults in all pages of a shard
+ * spIndexShardLoad          - Copies the descriptors of a shard into memory
+ * spIndexShardHistDistances - Computes histogram distances to all images in a shard
+ * spIndexShardSearch        - Finds the closest sift features in a shard
+ */
+
+/** Number of features stored for an image skipped by preprocessing **/
+#define SP_INDEX_SKIPPED_IMAGE -1
+
+/** Type for defining an open shard **/
+typedef struct sp_index_shard_t SPIndexShard;
+
+/** Index build parameters, stored in the manifest **/
+typedef struct sp_index_manifest_t {
+	int numOfImages;
+	int numOfBins;
+	int nFeaturesToExtract;
+	int shardSize;
+	int numOfShards;
+	int siftMaxSide;  // maximum side of images sift features were extracted from (0 - full)
+	int siftTileThreads; // maximum number of tiles sift features were extracted from (0 - whole images)
+	int siftTileOverlap; // overlap of the tiles in pixels
+	int histStride;   // side of the pixel blocks histograms were sampled from (1 - all pixels)
+	int histJitter;   // 1 if a hashed pixel of each block was sampled, 0 for its center
+	int histReduction; // reduction of the images for their histograms (1 - whole images)
+	int histDecodedReduction; // of which the reduction made by the decoder (the rest by the stride)
+	uint64_t sourceHash; // hash of the paths, sizes and modification times of the images
+	int numOfSkipped; // number of images skipped by the build (not a build parameter)
+} SPIndexManifest;
+
+/** type for error reporting **/
+typedef enum sp_index_msg_t {
+	SP_INDEX_OUT_OF_MEMORY,
+	SP_INDEX_IO_ERROR,
+	SP_INDEX_INVALID_FORMAT,
+	SP_INDEX_INVALID_ARGUMENT,
+	SP_INDEX_SUCCESS
+} SP_INDEX_MSG;
+
+/**
+ * Writes the index manifest to the file path (overwriting it).
+ *
+ * @param path - the index path
+ * @param manifest - the build parameters of the index
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the arguments is NULL
+ *         SP_INDEX_IO_ERROR if the file could not be written
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexWriteManifest(const char *path, const SPIndexManifest *manifest);
+
+/**
+ * Reads the index manifest from the file path.
+ *
+ * @param path - the index path
+ * @param manifest - the address in which the build parameters will be stored
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the arguments is NULL
+ *         SP_INDEX_IO_ERROR if the file could not be read
+ *         SP_INDEX_INVALID_FORMAT if the file is not an index manifest
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexReadManifest(const char *path, SPIndexManifest *manifest);
+
+/**
+ * Compares the build parameters of two indexes
+ *
+ * @return true if all build parameters are equal (numOfSkipped is not
+ *         compared), false otherwise (or if any of the arguments is NULL)
+ */
+bool spIndexManifestEqual(const SPIndexManifest *manifest, const SPIndexManifest *other);
+
+/**
+ * Writes the progress of an index build to the file path (replacing it
+ * atomically, so a crash leaves either the old or the new checkpoint).
+ * Shards 0, ..., completedShards-1 are complete, so a build can be resumed
+ * from shard completedShards.
+ *
+ * @param path - the checkpoint file name
+ * @param manifest - the build parameters of the index (numOfSkipped is the
+ *                   number of images skipped so far)
+ * @param completedShards - number of shards written so far
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the pointers is NULL
+ *         SP_INDEX_OUT_OF_MEMORY in case of allocation failure
+ *         SP_INDEX_IO_ERROR if the file could not be written
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexWriteCheckpoint(const char *path, const SPIndexManifest *manifest,
+		int completedShards);
+
+/**
+ * Reads the progress of an index build from the file path.
+ *
+ * @param path - the checkpoint file name
+ * @param manifest - the address in which the build parameters will be stored
+ * @param completedShards - the address in which the number of written shards will be stored
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the arguments is NULL
+ *         SP_INDEX_IO_ERROR if the file could not be read
+ *         SP_INDEX_INVALID_FORMAT if the file is not a checkpoint
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexReadCheckpoint(const char *path, SPIndexManifest *manifest,
+		int *completedShards);
+
+/**
+ * Builds the file name of shard number shard of the index path
+ * ("path.shard"). dest is assumed to be large enough.
+ *
+ * @param dest - the address in which the file name will be stored
+ * @param path - the index path
+ * @param shard - the shard number
+ */
+void spIndexShardPath(char *dest, const char *path, int shard);
+
+/**
+ * Builds the file name of the build checkpoint of the index path
+ * ("path.checkpoint"). dest is assumed to be large enough.
+ *
+ * @param dest - the address in which the file name will be stored
+ * @param path - the index path
+ */
+void spIndexCheckpointPath(char *dest, const char *path);
+
+/**
+ * Writes the descriptors of images firstImage, ..., firstImage+numOfImages-1
+ * to the shard file path (overwriting it).
+ * The arrays are indexed relative to firstImage, i.e. histDB[0] is the
+ * histogram of image firstImage.
+ *
+ * @param path - the shard file name
+ * @param histDB - histograms of the images (3 points of dimension numOfBins each)
+ * @param siftDB - sift features of the images
+ * @param nFeatures - number of sift features of each image
+ * @param skipped - if not NULL, images i for which skipped[i] is non zero are
+ *                  stored as skipped by preprocessing (their features are not stored)
+ * @param firstImage - index of the first image in the shard
+ * @param numOfImages - number of images in the shard (must be > 0)
+ * @param numOfBins - number of bins in each histogram
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the pointers is NULL or numOfImages <= 0
+ *         SP_INDEX_OUT_OF_MEMORY in case of allocation failure
+ *         SP_INDEX_IO_ERROR if the file could not be written
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexWriteShard(const char *path, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, const char *skipped, int firstImage, int numOfImages, int numOfBins);
+
+/**
+ * Maps the shard file path into memory.
+ *
+ * @param path - the shard file name
+ * @return
+ * NULL in case path is NULL, the file could not be mapped, the file is not a
+ * valid shard or allocation failure occurred
+ * Otherwise, the open shard
+ */
+SPIndexShard* spIndexShardOpen(const char *path);
+
+/**
+ * Unmaps a shard and frees all resources associated with it.
+ * If shard is NULL nothing happens.
+ */
+void spIndexShardClose(SPIndexShard *shard);
+
+/**
+ * A getter for the index of the first image in the shard
+ *
+ * @param shard - the source shard
+ * @assert shard != NULL
+ * @return
+ * The index of the first image in the shard
+ */
+int spIndexShardFirstImage(SPIndexShard *shard);
+
+/**
+ * A getter for the number of images in the shard
+ *
+ * @param shard - the source shard
+ * @assert shard != NULL
+ * @return
+ * The number of images in the shard
+ */
+int spIndexShardNumOfImages(SPIndexShard *shard);
+
+/**
+ * A getter for the number of sift features of an image in the shard
+ *
+ * @param shard - the source shard
+ * @param image - the index of the image relative to the first image of the shard
+ * @assert shard != NULL && 0 <= image < number of images in shard
+ * @return
+ * The number of sift features of the image (0 for a skipped image)
+ */
+int spIndexShardNumOfFeatures(SPIndexShard *shard, int image);
+
+/**
+ * Faults in all pages of the shard (with readahead advice), so later
+ * searches of the shard do not wait for the disk.
+ *
+ * @param shard - the source shard
+ * @return the number of bytes faulted in, 0 if shard is NULL
+ */
+long spIndexShardWarmUp(SPIndexShard *shard);
+
+/**
+ * Creates in-memory copies of the descriptors of all images in the shard.
+ * The arrays are indexed relative to the first image of the shard, as in
+ * spIndexWriteShard, and points are given their global image index.
+ * Descriptors are exactly the ones written, since they were computed as floats.
+ * On failure the points created so far are left in the arrays (unset entries
+ * are NULL and nFeatures counts the created features) so they can be destroyed.
+ *
+ * @param shard - the source shard
+ * @param histDB - the address in which the histograms will be stored
+ * @param siftDB - the address in which the sift features will be stored
+ *                 (an image without features gets an array with one NULL slot)
+ * @param nFeatures - the address in which the number of features will be stored
+ * @param skipped - if not NULL, the address in which a flag of each image
+ *                  skipped by preprocessing will be stored (1 if skipped, 0 otherwise)
+ * @return SP_INDEX_INVALID_ARGUMENT if any of histDB, siftDB and nFeatures is NULL
+ *         SP_INDEX_OUT_OF_MEMORY in case of allocation failure
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexShardLoad(SPIndexShard *shard, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, char *skipped);
+
+/**
+ * Computes the histogram distance (as in spRGBHistL2Distance) between the
+ * query histogram and the histogram of every image in the shard.
+ * dists[i] is set to the distance of image firstImage+i, or to HUGE_VAL if
+ * the image was skipped by preprocessing (so it is ranked last).
+ *
+ * @param shard - the source shard
+ * @param qhist - the query histogram (3 points of the shard's number of bins)
+ * @param dists - the address in which the distances will be stored
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the arguments is NULL or the
+ *         histogram dimensions do not match
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexShardHistDistances(SPIndexShard *shard, SPPoint **qhist, double *dists);
+
+/**
+ * Enqueues the L2-squared distance between every query feature and every
+ * sift feature of the images in the shard.
+ * Query feature i is compared against the shard features and the image
+ * indices of the closest ones are kept in queues[i], so searching all the
+ * shards of an index with the same queues gives the same result as
+ * spBestSIFTL2SquaredDistance over the whole database.
+ *
+ * @param shard - the source shard
+ * @param queries - the query features
+ * @param numOfQueries - number of query features
+ * @param queues - a bounded priority queue for each query feature
+ * @param selected - if not NULL, only images i for which selected[i] is
+ *                   non zero are searched (i is the global image index)
+ * @return SP_INDEX_INVALID_ARGUMENT if any of the pointers is NULL or the
+ *         feature dimensions do not match
+ *         SP_INDEX_OUT_OF_MEMORY in case of allocation failure
+ *         SP_INDEX_SUCCESS otherwise
+ */
+SP_INDEX_MSG spIndexShardSearch(SPIndexShard *shard, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected);
+
+#endif /* SPINDEX_H_ */
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "SPLatency.h"
+
+#define SP_LATENCY_SUB_BITS 5
+#define SP_LATENCY_SUB_BUCKETS (1 << SP_LATENCY_SUB_BITS)
+// one bucket range for values below SP_LATENCY_SUB_BUCKETS and one for each
+// power of two from SP_LATENCY_SUB_BITS to 63
+#define SP_LATENCY_NUM_OF_BUCKETS ((64 - SP_LATENCY_SUB_BITS + 1) * SP_LATENCY_SUB_BUCKETS)
+
+struct sp_latency_t {
+	long counts[SP_LATENCY_NUM_OF_BUCKETS];
+	long count;
+	uint64_t max;      // largest recorded value in nanoseconds
+};
+
+//Inner function returning the bucket of a value
+static int bucketOf(uint64_t value) {
+	if (value < SP_LATENCY_SUB_BUCKETS)
+		return (int) value;
+	int exponent = 63 - __builtin_clzll(value);  // >= SP_LATENCY_SUB_BITS
+	int shift = exponent - SP_LATENCY_SUB_BITS;
+	int sub = (int) ((value >> shift) & (SP_LATENCY_SUB_BUCKETS - 1));
+	return (shift + 1)*SP_LATENCY_SUB_BUCKETS + sub;
+}
+
+//Inner function returning the highest value of a bucket
+static uint64_t highestOf(int bucket) {
+	if (bucket < SP_LATENCY_SUB_BUCKETS)
+		return (uint64_t) bucket;
+	int shift = bucket/SP_LATENCY_SUB_BUCKETS - 1;
+	uint64_t sub = (uint64_t) (bucket % SP_LATENCY_SUB_BUCKETS + SP_LATENCY_SUB_BUCKETS);
+	return ((sub + 1) << shift) - 1;
+}
+
+SPLatency* spLatencyCreate(void) {
+	SPLatency *res = (SPLatency*) malloc(sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	spLatencyReset(res);
+	return res;
+}
+
+void spLatencyDestroy(SPLatency *latency) {
+	free(latency);
+}
+
+void spLatencyRecord(SPLatency *latency, double seconds) {
+	if (latency == NULL)
+		return;
+	double nanoseconds = seconds*1e9;
+	uint64_t value = nanoseconds <= 0 ? 0 :
+			nanoseconds >= 1.8e19 ? UINT64_MAX : (uint64_t) nanoseconds;
+	latency->counts[bucketOf(value)]++;
+	latency->count++;
+	if (value > latency->max)
+		latency->max = value;
+}
+
+void spLatencyReset(SPLatency *latency) {
+	if (latency == NULL)
+		return;
+	memset(latency->counts, 0, sizeof(latency->counts));
+	latency->count = 0;
+	latency->max = 0;
+}
+
+void spLatencyMerge(SPLatency *latency, SPLatency *other) {
+	if (latency == NULL || other == NULL)
+		return;
+	for (int bucket=0; bucket<SP_LATENCY_NUM_OF_BUCKETS; bucket++)
+		latency->counts[bucket] += other->counts[bucket];
+	latency->count += other->count;
+	if (other->max > latency->max)
+		latency->max = other->max;
+}
+
+long spLatencyCount(SPLatency *latency) {
+	if (latency == NULL)
+		return 0;
+	return latency->count;
+}
+
+double spLatencyMax(SPLatency *latency) {
+	if (latency == NULL)
+		return 0;
+	return latency->max/1e9;
+}
+
+double spLatencyPercentile(SPLatency *latency, double p) {
+	if (latency == NULL || latency->count == 0)
+		return 0;
+	// rank of the percentile value (at least the first value)
+	long rank = (long) ceil(p*latency->count);
+	if (rank < 1)
+		rank = 1;
+	long seen = 0;
+	for (int bucket=0; bucket<SP_LATENCY_NUM_OF_BUCKETS; bucket++) {
+		seen += latency->counts[bucket];
+		if (seen >= rank) {
+			// never report beyond the largest value
+			uint64_t value = highestOf(bucket);
+			return (value < latency->max ? value : latency->max)/1e9;
+		}
+	}
+	return latency->max/1e9;
+}
@@ -0,0 +1,98 @@
+#ifndef SPLATENCY_H_
+#define SPLATENCY_H_
+
+/**
+ * SP Latency Histogram summary
+ * A latency histogram with bounded relative error (in the style of HDR
+ * histograms), used to report tail percentiles of measured durations.
+ *
+ * Durations are recorded in nanoseconds into log-linear buckets: values below
+ * 32 ns have a bucket each, and every power of two range above is split into
+ * 32 equal buckets, so a value is known within 1/32 (about 3%) of itself.
+ * Recording is constant time and the histogram has a fixed size regardless
+ * of the number or range of recorded values (from 1 ns to centuries).
+ * Percentiles are reported as the highest value of the bucket they fall in,
+ * so they never underestimate.
+ *
+ * The following functions are supported:
+ *
+ * spLatencyCreate        - Creates a new empty histogram
+ * spLatencyDestroy       - Frees all resources associated with a histogram
+ * spLatencyRecord        - Records a duration
+ * spLatencyReset         - Removes all recorded durations
+ * spLatencyMerge         - Records the durations of another histogram
+ * spLatencyCount         - A getter of the number of recorded durations
+ * spLatencyMax           - A getter of the largest recorded duration
+ * spLatencyPercentile    - Returns a percentile of the recorded durations
+ */
+
+/** Type for defining the histogram **/
+typedef struct sp_latency_t SPLatency;
+
+/**
+ * Allocates a new empty histogram.
+ *
+ * @return
+ * NULL in case allocation failure occurred
+ * Otherwise, the new histogram
+ */
+SPLatency* spLatencyCreate(void);
+
+/**
+ * Frees all memory resources associated with the histogram.
+ * If latency is NULL nothing happens.
+ */
+void spLatencyDestroy(SPLatency *latency);
+
+/**
+ * Records a duration (negative durations are recorded as 0).
+ * If latency is NULL nothing happens.
+ *
+ * @param latency - the target histogram
+ * @param seconds - the duration in seconds
+ */
+void spLatencyRecord(SPLatency *latency, double seconds);
+
+/**
+ * Removes all recorded durations.
+ * If latency is NULL nothing happens.
+ */
+void spLatencyReset(SPLatency *latency);
+
+/**
+ * Records all durations recorded by another histogram (for example, to
+ * combine histograms recorded by different threads).
+ * If latency or other is NULL nothing happens.
+ *
+ * @param latency - the target histogram
+ * @param other - the source histogram (unchanged)
+ */
+void spLatencyMerge(SPLatency *latency, SPLatency *other);
+
+/**
+ * A getter for the number of recorded durations
+ *
+ * @param latency - the source histogram
+ * @return the number of recorded durations, 0 if latency is NULL
+ */
+long spLatencyCount(SPLatency *latency);
+
+/**
+ * A getter for the largest recorded duration (exact, not bucketed)
+ *
+ * @param latency - the source histogram
+ * @return the largest duration in seconds, 0 if latency is NULL or empty
+ */
+double spLatencyMax(SPLatency *latency);
+
+/**
+ * Returns the smallest bucket value such that a fraction p of the recorded
+ * durations are at most that value (e.g. p = 0.99 for the 99th percentile).
+ *
+ * @param latency - the source histogram
+ * @param p - the fraction (between 0 and 1)
+ * @return the percentile in seconds, 0 if latency is NULL or empty
+ */
+double spLatencyPercentile(SPLatency *latency, double p);
+
+#endif /* SPLATENCY_H_ */
@@ -16,6 +16,9 @@
  * spPointGetDimension		- A getter of the dimension of a point
  * spPointGetIndex			- A getter of the index of a point
  * spPointGetAxisCoor		- A getter of a given coordinate of the point
+ * spPointGetData			- A getter of all the coordinates of the point
+ * spPointGetMemory		- A getter of the memory used by the point
+ * spPointSetData			- Overwrites the coordinates and index of a point
  * spPointL2SquaredDistance	- Calculates the L2 squared distance between two points
  *
  */
@@ -136,6 +139,53 @@ double spPointGetAxisCoor(SPPoint* point, int axis){
     return point->coor[axis];
 }
 
+/**
+ * A getter for the coordinates of the point (for distance kernels which
+ * scan many points and cannot afford a call per coordinate)
+ *
+ * @param point - The source point
+ * @assert point!=NULL
+ * @return
+ * A pointer to the dim(point) coordinates of the point (owned by the point)
+ */
+const double* spPointGetData(SPPoint* point){
+    assert (point != NULL);
+    return point->coor;
+}
+
+/**
+ * A getter for the memory used by the point (the point and its coordinates)
+ *
+ * @param point - The source point
+ * @param allocated - The address in which the number of bytes actually
+ * 					  allocated is stored (including allocator slack), or NULL
+ * @assert point!=NULL
+ * @return
+ * The number of bytes requested for the point
+ */
+long spPointGetMemory(SPPoint* point, long* allocated){
+    assert (point != NULL);
+    if (allocated != NULL)
+        *allocated = malloc_usable_size(point) + malloc_usable_size(point->coor);
+    return sizeof(*point) + point->dim*sizeof(double);
+}
+
+/**
+ * Overwrites the coordinates and the index of the point, so a point can be
+ * reused for new data of the same dimension without allocating.
+ *
+ * @param point - The target point
+ * @param data - dim(point) new coordinates (copied)
+ * @param index - The new index
+ * @assert point!=NULL && data!=NULL && index>=0
+ */
+void spPointSetData(SPPoint* point, const double* data, int index){
+    assert (point != NULL && data != NULL && index >= 0);
+    for (int i=0; i<point->dim; i++)
+        point->coor[i] = data[i];
+    point->index = index;
+}
+
 /**
  * Calculates the L2-squared distance between p and q.
  * The L2-squared distance is defined as:
@@ -0,0 +1,211 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include "SPQueryCache.h"
+
+#define SP_QUERY_CACHE_FNV_OFFSET 14695981039346656037ULL
+#define SP_QUERY_CACHE_FNV_PRIME 1099511628211ULL
+#define SP_QUERY_CACHE_READ_SIZE 65536
+
+typedef struct sp_query_cache_entry_t {
+	SPQueryCacheKey key;
+	SPPoint **hist;
+	SPPoint **sift;
+	int nFeatures;
+	int *rankings;     // k global then k local image indices, NULL if not cached
+	long lastUsed;     // 0 if the entry is empty
+} SPQueryCacheEntry;
+
+struct sp_query_cache_t {
+	SPQueryCacheEntry *entries;
+	int maxSize;
+	long clock;        // incremented on every use
+};
+
+//Inner function destroying an array of points
+static void destroyPoints(SPPoint **points, int numOfPoints) {
+	if (points != NULL) {
+		for (int i=0; i<numOfPoints; i++)
+			spPointDestroy(points[i]);
+		free(points);
+	}
+}
+
+//Inner function copying an array of points, returns NULL on allocation failure
+static SPPoint** copyPoints(SPPoint **points, int numOfPoints) {
+	SPPoint **res = (SPPoint**) malloc((numOfPoints > 0 ? numOfPoints : 1)*sizeof(SPPoint*));
+	if (res == NULL)
+		return NULL;
+	for (int i=0; i<numOfPoints; i++) {
+		res[i] = spPointCopy(points[i]);
+		if (res[i] == NULL) {
+			destroyPoints(res, i);
+			return NULL;
+		}
+	}
+	return res;
+}
+
+//Inner function emptying a cache entry
+static void clearEntry(SPQueryCacheEntry *entry) {
+	destroyPoints(entry->hist, 3);
+	destroyPoints(entry->sift, entry->nFeatures);
+	free(entry->rankings);
+	memset(entry, 0, sizeof(*entry));
+}
+
+//Inner function finding the entry of a key (and marking it as used), NULL if not cached
+static SPQueryCacheEntry* findEntry(SPQueryCache *cache, const SPQueryCacheKey *key) {
+	if (cache == NULL || key == NULL)
+		return NULL;
+	for (int i=0; i<cache->maxSize; i++) {
+		SPQueryCacheEntry *entry = cache->entries + i;
+		if (entry->lastUsed != 0 && entry->key.hash == key->hash &&
+				entry->key.numOfBins == key->numOfBins &&
+				entry->key.nFeaturesToExtract == key->nFeaturesToExtract &&
+				entry->key.k == key->k) {
+			entry->lastUsed = ++cache->clock;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+SPQueryCache* spQueryCacheCreate(int maxSize) {
+	if (maxSize <= 0)
+		return NULL;
+	SPQueryCache *res = (SPQueryCache*) malloc(sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	res->entries = (SPQueryCacheEntry*) calloc(maxSize, sizeof(SPQueryCacheEntry));
+	if (res->entries == NULL) {
+		free(res);
+		return NULL;
+	}
+	res->maxSize = maxSize;
+	res->clock = 0;
+	return res;
+}
+
+void spQueryCacheDestroy(SPQueryCache *cache) {
+	if (cache != NULL) {
+		for (int i=0; i<cache->maxSize; i++)
+			clearEntry(cache->entries + i);
+		free(cache->entries);
+		free(cache);
+	}
+}
+
+bool spQueryCacheKey(const char *path, int numOfBins, int nFeaturesToExtract, int k,
+		SPQueryCacheKey *key) {
+	if (path == NULL || key == NULL)
+		return false;
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+
+	unsigned char buf[SP_QUERY_CACHE_READ_SIZE];
+	uint64_t hash = SP_QUERY_CACHE_FNV_OFFSET;
+	size_t n;
+	while ((n = fread(buf, 1, SP_QUERY_CACHE_READ_SIZE, file)) > 0) {
+		for (size_t i=0; i<n; i++) {
+			hash ^= buf[i];
+			hash *= SP_QUERY_CACHE_FNV_PRIME;
+		}
+	}
+	bool ok = !ferror(file);
+	fclose(file);
+
+	key->hash = hash;
+	key->numOfBins = numOfBins;
+	key->nFeaturesToExtract = nFeaturesToExtract;
+	key->k = k;
+	return ok;
+}
+
+SPPoint** spQueryCacheGetHist(SPQueryCache *cache, const SPQueryCacheKey *key) {
+	SPQueryCacheEntry *entry = findEntry(cache, key);
+	if (entry == NULL)
+		return NULL;
+	return copyPoints(entry->hist, 3);
+}
+
+SPPoint** spQueryCacheGetSift(SPQueryCache *cache, const SPQueryCacheKey *key, int *nFeatures) {
+	if (nFeatures == NULL)
+		return NULL;
+	SPQueryCacheEntry *entry = findEntry(cache, key);
+	if (entry == NULL)
+		return NULL;
+	SPPoint **res = copyPoints(entry->sift, entry->nFeatures);
+	if (res != NULL)
+		*nFeatures = entry->nFeatures;
+	return res;
+}
+
+bool spQueryCacheGetRankings(SPQueryCache *cache, const SPQueryCacheKey *key,
+		int *global, int *local) {
+	if (global == NULL || local == NULL)
+		return false;
+	SPQueryCacheEntry *entry = findEntry(cache, key);
+	if (entry == NULL || entry->rankings == NULL)
+		return false;
+	memcpy(global, entry->rankings, key->k*sizeof(int));
+	memcpy(local, entry->rankings + key->k, key->k*sizeof(int));
+	return true;
+}
+
+bool spQueryCachePutDescriptors(SPQueryCache *cache, const SPQueryCacheKey *key,
+		SPPoint **hist, SPPoint **sift, int nFeatures) {
+	if (cache == NULL || key == NULL || hist == NULL || sift == NULL)
+		return false;
+
+	SPPoint **histCopy = copyPoints(hist, 3);
+	SPPoint **siftCopy = copyPoints(sift, nFeatures);
+	if (histCopy == NULL || siftCopy == NULL) {
+		destroyPoints(histCopy, 3);
+		destroyPoints(siftCopy, nFeatures);
+		return false;
+	}
+
+	// reuse the entry of the key, otherwise replace the least recently used entry
+	SPQueryCacheEntry *entry = findEntry(cache, key);
+	if (entry == NULL) {
+		entry = cache->entries;
+		for (int i=1; i<cache->maxSize; i++)
+			if (cache->entries[i].lastUsed < entry->lastUsed)
+				entry = cache->entries + i;
+	}
+	clearEntry(entry);
+	entry->key = *key;
+	entry->hist = histCopy;
+	entry->sift = siftCopy;
+	entry->nFeatures = nFeatures;
+	entry->lastUsed = ++cache->clock;
+	return true;
+}
+
+bool spQueryCachePutRankings(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const int *global, const int *local) {
+	if (global == NULL || local == NULL)
+		return false;
+	SPQueryCacheEntry *entry = findEntry(cache, key);
+	if (entry == NULL)
+		return false;
+	if (entry->rankings == NULL) {
+		entry->rankings = (int*) malloc(2*key->k*sizeof(int));
+		if (entry->rankings == NULL)
+			return false;
+	}
+	memcpy(entry->rankings, global, key->k*sizeof(int));
+	memcpy(entry->rankings + key->k, local, key->k*sizeof(int));
+	return true;
+}
+
+void spQueryCacheInvalidate(SPQueryCache *cache) {
+	if (cache != NULL) {
+		for (int i=0; i<cache->maxSize; i++) {
+			free(cache->entries[i].rankings);
+			cache->entries[i].rankings = NULL;
+		}
+	}
+}
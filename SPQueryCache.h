@@ -0,0 +1,147 @@
+#ifndef SPQUERYCACHE_H_
+#define SPQUERYCACHE_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "SPPoint.h"
+
+/**
+ * SP Query Cache summary
+ * A bounded LRU cache of query results, keyed by the contents of the query
+ * image file and the parameters that affect the result.
+ *
+ * For each query the cache holds the extracted descriptors (histogram and
+ * sift features) and the final rankings (k closest images by global and by
+ * local descriptors). Rankings depend on the database, so they are dropped by
+ * spQueryCacheInvalidate when the database changes, while descriptors only
+ * depend on the query file and are kept.
+ * When the cache is full, the least recently used entry is replaced.
+ *
+ * The following functions are supported:
+ *
+ * spQueryCacheCreate         - Creates a new empty cache
+ * spQueryCacheDestroy        - Frees all resources associated with a cache
+ * spQueryCacheKey            - Computes the key of a query
+ * spQueryCacheGetHist        - Returns a copy of a cached query histogram
+ * spQueryCacheGetSift        - Returns a copy of cached query sift features
+ * spQueryCacheGetRankings    - Copies cached query rankings
+ * spQueryCachePutDescriptors - Caches query descriptors
+ * spQueryCachePutRankings    - Caches query rankings
+ * spQueryCacheInvalidate     - Drops all cached rankings
+ */
+
+/** Type for defining the cache **/
+typedef struct sp_query_cache_t SPQueryCache;
+
+/** Key of a cached query **/
+typedef struct sp_query_cache_key_t {
+	uint64_t hash;         // hash of the query file contents
+	int numOfBins;
+	int nFeaturesToExtract;
+	int k;
+} SPQueryCacheKey;
+
+/**
+ * Allocates a new empty cache.
+ * @param maxSize - the maximum number of cached queries
+ *
+ * @return
+ * NULL in case allocation failure occurred OR maxSize <= 0
+ * Otherwise, the new cache
+ */
+SPQueryCache* spQueryCacheCreate(int maxSize);
+
+/**
+ * Frees all memory resources associated with the cache.
+ * If cache is NULL nothing happens.
+ */
+void spQueryCacheDestroy(SPQueryCache *cache);
+
+/**
+ * Computes the key of a query by hashing (64 bit FNV-1a) the contents of
+ * the query image file.
+ *
+ * @param path - path of the query image
+ * @param numOfBins - number of bins in histogram
+ * @param nFeaturesToExtract - number of sift features to extract
+ * @param k - number of closest images in the rankings
+ * @param key - the address in which the key will be stored
+ * @return false if path or key are NULL or the file could not be read,
+ *         true otherwise
+ */
+bool spQueryCacheKey(const char *path, int numOfBins, int nFeaturesToExtract, int k,
+		SPQueryCacheKey *key);
+
+/**
+ * Returns a copy of the cached histogram of a query (marks the entry as used).
+ *
+ * @param cache - the source cache
+ * @param key - the query key
+ * @return NULL if cache or key are NULL, the query is not cached or
+ *         allocation failure occurred
+ *         Otherwise, a new array of 3 points (owned by the caller)
+ */
+SPPoint** spQueryCacheGetHist(SPQueryCache *cache, const SPQueryCacheKey *key);
+
+/**
+ * Returns a copy of the cached sift features of a query (marks the entry as used).
+ *
+ * @param cache - the source cache
+ * @param key - the query key
+ * @param nFeatures - the address in which the number of features will be stored
+ * @return NULL if any of the arguments is NULL, the query is not cached or
+ *         allocation failure occurred
+ *         Otherwise, a new array of *nFeatures points (owned by the caller)
+ */
+SPPoint** spQueryCacheGetSift(SPQueryCache *cache, const SPQueryCacheKey *key, int *nFeatures);
+
+/**
+ * Copies the cached rankings of a query (marks the entry as used).
+ *
+ * @param cache - the source cache
+ * @param key - the query key
+ * @param global - the address in which the k closest images by global descriptors are stored
+ * @param local - the address in which the k closest images by local descriptors are stored
+ * @return true if the rankings are cached (and copied), false otherwise
+ */
+bool spQueryCacheGetRankings(SPQueryCache *cache, const SPQueryCacheKey *key,
+		int *global, int *local);
+
+/**
+ * Caches copies of the descriptors of a query, replacing the least recently
+ * used entry if the cache is full.
+ *
+ * @param cache - the source cache
+ * @param key - the query key
+ * @param hist - the query histogram (3 points)
+ * @param sift - the query sift features
+ * @param nFeatures - number of sift features
+ * @return false if any of the pointers is NULL or allocation failure occurred
+ *         (in which case nothing is cached), true otherwise
+ */
+bool spQueryCachePutDescriptors(SPQueryCache *cache, const SPQueryCacheKey *key,
+		SPPoint **hist, SPPoint **sift, int nFeatures);
+
+/**
+ * Caches copies of the rankings of a query. The query descriptors must
+ * already be cached.
+ *
+ * @param cache - the source cache
+ * @param key - the query key
+ * @param global - the k closest images by global descriptors
+ * @param local - the k closest images by local descriptors
+ * @return false if any of the pointers is NULL, the query is not cached or
+ *         allocation failure occurred, true otherwise
+ */
+bool spQueryCachePutRankings(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const int *global, const int *local);
+
+/**
+ * Drops the rankings of all cached queries (descriptors are kept).
+ * Must be called whenever the database changes, before the next query is
+ * answered against it (ex3 calls it after each image added or removed in
+ * DATABASE_SNAPSHOTS mode, the only mode in which the database changes).
+ * If cache is NULL nothing happens.
+ */
+void spQueryCacheInvalidate(SPQueryCache *cache);
+
+#endif /* SPQUERYCACHE_H_ */
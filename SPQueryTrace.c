@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "SPQueryTrace.h"
+
+#define SP_QUERY_TRACE_MAGIC 0x54515053 // "SPQT"
+#define SP_QUERY_TRACE_VERSION 3
+#define SP_QUERY_TRACE_HEADER_SIZE 27
+
+struct sp_query_trace_t {
+	FILE *file;
+	bool recording;    // created by spQueryTraceCreate (otherwise opened for reading)
+	int numOfStages;
+	bool hasOrigin;    // origin holds the time of the first appended record
+	double origin;
+};
+
+//Inner function converting seconds to whole microseconds (-1 if negative)
+static int64_t toMicros(double seconds) {
+	if (seconds < 0)
+		return -1;
+	double micros = floor(seconds*1e6 + 0.5);
+	return micros >= 9.2e18 ? INT64_MAX : (int64_t) micros;
+}
+
+SPQueryTrace* spQueryTraceCreate(const char *path, const SPQueryTraceParams *params) {
+	if (path == NULL || params == NULL || params->numOfStages <= 0 ||
+			params->numOfStages > SP_QUERY_TRACE_MAX_STAGES)
+		return NULL;
+
+	SPQueryTrace *res = (SPQueryTrace*) malloc(sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	res->file = fopen(path, "wb");
+	if (res->file == NULL) {
+		free(res);
+		return NULL;
+	}
+	res->recording = true;
+	res->numOfStages = params->numOfStages;
+	res->hasOrigin = false;
+	res->origin = 0;
+
+	int32_t header[SP_QUERY_TRACE_HEADER_SIZE] = {SP_QUERY_TRACE_MAGIC, SP_QUERY_TRACE_VERSION,
+			params->numOfImages, params->numOfBins, params->nFeaturesToExtract, params->k,
+			params->cascadeCandidates, params->numOfStages, params->siftMaxSide,
+			params->siftTileThreads, params->siftTileOverlap, params->histSampleStride,
+			params->histSampleJitter, params->histDecodeReduction, params->histCoarseBins,
+			params->queryCacheSize, params->numaSearchThreads, params->numaNodes,
+			params->halfPrecision, params->pcaComponents, params->pcaCandidates,
+			params->lshBits, params->lshTables, params->lshCandidates,
+			params->vocabBranching, params->vocabDepth, params->skipBadImages};
+	if (fwrite(header, sizeof(int32_t), SP_QUERY_TRACE_HEADER_SIZE, res->file) !=
+			SP_QUERY_TRACE_HEADER_SIZE) {
+		fclose(res->file);
+		free(res);
+		return NULL;
+	}
+	return res;
+}
+
+SPQueryTrace* spQueryTraceOpen(const char *path, SPQueryTraceParams *params) {
+	if (path == NULL || params == NULL)
+		return NULL;
+
+	SPQueryTrace *res = (SPQueryTrace*) malloc(sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	res->file = fopen(path, "rb");
+	if (res->file == NULL) {
+		free(res);
+		return NULL;
+	}
+	int32_t header[SP_QUERY_TRACE_HEADER_SIZE];
+	if (fread(header, sizeof(int32_t), SP_QUERY_TRACE_HEADER_SIZE, res->file) !=
+			SP_QUERY_TRACE_HEADER_SIZE || header[0] != SP_QUERY_TRACE_MAGIC ||
+			header[1] != SP_QUERY_TRACE_VERSION || header[7] <= 0 ||
+			header[7] > SP_QUERY_TRACE_MAX_STAGES) {
+		fclose(res->file);
+		free(res);
+		return NULL;
+	}
+	res->recording = false;
+	res->numOfStages = header[7];
+	res->hasOrigin = false;
+	res->origin = 0;
+
+	params->numOfImages = header[2];
+	params->numOfBins = header[3];
+	params->nFeaturesToExtract = header[4];
+	params->k = header[5];
+	params->cascadeCandidates = header[6];
+	params->numOfStages = header[7];
+	params->siftMaxSide = header[8];
+	params->siftTileThreads = header[9];
+	params->siftTileOverlap = header[10];
+	params->histSampleStride = header[11];
+	params->histSampleJitter = header[12];
+	params->histDecodeReduction = header[13];
+	params->histCoarseBins = header[14];
+	params->queryCacheSize = header[15];
+	params->numaSearchThreads = header[16];
+	params->numaNodes = header[17];
+	params->halfPrecision = header[18];
+	params->pcaComponents = header[19];
+	params->pcaCandidates = header[20];
+	params->lshBits = header[21];
+	params->lshTables = header[22];
+	params->lshCandidates = header[23];
+	params->vocabBranching = header[24];
+	params->vocabDepth = header[25];
+	params->skipBadImages = header[26];
+	return res;
+}
+
+bool spQueryTraceClose(SPQueryTrace *trace) {
+	if (trace == NULL)
+		return true;
+	bool ok = fclose(trace->file) == 0;
+	free(trace);
+	return ok;
+}
+
+SP_QUERY_TRACE_MSG spQueryTraceAppend(SPQueryTrace *trace, const SPQueryTraceRecord *record) {
+	if (trace == NULL || record == NULL || !trace->recording)
+		return SP_QUERY_TRACE_INVALID_ARGUMENT;
+
+	if (!trace->hasOrigin) {
+		trace->origin = record->time;
+		trace->hasOrigin = true;
+	}
+	int64_t time = toMicros(record->time - trace->origin);
+	uint64_t hash = record->hash;
+	int32_t status = record->status;
+	int32_t stages[SP_QUERY_TRACE_MAX_STAGES];
+	for (int s=0; s<trace->numOfStages; s++) {
+		int64_t micros = toMicros(record->stageSeconds[s]);
+		stages[s] = (int32_t) (micros > INT32_MAX ? INT32_MAX : micros);
+	}
+	const char *end = (const char*) memchr(record->path, '\0', SP_QUERY_TRACE_MAX_PATH - 1);
+	int32_t length = end != NULL ? (int32_t) (end - record->path) : SP_QUERY_TRACE_MAX_PATH - 1;
+
+	// stdio buffers the records, so recording does not wait for the disk
+	bool ok = fwrite(&time, sizeof(time), 1, trace->file) == 1 &&
+			fwrite(&hash, sizeof(hash), 1, trace->file) == 1 &&
+			fwrite(&status, sizeof(status), 1, trace->file) == 1 &&
+			fwrite(stages, sizeof(int32_t), trace->numOfStages, trace->file) ==
+					(size_t) trace->numOfStages &&
+			fwrite(&length, sizeof(length), 1, trace->file) == 1 &&
+			fwrite(record->path, 1, length, trace->file) == (size_t) length;
+	return ok ? SP_QUERY_TRACE_SUCCESS : SP_QUERY_TRACE_IO_ERROR;
+}
+
+SP_QUERY_TRACE_MSG spQueryTraceNext(SPQueryTrace *trace, SPQueryTraceRecord *record) {
+	if (trace == NULL || record == NULL || trace->recording)
+		return SP_QUERY_TRACE_INVALID_ARGUMENT;
+
+	int64_t time;
+	uint64_t hash;
+	int32_t status, length;
+	int32_t stages[SP_QUERY_TRACE_MAX_STAGES];
+	if (fread(&time, sizeof(time), 1, trace->file) != 1)
+		return feof(trace->file) ? SP_QUERY_TRACE_END : SP_QUERY_TRACE_IO_ERROR;
+	if (fread(&hash, sizeof(hash), 1, trace->file) != 1 ||
+			fread(&status, sizeof(status), 1, trace->file) != 1 ||
+			fread(stages, sizeof(int32_t), trace->numOfStages, trace->file) !=
+					(size_t) trace->numOfStages ||
+			fread(&length, sizeof(length), 1, trace->file) != 1 ||
+			length < 0 || length >= SP_QUERY_TRACE_MAX_PATH ||
+			fread(record->path, 1, length, trace->file) != (size_t) length)
+		return SP_QUERY_TRACE_INVALID_FORMAT;
+
+	record->path[length] = '\0';
+	record->time = time/1e6;
+	record->hash = hash;
+	record->status = status;
+	for (int s=0; s<SP_QUERY_TRACE_MAX_STAGES; s++)
+		record->stageSeconds[s] = s < trace->numOfStages && stages[s] >= 0 ? stages[s]/1e6 : -1;
+	return SP_QUERY_TRACE_SUCCESS;
+}
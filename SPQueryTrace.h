@@ -0,0 +1,156 @@
+#ifndef SPQUERYTRACE_H_
+#define SPQUERYTRACE_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * SP Query Trace summary
+ * A compact binary log of the queries answered by the engine, recorded while
+ * serving them and read back to replay the same load (see sp_replay).
+ *
+ * A trace starts with the parameters the queries were answered with (the
+ * database, the descriptor extraction and the search structures, so a replay
+ * can answer them alike), followed by one record for each query: its arrival
+ * time, the path and a hash of the contents of the query image, whether it was
+ * answered, and the duration of each stage of the query. Times are stored in whole microseconds, with
+ * arrival times relative to the first record of the trace.
+ *
+ * Trace file layout (integers are 4 bytes wide unless noted):
+ *   header  - magic, version, numOfImages, numOfBins, nFeaturesToExtract, k,
+ *             cascadeCandidates, numOfStages, siftMaxSide, siftTileThreads,
+ *             siftTileOverlap, histSampleStride, histSampleJitter,
+ *             histDecodeReduction, histCoarseBins, queryCacheSize,
+ *             numaSearchThreads, numaNodes, halfPrecision, pcaComponents,
+ *             pcaCandidates, lshBits, lshTables, lshCandidates,
+ *             vocabBranching, vocabDepth, skipBadImages
+ *   records - time (8 bytes), hash (8 bytes), status, numOfStages durations
+ *             (-1 if the stage did not run), path length, path (not terminated)
+ *
+ * The following functions are supported:
+ *
+ * spQueryTraceCreate     - Creates a new trace file for recording
+ * spQueryTraceOpen       - Opens an existing trace file for reading
+ * spQueryTraceClose      - Closes a trace, flushing recorded queries
+ * spQueryTraceAppend     - Records a query
+ * spQueryTraceNext       - Reads the next query
+ */
+
+/** Maximum number of stages of a recorded query **/
+#define SP_QUERY_TRACE_MAX_STAGES 8
+
+/** Maximum length of a recorded query path (including the terminating null) **/
+#define SP_QUERY_TRACE_MAX_PATH 1024
+
+/** Type for defining an open trace **/
+typedef struct sp_query_trace_t SPQueryTrace;
+
+/** Parameters the queries of a trace were answered with, stored in its header **/
+typedef struct sp_query_trace_params_t {
+	int numOfImages;
+	int numOfBins;
+	int nFeaturesToExtract;
+	int k;
+	int cascadeCandidates;
+	int numOfStages;       // number of durations of each record (at most SP_QUERY_TRACE_MAX_STAGES)
+	// descriptor extraction (see spSetSiftMaxSide, spSetSiftTiling and spSetHistSampling)
+	int siftMaxSide;
+	int siftTileThreads;
+	int siftTileOverlap;
+	int histSampleStride;
+	int histSampleJitter;
+	int histDecodeReduction;
+	// search structures (0 - not used)
+	int histCoarseBins;    // coarse histograms pruning the global search
+	int queryCacheSize;    // maximum number of cached query results
+	int numaSearchThreads; // local search threads on each NUMA node
+	int numaNodes;         // (0 - one partition on each NUMA node)
+	int halfPrecision;     // 1 - half precision sift features, 2 - also histograms
+	int pcaComponents;
+	int pcaCandidates;
+	int lshBits;
+	int lshTables;
+	int lshCandidates;
+	int vocabBranching;
+	int vocabDepth;
+	int skipBadImages;     // 1 - images which cannot be loaded were skipped by preprocessing
+} SPQueryTraceParams;
+
+/** A recorded query **/
+typedef struct sp_query_trace_record_t {
+	double time;           // arrival time in seconds (relative to the first record when read)
+	uint64_t hash;         // hash of the query image contents (0 - not hashed)
+	int status;            // 0 - answered, 1 - answered from the cache, -1 - failed
+	double stageSeconds[SP_QUERY_TRACE_MAX_STAGES]; // negative if the stage did not run
+	char path[SP_QUERY_TRACE_MAX_PATH];
+} SPQueryTraceRecord;
+
+/** type for error reporting **/
+typedef enum sp_query_trace_msg_t {
+	SP_QUERY_TRACE_OUT_OF_MEMORY,
+	SP_QUERY_TRACE_IO_ERROR,
+	SP_QUERY_TRACE_INVALID_FORMAT,
+	SP_QUERY_TRACE_INVALID_ARGUMENT,
+	SP_QUERY_TRACE_END,
+	SP_QUERY_TRACE_SUCCESS
+} SP_QUERY_TRACE_MSG;
+
+/**
+ * Creates a trace file (overwriting it) and writes its header.
+ *
+ * @param path - the trace path
+ * @param params - the parameters the recorded queries are answered with
+ * @return NULL if path or params are NULL, params->numOfStages is not in
+ *         1, ..., SP_QUERY_TRACE_MAX_STAGES, the file cannot be written or
+ *         allocation failure occurred, otherwise the new trace
+ */
+SPQueryTrace* spQueryTraceCreate(const char *path, const SPQueryTraceParams *params);
+
+/**
+ * Opens a trace file for reading and reads its header.
+ *
+ * @param path - the trace path
+ * @param params - the address in which the parameters of the trace will be stored
+ * @return NULL if path or params are NULL, the file cannot be read or is not
+ *         a trace, or allocation failure occurred, otherwise the open trace
+ */
+SPQueryTrace* spQueryTraceOpen(const char *path, SPQueryTraceParams *params);
+
+/**
+ * Closes a trace (a recorded trace is flushed to its file first).
+ * If trace is NULL nothing happens.
+ *
+ * @return false if the recorded queries could not be written, true otherwise
+ */
+bool spQueryTraceClose(SPQueryTrace *trace);
+
+/**
+ * Records a query at the end of a trace created by spQueryTraceCreate.
+ * The path is truncated to SP_QUERY_TRACE_MAX_PATH - 1 characters.
+ *
+ * @param trace - the target trace
+ * @param record - the query, with time on any clock in seconds (the first
+ *                 record appended is the origin of the times stored)
+ * @return
+ * SP_QUERY_TRACE_INVALID_ARGUMENT if trace or record are NULL or the trace
+ * was opened for reading
+ * SP_QUERY_TRACE_IO_ERROR if the record could not be written
+ * SP_QUERY_TRACE_SUCCESS otherwise
+ */
+SP_QUERY_TRACE_MSG spQueryTraceAppend(SPQueryTrace *trace, const SPQueryTraceRecord *record);
+
+/**
+ * Reads the next query of a trace opened by spQueryTraceOpen.
+ * Stages beyond the number of stages of the trace are set to -1.
+ *
+ * @param trace - the source trace
+ * @param record - the address in which the query will be stored
+ * @return
+ * SP_QUERY_TRACE_INVALID_ARGUMENT if trace or record are NULL or the trace
+ * was created for recording
+ * SP_QUERY_TRACE_END if there are no more queries
+ * SP_QUERY_TRACE_INVALID_FORMAT if the record is truncated or malformed
+ * SP_QUERY_TRACE_SUCCESS otherwise
+ */
+SP_QUERY_TRACE_MSG spQueryTraceNext(SPQueryTrace *trace, SPQueryTraceRecord *record);
+
+#endif /* SPQUERYTRACE_H_ */
@@ -0,0 +1,424 @@
+#define _POSIX_C_SOURCE 200809L
+#include <malloc.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "SPShardPool.h"
+
+#define SP_SHARD_POOL_QUIT 0
+#define SP_SHARD_POOL_HIST 1
+#define SP_SHARD_POOL_SEARCH 2
+#define SP_SHARD_POOL_PATH_SIZE 4096
+
+struct sp_shard_pool_t {
+	int numOfWorkers;
+	pid_t *pids;
+	int *sockets;      // coordinator side of each worker's socket pair
+	int numOfImages;
+	int numOfBins;
+};
+
+//Inner function writing size bytes to a socket, returns false on failure
+static bool writeAll(int fd, const void *buf, size_t size) {
+	const char *data = (const char*) buf;
+	while (size > 0) {
+		ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+//Inner function reading size bytes from a socket, returns false on failure
+static bool readAll(int fd, void *buf, size_t size) {
+	char *data = (char*) buf;
+	while (size > 0) {
+		ssize_t n = recv(fd, data, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+//Inner function discarding size bytes from a socket, returns false on failure
+static bool skipAll(int fd, size_t size) {
+	// used to drain a response which cannot be stored, so the socket stays in sync
+	char buf[4096];
+	while (size > 0) {
+		size_t n = size < sizeof(buf) ? size : sizeof(buf);
+		if (!readAll(fd, buf, n))
+			return false;
+		size -= n;
+	}
+	return true;
+}
+
+//Inner function creating points from an array of coordinates
+static SPPoint** pointsFromData(double *data, int numOfPoints, int dim) {
+	SPPoint **points = (SPPoint**) calloc(numOfPoints > 0 ? numOfPoints : 1, sizeof(SPPoint*));
+	if (points == NULL)
+		return NULL;
+	for (int i=0; i<numOfPoints; i++) {
+		points[i] = spPointCreate(data + (size_t) i*dim, dim, 0);
+		if (points[i] == NULL) {
+			for (int j=0; j<i; j++)
+				spPointDestroy(points[j]);
+			free(points);
+			return NULL;
+		}
+	}
+	return points;
+}
+
+//Inner function destroying an array of points
+static void destroyPoints(SPPoint **points, int numOfPoints) {
+	if (points != NULL) {
+		for (int i=0; i<numOfPoints; i++)
+			spPointDestroy(points[i]);
+		free(points);
+	}
+}
+
+//Inner function answering a histogram request, returns false on communication failure
+static bool workerHist(int fd, SPIndexShard **shards, int numOfShards) {
+	int32_t numOfBins;
+	if (!readAll(fd, &numOfBins, sizeof(int32_t)) || numOfBins <= 0)
+		return false;
+	double *data = (double*) malloc(3*numOfBins*sizeof(double));
+	if (data == NULL)
+		return false;
+	bool ok = readAll(fd, data, 3*numOfBins*sizeof(double));
+	SPPoint **qhist = ok ? pointsFromData(data, 3, numOfBins) : NULL;
+	free(data);
+	if (!ok)
+		return false;
+
+	// count images served by this worker
+	int32_t count = 0;
+	for (int s=0; s<numOfShards; s++)
+		count += spIndexShardNumOfImages(shards[s]);
+	int32_t *indices = (int32_t*) malloc(2*count*sizeof(int32_t));
+	double *dists = (double*) malloc(count*sizeof(double));
+
+	int32_t status = SP_INDEX_SUCCESS;
+	if (qhist == NULL || indices == NULL || dists == NULL)
+		status = SP_INDEX_OUT_OF_MEMORY;
+	for (int s=0, pos=0; s<numOfShards && status == SP_INDEX_SUCCESS; s++) {
+		status = spIndexShardHistDistances(shards[s], qhist, dists + pos);
+		for (int i=0; i<spIndexShardNumOfImages(shards[s]); i++, pos++) {
+			indices[pos] = spIndexShardFirstImage(shards[s]) + i;
+			indices[count + pos] = spIndexShardNumOfFeatures(shards[s], i);
+		}
+	}
+
+	// status, count, image indices, number of features, distances
+	ok = writeAll(fd, &status, sizeof(int32_t));
+	if (ok && status == SP_INDEX_SUCCESS)
+		ok = writeAll(fd, &count, sizeof(int32_t)) &&
+				writeAll(fd, indices, 2*count*sizeof(int32_t)) &&
+				writeAll(fd, dists, count*sizeof(double));
+	destroyPoints(qhist, 3);
+	free(indices);
+	free(dists);
+	return ok;
+}
+
+//Inner function answering a search request, returns false on communication failure
+static bool workerSearch(int fd, SPIndexShard **shards, int numOfShards, int numOfImages) {
+	int32_t params[4]; // numOfQueries, dim, k, hasSelected
+	if (!readAll(fd, params, sizeof(params)) || params[0] < 0 || params[1] <= 0 || params[2] <= 0)
+		return false;
+	int numOfQueries = params[0], dim = params[1], k = params[2];
+
+	double *data = (double*) malloc(((size_t) numOfQueries*dim + 1)*sizeof(double));
+	char *selected = params[3] ? (char*) malloc(numOfImages) : NULL;
+	bool ok = data != NULL && (!params[3] || selected != NULL);
+	ok = ok && readAll(fd, data, (size_t) numOfQueries*dim*sizeof(double));
+	ok = ok && (!params[3] || readAll(fd, selected, numOfImages));
+	SPPoint **queries = ok ? pointsFromData(data, numOfQueries, dim) : NULL;
+	free(data);
+	if (!ok) {
+		free(selected);
+		return false;
+	}
+
+	// search own shards
+	int32_t status = queries == NULL ? SP_INDEX_OUT_OF_MEMORY : SP_INDEX_SUCCESS;
+	SPBPQueue **queues = (SPBPQueue**) calloc(numOfQueries > 0 ? numOfQueries : 1, sizeof(SPBPQueue*));
+	if (queues == NULL)
+		status = SP_INDEX_OUT_OF_MEMORY;
+	for (int q=0; q<numOfQueries && status == SP_INDEX_SUCCESS; q++)
+		if ((queues[q] = spBPQueueCreate(k)) == NULL)
+			status = SP_INDEX_OUT_OF_MEMORY;
+	for (int s=0; s<numOfShards && status == SP_INDEX_SUCCESS; s++)
+		status = spIndexShardSearch(shards[s], queries, numOfQueries, queues, selected);
+
+	// status, then for each query - count, image indices, distances (closest first)
+	ok = writeAll(fd, &status, sizeof(int32_t));
+	BPQueueElement elem;
+	for (int q=0; ok && status == SP_INDEX_SUCCESS && q<numOfQueries; q++) {
+		int32_t count = spBPQueueSize(queues[q]);
+		int32_t indices[count > 0 ? count : 1];
+		double values[count > 0 ? count : 1];
+		for (int i=0; i<count; i++) {
+			spBPQueuePeek(queues[q], &elem);
+			indices[i] = elem.index;
+			values[i] = elem.value;
+			spBPQueueDequeue(queues[q]);
+		}
+		ok = writeAll(fd, &count, sizeof(int32_t)) &&
+				writeAll(fd, indices, count*sizeof(int32_t)) &&
+				writeAll(fd, values, count*sizeof(double));
+	}
+
+	if (queues != NULL)
+		for (int q=0; q<numOfQueries; q++)
+			spBPQueueDestroy(queues[q]);
+	free(queues);
+	destroyPoints(queries, numOfQueries);
+	free(selected);
+	return ok;
+}
+
+//Inner function running a worker process until quit is requested
+static void workerMain(int fd, const char *path, int worker, int numOfWorkers, int numOfShards,
+		int numOfImages) {
+	// map own shards once for the lifetime of the worker
+	int numOfOwnShards = (numOfShards - worker + numOfWorkers - 1) / numOfWorkers;
+	SPIndexShard **shards = (SPIndexShard**) calloc(numOfOwnShards, sizeof(SPIndexShard*));
+	char shardPath[SP_SHARD_POOL_PATH_SIZE];
+	bool ok = shards != NULL;
+	for (int s=0; ok && s<numOfOwnShards; s++) {
+		spIndexShardPath(shardPath, path, worker + s*numOfWorkers);
+		shards[s] = spIndexShardOpen(shardPath);
+		ok = shards[s] != NULL;
+	}
+
+	// if shards could not be mapped the socket is closed right away,
+	// which the coordinator sees as a communication failure
+	int32_t type;
+	while (ok && readAll(fd, &type, sizeof(int32_t)) && type != SP_SHARD_POOL_QUIT) {
+		if (type == SP_SHARD_POOL_HIST && !workerHist(fd, shards, numOfOwnShards))
+			break;
+		if (type == SP_SHARD_POOL_SEARCH && !workerSearch(fd, shards, numOfOwnShards, numOfImages))
+			break;
+	}
+
+	for (int s=0; shards != NULL && s<numOfOwnShards; s++)
+		spIndexShardClose(shards[s]);
+	free(shards);
+	close(fd);
+}
+
+SPShardPool* spShardPoolCreate(const char *path, const SPIndexManifest *manifest, int numOfWorkers) {
+	if (path == NULL || manifest == NULL || numOfWorkers <= 0 || manifest->numOfShards <= 0)
+		return NULL;
+	if (numOfWorkers > manifest->numOfShards)
+		numOfWorkers = manifest->numOfShards;
+
+	SPShardPool *res = (SPShardPool*) malloc(sizeof(*res));
+	if (res == NULL)
+		return NULL;
+	res->pids = (pid_t*) malloc(numOfWorkers*sizeof(pid_t));
+	res->sockets = (int*) malloc(numOfWorkers*sizeof(int));
+	res->numOfWorkers = 0;
+	res->numOfImages = manifest->numOfImages;
+	res->numOfBins = manifest->numOfBins;
+	if (res->pids == NULL || res->sockets == NULL) {
+		spShardPoolDestroy(res);
+		return NULL;
+	}
+
+	// flush buffered output so it is not duplicated by the workers
+	fflush(stdout);
+	for (int w=0; w<numOfWorkers; w++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			spShardPoolDestroy(res);
+			return NULL;
+		}
+		pid_t pid = fork();
+		if (pid == -1) {
+			close(sv[0]);
+			close(sv[1]);
+			spShardPoolDestroy(res);
+			return NULL;
+		}
+		if (pid == 0) { // worker - keep only its own socket
+			close(sv[0]);
+			for (int i=0; i<w; i++)
+				close(res->sockets[i]);
+			workerMain(sv[1], path, w, numOfWorkers, manifest->numOfShards, manifest->numOfImages);
+			_exit(0);
+		}
+		close(sv[1]);
+		res->pids[w] = pid;
+		res->sockets[w] = sv[0];
+		res->numOfWorkers++;
+	}
+	return res;
+}
+
+void spShardPoolDestroy(SPShardPool *pool) {
+	if (pool != NULL) {
+		int32_t type = SP_SHARD_POOL_QUIT;
+		for (int w=0; w<pool->numOfWorkers; w++) {
+			writeAll(pool->sockets[w], &type, sizeof(int32_t));
+			close(pool->sockets[w]);
+		}
+		for (int w=0; w<pool->numOfWorkers; w++)
+			waitpid(pool->pids[w], NULL, 0);
+		free(pool->pids);
+		free(pool->sockets);
+		free(pool);
+	}
+}
+
+//Inner function reading a worker's response status
+static SP_SHARD_POOL_MSG readStatus(int fd) {
+	int32_t status;
+	if (!readAll(fd, &status, sizeof(int32_t)))
+		return SP_SHARD_POOL_IO_ERROR;
+	if (status == SP_INDEX_OUT_OF_MEMORY)
+		return SP_SHARD_POOL_OUT_OF_MEMORY;
+	if (status != SP_INDEX_SUCCESS)
+		return SP_SHARD_POOL_WORKER_ERROR;
+	return SP_SHARD_POOL_SUCCESS;
+}
+
+SP_SHARD_POOL_MSG spShardPoolHistDistances(SPShardPool *pool, SPPoint **qhist,
+		double *dists, int *nFeatures) {
+	if (pool == NULL || qhist == NULL || dists == NULL)
+		return SP_SHARD_POOL_INVALID_ARGUMENT;
+	int numOfBins = spPointGetDimension(qhist[0]);
+
+	// scatter request
+	int32_t header[2] = {SP_SHARD_POOL_HIST, numOfBins};
+	double *data = (double*) malloc(3*numOfBins*sizeof(double));
+	if (data == NULL)
+		return SP_SHARD_POOL_OUT_OF_MEMORY;
+	for (int c=0; c<3; c++)
+		for (int j=0; j<numOfBins; j++)
+			data[c*numOfBins + j] = spPointGetAxisCoor(qhist[c], j);
+	SP_SHARD_POOL_MSG msg = SP_SHARD_POOL_SUCCESS;
+	for (int w=0; w<pool->numOfWorkers; w++)
+		if (!writeAll(pool->sockets[w], header, sizeof(header)) ||
+				!writeAll(pool->sockets[w], data, 3*numOfBins*sizeof(double)))
+			msg = SP_SHARD_POOL_IO_ERROR;
+	free(data);
+
+	// gather responses (all responses are read to keep the workers in sync)
+	for (int w=0; w<pool->numOfWorkers && msg != SP_SHARD_POOL_IO_ERROR; w++) {
+		SP_SHARD_POOL_MSG status = readStatus(pool->sockets[w]);
+		if (status != SP_SHARD_POOL_SUCCESS) {
+			msg = status;
+			continue;
+		}
+		int32_t count;
+		if (!readAll(pool->sockets[w], &count, sizeof(int32_t)) || count < 0) {
+			msg = SP_SHARD_POOL_IO_ERROR;
+			break;
+		}
+		int32_t *indices = (int32_t*) malloc((2*count + 1)*sizeof(int32_t));
+		double *values = (double*) malloc((count + 1)*sizeof(double));
+		if (indices == NULL || values == NULL) {
+			// the response is drained so the next request reads its own response
+			free(indices);
+			free(values);
+			if (!skipAll(pool->sockets[w], (size_t) count*(2*sizeof(int32_t) + sizeof(double))))
+				msg = SP_SHARD_POOL_IO_ERROR;
+			else if (msg == SP_SHARD_POOL_SUCCESS)
+				msg = SP_SHARD_POOL_OUT_OF_MEMORY;
+			continue;
+		}
+		if (!readAll(pool->sockets[w], indices, 2*count*sizeof(int32_t)) ||
+				!readAll(pool->sockets[w], values, count*sizeof(double)))
+			msg = SP_SHARD_POOL_IO_ERROR; // an unread response leaves the socket unusable
+		for (int i=0; msg != SP_SHARD_POOL_IO_ERROR && i<count; i++) {
+			if (indices[i] < 0 || indices[i] >= pool->numOfImages)
+				continue;
+			dists[indices[i]] = values[i];
+			if (nFeatures != NULL)
+				nFeatures[indices[i]] = indices[count + i];
+		}
+		free(indices);
+		free(values);
+	}
+	return msg;
+}
+
+SP_SHARD_POOL_MSG spShardPoolSearch(SPShardPool *pool, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected) {
+	if (pool == NULL || queries == NULL || queues == NULL)
+		return SP_SHARD_POOL_INVALID_ARGUMENT;
+	int dim = numOfQueries > 0 ? spPointGetDimension(queries[0]) : 1;
+	int k = numOfQueries > 0 ? spBPQueueGetMaxSize(queues[0]) : 1;
+
+	// scatter request
+	int32_t header[5] = {SP_SHARD_POOL_SEARCH, numOfQueries, dim, k, selected != NULL};
+	double *data = (double*) malloc(((size_t) numOfQueries*dim + 1)*sizeof(double));
+	if (data == NULL)
+		return SP_SHARD_POOL_OUT_OF_MEMORY;
+	for (int q=0; q<numOfQueries; q++)
+		for (int j=0; j<dim; j++)
+			data[(size_t) q*dim + j] = spPointGetAxisCoor(queries[q], j);
+	SP_SHARD_POOL_MSG msg = SP_SHARD_POOL_SUCCESS;
+	for (int w=0; w<pool->numOfWorkers; w++)
+		if (!writeAll(pool->sockets[w], header, sizeof(header)) ||
+				!writeAll(pool->sockets[w], data, (size_t) numOfQueries*dim*sizeof(double)) ||
+				(selected != NULL && !writeAll(pool->sockets[w], selected, pool->numOfImages)))
+			msg = SP_SHARD_POOL_IO_ERROR;
+	free(data);
+
+	// gather and merge per worker top k of each query feature
+	// (without buffers the responses are drained, so the workers stay in sync)
+	int32_t *indices = (int32_t*) malloc((k + 1)*sizeof(int32_t));
+	double *values = (double*) malloc((k + 1)*sizeof(double));
+	bool buffered = indices != NULL && values != NULL;
+	if (!buffered && msg == SP_SHARD_POOL_SUCCESS)
+		msg = SP_SHARD_POOL_OUT_OF_MEMORY;
+	for (int w=0; w<pool->numOfWorkers && msg != SP_SHARD_POOL_IO_ERROR; w++) {
+		// all responses are read to keep the workers in sync
+		SP_SHARD_POOL_MSG status = readStatus(pool->sockets[w]);
+		if (status != SP_SHARD_POOL_SUCCESS) {
+			msg = status;
+			continue;
+		}
+		for (int q=0; q<numOfQueries; q++) {
+			int32_t count;
+			if (!readAll(pool->sockets[w], &count, sizeof(int32_t)) || count < 0 || count > k) {
+				msg = SP_SHARD_POOL_IO_ERROR;
+				break;
+			}
+			if (!buffered) {
+				if (!skipAll(pool->sockets[w], (size_t) count*(sizeof(int32_t) + sizeof(double)))) {
+					msg = SP_SHARD_POOL_IO_ERROR;
+					break;
+				}
+				continue;
+			}
+			if (!readAll(pool->sockets[w], indices, count*sizeof(int32_t)) ||
+					!readAll(pool->sockets[w], values, count*sizeof(double))) {
+				msg = SP_SHARD_POOL_IO_ERROR;
+				break;
+			}
+			for (int i=0; i<count; i++)
+				spBPQueueEnqueue(queues[q], indices[i], values[i]);
+		}
+	}
+	free(indices);
+	free(values);
+	return msg;
+}
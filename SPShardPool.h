@@ -0,0 +1,104 @@
+#ifndef SPSHARDPOOL_H_
+#define SPSHARDPOOL_H_
+#include "SPPoint.h"
+#include "SPBPriorityQueue.h"
+#include "SPIndex.h"
+
+/**
+ * SP Shard Pool summary
+ * Scatter/gather search of an on-disk index (see SPIndex.h) by a pool of
+ * local worker processes.
+ *
+ * Each worker is a forked process which maps its share of the index shards
+ * (shard i is served by worker i % numOfWorkers) once, and answers requests
+ * sent by the coordinator over a Unix socket pair.
+ * A query is sent to all workers before any answer is read, so workers
+ * search their shards in parallel. Each worker returns its own k closest
+ * features for every query feature, and the coordinator merges them with
+ * bounded priority queues, so ties are broken exactly as in
+ * spBestSIFTL2SquaredDistance (smaller image index first).
+ *
+ * The following functions are supported:
+ *
+ * spShardPoolCreate          - Starts the worker processes
+ * spShardPoolDestroy         - Stops the worker processes and frees all resources
+ * spShardPoolHistDistances   - Computes histogram distances to all images
+ * spShardPoolSearch          - Finds the closest sift features to query features
+ */
+
+/** Type for defining the pool **/
+typedef struct sp_shard_pool_t SPShardPool;
+
+/** type for error reporting **/
+typedef enum sp_shard_pool_msg_t {
+	SP_SHARD_POOL_OUT_OF_MEMORY,
+	SP_SHARD_POOL_IO_ERROR,
+	SP_SHARD_POOL_WORKER_ERROR,
+	SP_SHARD_POOL_INVALID_ARGUMENT,
+	SP_SHARD_POOL_SUCCESS
+} SP_SHARD_POOL_MSG;
+
+/**
+ * Starts numOfWorkers worker processes serving the shards of the index
+ * path. Standard output is flushed before forking.
+ *
+ * @param path - the index path
+ * @param manifest - the build parameters of the index
+ * @param numOfWorkers - number of worker processes (if larger than the
+ *                       number of shards, one worker per shard is started)
+ * @return
+ * NULL in case any of the pointers is NULL, numOfWorkers <= 0, a worker could
+ * not be started or allocation failure occurred
+ * Otherwise, the new pool
+ */
+SPShardPool* spShardPoolCreate(const char *path, const SPIndexManifest *manifest, int numOfWorkers);
+
+/**
+ * Stops all worker processes, waits for them to exit and frees all
+ * resources associated with the pool.
+ * If pool is NULL nothing happens.
+ */
+void spShardPoolDestroy(SPShardPool *pool);
+
+/**
+ * Computes the histogram distance (as in spRGBHistL2Distance) between the
+ * query histogram and the histogram of every image in the index.
+ *
+ * @param pool - the source pool
+ * @param qhist - the query histogram
+ * @param dists - the address in which the distances will be stored
+ *                (dists[i] is the distance to image i, HUGE_VAL if it was
+ *                skipped by preprocessing)
+ * @param nFeatures - if not NULL, the number of sift features of every image
+ *                    is stored in it
+ * @return SP_SHARD_POOL_INVALID_ARGUMENT if any of pool, qhist, dists is NULL
+ *         SP_SHARD_POOL_OUT_OF_MEMORY in case of allocation failure
+ *         SP_SHARD_POOL_IO_ERROR in case of communication failure
+ *         SP_SHARD_POOL_WORKER_ERROR if a worker failed to compute the distances
+ *         SP_SHARD_POOL_SUCCESS otherwise
+ */
+SP_SHARD_POOL_MSG spShardPoolHistDistances(SPShardPool *pool, SPPoint **qhist,
+		double *dists, int *nFeatures);
+
+/**
+ * Finds the closest sift features in the index to each query feature.
+ * The results of all workers are enqueued to queues[i] for query feature i,
+ * so the queues hold the same elements as after spIndexShardSearch over
+ * all shards of the index.
+ *
+ * @param pool - the source pool
+ * @param queries - the query features
+ * @param numOfQueries - number of query features
+ * @param queues - a bounded priority queue for each query feature
+ * @param selected - if not NULL, only images i for which selected[i] is
+ *                   non zero are searched
+ * @return SP_SHARD_POOL_INVALID_ARGUMENT if any of pool, queries, queues is NULL
+ *         SP_SHARD_POOL_OUT_OF_MEMORY in case of allocation failure
+ *         SP_SHARD_POOL_IO_ERROR in case of communication failure
+ *         SP_SHARD_POOL_WORKER_ERROR if a worker failed to search its shards
+ *         SP_SHARD_POOL_SUCCESS otherwise
+ */
+SP_SHARD_POOL_MSG spShardPoolSearch(SPShardPool *pool, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected);
+
+#endif /* SPSHARDPOOL_H_ */
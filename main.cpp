@@ -1,15 +1,379 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <new>
 #include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
 #include "main_aux.h"
+#include "main_descriptors.h"
+#include "main_index.h"
+#include "sp_snapshot_db.h"
 
 // number of closest images to find
 #define K 5
+// number of I/O threads reading image files ahead of decoding during preprocessing
+// (0 - disabled, each image is read when it is decoded)
+#define PREFETCH_THREADS 0
+// if 1, images which cannot be loaded are skipped (ranked last) and reported
+// (0 - preprocessing fails on such an image, as it always does on allocation failure)
+#define SKIP_BAD_IMAGES 0
+// number of images between checkpoints of in-memory preprocessing, which then
+// resumes from the last checkpoint after a failure (0 - no checkpoints)
+#define CHECKPOINT_SIZE 0
+// path of the checkpoints (an on-disk index, reused if complete)
+#define CHECKPOINT_PATH "spcheckpoint"
+// number of closest images by global descriptors to search with local descriptors
+// (0 - disabled, all images are searched)
+#define CASCADE_CANDIDATES 0
+// number of bins of the coarse histograms pruning the global search, whose
+// results stay exact (0 - disabled, must be less than the number of bins)
+#define HIST_COARSE_BINS 0
+// number of images in each shard of the on-disk index
+// (0 - disabled, all descriptors are kept in memory)
+#define INDEX_SHARD_SIZE 0
+// path of the on-disk index
+#define INDEX_PATH "spindex"
+// if 1, an existing index built with the same parameters from the same image files
+// is searched without being rebuilt, so queries are accepted right after launch
+// (0 - always rebuild)
+#define INDEX_REUSE 0
+// if 1, each shard is mapped on its first access and stays mapped across queries
+// (0 - each shard is mapped for each search)
+#define INDEX_LAZY_SHARDS 0
+// if 1 (and INDEX_LAZY_SHARDS is 1), a background thread maps and faults in
+// all shards while queries are answered
+#define INDEX_WARM_UP 0
+// number of worker processes serving the index shards
+// (0 - disabled, shards are searched by the main process)
+#define SHARD_WORKERS 0
+// maximum number of cached query results, whose rankings are dropped when
+// images are added or removed (0 - disabled)
+#define QUERY_CACHE_SIZE 0
+// number of pinned local search threads on each NUMA node
+// (0 - disabled, the local search is done by the main thread)
+#define NUMA_SEARCH_THREADS 0
+// number of partitions of the sift features database when NUMA_SEARCH_THREADS > 0
+// (0 - one partition on each NUMA node of the machine)
+#define NUMA_NODES 0
+// number of database images whose sift features are searched to benchmark the
+// scan bandwidth of 1, 2, 4, ..., NUMA_NODES partitions (0 - disabled)
+#define NUMA_BENCHMARK_QUERIES 0
+// branching factor of the vocabulary tree ranking images by visual words in the local search
+// (0 - disabled, images are ranked by votes of their closest features)
+#define VOCAB_BRANCHING 0
+// number of levels of the vocabulary tree (up to VOCAB_BRANCHING^VOCAB_DEPTH words)
+#define VOCAB_DEPTH 4
+// dimension of PCA reduced sift features scanned for candidates by the local search
+// (0 - disabled, full features are scanned), typically 32 or 64
+#define PCA_COMPONENTS 0
+// number of candidates per query feature re-ranked by exact distance
+#define PCA_CANDIDATES 50
+// file in which the PCA projection is saved (and loaded from on the next run),
+// snapshot versions train their own without saving it
+#define PCA_MODEL_PATH "spindex.pca"
+// number of database features used to measure the recall of the PCA search
+#define PCA_RECALL_SAMPLES 100
+// length of binary codes of sift features searched for candidates by the local search
+// (0 - disabled, full features are scanned), 64, 128, 192 or 256
+#define LSH_BITS 0
+// number of hash tables looked up for candidates (0 - all codes are scanned)
+#define LSH_TABLES 4
+// number of candidates per query feature re-ranked by exact distance
+#define LSH_CANDIDATES 50
+// number of database features used to measure the recall of the LSH search
+#define LSH_RECALL_SAMPLES 100
+// 1 - search a half precision (fp16) copy of the sift features, exact for
+// integer coordinates, 2 - also rank images by bfloat16 histograms (approximate)
+// (0 - disabled), the double sift features are freed unless a vocabulary tree,
+// PCA, LSH or snapshots need them
+#define HALF_PRECISION 0
+// number of database images used to estimate the agreement of bfloat16 histograms
+#define HALF_AGREEMENT_SAMPLES 100
+// number of images used to benchmark SIFT_MAX_SIDE (see main_descriptors.h) against
+// full resolution
+// (0 - disabled)
+#define SIFT_BENCHMARK_IMAGES 0
+// number of images used to benchmark the histogram sampling against all pixels
+// (0 - disabled)
+#define HIST_BENCHMARK_IMAGES 0
+// number of images used to benchmark SIFT_TILE_THREADS against whole images
+// (0 - disabled)
+#define SIFT_TILE_BENCHMARK_IMAGES 0
+// 1 - queries read the databases through snapshots, so images can be added
+// or removed while queries run: entering +path adds the image at path and
+// -index removes the image of that index (0 - queries read the databases directly),
+// not supported by the on-disk index (INDEX_SHARD_SIZE > 0). Each update derives
+// the configured search structures of the whole new version again: PCA, LSH and
+// the vocabulary tree are retrained, the coarse histograms and half precision
+// copies rebuilt and the NUMA search threads respawned, so an update costs
+// about as much as their creation at startup
+#define DATABASE_SNAPSHOTS 0
+// 1 - print the memory used by the databases and local search structures
+// after preprocessing, 2 - also for each image (0 - disabled)
+#define MEMORY_REPORT 0
+// 1 - record per stage query latency histograms and print their percentiles
+// at exit (0 - disabled)
+#define LATENCY_HISTOGRAMS 0
+// number of queries between printed latency snapshots (0 - only at exit)
+#define LATENCY_SNAPSHOT_QUERIES 0
+// 1 - queries are videos (or image sequences such as frames/img%03d.png)
+// streamed frame by frame, with the local search done for keyframes only (0 - images),
+// not supported by the on-disk index (INDEX_SHARD_SIZE > 0)
+#define VIDEO_QUERIES 0
+// relative histogram change since the last keyframe starting a new keyframe
+#define VIDEO_KEYFRAME_CHANGE 0.2
+// maximum number of frames between keyframes (0 - no maximum)
+#define VIDEO_KEYFRAME_INTERVAL 0
+// 1 - record the image queries (arrival time, path, content hash and stage
+// durations) in a trace which sp_replay replays (0 - disabled), not supported
+// by the on-disk index (INDEX_SHARD_SIZE > 0)
+#define QUERY_TRACE 0
+#define QUERY_TRACE_PATH "sptrace"
+
+// the search structures derived from the databases
+// (members are NULL and disabled if not configured)
+struct derived_search {
+	local_search localSearch;
+	SPHistPyramid *histPyramid;   // coarse histograms pruning the global search
+};
+
+//Inner function freeing the search structures derived from the databases
+static void destroyDerivedSearch(derived_search *derived) {
+	if (derived == NULL)
+		return;
+	spHistPyramidDestroy(derived->histPyramid);
+	spVocabTreeDestroy(derived->localSearch.vocabTree);
+	spSiftLSHDestroy(derived->localSearch.lsh);
+	spSiftPCADestroy(derived->localSearch.pca);
+	spHalfStoreDestroy(derived->localSearch.half);
+	spNumaStoreDestroy(derived->localSearch.numaStore);
+	delete derived;
+}
+
+//Inner function creating the configured search structures from the databases
+static derived_search* createDerivedSearch(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		int numOfImages, bool initial) {
+	// initial is true for the databases preprocessed at startup: their reports
+	// (and the NUMA benchmark) are printed and the PCA projection is loaded from
+	// or saved to PCA_MODEL_PATH, which a snapshot version (initial is false)
+	// does not overwrite with the projection trained on its databases
+	// if fails returns NULL
+	derived_search *derived = new (std::nothrow) derived_search;
+	if (derived == NULL)
+		return NULL;
+	local_search none = { NULL, NULL, NULL, NULL, NULL };
+	derived->localSearch = none;
+	derived->histPyramid = NULL;
+	local_search &localSearch = derived->localSearch;
+	int ret = 0;
+	if (NUMA_SEARCH_THREADS > 0) {
+		if (initial && NUMA_BENCHMARK_QUERIES > 0)
+			benchmarkNumaStore(siftDB, nFeatures, numOfImages, NUMA_NODES, NUMA_SEARCH_THREADS,
+					K, NUMA_BENCHMARK_QUERIES);
+		localSearch.numaStore = spNumaStoreCreate(siftDB, nFeatures, numOfImages,
+				NUMA_NODES, NUMA_SEARCH_THREADS);
+		ret = localSearch.numaStore == NULL ? -1 : 0;
+	}
+	if (ret == 0 && HALF_PRECISION > 0) {
+		localSearch.half = spHalfStoreCreate(HALF_PRECISION == 2 ? histDB : NULL, siftDB, nFeatures,
+				numOfImages);
+		memory_usage doubles;
+		if (localSearch.half == NULL)
+			ret = -1;
+		else if (initial) {
+			if (databaseMemoryUsage(histDB, siftDB, nFeatures, numOfImages, &doubles, NULL) == -1)
+				ret = -1;
+			else {
+				// compared with the double points it replaces in queries
+				printf(HALF_REPORT_MSG, spHalfStoreMemoryBytes(localSearch.half)/1024.0,
+						(doubles.descriptors + (HALF_PRECISION == 2 ? doubles.histograms : 0))/1024.0,
+						spHalfStoreNumOfInexact(localSearch.half),
+						spHalfStoreNumOfFeatures(localSearch.half));
+				if (HALF_PRECISION == 2)
+					printf(HALF_HIST_REPORT_MSG, K, spHalfStoreHistAgreement(localSearch.half, histDB,
+							K, HALF_AGREEMENT_SAMPLES), HALF_AGREEMENT_SAMPLES < numOfImages ?
+							HALF_AGREEMENT_SAMPLES : numOfImages);
+			}
+		}
+	}
+	if (ret == 0 && PCA_COMPONENTS > 0) {
+		localSearch.pca = spSiftPCACreate(siftDB, nFeatures, numOfImages,
+				PCA_COMPONENTS, PCA_CANDIDATES, initial ? PCA_MODEL_PATH : NULL);
+		if (localSearch.pca == NULL)
+			ret = -1;
+		else if (initial)
+			printf(PCA_REPORT_MSG, PCA_COMPONENTS, PCA_CANDIDATES, K,
+					spSiftPCARecall(localSearch.pca, K, PCA_RECALL_SAMPLES), PCA_RECALL_SAMPLES);
+	}
+	if (ret == 0 && LSH_BITS > 0) {
+		localSearch.lsh = spSiftLSHCreate(siftDB, nFeatures, numOfImages,
+				LSH_BITS, LSH_TABLES, LSH_CANDIDATES);
+		if (localSearch.lsh == NULL)
+			ret = -1;
+		else if (initial)
+			printf(LSH_REPORT_MSG, LSH_BITS, LSH_TABLES, LSH_CANDIDATES, K,
+					spSiftLSHRecall(localSearch.lsh, K, LSH_RECALL_SAMPLES), LSH_RECALL_SAMPLES);
+	}
+	if (ret == 0 && VOCAB_BRANCHING > 0) {
+		localSearch.vocabTree = spVocabTreeCreate(siftDB, nFeatures, numOfImages,
+				VOCAB_BRANCHING, VOCAB_DEPTH);
+		if (localSearch.vocabTree == NULL)
+			ret = -1;
+		else if (initial)
+			printf(VOCAB_REPORT_MSG, spVocabTreeNumOfWords(localSearch.vocabTree),
+					spVocabTreeNumOfPostings(localSearch.vocabTree),
+					(double) spVocabTreeNumOfPostings(localSearch.vocabTree)/
+					spVocabTreeNumOfWords(localSearch.vocabTree));
+	}
+	if (ret == 0 && HIST_COARSE_BINS > 0) {
+		derived->histPyramid = spHistPyramidCreate(histDB, numOfImages, HIST_COARSE_BINS);
+		ret = derived->histPyramid == NULL ? -1 : 0;
+	}
+	if (ret == -1) {
+		destroyDerivedSearch(derived);
+		return NULL;
+	}
+	return derived;
+}
+
+//Inner function creating the search structures of a new snapshot version (see SPSnapshotDerive)
+static void* deriveSnapshot(const SPSnapshot *version, void *arg) {
+	(void) arg;
+	return createDerivedSearch(version->histDB, version->siftDB, version->nFeatures,
+			version->numOfImages, false);
+}
+
+//Inner function freeing the search structures of a snapshot version (see SPSnapshotDeriveFree)
+static void freeSnapshotDerived(void *derived, void *arg) {
+	(void) arg;
+	destroyDerivedSearch((derived_search*) derived);
+}
+
+//Inner function adding the image at path to the snapshot database
+static void addSnapshotImage(SPSnapshotDB *db, const char *path, int numOfBins,
+		int nFeaturesToExtract, SPQueryCache *cache) {
+	// the image is given the next index (images are only added by this thread)
+	SPSnapshot snapshot;
+	spSnapshotDBAcquire(db, &snapshot);
+	int index = snapshot.numOfImages;
+	spSnapshotDBRelease(db, &snapshot);
+
+	int n = 0;
+	SPPoint **hist = spGetRGBHist(path, index, numOfBins);
+	SPPoint **sift = hist == NULL ? NULL : spGetSiftDescriptors(path, index, nFeaturesToExtract, &n);
+	if (hist == NULL || sift == NULL) { // the loading error is already printed
+		destroySPPoint1D(hist, 3);
+		return;
+	}
+	if (spSnapshotDBAppend(db, hist, sift, n) == -1) {
+		printf("%s",SNAPSHOT_ERROR_MSG);
+		destroySPPoint1D(hist, 3);
+		destroySPPoint1D(sift, n);
+		return;
+	}
+	// cached rankings were computed against the previous version
+	spQueryCacheInvalidate(cache);
+	printf(SNAPSHOT_ADD_MSG, index, index+1);
+}
+
+//Inner function removing the image of a given index from the snapshot database
+static void removeSnapshotImage(SPSnapshotDB *db, const char *index, SPQueryCache *cache) {
+	SPSnapshot snapshot;
+	spSnapshotDBAcquire(db, &snapshot);
+	int numOfImages = snapshot.numOfImages;
+	spSnapshotDBRelease(db, &snapshot);
+
+	char *end;
+	long removedIndex = strtol(index, &end, 10);
+	if (end == index || *end != '\0' || removedIndex < 0 || removedIndex >= numOfImages) {
+		printf("%s",SNAPSHOT_INDEX_ERROR_MSG);
+		return;
+	}
+	char *removed = (char*) calloc(numOfImages, sizeof(char));
+	int left = -1;
+	if (removed != NULL) {
+		removed[removedIndex] = 1;
+		left = spSnapshotDBCompact(db, removed, numOfImages);
+	}
+	free(removed);
+	if (left == -1) {
+		printf("%s",SNAPSHOT_ERROR_MSG);
+		return;
+	}
+	// cached rankings were computed against the previous version
+	spQueryCacheInvalidate(cache);
+	printf(SNAPSHOT_REMOVE_MSG, (int) removedIndex, left);
+}
+
+//Inner function answering queries (and database updates) through snapshots
+static int querySnapshots(SPSnapshotDB *db, int numOfBins, int nFeaturesToExtract,
+		SPQueryCache *cache, query_latency *latency, SPQueryTrace *trace, query_context *context) {
+	// the query is read before a snapshot is acquired, so no version is kept
+	// alive while waiting for the user
+	// returns 0 when the exit character is entered, -1 when a query fails
+	char *query = context->query;
+	while (true) {
+		getUserStr(query, VIDEO_QUERIES ? ENTER_VIDEO_MSG : ENTER_QUERY_MSG);
+		if (strncmp(query, EXIT_CHAR, 1024) == 0) {
+			printf("%s", EXIT_MSG);
+			return 0;
+		}
+		if (query[0] == SNAPSHOT_ADD_CHAR) {
+			addSnapshotImage(db, query + 1, numOfBins, nFeaturesToExtract, cache);
+			continue;
+		}
+		if (query[0] == SNAPSHOT_REMOVE_CHAR) {
+			removeSnapshotImage(db, query + 1, cache);
+			continue;
+		}
+
+		SPSnapshot snapshot;
+		spSnapshotDBAcquire(db, &snapshot);
+		derived_search *derived = (derived_search*) snapshot.derived;
+		int ret;
+		if (VIDEO_QUERIES)
+			ret = answerVideoQuery(query, snapshot.histDB, snapshot.siftDB, snapshot.nFeatures,
+					snapshot.skipped, K, snapshot.numOfImages, numOfBins, nFeaturesToExtract,
+					CASCADE_CANDIDATES, derived->histPyramid, &derived->localSearch,
+					VIDEO_KEYFRAME_CHANGE, VIDEO_KEYFRAME_INTERVAL, latency, context);
+		else
+			ret = answerQuery(query, snapshot.histDB, snapshot.siftDB, snapshot.nFeatures,
+					snapshot.skipped, K, snapshot.numOfImages, numOfBins, nFeaturesToExtract,
+					CASCADE_CANDIDATES, derived->histPyramid, cache, &derived->localSearch, latency,
+					trace, context);
+		spSnapshotDBRelease(db, &snapshot);
+		if (ret == -1)
+			return -1;
+	}
+}
+
+//Inner function checking that the on-disk index supports the configuration
+static int checkIndexConfig() {
+	// if an option which only the in-memory databases support is set with
+	// INDEX_SHARD_SIZE > 0, prints an error and returns -1, otherwise 0
+	if (INDEX_SHARD_SIZE > 0 && QUERY_TRACE) {
+		printf(INDEX_UNSUPPORTED_MSG, "QUERY_TRACE");
+		return -1;
+	}
+	if (INDEX_SHARD_SIZE > 0 && VIDEO_QUERIES) {
+		printf(INDEX_UNSUPPORTED_MSG, "VIDEO_QUERIES");
+		return -1;
+	}
+	if (INDEX_SHARD_SIZE > 0 && DATABASE_SNAPSHOTS) {
+		printf(INDEX_UNSUPPORTED_MSG, "DATABASE_SNAPSHOTS");
+		return -1;
+	}
+	return 0;
+}
 
 
 int main () {
 	int ret;
 
+	// reject options the on-disk index would ignore before reading the parameters
+	if (checkIndexConfig() == -1)
+		return -1;
+
 	// 1-6. get parameters from user
 	int numOfImages, numOfBins, nFeaturesToExtract;
 	char *dir = (char*) malloc(1024*sizeof(char));
@@ -26,30 +390,210 @@ int main () {
 		return -1;
 	}
 
+	// extract descriptors of database and query images at the same resolution, tiling
+	// and sampling
+	spSetSiftMaxSide(SIFT_MAX_SIDE);
+	spSetSiftTiling(SIFT_TILE_THREADS, SIFT_TILE_OVERLAP);
+	if (SIFT_MAX_SIDE > 0 && SIFT_BENCHMARK_IMAGES > 0)
+		benchmarkSiftMaxSide(dir, prefix, suffix, numOfImages, nFeaturesToExtract,
+				SIFT_MAX_SIDE, K, SIFT_BENCHMARK_IMAGES);
+	if (SIFT_TILE_THREADS > 1 && SIFT_TILE_BENCHMARK_IMAGES > 0)
+		benchmarkSiftTiling(dir, prefix, suffix, numOfImages, nFeaturesToExtract, K,
+				SIFT_TILE_BENCHMARK_IMAGES);
+	spSetHistSampling(HIST_SAMPLE_STRIDE, HIST_SAMPLE_JITTER, HIST_DECODE_REDUCTION);
+	if ((HIST_SAMPLE_STRIDE > 1 || HIST_DECODE_REDUCTION > 1) && HIST_BENCHMARK_IMAGES > 0)
+		benchmarkHistSampling(dir, prefix, suffix, numOfImages, numOfBins, K,
+				HIST_BENCHMARK_IMAGES);
+
+	// per stage query latency histograms (NULL and disabled if LATENCY_HISTOGRAMS is 0)
+	query_latency latency, *queryLatency = NULL;
+	if (LATENCY_HISTOGRAMS) {
+		if (createQueryLatency(&latency, LATENCY_SNAPSHOT_QUERIES) == -1) {
+			printf("%s",MEMORY_ERROR);
+			free(dir);
+			free(prefix);
+			free(suffix);
+			return -1;
+		}
+		queryLatency = &latency;
+	}
+
+	// 7-11. out-of-core mode - build index on disk and query it
+	if (INDEX_SHARD_SIZE > 0) {
+		SPIndexManifest manifest;
+		if (INDEX_REUSE && findIndex(INDEX_PATH, dir, prefix, suffix, numOfImages, numOfBins,
+				nFeaturesToExtract, INDEX_SHARD_SIZE, SKIP_BAD_IMAGES, &manifest) == 0)
+			printf(INDEX_REUSE_MSG, manifest.numOfShards, manifest.numOfImages);
+		else
+			ret = buildIndex(INDEX_PATH, dir, prefix, suffix, numOfImages, numOfBins,
+					nFeaturesToExtract, INDEX_SHARD_SIZE, PREFETCH_THREADS, &manifest,
+					SKIP_BAD_IMAGES);
+		free(dir);
+		free(prefix);
+		free(suffix);
+		if (ret == -1) {
+			destroyQueryLatency(queryLatency);
+			return -1;
+		}
+		if (manifest.numOfSkipped > 0)
+			printf(SKIPPED_REPORT_MSG, manifest.numOfSkipped, numOfImages);
+		SPShardPool *pool = NULL;
+		SPLazyIndex *lazyIndex = NULL;
+		if (SHARD_WORKERS > 0) {
+			pool = spShardPoolCreate(INDEX_PATH, &manifest, SHARD_WORKERS);
+			if (pool == NULL) {
+				printf("%s",SHARD_WORKER_ERROR_MSG);
+				destroyQueryLatency(queryLatency);
+				return -1;
+			}
+		}
+		else if (INDEX_LAZY_SHARDS) {
+			lazyIndex = spLazyIndexCreate(INDEX_PATH, &manifest, INDEX_WARM_UP);
+			if (lazyIndex == NULL) {
+				printf("%s",MEMORY_ERROR);
+				destroyQueryLatency(queryLatency);
+				return -1;
+			}
+		}
+		SPQueryCache *cache = spQueryCacheCreate(QUERY_CACHE_SIZE);
+		while (queryAndCheckIndex(INDEX_PATH, &manifest, pool, lazyIndex, K, CASCADE_CANDIDATES,
+				cache, queryLatency) == 0) {}
+		printQueryLatency(queryLatency);
+		if (lazyIndex != NULL)
+			printf(INDEX_LAZY_REPORT_MSG, spLazyIndexNumOfOpenShards(lazyIndex), manifest.numOfShards);
+		destroyQueryLatency(queryLatency);
+		spQueryCacheDestroy(cache);
+		spLazyIndexDestroy(lazyIndex);
+		spShardPoolDestroy(pool);
+		return 0;
+	}
+
 	// 7. create databases
 	SPPoint ***histDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
 	SPPoint ***siftDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
 	int *nFeatures = (int*) malloc(numOfImages*sizeof(int));
-	ret = preprocessing(histDB, siftDB, nFeatures, dir, prefix, suffix, numOfImages, numOfBins, nFeaturesToExtract);
+	// images skipped by preprocessing (NULL and disabled if SKIP_BAD_IMAGES is 0)
+	char *skipped = SKIP_BAD_IMAGES ? (char*) malloc(numOfImages*sizeof(char)) : NULL;
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL ||
+			(SKIP_BAD_IMAGES && skipped == NULL))
+		ret = -1;
+	else if (CHECKPOINT_SIZE > 0)
+		ret = preprocessingCheckpointed(histDB, siftDB, nFeatures, dir, prefix, suffix,
+				numOfImages, numOfBins, nFeaturesToExtract, PREFETCH_THREADS,
+				CHECKPOINT_PATH, CHECKPOINT_SIZE, skipped);
+	else
+		ret = preprocessing(histDB, siftDB, nFeatures, dir, prefix, suffix,
+				numOfImages, numOfBins, nFeaturesToExtract, PREFETCH_THREADS, skipped);
 	free(dir);
 	free(prefix);
 	free(suffix);
 	// if pre-processing failed (or allocation failure)
 	if (ret == -1) {
-		if (histDB == NULL || siftDB == NULL || nFeatures == NULL)
+		if (histDB == NULL || siftDB == NULL || nFeatures == NULL ||
+				(SKIP_BAD_IMAGES && skipped == NULL))
 			printf("%s",MEMORY_ERROR);
+		destroyQueryLatency(queryLatency);
 		destroySPPoint2D(histDB,numOfImages,NULL);
 		destroySPPoint2D(siftDB,numOfImages,nFeatures);
+		free(skipped);
 		return -1;
 	}
+	int numOfSkipped = numOfSkippedImages(skipped, numOfImages);
+	if (numOfSkipped > 0)
+		printf(SKIPPED_REPORT_MSG, numOfSkipped, numOfImages);
+
+	// place the sift features on the NUMA nodes of the local search threads
+	// and/or convert them to half precision, reduce them by PCA, encode them by
+	// LSH or train a vocabulary tree, and create the coarse histograms
+	derived_search *derived = createDerivedSearch(histDB, siftDB, nFeatures, numOfImages, true);
+	if (derived == NULL) {
+		printf("%s",MEMORY_ERROR);
+		destroyQueryLatency(queryLatency);
+		destroySPPoint2D(histDB,numOfImages,NULL);
+		destroySPPoint2D(siftDB,numOfImages,nFeatures);
+		free(skipped);
+		return -1;
+	}
+	// the half precision features answer every local search, so the doubles
+	// are only kept if another structure reads them or they may be derived
+	// again (snapshots)
+	if (HALF_PRECISION > 0 && VOCAB_BRANCHING == 0 && PCA_COMPONENTS == 0 && LSH_BITS == 0 &&
+			!DATABASE_SNAPSHOTS)
+		for (int i=0; i<numOfImages; i++) {
+			destroySPPoint1D(siftDB[i],nFeatures[i]);
+			siftDB[i] = NULL;
+		}
+	if (MEMORY_REPORT > 0)
+		printMemoryUsage(histDB, siftDB, nFeatures, numOfImages, &derived->localSearch,
+				MEMORY_REPORT == 2);
+
+	// query trace (NULL and disabled if QUERY_TRACE is 0), whose header records
+	// how the queries are answered so sp_replay answers them alike
+	SPQueryTrace *trace = NULL;
+	if (QUERY_TRACE) {
+		SPQueryTraceParams traceParams = {numOfImages, numOfBins, nFeaturesToExtract, K,
+				CASCADE_CANDIDATES, NUM_OF_STAGES, spGetSiftMaxSide(), spGetSiftTileThreads(),
+				spGetSiftTileOverlap(), spGetHistStride(), spGetHistJitter() ? 1 : 0,
+				spGetHistReduction(), HIST_COARSE_BINS, QUERY_CACHE_SIZE, NUMA_SEARCH_THREADS,
+				NUMA_NODES, HALF_PRECISION, PCA_COMPONENTS, PCA_CANDIDATES, LSH_BITS, LSH_TABLES,
+				LSH_CANDIDATES, VOCAB_BRANCHING, VOCAB_DEPTH, SKIP_BAD_IMAGES};
+		trace = spQueryTraceCreate(QUERY_TRACE_PATH, &traceParams);
+		if (trace == NULL) {
+			printf("%s",QUERY_TRACE_ERROR_MSG);
+			destroyQueryLatency(queryLatency);
+			destroyDerivedSearch(derived);
+			destroySPPoint2D(histDB,numOfImages,NULL);
+			destroySPPoint2D(siftDB,numOfImages,nFeatures);
+			free(skipped);
+			return -1;
+		}
+	}
 
 	// 8-11. query user and compare given image to all other images
-	while (queryAndCheck(histDB, siftDB, nFeatures, K,
-			numOfImages, numOfBins, nFeaturesToExtract) == 0) {}
+	// (cache is NULL and disabled if QUERY_CACHE_SIZE is 0)
+	// (scratch buffers of the queries are reused across queries)
+	SPQueryCache *cache = spQueryCacheCreate(QUERY_CACHE_SIZE);
+	query_context context;
+	initQueryContext(&context);
+	if (DATABASE_SNAPSHOTS) {
+		// the database takes the descriptors and the derived structures, only
+		// the arrays are left to free
+		SPSnapshotDB *db = spSnapshotDBCreate(histDB, siftDB, nFeatures, skipped, numOfImages,
+				derived, deriveSnapshot, freeSnapshotDerived, NULL);
+		if (db == NULL)
+			printf("%s",MEMORY_ERROR);
+		else {
+			free(histDB);
+			free(siftDB);
+			free(nFeatures);
+			histDB = NULL;
+			siftDB = NULL;
+			nFeatures = NULL;
+			derived = NULL;
+			querySnapshots(db, numOfBins, nFeaturesToExtract, cache, queryLatency, trace, &context);
+			spSnapshotDBDestroy(db);
+		}
+	}
+	else if (VIDEO_QUERIES)
+		while (queryAndCheckVideo(histDB, siftDB, nFeatures, skipped, K, numOfImages, numOfBins,
+				nFeaturesToExtract, CASCADE_CANDIDATES, derived->histPyramid, &derived->localSearch,
+				VIDEO_KEYFRAME_CHANGE, VIDEO_KEYFRAME_INTERVAL, queryLatency, &context) == 0) {}
+	else
+		while (queryAndCheck(histDB, siftDB, nFeatures, skipped, K, numOfImages, numOfBins,
+				nFeaturesToExtract, CASCADE_CANDIDATES, derived->histPyramid, cache,
+				&derived->localSearch, queryLatency, trace, &context) == 0) {}
+	printQueryLatency(queryLatency);
+	if (!spQueryTraceClose(trace))
+		printf("%s",QUERY_TRACE_ERROR_MSG);
 
 	// cleanup
+	destroyQueryContext(&context);
+	destroyQueryLatency(queryLatency);
+	spQueryCacheDestroy(cache);
+	destroyDerivedSearch(derived);
 	destroySPPoint2D(histDB,numOfImages,NULL);
 	destroySPPoint2D(siftDB,numOfImages,nFeatures);
+	free(skipped);
 
 	return 0;
 }
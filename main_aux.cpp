@@ -2,7 +2,15 @@
 #include <cstdlib>
 #include <climits>
 #include <cstring>
+#include <cmath>
+#include <chrono>
+#include <malloc.h>
+#include <algorithm>
+#include <vector>
+#include <new>
 #include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
+#include "sp_image_prefetch.h"
 #include "main_aux.h"
 extern "C" {
 	#include "SPBPriorityQueue.h"
@@ -76,9 +84,57 @@ int getUserParams(char *dir, char *prefix, char *suffix,
 
 int preprocessing(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
 		char *dir, char *prefix, char *suffix,
-		int numOfImages, int numOfBins, int nFeaturesToExtract) {
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int prefetchThreads,
+		char *skipped) {
 	// compute histogram and sift features for all images
 	// if fails returns -1, otherwise 0
+	return preprocessingRange(histDB, siftDB, nFeatures, dir, prefix, suffix,
+			0, numOfImages, numOfBins, nFeaturesToExtract, prefetchThreads, skipped);
+}
+
+int numOfSkippedImages(const char *skipped, int numOfImages) {
+	int res = 0;
+	for (int i=0; skipped != NULL && i<numOfImages; i++)
+		if (skipped[i])
+			res++;
+	return res;
+}
+
+//Inner function creating the descriptors of a skipped image
+static int skippedImageDescriptors(SPPoint ***hist, SPPoint ***sift, int *nFeatures,
+		int imageIndex, int numOfBins) {
+	// empty histograms and no sift features (the image is excluded from
+	// rankings by its skipped flag)
+	// if fails returns -1, otherwise 0
+	double *data = (double*) calloc(numOfBins, sizeof(double));
+	*hist = (SPPoint**) calloc(3, sizeof(SPPoint*));
+	*sift = (SPPoint**) malloc(sizeof(SPPoint*));
+	*nFeatures = 0;
+	int ret = data != NULL && *hist != NULL && *sift != NULL ? 0 : -1;
+	for (int c=0; c<3 && ret == 0; c++) {
+		(*hist)[c] = spPointCreate(data, numOfBins, imageIndex);
+		if ((*hist)[c] == NULL)
+			ret = -1;
+	}
+	if (ret == -1) {
+		printf("%s",MEMORY_ERROR);
+		destroySPPoint1D(*hist, 3);
+		free(*sift);
+		*hist = NULL;
+		*sift = NULL;
+	}
+	free(data);
+	return ret;
+}
+
+int preprocessingRange(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		char *dir, char *prefix, char *suffix,
+		int firstImage, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int prefetchThreads, char *skipped) {
+	// compute histogram and sift features for images firstImage, ..., firstImage+numOfImages-1
+	// if prefetchThreads > 0 image files are read ahead by I/O threads and decoded from memory
+	// if skipped is not NULL images which cannot be loaded are skipped and flagged in skipped
+	// if fails returns -1, otherwise 0
 
 	if (histDB == NULL || siftDB == NULL || nFeatures == NULL ||
 			dir == NULL || prefix == NULL || suffix == NULL)
@@ -96,46 +152,84 @@ int preprocessing(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
 	for (int i=0; i<numOfImages; i++) {
 		histDB[i] = NULL;
 		siftDB[i] = NULL;
+		if (skipped != NULL)
+			skipped[i] = 0;
+	}
+	// start reading image files ahead
+	SPImagePrefetcher *prefetcher = NULL;
+	if (prefetchThreads > 0) {
+		prefetcher = spImagePrefetcherCreate(dir, prefix, suffix, firstImage, numOfImages,
+				prefetchThreads, prefetchThreads*PREFETCH_IMAGES_PER_THREAD);
+		if (prefetcher == NULL) {
+			printf("%s",MEMORY_ERROR);
+			free(imageName);
+			return -1;
+		}
 	}
+
 	// compute histogram and sift features
 	for (int i=0; i<numOfImages; i++) {
-		sprintf(imageName,"%s%s%d%s", dir, prefix, i, suffix);
+		sprintf(imageName,"%s%s%d%s", dir, prefix, firstImage+i, suffix);
 		//printf("%s\n",imageName); // remove this ###
 
+		// get prefetched image file (if reading failed, fall back to loading from
+		// disk below, which reports the error)
+		const unsigned char *buf = NULL;
+		size_t size = 0;
+		if (prefetcher != NULL && !spImagePrefetcherGet(prefetcher, firstImage+i, &buf, &size))
+			buf = NULL;
+
 		// get histogram
-		histDB[i] = spGetRGBHist(imageName,i,numOfBins);
-		if (histDB[i] == NULL) {
-			free(imageName);
-			return -1;
-		}
+		spTakeImageLoadFailed();
+		if (buf != NULL)
+			histDB[i] = spGetRGBHistFromBuffer(imageName,buf,size,firstImage+i,numOfBins);
+		else
+			histDB[i] = spGetRGBHist(imageName,firstImage+i,numOfBins);
 
 		// get sift features
-		siftDB[i] = spGetSiftDescriptors(imageName,i,nFeaturesToExtract, nFeatures + i);
-		if (siftDB[i] == NULL) {
+		if (histDB[i] != NULL && buf != NULL)
+			siftDB[i] = spGetSiftDescriptorsFromBuffer(imageName,buf,size,firstImage+i,
+					nFeaturesToExtract, nFeatures + i);
+		else if (histDB[i] != NULL)
+			siftDB[i] = spGetSiftDescriptors(imageName,firstImage+i,nFeaturesToExtract, nFeatures + i);
+
+		// skip an image which cannot be loaded (error message printed in function)
+		// or abort (also on allocation failure, which would fail the next images too)
+		if (siftDB[i] == NULL && skipped != NULL && spTakeImageLoadFailed()) {
+			destroySPPoint1D(histDB[i], 3);
+			if (skippedImageDescriptors(histDB + i, siftDB + i, nFeatures + i,
+					firstImage+i, numOfBins) == 0)
+				skipped[i] = 1;
+		}
+		if (histDB[i] == NULL || siftDB[i] == NULL) {
+			spImagePrefetcherDestroy(prefetcher);
 			free(imageName);
 			return -1;
 		}
+		spImagePrefetcherRelease(prefetcher, firstImage+i);
 	}
+	spImagePrefetcherDestroy(prefetcher);
 	free(imageName);
 
 	return 0;
 }
 
-// struct for sortAndPrint
-typedef struct sortable_index {
-	int index;
-	double value;
-} sortable_index;
-
 // comparator for sortAndPrint
-int compareIndex(const void *a, const void *b) {
+bool lessIndex(const sortable_index &a, const sortable_index &b) {
 	// sortable_index comparator
 	// compares by value and uses index as tie breaker
-	if (((sortable_index*)a)->value > ((sortable_index*)b)->value ||
-			(((sortable_index*)a)->value == ((sortable_index*)b)->value &&
-					((sortable_index*)a)->index > ((sortable_index*)b)->index))
-		return 1;
-	return -1;
+	return a.value < b.value || (a.value == b.value && a.index < b.index);
+}
+
+void sortIndices(sortable_index *arr, int dim, int order) {
+	// sorts an array by value
+	// if order = -1, flips sorting order
+	if (arr == NULL) return;
+
+	if (order == -1) // flip order if -1
+		for (int i=0; i<dim; i++) arr[i].value *= -1;
+	// (std::sort never allocates, unlike qsort for large arrays)
+	std::sort(arr, arr + dim, lessIndex);
 }
 
 void sortAndPrint(sortable_index *arr, int dim, int k, int order, const char *msg) {
@@ -144,9 +238,7 @@ void sortAndPrint(sortable_index *arr, int dim, int k, int order, const char *ms
 	// if order = -1, flips sorting order
 	if (arr == NULL) return;
 
-	if (order == -1) // flip order if -1
-		for (int i=0; i<dim; i++) arr[i].value *= -1;
-	qsort(arr, dim, sizeof(sortable_index), &compareIndex);
+	sortIndices(arr, dim, order);
 
 	if (msg != NULL) printf("%s", msg);
 	for (int i=0; i<k-1; i++)
@@ -154,8 +246,469 @@ void sortAndPrint(sortable_index *arr, int dim, int k, int order, const char *ms
 	printf("%d\n",arr[k-1].index);
 }
 
-int queryAndCheck(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int k,
-		int numOfImages, int numOfBins, int nFeaturesToExtract) {
+void selectCandidates(sortable_index *dists, SPPoint ***siftDB, int *nFeatures,
+		int numOfImages, int numOfCandidates, SPPoint ***candSift, int *candNFeatures,
+		bool report) {
+	// builds a sift database of the numOfCandidates first images in dists
+	// (dists is assumed to be sorted by global distance) in the given arrays
+	// prints a report of the descriptors skipped by the cascade (if report)
+
+	long totalFeatures = 0, searchedFeatures = 0;
+	for (int i=0; i<numOfImages; i++)
+		totalFeatures += nFeatures[i];
+	for (int i=0; i<numOfCandidates; i++) {
+		candSift[i] = siftDB[dists[i].index];
+		candNFeatures[i] = nFeatures[dists[i].index];
+		searchedFeatures += candNFeatures[i];
+	}
+
+	if (report)
+		printf(CASCADE_REPORT_MSG, numOfCandidates, numOfImages,
+				totalFeatures - searchedFeatures, totalFeatures);
+}
+
+SPPoint** getQueryHist(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const char *query, int imageIndex, int numOfBins) {
+	// returns the histogram of the query image, from the cache if possible
+	SPPoint **qhist = NULL;
+	if (key != NULL)
+		qhist = spQueryCacheGetHist(cache, key);
+	if (qhist == NULL)
+		qhist = spGetRGBHist(query, imageIndex, numOfBins);
+	return qhist;
+}
+
+SPPoint** getQuerySift(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const char *query, int imageIndex, int nFeaturesToExtract, int *qnFeatures) {
+	// returns the sift features of the query image, from the cache if possible
+	SPPoint **qsift = NULL;
+	if (key != NULL)
+		qsift = spQueryCacheGetSift(cache, key, qnFeatures);
+	if (qsift == NULL)
+		qsift = spGetSiftDescriptors(query, imageIndex, nFeaturesToExtract, qnFeatures);
+	return qsift;
+}
+
+int printCachedRankings(SPQueryCache *cache, const SPQueryCacheKey *key, bool print) {
+	// prints cached rankings in the same format as sortAndPrint (if print)
+	// returns 0 if cached, -1 if not cached
+	if (key == NULL)
+		return -1;
+	int *ranking = (int*) malloc(2*key->k*sizeof(int));
+	if (ranking == NULL || !spQueryCacheGetRankings(cache, key, ranking, ranking + key->k)) {
+		free(ranking);
+		return -1;
+	}
+	if (!print) {
+		free(ranking);
+		return 0;
+	}
+
+	printf("%s", OUTPUT_GLOBAL_MSG);
+	for (int i=0; i<key->k-1; i++)
+		printf("%d, ",ranking[i]);
+	printf("%d\n",ranking[key->k-1]);
+	printf("%s", OUTPUT_LOCAL_MSG);
+	for (int i=0; i<key->k-1; i++)
+		printf("%d, ",ranking[key->k+i]);
+	printf("%d\n",ranking[2*key->k-1]);
+
+	free(ranking);
+	return 0;
+}
+
+//Inner function growing the queues of a query context
+static int reserveQueues(query_context *context, int numOfQueues) {
+	// the queues have maximum size context->k
+	// if fails returns -1, otherwise 0
+	if (numOfQueues > context->numOfQueues) {
+		SPBPQueue **grown = (SPBPQueue**) realloc(context->queues, numOfQueues*sizeof(SPBPQueue*));
+		if (grown == NULL)
+			return -1;
+		context->queues = grown;
+		for (; context->numOfQueues<numOfQueues; context->numOfQueues++) {
+			context->queues[context->numOfQueues] = spBPQueueCreate(context->k);
+			if (context->queues[context->numOfQueues] == NULL)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+//Inner function counting hits of the local search done by a NUMA store
+static int numaStoreHits(SPNumaStore *numaStore, SPPoint **qsift, int qnFeatures,
+		const char *selected, sortable_index *dists, query_context *context) {
+	// adds to dists[i].value the number of query features for which one of
+	// the k closest features belongs to image i and prints a bandwidth report
+	// (the queues of the context are used)
+	// if fails returns -1, otherwise 0
+
+	int ret = 0;
+	SPBPQueue **queues = NULL;
+	if (reserveQueues(context, qnFeatures > 0 ? qnFeatures : 1) == 0)
+		queues = context->queues;
+	for (int i=0; queues != NULL && i<qnFeatures; i++)
+		spBPQueueClear(queues[i]);
+	if (queues == NULL ||
+			!spNumaStoreSearch(numaStore, qsift, qnFeatures, queues, selected, context->scratch)) {
+		printf("%s",MEMORY_ERROR);
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		BPQueueElement elem;
+		for (int i=0; i<qnFeatures; i++) {
+			while (spBPQueuePeek(queues[i], &elem) == SP_BPQUEUE_SUCCESS) {
+				dists[elem.index].value ++;
+				spBPQueueDequeue(queues[i]);
+			}
+		}
+		double bytes = context->scratch->scanBytes, seconds = context->scratch->scanSeconds;
+		if (!context->quiet)
+			printf(NUMA_REPORT_MSG, spNumaStoreNumOfNodes(numaStore), bytes/1e6, seconds*1e3,
+					seconds > 0 ? bytes/seconds/1e9 : 0.0);
+	}
+	return ret;
+}
+
+//Inner function computing local distances by a vocabulary tree
+static int vocabTreeDists(SPVocabTree *vocabTree, SPPoint **qsift, int qnFeatures,
+		int numOfImages, const char *selected, sortable_index *dists, query_context *context) {
+	// sets dists[i].value to the vocabulary tree distance of image i to the query
+	// (the scores of the context are used)
+	// if fails returns -1, otherwise 0
+	double *scores = context->scores;
+	if (!spVocabTreeScore(vocabTree, qsift, qnFeatures, selected, scores, context->scratch)) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+	for (int i=0; i<numOfImages; i++)
+		dists[i].value = scores[i];
+	return 0;
+}
+
+void cacheQuery(SPQueryCache *cache, const SPQueryCacheKey *key,
+		SPPoint **qhist, SPPoint **qsift, int qnFeatures, const int *ranking) {
+	// caches query descriptors and rankings (failures only mean a cache miss later)
+	if (key != NULL && spQueryCachePutDescriptors(cache, key, qhist, qsift, qnFeatures))
+		spQueryCachePutRankings(cache, key, ranking, ranking + key->k);
+}
+
+//Inner function computing the query histogram into a query context
+static SPPoint** contextQueryHist(query_context *context, SPQueryCache *cache,
+		const SPQueryCacheKey *key, const char *query, int imageIndex, int numOfBins) {
+	// returns the histogram of the query image (owned by the context), from the
+	// cache if possible, or NULL if fails
+	SPPoint **cached = key != NULL ? spQueryCacheGetHist(cache, key) : NULL;
+	if (cached != NULL) {
+		for (int c=0; c<3; c++) {
+			spPointDestroy(context->qhist[c]);
+			context->qhist[c] = cached[c];
+		}
+		free(cached);
+	}
+	else if (spGetRGBHistInto(query, imageIndex, numOfBins, context->qhist) == -1)
+		return NULL;
+	return context->qhist;
+}
+
+//Inner function computing the query sift features into a query context
+static SPPoint** contextQuerySift(query_context *context, SPQueryCache *cache,
+		const SPQueryCacheKey *key, const char *query, int imageIndex, int nFeaturesToExtract,
+		int *qnFeatures) {
+	// returns the sift features of the query image (owned by the context), from
+	// the cache if possible, or NULL if fails
+	SPPoint **cached = key != NULL ? spQueryCacheGetSift(cache, key, qnFeatures) : NULL;
+	if (cached != NULL) {
+		if (*qnFeatures > context->siftCapacity) {
+			SPPoint **grown = (SPPoint**) realloc(context->qsift, *qnFeatures*sizeof(SPPoint*));
+			if (grown == NULL) {
+				printf("%s",MEMORY_ERROR);
+				destroySPPoint1D(cached, *qnFeatures);
+				return NULL;
+			}
+			for (int i=context->siftCapacity; i<*qnFeatures; i++)
+				grown[i] = NULL;
+			context->qsift = grown;
+			context->siftCapacity = *qnFeatures;
+		}
+		for (int i=0; i<*qnFeatures; i++) {
+			spPointDestroy(context->qsift[i]);
+			context->qsift[i] = cached[i];
+		}
+		free(cached);
+	}
+	else {
+		*qnFeatures = spGetSiftDescriptorsInto(query, imageIndex, nFeaturesToExtract,
+				&context->qsift, &context->siftCapacity);
+		if (*qnFeatures == -1)
+			return NULL;
+	}
+	return context->qsift;
+}
+
+void globalRanking(SPPoint ***histDB, const char *skipped, int numOfImages, int k,
+		int cascadeCandidates, SPHistPyramid *histPyramid, const local_search *localSearch,
+		SPPoint **qhist, query_context *context) {
+	// sorts context->dists by distance to the query histogram, prints the k
+	// closest images and stores them as the global part of context->ranking
+	// with a histogram pyramid only the closest images needed (k, or the
+	// cascade candidates) are found and sorted, the rest of dists is undefined
+	// skipped images are ranked last
+	sortable_index *dists = context->dists;
+	int numOfSorted = numOfImages;
+	bool searched = false;
+	if (histPyramid != NULL && spHistPyramidNumOfImages(histPyramid) == numOfImages) {
+		// skipped images found by the pyramid are dropped below, so as many
+		// more images are needed
+		int needed = cascadeCandidates > k && cascadeCandidates < numOfImages ? cascadeCandidates : k;
+		needed = std::min(needed + numOfSkippedImages(skipped, numOfImages), numOfImages);
+		int found = spHistPyramidSearch(histPyramid, qhist, histDB, needed, context->closest,
+				context->scores, context->scratch);
+		if (found != -1) {
+			for (int i=0; i<found; i++) {
+				dists[i].value = context->scores[i];
+				dists[i].index = context->closest[i];
+			}
+			numOfSorted = found;
+			searched = true;
+			if (!context->quiet)
+				printf(PYRAMID_REPORT_MSG, context->scratch->numOfExact, numOfImages);
+		}
+	}
+	SPHalfStore *half = localSearch != NULL ? localSearch->half : NULL;
+	if (!searched && spHalfStoreHasHist(half) &&
+			spHalfStoreHistDistances(half, qhist, context->scores, context->scratch)) {
+		for (int i=0; i<numOfImages; i++) {
+			dists[i].value = context->scores[i];
+			dists[i].index = i;
+		}
+		searched = true;
+	}
+	if (!searched)
+		for (int i=0; i<numOfImages; i++) {
+			dists[i].value = spRGBHistL2Distance(qhist, histDB[i]);
+			dists[i].index = i;
+		}
+	for (int i=0; skipped != NULL && i<numOfSorted; i++)
+		if (skipped[dists[i].index])
+			dists[i].value = HUGE_VAL;
+	if (context->quiet)
+		sortIndices(dists, numOfSorted, 1);
+	else
+		sortAndPrint(dists, numOfSorted, k, 1, OUTPUT_GLOBAL_MSG);
+	for (int i=0; i<k; i++)
+		context->ranking[i] = dists[i].index;
+}
+
+int localRanking(SPPoint ***siftDB, int *nFeatures, const char *skipped, int k, int numOfImages,
+		int cascadeCandidates, const local_search *localSearch, SPPoint **qsift, int qnFeatures,
+		query_context *context) {
+	// context->dists must be sorted by global distance (see globalRanking)
+	// prints the k closest images by local descriptors and stores them as the
+	// local part of context->ranking
+	// skipped images are ranked last (below images with no votes)
+	// if fails returns -1, otherwise 0
+	sortable_index *dists = context->dists;
+	int *hits = context->hits;
+	int ret = 0;
+	SPPoint ***localDB = siftDB;
+	int *localNFeatures = nFeatures;
+	int localNumOfImages = numOfImages;
+	char *selected = NULL;
+	SPVocabTree *vocabTree = localSearch != NULL ? localSearch->vocabTree : NULL;
+	SPSiftPCA *pca = localSearch != NULL && vocabTree == NULL ? localSearch->pca : NULL;
+	SPSiftLSH *lsh = localSearch != NULL && vocabTree == NULL && pca == NULL ? localSearch->lsh : NULL;
+	SPHalfStore *half = localSearch != NULL && vocabTree == NULL && pca == NULL && lsh == NULL ?
+			localSearch->half : NULL;
+	SPNumaStore *numaStore = localSearch != NULL && vocabTree == NULL && pca == NULL && lsh == NULL &&
+			half == NULL ? localSearch->numaStore : NULL;
+
+	// cascade - restrict local search to closest images by global descriptors
+	if (cascadeCandidates > 1 && cascadeCandidates < numOfImages) {
+		localDB = context->candSift;
+		localNFeatures = context->candNFeatures;
+		localNumOfImages = cascadeCandidates;
+		selectCandidates(dists, siftDB, nFeatures, numOfImages, cascadeCandidates,
+				localDB, localNFeatures, !context->quiet);
+		// alternative local searches scan selected images only
+		if (vocabTree != NULL || pca != NULL || lsh != NULL || half != NULL || numaStore != NULL) {
+			selected = context->selected;
+			memset(selected, 0, numOfImages*sizeof(char));
+			for (int i=0; i<cascadeCandidates; i++)
+				selected[dists[i].index] = 1;
+		}
+	}
+
+	// compare sift features
+	for (int i=0; i<numOfImages; i++) {
+		dists[i].value = 0;
+		dists[i].index = i;
+	}
+
+	if (vocabTree != NULL)
+		ret = vocabTreeDists(vocabTree, qsift, qnFeatures, numOfImages, selected, dists, context);
+	else if (numaStore != NULL)
+		ret = numaStoreHits(numaStore, qsift, qnFeatures, selected, dists, context);
+	for (int i=0; vocabTree == NULL && numaStore == NULL && i<qnFeatures && ret == 0; i++) {
+		int nHits;
+		if (pca != NULL)
+			nHits = spSiftPCASearch(pca, qsift[i], k, selected, hits, context->scratch);
+		else if (lsh != NULL)
+			nHits = spSiftLSHSearch(lsh, qsift[i], k, selected, hits, context->scratch);
+		else if (half != NULL)
+			nHits = spHalfStoreSearch(half, qsift[i], k, selected, hits, context->scratch);
+		else
+			nHits = spBestSIFTL2SquaredDistanceWithQueue(k, qsift[i], localDB, localNumOfImages,
+					localNFeatures, hits, context->queue);
+		if (nHits == -1) { // if failed (error messages printed in function)
+			ret = -1;
+			break;
+		}
+
+		// sum hits
+		for (int j=0; j<nHits; j++) dists[hits[j]].value ++;
+	}
+
+	// sort and print (by descending votes, or ascending vocabulary tree distance)
+	if (ret == 0) {
+		for (int i=0; skipped != NULL && i<numOfImages; i++)
+			if (skipped[i])
+				dists[i].value = vocabTree != NULL ? HUGE_VAL : -1;
+		if (context->quiet)
+			sortIndices(dists, numOfImages, vocabTree != NULL ? 1 : -1);
+		else
+			sortAndPrint(dists, numOfImages, k, vocabTree != NULL ? 1 : -1, OUTPUT_LOCAL_MSG);
+		for (int i=0; i<k; i++)
+			context->ranking[k+i] = dists[i].index;
+	}
+	return ret;
+}
+
+//Inner function returning the steady clock in seconds
+static double clockSeconds() {
+	std::chrono::duration<double> now = std::chrono::steady_clock::now().time_since_epoch();
+	return now.count();
+}
+
+//Inner function recording a query in a trace
+static void traceQuery(SPQueryTrace *trace, const char *query, int numOfBins,
+		int nFeaturesToExtract, int k, query_timer *timer, int status) {
+	// the query duration is taken now if it was not recorded, and the query
+	// image contents are hashed after that
+	static_assert(NUM_OF_STAGES <= SP_QUERY_TRACE_MAX_STAGES, "too many query stages to trace");
+	if (timer->stageSeconds[STAGE_QUERY] < 0)
+		timer->stageSeconds[STAGE_QUERY] = clockSeconds() - timer->start;
+
+	SPQueryTraceRecord record;
+	SPQueryCacheKey key;
+	record.time = timer->start;
+	record.hash = spQueryCacheKey(query, numOfBins, nFeaturesToExtract, k, &key) ? key.hash : 0;
+	record.status = status;
+	for (int s=0; s<SP_QUERY_TRACE_MAX_STAGES; s++)
+		record.stageSeconds[s] = s < NUM_OF_STAGES ? timer->stageSeconds[s] : -1;
+	strncpy(record.path, query, SP_QUERY_TRACE_MAX_PATH - 1);
+	record.path[SP_QUERY_TRACE_MAX_PATH - 1] = '\0';
+	if (spQueryTraceAppend(trace, &record) != SP_QUERY_TRACE_SUCCESS)
+		printf("%s",QUERY_TRACE_ERROR_MSG);
+}
+
+//Inner function doing the work of answerQuery once its timer started
+static int answerQueryTimed(const char *query, SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, SPQueryCache *cache,
+		const local_search *localSearch, query_latency *latency, query_timer *timer,
+		query_context *context, bool *cached) {
+
+	// look up query in cache - nothing left to do if its rankings are cached
+	SPQueryCacheKey cacheKey, *key = NULL;
+	if (cache != NULL && spQueryCacheKey(query, numOfBins, nFeaturesToExtract, k, &cacheKey))
+		key = &cacheKey;
+	if (printCachedRankings(cache, key, !context->quiet) == 0) {
+		recordQueryLatency(latency, timer);
+		*cached = true;
+		return 0;
+	}
+
+	// distance array for comparisons, rankings (k global then k local)
+	// and closest images of a query feature (reused for all features)
+	if (reserveQueryContext(context, numOfImages, k) == -1) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+
+	// compare global descriptors
+	// get histogram
+	SPPoint **qhist = contextQueryHist(context, cache, key, query, numOfImages+1, numOfBins);
+	if (qhist == NULL) // if failed (error messages printed in function)
+		return -1;
+	endQueryStage(timer, STAGE_HISTOGRAM);
+	// compare histograms, sort and print output
+	globalRanking(histDB, skipped, numOfImages, k, cascadeCandidates, histPyramid, localSearch,
+			qhist, context);
+	endQueryStage(timer, STAGE_GLOBAL);
+
+	// compare local descriptors
+	// get sift features
+	int qnFeatures = 0;
+	SPPoint **qsift = contextQuerySift(context, cache, key, query, numOfImages+1,
+			nFeaturesToExtract, &qnFeatures);
+	if (qsift == NULL) // if failed (error messages printed in function)
+		return -1;
+	endQueryStage(timer, STAGE_SIFT);
+
+	// compare sift features, sort and print output
+	if (localRanking(siftDB, nFeatures, skipped, k, numOfImages, cascadeCandidates, localSearch,
+			qsift, qnFeatures, context) == -1)
+		return -1;
+	endQueryStage(timer, STAGE_LOCAL);
+	recordQueryLatency(latency, timer);
+	cacheQuery(cache, key, qhist, qsift, qnFeatures, context->ranking);
+	return 0;
+}
+
+int answerQuery(const char *query, SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, SPQueryCache *cache,
+		const local_search *localSearch, query_latency *latency, SPQueryTrace *trace,
+		query_context *context) {
+	if (query == NULL || context == NULL)
+		return -1;
+	query_timer timer;
+	startQueryTimer(&timer);
+	bool cached = false;
+	int ret = answerQueryTimed(query, histDB, siftDB, nFeatures, skipped, k, numOfImages, numOfBins,
+			nFeaturesToExtract, cascadeCandidates, histPyramid, cache, localSearch, latency,
+			&timer, context, &cached);
+	if (trace != NULL)
+		traceQuery(trace, query, numOfBins, nFeaturesToExtract, k, &timer,
+				ret == -1 ? -1 : cached ? 1 : 0);
+	return ret;
+}
+
+//Inner function doing the work of queryAndCheck with a given query context
+static int queryAndCheckContext(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, SPQueryCache *cache,
+		const local_search *localSearch, query_latency *latency, SPQueryTrace *trace,
+		query_context *context) {
+
+	// get query and check exit character
+	char *query = context->query;
+	getUserStr(query, ENTER_QUERY_MSG);
+	if (strncmp(query, EXIT_CHAR, 1024) == 0) {
+		printf("%s", EXIT_MSG);
+		return 1;
+	}
+	return answerQuery(query, histDB, siftDB, nFeatures, skipped, k, numOfImages, numOfBins,
+			nFeaturesToExtract, cascadeCandidates, histPyramid, cache, localSearch, latency,
+			trace, context);
+}
+
+int queryAndCheck(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, const char *skipped,
+		int k, int numOfImages, int numOfBins, int nFeaturesToExtract, int cascadeCandidates,
+		SPHistPyramid *histPyramid, SPQueryCache *cache, const local_search *localSearch,
+		query_latency *latency, SPQueryTrace *trace, query_context *context) {
 	/**
 	 * Queries user for action - either image path or # exit character
      * Computes histogram and sift features for query image
@@ -163,84 +716,511 @@ int queryAndCheck(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int k,
      * once for global descriptors (histogram) and once for local descriptors (sift features)
 	 */
 
-	// allocate memory for query string
-	char *query = (char*) malloc(1024*sizeof(char));
-	if (query == NULL) {
+	// without a context, buffers are allocated for this query only
+	query_context temporary;
+	if (context == NULL) {
+		initQueryContext(&temporary);
+		context = &temporary;
+	}
+	int ret = queryAndCheckContext(histDB, siftDB, nFeatures, skipped, k, numOfImages, numOfBins,
+			nFeaturesToExtract, cascadeCandidates, histPyramid, cache, localSearch, latency,
+			trace, context);
+	if (context == &temporary)
+		destroyQueryContext(&temporary);
+	return ret;
+}
+
+//Inner function computing the squared norm of a histogram, weighted as spRGBHistL2Distance
+static double histSquaredNorm(SPPoint **hist) {
+	double norm = 0;
+	for (int c=0; c<3; c++) {
+		const double *data = spPointGetData(hist[c]);
+		for (int i=0; i<spPointGetDimension(hist[c]); i++)
+			norm += 0.33*data[i]*data[i];
+	}
+	return norm;
+}
+
+//Inner function storing a copy of a frame histogram as the keyframe histogram
+static int storeKeyframeHist(SPPoint **keyHist, SPPoint **hist) {
+	// keyHist points are created by the first keyframe and overwritten later
+	// if fails returns -1, otherwise 0
+	for (int c=0; c<3; c++) {
+		if (keyHist[c] == NULL)
+			keyHist[c] = spPointCopy(hist[c]);
+		else
+			spPointSetData(keyHist[c], spPointGetData(hist[c]), spPointGetIndex(hist[c]));
+		if (keyHist[c] == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+int answerVideoQuery(const char *query, SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, const local_search *localSearch,
+		double keyframeChange, int keyframeInterval, query_latency *latency,
+		query_context *context) {
+	if (query == NULL || context == NULL)
+		return -1;
+	if (reserveQueryContext(context, numOfImages, k) == -1) {
 		printf("%s",MEMORY_ERROR);
 		return -1;
 	}
+	SPFrameReader *reader = spFrameReaderOpen(query);
+	if (reader == NULL) // if failed (error messages printed in function)
+		return -1;
 
-	// get query and check exit character
-	getUserStr(query, ENTER_QUERY_MSG);
+	int ret = 0, numOfFrames = 0, numOfKeyframes = 0, lastKeyframe = 0;
+	SPPoint *keyHist[3] = { NULL, NULL, NULL };
+	double keyNorm = 0;
+	double start = clockSeconds();
+	while (ret == 0) {
+		query_timer timer;
+		startQueryTimer(&timer);
+		if (spFrameReaderNext(reader) != 1)
+			break;
+
+		// frame histogram, its change since the last keyframe decides if it is a keyframe
+		if (spFrameReaderHistInto(reader, numOfImages+1, numOfBins, context->qhist) == -1) {
+			ret = -1;
+			break;
+		}
+		endQueryStage(&timer, STAGE_HISTOGRAM);
+		bool keyframe = numOfKeyframes == 0 ||
+				(keyframeInterval > 0 && numOfFrames - lastKeyframe >= keyframeInterval);
+		if (!keyframe) {
+			double change = spRGBHistL2Distance(context->qhist, keyHist);
+			keyframe = keyNorm > 0 ? sqrt(change/keyNorm) > keyframeChange : change > 0;
+		}
+		printf(FRAME_MSG, numOfFrames, keyframe ? " (keyframe)" : "");
+
+		// the global search is cheap, so it is done for every frame
+		globalRanking(histDB, skipped, numOfImages, k, cascadeCandidates, histPyramid,
+				localSearch, context->qhist, context);
+		endQueryStage(&timer, STAGE_GLOBAL);
+
+		// the local search is only done for keyframes, other frames reuse its ranking
+		if (keyframe) {
+			int qnFeatures = spFrameReaderSiftInto(reader, numOfImages+1, nFeaturesToExtract,
+					&context->qsift, &context->siftCapacity);
+			endQueryStage(&timer, STAGE_SIFT);
+			if (qnFeatures == -1 || localRanking(siftDB, nFeatures, skipped, k, numOfImages,
+					cascadeCandidates, localSearch, context->qsift, qnFeatures, context) == -1 ||
+					storeKeyframeHist(keyHist, context->qhist) == -1) {
+				ret = -1;
+				break;
+			}
+			endQueryStage(&timer, STAGE_LOCAL);
+			keyNorm = histSquaredNorm(keyHist);
+			lastKeyframe = numOfFrames;
+			numOfKeyframes++;
+		}
+		else {
+			printf("%s", OUTPUT_LOCAL_MSG);
+			for (int i=0; i<k-1; i++)
+				printf("%d, ",context->ranking[k+i]);
+			printf("%d\n",context->ranking[2*k-1]);
+		}
+		recordQueryLatency(latency, &timer);
+		numOfFrames++;
+	}
+
+	if (ret == 0) {
+		double seconds = clockSeconds() - start;
+		printf(VIDEO_REPORT_MSG, numOfFrames, numOfKeyframes, seconds,
+				seconds > 0 ? numOfFrames/seconds : 0.0, spFrameReaderFps(reader));
+	}
+	for (int c=0; c<3; c++)
+		spPointDestroy(keyHist[c]);
+	spFrameReaderClose(reader);
+	return ret;
+}
+
+//Inner function doing the work of queryAndCheckVideo with a given query context
+static int queryAndCheckVideoContext(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, const local_search *localSearch,
+		double keyframeChange, int keyframeInterval, query_latency *latency,
+		query_context *context) {
+
+	// get video and check exit character
+	char *query = context->query;
+	getUserStr(query, ENTER_VIDEO_MSG);
 	if (strncmp(query, EXIT_CHAR, 1024) == 0) {
-		free(query);
 		printf("%s", EXIT_MSG);
 		return 1;
 	}
+	return answerVideoQuery(query, histDB, siftDB, nFeatures, skipped, k, numOfImages, numOfBins,
+			nFeaturesToExtract, cascadeCandidates, histPyramid, localSearch, keyframeChange,
+			keyframeInterval, latency, context);
+}
 
-	// allocate distance array for comparisons
-	sortable_index *dists = (sortable_index*) malloc(numOfImages*sizeof(sortable_index));
-	if (dists == NULL) {
-		printf("%s",MEMORY_ERROR);
-		free(query);
-		return -1;
+int queryAndCheckVideo(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, const char *skipped,
+		int k, int numOfImages, int numOfBins, int nFeaturesToExtract, int cascadeCandidates,
+		SPHistPyramid *histPyramid, const local_search *localSearch, double keyframeChange,
+		int keyframeInterval, query_latency *latency, query_context *context) {
+	// without a context, buffers are allocated for this video only
+	query_context temporary;
+	if (context == NULL) {
+		initQueryContext(&temporary);
+		context = &temporary;
 	}
+	int ret = queryAndCheckVideoContext(histDB, siftDB, nFeatures, skipped, k, numOfImages, numOfBins,
+			nFeaturesToExtract, cascadeCandidates, histPyramid, localSearch, keyframeChange,
+			keyframeInterval, latency, context);
+	if (context == &temporary)
+		destroyQueryContext(&temporary);
+	return ret;
+}
 
-	// compare global descriptors
-	// get histogram
-	SPPoint **qhist = spGetRGBHist(query,numOfImages+1,numOfBins);
-	if (qhist == NULL) { // if failed (error messages printed in function)
-		free(query);
-		free(dists);
+void initQueryContext(query_context *context) {
+	if (context == NULL)
+		return;
+	context->query[0] = 0;
+	context->dists = NULL;
+	context->selected = NULL;
+	context->candSift = NULL;
+	context->candNFeatures = NULL;
+	context->scores = NULL;
+	context->closest = NULL;
+	context->numOfImages = 0;
+	context->ranking = NULL;
+	context->hits = NULL;
+	context->queue = NULL;
+	context->k = 0;
+	context->queues = NULL;
+	context->numOfQueues = 0;
+	for (int c=0; c<3; c++)
+		context->qhist[c] = NULL;
+	context->qsift = NULL;
+	context->siftCapacity = 0;
+	context->scratch = NULL;
+	context->quiet = false;
+}
+
+int reserveQueryContext(query_context *context, int numOfImages, int k) {
+	// buffers are replaced (not reallocated) since their contents need not be kept
+	if (context == NULL)
 		return -1;
+	if (context->scratch == NULL && (context->scratch = new (std::nothrow) SPSearchScratch) == NULL)
+		return -1;
+	if (numOfImages > context->numOfImages) {
+		free(context->dists);
+		free(context->selected);
+		free(context->candSift);
+		free(context->candNFeatures);
+		free(context->scores);
+		free(context->closest);
+		context->dists = (sortable_index*) malloc(numOfImages*sizeof(sortable_index));
+		context->selected = (char*) malloc(numOfImages*sizeof(char));
+		context->candSift = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
+		context->candNFeatures = (int*) malloc(numOfImages*sizeof(int));
+		context->scores = (double*) malloc(numOfImages*sizeof(double));
+		context->closest = (int*) malloc(numOfImages*sizeof(int));
+		context->numOfImages = numOfImages;
+		if (context->dists == NULL || context->selected == NULL || context->candSift == NULL ||
+				context->candNFeatures == NULL || context->scores == NULL ||
+				context->closest == NULL) {
+			context->numOfImages = 0;
+			return -1;
+		}
 	}
-	// compare histograms, sort and print output
+	if (k != context->k) {
+		// queues have a maximum size of k, so they are replaced if k changes
+		free(context->ranking);
+		free(context->hits);
+		spBPQueueDestroy(context->queue);
+		for (int i=0; i<context->numOfQueues; i++)
+			spBPQueueDestroy(context->queues[i]);
+		context->numOfQueues = 0;
+		context->ranking = (int*) malloc(2*k*sizeof(int));
+		context->hits = (int*) malloc(k*sizeof(int));
+		context->queue = k > SP_TOPK_MAX_FIXED ? spBPQueueCreate(k) : NULL;
+		context->k = k;
+		if (context->ranking == NULL || context->hits == NULL ||
+				(k > SP_TOPK_MAX_FIXED && context->queue == NULL)) {
+			context->k = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void destroyQueryContext(query_context *context) {
+	if (context == NULL)
+		return;
+	free(context->dists);
+	free(context->selected);
+	free(context->candSift);
+	free(context->candNFeatures);
+	free(context->scores);
+	free(context->closest);
+	free(context->ranking);
+	free(context->hits);
+	spBPQueueDestroy(context->queue);
+	for (int i=0; i<context->numOfQueues; i++)
+		spBPQueueDestroy(context->queues[i]);
+	free(context->queues);
+	for (int c=0; c<3; c++)
+		spPointDestroy(context->qhist[c]);
+	destroySPPoint1D(context->qsift, context->siftCapacity);
+	delete context->scratch;
+	initQueryContext(context);
+}
+
+void imageMemoryUsage(SPPoint **hist, SPPoint **sift, int nFeatures, memory_usage *usage) {
+	usage->histograms = 0;
+	usage->descriptors = 0;
+	usage->index = 0;
+	usage->slack = 0;
+	long requested, allocated;
+	if (hist != NULL) {
+		usage->index += 3*sizeof(SPPoint*);
+		usage->slack += malloc_usable_size(hist) - 3*sizeof(SPPoint*);
+		for (int c=0; c<3; c++)
+			if (hist[c] != NULL) {
+				requested = spPointGetMemory(hist[c], &allocated);
+				usage->histograms += requested;
+				usage->slack += allocated - requested;
+			}
+	}
+	if (sift != NULL) {
+		usage->index += nFeatures*sizeof(SPPoint*);
+		usage->slack += malloc_usable_size(sift) - nFeatures*sizeof(SPPoint*);
+		for (int i=0; i<nFeatures; i++) {
+			requested = spPointGetMemory(sift[i], &allocated);
+			usage->descriptors += requested;
+			usage->slack += allocated - requested;
+		}
+	}
+}
+
+int databaseMemoryUsage(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		memory_usage *total, memory_usage *perImage) {
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL || total == NULL)
+		return -1;
+	// the database arrays themselves
+	long arrays = numOfImages*(2*sizeof(SPPoint**) + sizeof(int));
+	total->histograms = 0;
+	total->descriptors = 0;
+	total->index = arrays;
+	total->slack = malloc_usable_size(histDB) + malloc_usable_size(siftDB) +
+			malloc_usable_size(nFeatures) - arrays;
+	memory_usage image;
 	for (int i=0; i<numOfImages; i++) {
-		dists[i].value = spRGBHistL2Distance(qhist, histDB[i]);
-		dists[i].index = i;
+		imageMemoryUsage(histDB[i], siftDB[i], nFeatures[i], &image);
+		total->histograms += image.histograms;
+		total->descriptors += image.descriptors;
+		total->index += image.index;
+		total->slack += image.slack;
+		if (perImage != NULL)
+			perImage[i] = image;
 	}
-	sortAndPrint(dists, numOfImages, k, 1, OUTPUT_GLOBAL_MSG);
-	destroySPPoint1D(qhist, 3); // cleanup
+	return 0;
+}
 
+long localSearchMemoryBytes(const local_search *localSearch) {
+	if (localSearch == NULL)
+		return 0;
+	return spVocabTreeMemoryBytes(localSearch->vocabTree) + spSiftPCAMemoryBytes(localSearch->pca) +
+			spSiftLSHMemoryBytes(localSearch->lsh) + spHalfStoreMemoryBytes(localSearch->half) +
+			spNumaStoreMemoryBytes(localSearch->numaStore);
+}
 
-	// compare local descriptors
-	// get sift features
-	int qnFeatures;
-	SPPoint **qsift = spGetSiftDescriptors(query,numOfImages+1,nFeaturesToExtract, &qnFeatures);
-	if (qsift == NULL) { // if failed (error messages printed in function)
-		free(query);
-		free(dists);
+int printMemoryUsage(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		const local_search *localSearch, int perImage) {
+	memory_usage total, *images = NULL;
+	if (perImage == 1 && numOfImages > 0) {
+		images = (memory_usage*) malloc(numOfImages*sizeof(memory_usage));
+		if (images == NULL) {
+			printf("%s",MEMORY_ERROR);
+			return -1;
+		}
+	}
+	if (databaseMemoryUsage(histDB, siftDB, nFeatures, numOfImages, &total, images) == -1) {
+		free(images);
 		return -1;
 	}
+	for (int i=0; images != NULL && i<numOfImages; i++)
+		printf(MEMORY_IMAGE_MSG, i, images[i].histograms, images[i].descriptors, nFeatures[i],
+				images[i].index, images[i].slack);
+	long local = localSearchMemoryBytes(localSearch);
+	double all = total.histograms + total.descriptors + total.index + total.slack + local;
+	printf(MEMORY_REPORT_MSG, total.histograms/1024.0, total.descriptors/1024.0,
+			total.index/1024.0, total.slack/1024.0, local/1024.0, all/1024.0,
+			numOfImages > 0 ? all/1024.0/numOfImages : 0);
+	free(images);
+	return 0;
+}
 
-	// compare sift features
-	int* hits;
-	for (int i=0; i<numOfImages; i++) {
-		dists[i].value = 0;
-		dists[i].index = i;
+// names of the query stages in latency reports
+static const char *stageNames[NUM_OF_STAGES] = { "decode", "histogram", "sift", "global", "local", "query" };
+
+//Inner function searching the benchmark queries in a NUMA store
+static int benchmarkNumaQueries(SPNumaStore *store, SPPoint ***siftDB, int *nFeatures,
+		const std::vector<int> &queries, SPBPQueue **queues, SPSearchScratch *scratch,
+		double *bytes, double *seconds) {
+	// sums the bytes scanned and the wall time of the searches
+	// if fails returns -1, otherwise 0
+	*bytes = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t q=0; q<queries.size(); q++) {
+		int i = queries[q];
+		for (int j=0; j<nFeatures[i]; j++)
+			spBPQueueClear(queues[j]);
+		if (!spNumaStoreSearch(store, siftDB[i], nFeatures[i], queues, NULL, scratch))
+			return -1;
+		*bytes += scratch->scanBytes;
 	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	*seconds = elapsed.count();
+	return 0;
+}
 
-	for (int i=0; i<qnFeatures; i++) {
-		hits = spBestSIFTL2SquaredDistance(k, qsift[i], siftDB, numOfImages, nFeatures);
-		if (hits == NULL) { // if failed (error messages printed in function)
-			free(query);
-			free(dists);
-			destroySPPoint1D(qsift, qnFeatures);
+int benchmarkNumaStore(SPPoint ***siftDB, int *nFeatures, int numOfImages, int maxNodes,
+		int threadsPerNode, int k, int numOfQueries) {
+	// searches the same query images with 1, 2, 4, ..., maxNodes partitions
+	// if fails returns -1, otherwise 0
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0 || maxNodes < 0 ||
+			threadsPerNode <= 0 || k <= 0 || numOfQueries <= 0)
+		return -1;
+	if (maxNodes == 0) { // the number of nodes of the machine
+		SPNumaStore *store = spNumaStoreCreate(siftDB, nFeatures, numOfImages, 0, threadsPerNode);
+		if (store == NULL) {
+			printf("%s",MEMORY_ERROR);
+			return -1;
 		}
+		maxNodes = spNumaStoreNumOfNodes(store);
+		spNumaStoreDestroy(store);
+	}
 
-		// sum hits
-		for (int j=0; j<k; j++) dists[hits[j]].value ++;
-		free(hits);
+	int ret = 0;
+	std::vector<int> queries, configurations;
+	std::vector<SPBPQueue*> queues;
+	try {
+		SPSearchScratch scratch;
+		// evenly spaced query images, queues for the largest of them
+		int n = numOfQueries < numOfImages ? numOfQueries : numOfImages, maxFeatures = 0;
+		long numOfFeatures = 0;
+		for (int q=0; q<n; q++) {
+			int i = (int) ((long) q*numOfImages/n);
+			queries.push_back(i);
+			numOfFeatures += nFeatures[i];
+			maxFeatures = nFeatures[i] > maxFeatures ? nFeatures[i] : maxFeatures;
+		}
+		queues.assign(maxFeatures, NULL);
+		for (int j=0; j<maxFeatures && ret == 0; j++)
+			if ((queues[j] = spBPQueueCreate(k)) == NULL)
+				ret = -1;
+		for (int nodes=1; nodes<maxNodes; nodes*=2)
+			configurations.push_back(nodes);
+		configurations.push_back(maxNodes);
+
+		for (size_t c=0; c<configurations.size() && ret == 0; c++) {
+			SPNumaStore *store = spNumaStoreCreate(siftDB, nFeatures, numOfImages,
+					configurations[c], threadsPerNode);
+			double bytes = 0, seconds = 0;
+			// one untimed pass, so every partition is resident and its workers are running
+			if (store == NULL ||
+					benchmarkNumaQueries(store, siftDB, nFeatures, queries, queues.data(), &scratch,
+							&bytes, &seconds) == -1 ||
+					benchmarkNumaQueries(store, siftDB, nFeatures, queries, queues.data(), &scratch,
+							&bytes, &seconds) == -1)
+				ret = -1;
+			else {
+				int nodes = spNumaStoreNumOfNodes(store);
+				double bandwidth = seconds > 0 ? bytes/seconds/1e9 : 0.0;
+				printf(NUMA_BENCHMARK_MSG, nodes, threadsPerNode, n, numOfFeatures, bytes/1e6,
+						seconds, bandwidth, bandwidth/nodes);
+			}
+			spNumaStoreDestroy(store);
+		}
+	}
+	catch (std::bad_alloc &) {
+		ret = -1;
 	}
+	if (ret == -1)
+		printf("%s",MEMORY_ERROR);
+	for (size_t j=0; j<queues.size(); j++)
+		spBPQueueDestroy(queues[j]);
+	return ret;
+}
 
-	// sort and print
-	sortAndPrint(dists, numOfImages, k, -1, OUTPUT_LOCAL_MSG);
-	destroySPPoint1D(qsift, qnFeatures); // cleanup
+int createQueryLatency(query_latency *latency, int snapshotInterval) {
+	// creates a histogram for each stage
+	// if fails returns -1, otherwise 0
+	if (latency == NULL)
+		return -1;
+	int ret = 0;
+	for (int s=0; s<NUM_OF_STAGES; s++) {
+		latency->stages[s] = spLatencyCreate();
+		if (latency->stages[s] == NULL)
+			ret = -1;
+	}
+	latency->snapshotInterval = snapshotInterval;
+	latency->numOfQueries = 0;
+	if (ret == -1)
+		destroyQueryLatency(latency);
+	return ret;
+}
 
-	// cleanup
-	free(query);
-	free(dists);
-	return 0;
+void destroyQueryLatency(query_latency *latency) {
+	if (latency != NULL)
+		for (int s=0; s<NUM_OF_STAGES; s++) {
+			spLatencyDestroy(latency->stages[s]);
+			latency->stages[s] = NULL;
+		}
+}
+
+void startQueryTimer(query_timer *timer) {
+	for (int s=0; s<NUM_OF_STAGES; s++)
+		timer->stageSeconds[s] = -1;
+	spTakeDecodeSeconds();
+	timer->start = clockSeconds();
+	timer->lap = timer->start;
+}
+
+void endQueryStage(query_timer *timer, query_stage stage) {
+	// adds the time since the last stage to stage (decoding time to STAGE_DECODE)
+	double now = clockSeconds();
+	double seconds = now - timer->lap;
+	timer->lap = now;
+	if (stage == STAGE_HISTOGRAM || stage == STAGE_SIFT) {
+		double decode = spTakeDecodeSeconds();
+		seconds -= decode;
+		timer->stageSeconds[STAGE_DECODE] = (timer->stageSeconds[STAGE_DECODE] > 0 ?
+				timer->stageSeconds[STAGE_DECODE] : 0) + decode;
+	}
+	timer->stageSeconds[stage] = (timer->stageSeconds[stage] > 0 ? timer->stageSeconds[stage] : 0) +
+			(seconds > 0 ? seconds : 0);
+}
+
+void recordQueryLatency(query_latency *latency, query_timer *timer) {
+	// records the query and its stages, prints a snapshot every snapshotInterval queries
+	if (latency == NULL)
+		return;
+	timer->stageSeconds[STAGE_QUERY] = clockSeconds() - timer->start;
+	for (int s=0; s<NUM_OF_STAGES; s++)
+		if (timer->stageSeconds[s] >= 0)
+			spLatencyRecord(latency->stages[s], timer->stageSeconds[s]);
+	latency->numOfQueries++;
+	if (latency->snapshotInterval > 0 && latency->numOfQueries % latency->snapshotInterval == 0)
+		printQueryLatency(latency);
+}
+
+void printQueryLatency(query_latency *latency) {
+	// prints the percentiles of each stage which ran, in milliseconds
+	if (latency == NULL)
+		return;
+	for (int s=0; s<NUM_OF_STAGES; s++) {
+		SPLatency *stage = latency->stages[s];
+		if (spLatencyCount(stage) > 0)
+			printf(LATENCY_REPORT_MSG, stageNames[s], spLatencyCount(stage),
+					spLatencyPercentile(stage, 0.5)*1e3, spLatencyPercentile(stage, 0.9)*1e3,
+					spLatencyPercentile(stage, 0.99)*1e3, spLatencyPercentile(stage, 0.999)*1e3,
+					spLatencyMax(stage)*1e3);
+	}
 }
 
 void destroySPPoint1D(SPPoint **DB, int dim) {
@@ -275,6 +1255,253 @@ void destroySPPoint2D(SPPoint ***DB, int dim, int *nChannels) {
 	free(nChannels);
 }
 
+//Inner function ranking images by votes of their closest features at one resolution
+static int benchmarkTopImages(SPPoint ***siftDB, int *nFeatures, int n, int query,
+		int k, sortable_index *votes, SPPoint ***others, int *otherNFeatures, int *hits) {
+	// sorts votes (of size n) by descending votes of the images other than query
+	// for the features of query, as in the local search
+	// if fails returns -1, otherwise 0
+	int m = 0;
+	for (int i=0; i<n; i++) {
+		votes[i].index = i;
+		votes[i].value = i == query ? 1 : 0;  // query ranked last
+		if (i != query) {
+			others[m] = siftDB[i];
+			otherNFeatures[m++] = nFeatures[i];
+		}
+	}
+	for (int j=0; j<nFeatures[query]; j++) {
+		int nHits = spBestSIFTL2SquaredDistanceInto(k, siftDB[query][j], others, m,
+				otherNFeatures, hits);
+		if (nHits == -1)
+			return -1;
+		for (int h=0; h<nHits; h++)
+			votes[hits[h]].value --;  // negated, so ascending order ranks by votes
+	}
+	sortIndices(votes, n, 1);
+	return 0;
+}
 
+// a setting of the sift extraction compared by benchmarkSift
+struct sift_setting {
+	int maxSide;       // see spSetSiftMaxSide
+	int tileThreads;   // see spSetSiftTiling
+	int tileOverlap;
+};
 
+// the comparison of two settings of the sift extraction
+struct sift_benchmark {
+	double speedup;     // extraction time of the first setting over that of the second
+	double agreement;   // average fraction of shared top images
+	int top;            // number of top images compared
+	int n;              // number of images used
+};
 
+//Inner function applying a setting of the sift extraction
+static void setSiftSetting(const sift_setting *setting) {
+	spSetSiftMaxSide(setting->maxSide);
+	if (setting->tileThreads != spGetSiftTileThreads() ||
+			setting->tileOverlap != spGetSiftTileOverlap())
+		spSetSiftTiling(setting->tileThreads, setting->tileOverlap);
+}
+
+//Inner function comparing the sift features extracted with two settings
+static int benchmarkSift(char *dir, char *prefix, char *suffix, int numOfImages,
+		int nFeaturesToExtract, int k, int numOfBenchmarkImages, const sift_setting *settings,
+		sift_benchmark *res) {
+	// extracts the sift features of the first images with settings[0] and with
+	// settings[1], and compares the extraction time and the local search
+	// rankings, leaving settings[1] set
+	// if fails returns -1, otherwise 0
+	int n = numOfBenchmarkImages < numOfImages ? numOfBenchmarkImages : numOfImages;
+	if (dir == NULL || prefix == NULL || suffix == NULL || k <= 0 || n < 2)
+		return -1;
+	int top = k < n-1 ? k : n-1;
+
+	int ret = 0;
+	SPPoint ***siftDB[2] = { NULL, NULL };
+	int *nFeatures[2] = { NULL, NULL };
+	double seconds[2] = { 0, 0 };
+	char *imageName = (char*) malloc(2048*sizeof(char));
+	sortable_index *votes[2] = { (sortable_index*) malloc(n*sizeof(sortable_index)),
+			(sortable_index*) malloc(n*sizeof(sortable_index)) };
+	SPPoint ***others = (SPPoint***) malloc(n*sizeof(SPPoint**));
+	int *otherNFeatures = (int*) malloc(n*sizeof(int));
+	int *hits = (int*) malloc(k*sizeof(int));
+	for (int r=0; r<2; r++) {
+		siftDB[r] = (SPPoint***) calloc(n, sizeof(SPPoint**));
+		nFeatures[r] = (int*) calloc(n, sizeof(int));
+	}
+	if (imageName == NULL || votes[0] == NULL || votes[1] == NULL || others == NULL ||
+			otherNFeatures == NULL || hits == NULL || siftDB[0] == NULL || siftDB[1] == NULL ||
+			nFeatures[0] == NULL || nFeatures[1] == NULL) {
+		printf("%s",MEMORY_ERROR);
+		ret = -1;
+	}
+
+	// extract with each setting
+	for (int r=0; r<2 && ret == 0; r++) {
+		setSiftSetting(&settings[r]);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i=0; i<n && ret == 0; i++) {
+			sprintf(imageName,"%s%s%d%s", dir, prefix, i, suffix);
+			siftDB[r][i] = spGetSiftDescriptors(imageName, i, nFeaturesToExtract, nFeatures[r] + i);
+			if (siftDB[r][i] == NULL)
+				ret = -1;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		seconds[r] = elapsed.count();
+	}
+	setSiftSetting(&settings[1]);
+
+	// fraction of the top images of each query shared by both settings
+	double agreement = 0;
+	for (int q=0; q<n && ret == 0; q++) {
+		for (int r=0; r<2 && ret == 0; r++)
+			if (benchmarkTopImages(siftDB[r], nFeatures[r], n, q, k, votes[r],
+					others, otherNFeatures, hits) == -1)
+				ret = -1;
+		for (int i=0; i<top && ret == 0; i++)
+			for (int j=0; j<top; j++)
+				if (votes[0][i].index == votes[1][j].index)
+					agreement += 1.0/top;
+	}
+	res->speedup = seconds[1] > 0 ? seconds[0]/seconds[1] : 0.0;
+	res->agreement = agreement/n;
+	res->top = top;
+	res->n = n;
+
+	// cleanup
+	for (int r=0; r<2; r++) {
+		if (siftDB[r] != NULL && nFeatures[r] != NULL)
+			for (int i=0; i<n; i++)
+				if (siftDB[r][i] != NULL)
+					destroySPPoint1D(siftDB[r][i], nFeatures[r][i]);
+		free(siftDB[r]);
+		free(nFeatures[r]);
+		free(votes[r]);
+	}
+	free(imageName);
+	free(others);
+	free(otherNFeatures);
+	free(hits);
+	return ret;
+}
+
+int benchmarkSiftMaxSide(char *dir, char *prefix, char *suffix, int numOfImages,
+		int nFeaturesToExtract, int maxSide, int k, int numOfBenchmarkImages) {
+	// compares full resolution with maxSide, keeping the current tiling
+	if (maxSide <= 0)
+		return -1;
+	sift_setting settings[2];
+	for (int r=0; r<2; r++) {
+		settings[r].maxSide = r == 0 ? 0 : maxSide;
+		settings[r].tileThreads = spGetSiftTileThreads();
+		settings[r].tileOverlap = spGetSiftTileOverlap();
+	}
+	sift_benchmark res;
+	if (benchmarkSift(dir, prefix, suffix, numOfImages, nFeaturesToExtract, k,
+			numOfBenchmarkImages, settings, &res) == -1)
+		return -1;
+	printf(SIFT_BENCHMARK_MSG, maxSide, res.speedup, res.top, res.agreement, res.n);
+	return 0;
+}
+
+int benchmarkSiftTiling(char *dir, char *prefix, char *suffix, int numOfImages,
+		int nFeaturesToExtract, int k, int numOfBenchmarkImages) {
+	// compares whole images with the current tiling, keeping the current maximum side
+	int numOfThreads = spGetSiftTileThreads();
+	if (numOfThreads <= 1)
+		return -1;
+	sift_setting settings[2];
+	for (int r=0; r<2; r++) {
+		settings[r].maxSide = spGetSiftMaxSide();
+		settings[r].tileThreads = r == 0 ? 0 : numOfThreads;
+		settings[r].tileOverlap = r == 0 ? 0 : spGetSiftTileOverlap();
+	}
+	sift_benchmark res;
+	if (benchmarkSift(dir, prefix, suffix, numOfImages, nFeaturesToExtract, k,
+			numOfBenchmarkImages, settings, &res) == -1)
+		return -1;
+	printf(SIFT_TILE_BENCHMARK_MSG, numOfThreads, settings[1].tileOverlap, res.speedup, res.top,
+			res.agreement, res.n);
+	return 0;
+}
+
+int benchmarkHistSampling(char *dir, char *prefix, char *suffix, int numOfImages,
+		int numOfBins, int k, int numOfBenchmarkImages) {
+	// computes the histograms of the first images from all pixels and with the
+	// current sampling, and compares the computation time and the global rankings
+	// if fails returns -1, otherwise 0
+	if (dir == NULL || prefix == NULL || suffix == NULL || k <= 0)
+		return -1;
+	int n = numOfBenchmarkImages < numOfImages ? numOfBenchmarkImages : numOfImages;
+	if (n < 2)
+		return -1;
+	int top = k < n-1 ? k : n-1;
+	int stride = spGetHistStride(), reduction = spGetHistReduction();
+	bool jitter = spGetHistJitter();
+
+	int ret = 0;
+	SPPoint ***histDB[2] = { NULL, NULL };
+	double seconds[2] = { 0, 0 };
+	char *imageName = (char*) malloc(2048*sizeof(char));
+	sortable_index *dists[2] = { (sortable_index*) malloc(n*sizeof(sortable_index)),
+			(sortable_index*) malloc(n*sizeof(sortable_index)) };
+	for (int r=0; r<2; r++)
+		histDB[r] = (SPPoint***) calloc(n, sizeof(SPPoint**));
+	if (imageName == NULL || dists[0] == NULL || dists[1] == NULL ||
+			histDB[0] == NULL || histDB[1] == NULL) {
+		printf("%s",MEMORY_ERROR);
+		ret = -1;
+	}
+
+	// compute from all pixels (r = 0) and with the sampling (r = 1)
+	for (int r=0; r<2 && ret == 0; r++) {
+		if (r == 0)
+			spSetHistSampling(1, false, 1);
+		else
+			spSetHistSampling(stride, jitter, reduction);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int i=0; i<n && ret == 0; i++) {
+			sprintf(imageName,"%s%s%d%s", dir, prefix, i, suffix);
+			histDB[r][i] = spGetRGBHist(imageName, i, numOfBins);
+			if (histDB[r][i] == NULL)
+				ret = -1;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		seconds[r] = elapsed.count();
+	}
+	spSetHistSampling(stride, jitter, reduction);
+
+	// fraction of the top images of each query shared by both histograms
+	double agreement = 0;
+	for (int q=0; q<n && ret == 0; q++) {
+		for (int r=0; r<2; r++) {
+			for (int i=0; i<n; i++) {
+				dists[r][i].index = i;
+				dists[r][i].value = i == q ? HUGE_VAL : spRGBHistL2Distance(histDB[r][q], histDB[r][i]);
+			}
+			sortIndices(dists[r], n, 1);
+		}
+		for (int i=0; i<top; i++)
+			for (int j=0; j<top; j++)
+				if (dists[0][i].index == dists[1][j].index)
+					agreement += 1.0/top;
+	}
+	if (ret == 0)
+		printf(HIST_BENCHMARK_MSG, stride, jitter ? " (jittered)" : "", reduction,
+				seconds[1] > 0 ? seconds[0]/seconds[1] : 0.0, top, agreement/n, n);
+
+	// cleanup
+	for (int r=0; r<2; r++) {
+		if (histDB[r] != NULL)
+			for (int i=0; i<n; i++)
+				if (histDB[r][i] != NULL)
+					destroySPPoint1D(histDB[r][i], 3);
+		free(histDB[r]);
+		free(dists[r]);
+	}
+	free(imageName);
+	return ret;
+}
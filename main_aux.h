@@ -1,6 +1,19 @@
 #ifndef MAIN_AUX_H_
 #define MAIN_AUX_H_
 
+#include "sp_half_store.h"
+#include "sp_hist_pyramid.h"
+#include "sp_numa_store.h"
+#include "sp_sift_pca.h"
+#include "sp_sift_lsh.h"
+#include "sp_vocab_tree.h"
+extern "C" {
+	#include "SPBPriorityQueue.h"
+	#include "SPQueryCache.h"
+	#include "SPLatency.h"
+	#include "SPQueryTrace.h"
+}
+
 #define ENTER_IM_DIR_MSG "Enter images directory path:\n"
 #define ENTER_IM_PRE_MSG "Enter images prefix:\n"
 #define ENTER_IM_NUM_MSG "Enter number of images:\n"
@@ -11,12 +24,153 @@
 #define ENTER_NUM_FEATURES_MSG "Enter number of features:\n"
 #define ERROR_NUM_FEATURES_MSG "An error occurred - invalid number of features\n"
 #define ENTER_QUERY_MSG "Enter a query image or # to terminate:\n"
+#define ENTER_VIDEO_MSG "Enter a query video or # to terminate:\n"
 #define EXIT_MSG "Exiting...\n"
 #define EXIT_CHAR "#"
 #define OUTPUT_GLOBAL_MSG "Nearest images using global descriptors:\n"
 #define OUTPUT_LOCAL_MSG "Nearest images using local descriptors:\n"
 #define MEMORY_ERROR "An error occurred - allocation failure\n"
+#define PREFETCH_IMAGES_PER_THREAD 4
+#define SKIPPED_REPORT_MSG "Preprocessing - skipped %d of %d images\n"
+#define PYRAMID_REPORT_MSG "Coarse-to-fine - computed %d of %d exact histogram distances\n"
+#define CASCADE_REPORT_MSG "Cascade - searched %d of %d images, skipped %ld of %ld descriptors\n"
+#define NUMA_REPORT_MSG "NUMA search - %d nodes, scanned %.1f MB in %.3f ms (%.2f GB/s)\n"
+#define VOCAB_REPORT_MSG "Vocabulary tree - %d words, %ld postings (%.1f per word)\n"
+#define PCA_REPORT_MSG "PCA - reduced to %d dimensions, re-ranking %d candidates, recall@%d %.3f on %d sampled features\n"
+#define SIFT_BENCHMARK_MSG "SIFT max side %d - extraction %.2fx faster, local top-%d agreement %.3f on %d images\n"
+#define SIFT_TILE_BENCHMARK_MSG "SIFT tiling %d threads, overlap %d - extraction %.2fx faster, local top-%d agreement %.3f on %d images\n"
+#define HIST_BENCHMARK_MSG "Histogram sampling stride %d%s, reduction %d - %.2fx faster, global top-%d agreement %.3f on %d images\n"
+#define NUMA_BENCHMARK_MSG "NUMA benchmark - %d nodes x %d threads, %d queries (%ld features), scanned %.1f MB in %.3f s, sustained %.2f GB/s (%.2f GB/s per node)\n"
+#define LATENCY_REPORT_MSG "Latency %s - %ld queries, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n"
+#define MEMORY_REPORT_MSG "Memory - histograms %.1f KB, descriptors %.1f KB, index %.1f KB, allocator slack %.1f KB, local search %.1f KB, total %.1f KB (%.1f KB per image)\n"
+#define MEMORY_IMAGE_MSG "Memory - image %d: histograms %ld B, descriptors %ld B (%d features), index %ld B, allocator slack %ld B\n"
+#define FRAME_MSG "Frame %d%s:\n"
+#define VIDEO_REPORT_MSG "Video - %d frames, %d keyframes in %.3f s (%.1f frames per second, video %.1f)\n"
+#define HALF_REPORT_MSG "Half precision - %.1f KB instead of %.1f KB, %ld of %ld sift features inexact\n"
+#define HALF_HIST_REPORT_MSG "Half precision - bfloat16 histograms, global top-%d agreement %.3f on %d images\n"
+#define LSH_REPORT_MSG "LSH - %d bit codes, %d tables, re-ranking %d candidates, recall@%d %.3f on %d sampled features\n"
+#define QUERY_TRACE_ERROR_MSG "An error occurred - the query trace cannot be written\n"
+#define SNAPSHOT_ADD_CHAR '+'
+#define SNAPSHOT_REMOVE_CHAR '-'
+#define SNAPSHOT_ADD_MSG "Snapshot - added image %d, %d images\n"
+#define SNAPSHOT_REMOVE_MSG "Snapshot - removed image %d, %d images\n"
+#define SNAPSHOT_INDEX_ERROR_MSG "An error occurred - invalid image index\n"
+#define SNAPSHOT_ERROR_MSG "An error occurred - the database cannot be updated\n"
+
+/** Image index and distance (or score), used for sorting images **/
+typedef struct sortable_index {
+	int index;
+	double value;
+} sortable_index;
+
+/**
+ * Copies of the sift features database used for the local search instead of
+ * searching siftDB directly (a NULL member is disabled). If several are given,
+ * the first in this order is used. A half precision store holding histograms
+ * is also used for the global search (unless a histogram pyramid is given).
+ */
+typedef struct local_search {
+	SPVocabTree *vocabTree;  // images ranked by TF-IDF weighted visual words
+	SPSiftPCA *pca;          // PCA reduced features with exact re-ranking
+	SPSiftLSH *lsh;          // binary codes of the features with exact re-ranking
+	SPHalfStore *half;       // fp16 features (and bfloat16 histograms)
+	SPNumaStore *numaStore;  // features partitioned across NUMA nodes
+} local_search;
+
+/**
+ * Scratch buffers of queryAndCheck, owned by a query worker and reused by its
+ * consecutive queries. Buffers are sized on first use and only grow, and the
+ * query descriptors are extracted into the points of the previous query.
+ * Once warmed up, the ranking stages (globalRanking and localRanking, with
+ * the exact scan or an alternative search) allocate nothing. A query still
+ * allocates in OpenCV image decoding and feature extraction, in query cache
+ * hits (the cached descriptors are copied) and when its results are cached.
+ */
+typedef struct query_context {
+	char query[1024];        // query string
+	sortable_index *dists;   // distance (or votes) of each image
+	char *selected;          // images kept by the cascade
+	SPPoint ***candSift;     // sift features of the images kept by the cascade
+	int *candNFeatures;
+	double *scores;          // vocabulary tree distance of each image
+	int *closest;            // closest images by global descriptors (histogram pyramid)
+	int numOfImages;         // size of the per image arrays
+	int *ranking;            // k global then k local
+	int *hits;               // closest images of a query feature
+	SPBPQueue *queue;        // closest features of a query feature (if k > SP_TOPK_MAX_FIXED)
+	int k;                   // size of the per k arrays and queues
+	SPBPQueue **queues;      // closest features of each query feature (NUMA store)
+	int numOfQueues;
+	SPPoint *qhist[3];       // query histograms
+	SPPoint **qsift;         // query sift features
+	int siftCapacity;        // size of qsift
+	SPSearchScratch *scratch; // scratch space of the alternative local and global searches
+	bool quiet;              // rankings and reports are not printed (see answerQuery)
+} query_context;
+
+/** Memory used by (a part of) the databases, in bytes **/
+typedef struct memory_usage {
+	long histograms;   // histogram points (requested bytes)
+	long descriptors;  // sift feature points (requested bytes)
+	long index;        // arrays of point pointers and feature counts (requested bytes)
+	long slack;        // bytes allocated beyond the requested ones
+} memory_usage;
+
+/** Stages of a query measured by query_latency **/
+enum query_stage {
+	STAGE_DECODE,     // reading and decompressing the query image
+	STAGE_HISTOGRAM,  // computing the query histogram (without decoding)
+	STAGE_SIFT,       // extracting the query sift features (without decoding)
+	STAGE_GLOBAL,     // ranking images by global descriptors
+	STAGE_LOCAL,      // cascade selection, local search, voting and ranking by local descriptors
+	STAGE_QUERY,      // the whole query
+	NUM_OF_STAGES
+};
+
+/** Latency histograms of the queries and of each of their stages **/
+typedef struct query_latency {
+	SPLatency *stages[NUM_OF_STAGES];
+	int snapshotInterval;   // queries between printed snapshots (0 - none)
+	long numOfQueries;
+} query_latency;
 
+/** Durations of the stages of a query being timed **/
+typedef struct query_timer {
+	double stageSeconds[NUM_OF_STAGES];  // negative if the stage did not run
+	double start;                        // clock at the start of the query
+	double lap;                          // clock at the end of the last stage
+} query_timer;
+
+/**
+ * Prints msg and then gets a string (of up to 1024 characters) from the user
+ * The trailing new line is removed
+ *
+ * @param str - the address in which the string will be stored
+ * @param msg - message to print
+ * @return 0 if succeeds, -1 if any of the arguments is NULL
+ */
+int getUserStr(char *str, const char *msg);
+
+/**
+ * Sorts an array by value (using index as tie breaker)
+ *
+ * @param arr - the array to sort
+ * @param dim - size of arr
+ * @param order - if -1, sorts in descending order of value (flips the sign of the values)
+ */
+void sortIndices(sortable_index *arr, int dim, int order);
+
+/**
+ * Sorts an array by value (using index as tie breaker) and prints msg
+ * followed by the first k indices
+ *
+ * @param arr - the array to sort
+ * @param dim - size of arr
+ * @param k - number of indices to print
+ * @param order - if -1, sorts in descending order of value (flips the sign of the values)
+ * @param msg - message to print before the indices (not printed if NULL)
+ */
+void sortAndPrint(sortable_index *arr, int dim, int k, int order, const char *msg);
 
 /**
  * Get initial program parameters form user:
@@ -63,16 +217,49 @@ int getUserParams(char *dir, char *prefix, char *suffix,
  * @param numOfImages - number of images in directory (assumed to be > 0)
  * @param numOfBins - number of bins in histogram (assumed to be > 0 and < 256)
  * @param nFeaturesToExtract - number of sift features to try to extract (assumed to be > 0)
+ * @param prefetchThreads - number of I/O threads reading image files ahead of decoding
+ *                          (at most PREFETCH_IMAGES_PER_THREAD images per thread are
+ *                          held in memory), if 0 each image is read when decoded
+ * @param skipped - if NULL, preprocessing fails on an image which cannot be
+ *                  loaded. Otherwise such an image is skipped: it gets empty
+ *                  histograms and no sift features, and skipped[i] is set to 1
+ *                  (0 for the other images) so the queries rank it last by
+ *                  global descriptors (it gets no votes by local descriptors)
  * @return 0 if succeeds
  * 	and -1 if fails:
- *    - Any of the pointer arguments is NULL
+ *    - Any of the pointer arguments (but skipped) is NULL
  *    - An error occurs during histogram or sift features calculation
- *    	including error in opening image (for wrong path for example)
- *    - Memory allocation failure
+ *    	including error in opening image (for wrong path for example) if
+ *    	skipped is NULL
+ *    - Memory allocation failure (even if skipped is not NULL)
  */
 int preprocessing(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
 		char *dir, char *prefix, char *suffix,
-		int numOfImages, int numOfBins, int nFeaturesToExtract);
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int prefetchThreads,
+		char *skipped);
+
+/**
+ * Compute histograms and sift features for the images
+ * firstImage, ..., firstImage+numOfImages-1 (same as preprocessing)
+ * The database arrays are indexed relative to firstImage
+ * i.e. histDB[0] is the histogram of image firstImage
+ *
+ * @param firstImage - index of the first image to process
+ * See preprocessing for the rest of the parameters and return value
+ */
+int preprocessingRange(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		char *dir, char *prefix, char *suffix,
+		int firstImage, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int prefetchThreads, char *skipped);
+
+/**
+ * Counts the images skipped by preprocessing
+ *
+ * @param skipped - the skipped flag of each image (see preprocessing), or NULL
+ * @param numOfImages - number of images
+ * @return the number of skipped images (0 if skipped is NULL)
+ */
+int numOfSkippedImages(const char *skipped, int numOfImages);
 
 /*
  * Queries user for action - either image path or # exit character
@@ -80,14 +267,52 @@ int preprocessing(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
  * Compares query image to pre-processed descriptors and prints k closest image indices
  * once for global descriptors (histogram) and once for local descriptors (sift features)
  *
+ * Cascade mode - if cascadeCandidates is between 2 and numOfImages-1 the local search
+ * only scans the sift features of the cascadeCandidates images closest to the query by
+ * global descriptors, and a report of the skipped work is printed
+ *
+ * If a histogram pyramid (built from histDB) is given, the global search computes
+ * exact histogram distances only for images not ruled out by their coarse
+ * histograms (see spHistPyramidSearch), with the same rankings, and a report
+ * of the number of exact distances computed is printed
+ *
+ * If a query cache is given, descriptors and rankings of repeated query images
+ * (same file contents) are taken from the cache instead of being recomputed
+ *
+ * The local search is done on siftDB by spBestSIFTL2SquaredDistance unless an
+ * alternative is given: a vocabulary tree (images are ranked by the distance of
+ * their visual words instead of by votes, see spVocabTreeScore), a PCA reduced
+ * database (approximate, see spSiftPCASearch), binary codes (approximate, see
+ * spSiftLSHSearch), a half precision store (see spHalfStoreSearch, its bfloat16
+ * histograms if any are also used by the global search) or a NUMA store
+ * (searched by its pinned workers, and a bandwidth report is printed)
+ *
+ * If a trace is given, each query is recorded in it after its rankings are
+ * printed (see answerQuery)
+ *
  * @param histDB - 1D array of histograms
  *            histDB[i] points to the channel array (of size 3) of image i
  * @param siftDB - 2D array of siftFeatures
  *            siftDB[i][j] is feature j of image i
  * @param nFeatures - number of sift features for each image
+ * @param skipped - flag of each image skipped by preprocessing (ranked last by
+ *                  global and local descriptors), or NULL if none was skipped
  * @param numOfImages - number of images in directory (assumed to be > 0)
  * @param numOfBins - number of bins in histogram (assumed to be > 0 and < 256)
  * @param nFeaturesToExtract - number of sift features to try to extract (assumed to be > 0)
+ * @param cascadeCandidates - number of images kept for local search (cascade mode)
+ *                            cascade is disabled if <= 1 or >= numOfImages
+ * @param histPyramid - coarse histograms of histDB, or NULL to compare all histograms
+ *                      (ignored if built for another number of images)
+ * @param cache - query result cache, or NULL to disable caching
+ * @param localSearch - alternatives to searching siftDB directly, or NULL for none
+ *                      (the features of siftDB may have been freed, siftDB[i]
+ *                      being NULL, if localSearch->half answers the local search)
+ * @param latency - recorder of the latency of each query and of its stages
+ *                  (from reading the query path to printing the rankings), or NULL
+ * @param trace - recorder of the queries, or NULL
+ * @param context - scratch buffers reused across queries, or NULL to allocate
+ *                  them for this query only
  *
  * @return 1 if exit character is entered, 0 if succeeds
  * 	and -1 if fails:
@@ -97,8 +322,401 @@ int preprocessing(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
  *    - Memory allocation failure
 
  */
-int queryAndCheck(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int K,
-		int numOfImages, int numOfBins, int nFeaturesToExtract);
+int queryAndCheck(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, const char *skipped,
+		int K, int numOfImages, int numOfBins, int nFeaturesToExtract, int cascadeCandidates,
+		SPHistPyramid *histPyramid, SPQueryCache *cache, const local_search *localSearch,
+		query_latency *latency, SPQueryTrace *trace, query_context *context);
+
+/**
+ * Answers a given query image as queryAndCheck does once the user entered
+ * it, so queries can be answered without the user (for example, replayed
+ * from a trace by several threads, each with its own context and latency
+ * recorder). If context->quiet is true, the rankings (left in
+ * context->ranking) and reports are not printed.
+ *
+ * If a trace is given, the query is recorded in it: its arrival time (the
+ * start of the answer), path, status (answered, from the cache, or failed)
+ * and stage durations, and the hash of the query image contents, computed
+ * after the answer so the durations do not include it.
+ *
+ * @param query - path of the query image
+ * @param context - scratch buffers reused across queries (must not be NULL)
+ * See queryAndCheck for the rest of the parameters (histPyramid and
+ * localSearch keep their scratch space in the context, so concurrent queries
+ * with contexts of their own may share them, but not the cache)
+ *
+ * @return 0 if succeeds, -1 if query or context is NULL, an error occurs
+ *         during histogram or sift features calculation or memory allocation
+ *         failure occurs
+ */
+int answerQuery(const char *query, SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, SPQueryCache *cache,
+		const local_search *localSearch, query_latency *latency, SPQueryTrace *trace,
+		query_context *context);
+
+/*
+ * Queries user for action - either a video path or # exit character
+ * Streams the frames of the video (a video file, or an image sequence given by
+ * a printf style pattern such as "frames/img%03d.png", see spFrameReaderOpen)
+ * and prints the frame number followed by the k closest image indices of each
+ * frame, as queryAndCheck does for a query image, and finally a report of the
+ * number of frames, keyframes and the frame rate achieved
+ *
+ * Consecutive frames are mostly alike, so the local search (the expensive part
+ * of a query) is only done for keyframes: the first frame, a frame whose RGB
+ * histogram changed by more than keyframeChange since the last keyframe, and
+ * (if keyframeInterval > 0) a frame keyframeInterval frames after the last
+ * keyframe. Other frames reuse the local ranking of the last keyframe, while
+ * the global ranking (from the histogram, computed anyway) is done for each frame.
+ * The change is spRGBHistL2Distance relative to the weighted squared norm of
+ * the keyframe histogram, square rooted - the relative L2 change, independent
+ * of the frame size (0 for identical histograms)
+ *
+ * @param keyframeChange - relative histogram change starting a new keyframe
+ * @param keyframeInterval - maximum number of frames between keyframes (0 - no maximum)
+ * @param latency - recorder of the latency of each frame and of its stages, or NULL
+ * @param context - scratch buffers reused across frames and videos, or NULL to
+ *                  allocate them for this video only
+ * See queryAndCheck for the rest of the parameters
+ *
+ * @return 1 if exit character is entered, 0 if succeeds
+ * 	and -1 if fails:
+ *    - Any of the pointer arguments is NULL
+ *    - The video cannot be opened
+ *    - An error occurs during histogram or sift features calculation
+ *    - Memory allocation failure
+ */
+int queryAndCheckVideo(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, const char *skipped,
+		int K, int numOfImages, int numOfBins, int nFeaturesToExtract, int cascadeCandidates,
+		SPHistPyramid *histPyramid, const local_search *localSearch, double keyframeChange,
+		int keyframeInterval, query_latency *latency, query_context *context);
+
+/**
+ * Answers a given query video as queryAndCheckVideo does once the user
+ * entered it
+ *
+ * @param query - path of the query video
+ * @param context - scratch buffers reused across frames and videos (must not be NULL)
+ * See queryAndCheckVideo for the rest of the parameters
+ *
+ * @return 0 if succeeds, -1 if query or context is NULL or queryAndCheckVideo
+ *         would fail
+ */
+int answerVideoQuery(const char *query, SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int k, int numOfImages, int numOfBins, int nFeaturesToExtract,
+		int cascadeCandidates, SPHistPyramid *histPyramid, const local_search *localSearch,
+		double keyframeChange, int keyframeInterval, query_latency *latency,
+		query_context *context);
+
+/**
+ * Initializes an empty query context (nothing is allocated until first used)
+ *
+ * @param context - the context
+ */
+void initQueryContext(query_context *context);
+
+/**
+ * Grows the per image and per k buffers of a query context (if needed) and
+ * creates its search scratch space on first use
+ *
+ * @param context - the context
+ * @param numOfImages - number of images in the databases
+ * @param k - number of closest images
+ * @return 0 if succeeds, -1 if context is NULL or allocation failure occurred
+ *         (the context stays valid)
+ */
+int reserveQueryContext(query_context *context, int numOfImages, int k);
+
+/**
+ * Frees all buffers of a query context and initializes it again
+ * If context is NULL nothing happens.
+ */
+void destroyQueryContext(query_context *context);
+
+/**
+ * Returns the histogram of a query image, taken from the cache if the query
+ * is cached, otherwise computed by spGetRGBHist
+ *
+ * @param cache - query result cache (may be NULL)
+ * @param key - key of the query in the cache, or NULL if not cached
+ * @param query - path of the query image
+ * @param imageIndex - the index given to the histogram points
+ * @param numOfBins - number of bins in histogram
+ * @return the histogram (owned by the caller), NULL if it could not be computed
+ */
+SPPoint** getQueryHist(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const char *query, int imageIndex, int numOfBins);
+
+/**
+ * Returns the sift features of a query image, taken from the cache if the
+ * query is cached, otherwise computed by spGetSiftDescriptors
+ *
+ * @param cache - query result cache (may be NULL)
+ * @param key - key of the query in the cache, or NULL if not cached
+ * @param query - path of the query image
+ * @param imageIndex - the index given to the feature points
+ * @param nFeaturesToExtract - number of sift features to try to extract
+ * @param qnFeatures - the address in which the number of features will be stored
+ * @return the features (owned by the caller), NULL if they could not be computed
+ */
+SPPoint** getQuerySift(SPQueryCache *cache, const SPQueryCacheKey *key,
+		const char *query, int imageIndex, int nFeaturesToExtract, int *qnFeatures);
+
+/**
+ * Prints the cached rankings of a query in the same format as queryAndCheck
+ *
+ * @param cache - query result cache (may be NULL)
+ * @param key - key of the query in the cache, or NULL if not cached
+ * @param print - false to only check whether the rankings are cached
+ * @return 0 if the rankings are cached (and printed), -1 otherwise
+ */
+int printCachedRankings(SPQueryCache *cache, const SPQueryCacheKey *key, bool print);
+
+/**
+ * Caches the descriptors and rankings of a query
+ * Caching failures are ignored (they only cause a cache miss later)
+ *
+ * @param cache - query result cache (may be NULL)
+ * @param key - key of the query in the cache, or NULL to skip caching
+ * @param qhist - the query histogram
+ * @param qsift - the query sift features
+ * @param qnFeatures - number of query sift features
+ * @param ranking - k closest images by global descriptors followed by
+ *                  k closest images by local descriptors
+ */
+void cacheQuery(SPQueryCache *cache, const SPQueryCacheKey *key,
+		SPPoint **qhist, SPPoint **qsift, int qnFeatures, const int *ranking);
+
+/**
+ * Ranks the images by global descriptors, the global stage of answerQuery:
+ * sorts context->dists by the distance of each image histogram to the query
+ * histogram (skipped images last), prints the k closest images unless
+ * context->quiet is true and stores them as the global part of
+ * context->ranking. With a histogram pyramid only the closest images needed
+ * (k, or the cascade candidates) are found and sorted, the rest of
+ * context->dists is undefined.
+ *
+ * @param qhist - the query histogram (3 channels)
+ * @param context - a context reserved for numOfImages images and k (see
+ *                  reserveQueryContext)
+ * See queryAndCheck for the rest of the parameters
+ */
+void globalRanking(SPPoint ***histDB, const char *skipped, int numOfImages, int k,
+		int cascadeCandidates, SPHistPyramid *histPyramid, const local_search *localSearch,
+		SPPoint **qhist, query_context *context);
+
+/**
+ * Ranks the images by local descriptors, the local stage of answerQuery:
+ * votes for the images of the k closest database features of each query
+ * feature (or scores them by the vocabulary tree), skipped images last (even
+ * below images with no votes), prints the k closest images unless
+ * context->quiet is true and stores them as the local part of
+ * context->ranking. Allocates nothing once the context is warm.
+ *
+ * @param qsift - the query sift features
+ * @param qnFeatures - number of query sift features
+ * @param context - a context whose dists were sorted by globalRanking
+ * See queryAndCheck for the rest of the parameters
+ *
+ * @return 0 if succeeds, -1 if the local search fails
+ */
+int localRanking(SPPoint ***siftDB, int *nFeatures, const char *skipped, int k, int numOfImages,
+		int cascadeCandidates, const local_search *localSearch, SPPoint **qsift, int qnFeatures,
+		query_context *context);
+
+/**
+ * Measures the effect of extracting sift features with a maximum image side
+ * (see spSetSiftMaxSide): the features of the first numOfBenchmarkImages images
+ * are extracted at full resolution and with maxSide, and a report is printed of
+ * the extraction speedup and of the agreement of the local search rankings.
+ * Each image is used as a query against the other benchmark images, and the
+ * agreement is the average fraction of the top min(k, n-1) images (by votes of
+ * their closest features) shared by both resolutions.
+ * The maximum side is left set to maxSide.
+ *
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param numOfImages - number of images in directory
+ * @param nFeaturesToExtract - number of sift features to try to extract
+ * @param maxSide - the maximum side benchmarked (must be > 0)
+ * @param k - number of closest features and of top images compared
+ * @param numOfBenchmarkImages - number of images used (at most numOfImages, at least 2)
+ * @return 0 if succeeds, -1 if any of the arguments is invalid, an image
+ *         cannot be loaded or allocation failure occurred
+ */
+int benchmarkSiftMaxSide(char *dir, char *prefix, char *suffix, int numOfImages,
+		int nFeaturesToExtract, int maxSide, int k, int numOfBenchmarkImages);
+
+/**
+ * Measures the effect of the tiled extraction of sift features (see
+ * spSetSiftTiling) as benchmarkSiftMaxSide does: the sift features of the
+ * first numOfBenchmarkImages images are extracted whole and with the current
+ * tiling (both at the current maximum side), and a report is printed of the
+ * extraction speedup and of the agreement of the local search rankings.
+ * The current tiling is left set.
+ *
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param numOfImages - number of images in directory
+ * @param nFeaturesToExtract - number of sift features to try to extract
+ * @param k - number of closest features and of top images compared
+ * @param numOfBenchmarkImages - number of images used (at most numOfImages, at least 2)
+ * @return 0 if succeeds, -1 if tiling is not set, any of the arguments is
+ *         invalid, an image cannot be loaded or allocation failure occurred
+ */
+int benchmarkSiftTiling(char *dir, char *prefix, char *suffix, int numOfImages,
+		int nFeaturesToExtract, int k, int numOfBenchmarkImages);
+
+/**
+ * Measures the effect of sampling the pixels of RGB histograms (see
+ * spSetHistSampling): the histograms of the first numOfBenchmarkImages images
+ * are computed from all pixels and with the current sampling, and a report is
+ * printed of the speedup (including decoding) and of the agreement of the
+ * global rankings. Each image is used as a query against the other benchmark
+ * images, and the agreement is the average fraction of the top min(k, n-1)
+ * images (by spRGBHistL2Distance) shared by both histograms.
+ * The current sampling is left set.
+ *
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param numOfImages - number of images in directory
+ * @param numOfBins - number of histogram bins
+ * @param k - number of top images compared
+ * @param numOfBenchmarkImages - number of images used (at most numOfImages, at least 2)
+ * @return 0 if succeeds, -1 if any of the arguments is invalid, an image
+ *         cannot be loaded or allocation failure occurred
+ */
+int benchmarkHistSampling(char *dir, char *prefix, char *suffix, int numOfImages,
+		int numOfBins, int k, int numOfBenchmarkImages);
+
+/**
+ * Measures the sustained scan bandwidth of the NUMA store: for 1, 2, 4, ...
+ * partitions up to maxNodes (and maxNodes itself), a store is created with
+ * threadsPerNode workers on each partition and the sift features of a fixed
+ * set of database images (numOfQueries images, evenly spaced) are searched
+ * one image at a time, as queries are. A report is printed for each node
+ * configuration of the bytes scanned over the wall time of all searches.
+ *
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @param maxNodes - the largest number of partitions (0 - the number of
+ *                   NUMA nodes of the machine)
+ * @param threadsPerNode - number of search workers on each partition
+ * @param k - number of closest features of each query feature
+ * @param numOfQueries - number of query images (at most numOfImages)
+ * @return 0 if succeeds, -1 if any of the arguments is invalid or allocation
+ *         or thread creation failure occurred
+ */
+int benchmarkNumaStore(SPPoint ***siftDB, int *nFeatures, int numOfImages, int maxNodes,
+		int threadsPerNode, int k, int numOfQueries);
+
+/**
+ * Creates the histograms of a query latency recorder
+ *
+ * @param latency - the recorder
+ * @param snapshotInterval - number of queries between printed snapshots
+ *                           (0 - printed by printQueryLatency only)
+ * @return 0 if succeeds, -1 if latency is NULL or allocation failure occurred
+ */
+int createQueryLatency(query_latency *latency, int snapshotInterval);
+
+/**
+ * Frees the histograms of a query latency recorder
+ * If latency is NULL nothing happens.
+ */
+void destroyQueryLatency(query_latency *latency);
+
+/**
+ * Starts timing a query (no stage has run yet)
+ * Decoding time counted before the call is discarded (see spTakeDecodeSeconds)
+ *
+ * @param timer - the timer
+ */
+void startQueryTimer(query_timer *timer);
+
+/**
+ * Ends a stage of a timed query: the time since the end of the previous stage
+ * (or the start of the query) is added to the stage. For STAGE_HISTOGRAM and
+ * STAGE_SIFT the image decoding time is moved to STAGE_DECODE.
+ *
+ * @param timer - the timer
+ * @param stage - the stage which ended
+ */
+void endQueryStage(query_timer *timer, query_stage stage);
+
+/**
+ * Ends a timed query and records its duration and the durations of the
+ * stages which ran. Every snapshotInterval queries a snapshot is printed.
+ * If latency is NULL nothing happens.
+ *
+ * @param latency - the recorder
+ * @param timer - the timer of the query
+ */
+void recordQueryLatency(query_latency *latency, query_timer *timer);
+
+/**
+ * Prints the count, p50, p90, p99, p999 and maximum latency of the queries
+ * and of each of their stages (stages which never ran are not printed)
+ * If latency is NULL nothing happens.
+ *
+ * @param latency - the recorder
+ */
+void printQueryLatency(query_latency *latency);
+
+/**
+ * Computes the memory used by the descriptors of a single image
+ *
+ * @param hist - the 3 histograms of the image (or NULL)
+ * @param sift - the sift features of the image (or NULL)
+ * @param nFeatures - number of sift features
+ * @param usage - the address in which the memory used is stored
+ */
+void imageMemoryUsage(SPPoint **hist, SPPoint **sift, int nFeatures, memory_usage *usage);
+
+/**
+ * Computes the memory used by the databases, in total and for each image
+ * The total includes the histDB, siftDB and nFeatures arrays as index memory.
+ *
+ * @param histDB - histograms database
+ * @param siftDB - sift features database
+ * @param nFeatures - number of features for each image
+ * @param numOfImages - number of images in the databases
+ * @param total - the address in which the total memory used is stored
+ * @param perImage - array of numOfImages in which the memory used by each
+ *                   image is stored, or NULL
+ * @return 0 if succeeds, -1 if any of the database arguments or total is NULL
+ */
+int databaseMemoryUsage(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		memory_usage *total, memory_usage *perImage);
+
+/**
+ * Returns the memory used by the enabled local search structures, in bytes
+ * (the features they refer to are owned by siftDB and not counted)
+ *
+ * @param localSearch - local search structures (or NULL)
+ */
+long localSearchMemoryBytes(const local_search *localSearch);
+
+/**
+ * Prints the memory used by the databases and the local search structures,
+ * and if perImage is 1, the memory used by each image
+ *
+ * @param histDB - histograms database
+ * @param siftDB - sift features database
+ * @param nFeatures - number of features for each image
+ * @param numOfImages - number of images in the databases
+ * @param localSearch - local search structures (or NULL)
+ * @param perImage - 1 to print a line for each image
+ * @return 0 if succeeds, -1 if any of the database arguments is NULL or
+ *         allocation failure occurred
+ */
+int printMemoryUsage(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		const local_search *localSearch, int perImage);
 
 /**
  * Frees memory of a 1D SPPoint array of size dim
@@ -0,0 +1,30 @@
+#ifndef MAIN_DESCRIPTORS_H_
+#define MAIN_DESCRIPTORS_H_
+
+/**
+ * The resolution, tiling and sampling with which ex3 extracts the descriptors
+ * of database and query images (see sp_image_proc_ext). sp_eval extracts its
+ * databases and queries with the same settings, so the evaluated backends
+ * search the descriptors ex3 searches.
+ */
+
+// maximum side of images sift features are extracted from, larger images
+// are downsampled (0 - full resolution)
+#define SIFT_MAX_SIDE 0
+// maximum number of tiles of an image whose sift features are extracted in
+// parallel by a pool of threads, approximating the features of the whole
+// image (0 - images are extracted whole by one thread)
+#define SIFT_TILE_THREADS 0
+// overlap of the tiles in pixels, so keypoints near a tile border are
+// detected and described with their surroundings
+#define SIFT_TILE_OVERLAP 32
+// side of the pixel blocks of which one pixel is counted by the RGB histograms,
+// whose counts are scaled to the whole image (1 - all pixels are counted)
+#define HIST_SAMPLE_STRIDE 1
+// if 1, a hashed pixel of each block is counted (0 - its center)
+#define HIST_SAMPLE_JITTER 0
+// 2, 4 or 8 - images are decoded at 1/HIST_DECODE_REDUCTION of their size for
+// their histograms (1 - whole images)
+#define HIST_DECODE_REDUCTION 1
+
+#endif /* MAIN_DESCRIPTORS_H_ */
@@ -0,0 +1,525 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
+#include "main_aux.h"
+#include "main_index.h"
+
+//Inner function hashing the paths, sizes and modification times of the images
+static uint64_t imageSourceHash(const char *dir, const char *prefix, const char *suffix,
+		int numOfImages, char *imageName) {
+	// 64 bit FNV-1a, a missing image is hashed as size and time -1
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i=0; i<numOfImages; i++) {
+		sprintf(imageName, "%s%s%d%s", dir, prefix, i, suffix);
+		struct stat info;
+		int64_t fields[2] = { -1, -1 };
+		if (stat(imageName, &info) == 0) {
+			fields[0] = (int64_t) info.st_size;
+			fields[1] = (int64_t) info.st_mtime;
+		}
+		const unsigned char *bytes[2] = { (const unsigned char*) imageName,
+				(const unsigned char*) fields };
+		size_t sizes[2] = { strlen(imageName) + 1, sizeof(fields) };
+		for (int b=0; b<2; b++)
+			for (size_t j=0; j<sizes[b]; j++)
+				hash = (hash ^ bytes[b][j])*1099511628211ULL;
+	}
+	return hash;
+}
+
+//Inner function filling the manifest of an index of the images with the current settings
+static int expectedManifest(const char *dir, const char *prefix, const char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int shardSize,
+		SPIndexManifest *manifest) {
+	// if fails returns -1, otherwise 0
+	char *imageName = (char*) malloc((strlen(dir) + strlen(prefix) + strlen(suffix) + 16)*sizeof(char));
+	if (imageName == NULL) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+	manifest->numOfImages = numOfImages;
+	manifest->numOfBins = numOfBins;
+	manifest->nFeaturesToExtract = nFeaturesToExtract;
+	manifest->shardSize = shardSize;
+	manifest->numOfShards = (numOfImages + shardSize - 1) / shardSize;
+	manifest->siftMaxSide = spGetSiftMaxSide();
+	manifest->siftTileThreads = spGetSiftTileThreads();
+	manifest->siftTileOverlap = spGetSiftTileOverlap();
+	manifest->histStride = spGetHistStride();
+	manifest->histJitter = spGetHistJitter() ? 1 : 0;
+	manifest->histReduction = spGetHistReduction();
+	manifest->histDecodedReduction = spGetHistDecodedReduction();
+	manifest->sourceHash = imageSourceHash(dir, prefix, suffix, numOfImages, imageName);
+	manifest->numOfSkipped = 0;
+	free(imageName);
+	return 0;
+}
+
+int buildIndex(const char *indexPath, char *dir, char *prefix, char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int shardSize,
+		int prefetchThreads, SPIndexManifest *manifest, bool skipBadImages) {
+	// compute descriptors in batches of shardSize images and write each batch to a shard
+	// resumes a build interrupted after a checkpoint with the same parameters
+	// if fails returns -1, otherwise 0
+
+	if (indexPath == NULL || dir == NULL || prefix == NULL || suffix == NULL || manifest == NULL)
+		return -1;
+
+	// allocate batch databases, shard and checkpoint file names
+	SPPoint ***histDB = (SPPoint***) malloc(shardSize*sizeof(SPPoint**));
+	SPPoint ***siftDB = (SPPoint***) malloc(shardSize*sizeof(SPPoint**));
+	int *nFeatures = (int*) malloc(shardSize*sizeof(int));
+	char *skipped = skipBadImages ? (char*) malloc(shardSize*sizeof(char)) : NULL;
+	char *shardPath = (char*) malloc((strlen(indexPath)+16)*sizeof(char));
+	char *checkpointPath = (char*) malloc((strlen(indexPath)+16)*sizeof(char));
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL || shardPath == NULL ||
+			checkpointPath == NULL || (skipBadImages && skipped == NULL)) {
+		printf("%s",MEMORY_ERROR);
+		free(histDB);
+		free(siftDB);
+		free(nFeatures);
+		free(skipped);
+		free(shardPath);
+		free(checkpointPath);
+		return -1;
+	}
+
+	if (expectedManifest(dir, prefix, suffix, numOfImages, numOfBins, nFeaturesToExtract,
+			shardSize, manifest) == -1) {
+		free(histDB);
+		free(siftDB);
+		free(nFeatures);
+		free(skipped);
+		free(shardPath);
+		free(checkpointPath);
+		return -1;
+	}
+
+	// a previous index is invalid from now on, resume from a matching checkpoint
+	remove(indexPath);
+	spIndexCheckpointPath(checkpointPath, indexPath);
+	SPIndexManifest checkpoint;
+	int firstShard = 0;
+	if (spIndexReadCheckpoint(checkpointPath, &checkpoint, &firstShard) != SP_INDEX_SUCCESS ||
+			!spIndexManifestEqual(&checkpoint, manifest) ||
+			firstShard < 0 || firstShard > manifest->numOfShards || checkpoint.numOfSkipped < 0 ||
+			(!skipBadImages && checkpoint.numOfSkipped > 0))
+		firstShard = 0;
+	else
+		manifest->numOfSkipped = checkpoint.numOfSkipped;
+	if (firstShard > 0)
+		printf(INDEX_RESUME_MSG, firstShard, manifest->numOfShards);
+
+	int ret = 0;
+	for (int shard=firstShard; shard<manifest->numOfShards && ret == 0; shard++) {
+		int firstImage = shard*shardSize;
+		int batchSize = numOfImages - firstImage < shardSize ? numOfImages - firstImage : shardSize;
+
+		// compute batch descriptors
+		for (int i=0; i<batchSize; i++) {
+			histDB[i] = NULL;
+			siftDB[i] = NULL;
+		}
+		ret = preprocessingRange(histDB, siftDB, nFeatures, dir, prefix, suffix,
+				firstImage, batchSize, numOfBins, nFeaturesToExtract, prefetchThreads, skipped);
+
+		// spill batch to disk, then record it in the checkpoint
+		if (ret == 0) {
+			spIndexShardPath(shardPath, indexPath, shard);
+			manifest->numOfSkipped += numOfSkippedImages(skipped, batchSize);
+			if (spIndexWriteShard(shardPath, histDB, siftDB, nFeatures, skipped,
+					firstImage, batchSize, numOfBins) != SP_INDEX_SUCCESS) {
+				printf(INDEX_ERROR_MSG, shardPath);
+				ret = -1;
+			}
+			else if (spIndexWriteCheckpoint(checkpointPath, manifest, shard + 1) != SP_INDEX_SUCCESS) {
+				printf(INDEX_ERROR_MSG, checkpointPath);
+				ret = -1;
+			}
+		}
+
+		// free batch (nFeatures is reused by the next batch)
+		for (int i=0; i<batchSize; i++) {
+			destroySPPoint1D(histDB[i], 3);
+			if (siftDB[i] != NULL)
+				destroySPPoint1D(siftDB[i], nFeatures[i]);
+		}
+	}
+
+	// manifest is written last so a partial index is never used
+	if (ret == 0 && spIndexWriteManifest(indexPath, manifest) != SP_INDEX_SUCCESS) {
+		printf(INDEX_ERROR_MSG, indexPath);
+		ret = -1;
+	}
+	if (ret == 0)
+		remove(checkpointPath);
+
+	free(histDB);
+	free(siftDB);
+	free(nFeatures);
+	free(skipped);
+	free(shardPath);
+	free(checkpointPath);
+	return ret;
+}
+
+int preprocessingCheckpointed(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		char *dir, char *prefix, char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int prefetchThreads,
+		const char *checkpointPath, int checkpointSize, char *skipped) {
+	// builds (or resumes, or reuses) an index of the images and loads it into memory
+	// if fails returns -1, otherwise 0
+
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL || checkpointPath == NULL)
+		return -1;
+	for (int i=0; i<numOfImages; i++) {
+		histDB[i] = NULL;
+		siftDB[i] = NULL;
+		nFeatures[i] = 0;
+		if (skipped != NULL)
+			skipped[i] = 0;
+	}
+
+	SPIndexManifest manifest;
+	if (findIndex(checkpointPath, dir, prefix, suffix, numOfImages, numOfBins,
+			nFeaturesToExtract, checkpointSize, skipped != NULL, &manifest) == 0)
+		printf(INDEX_REUSE_MSG, manifest.numOfShards, manifest.numOfImages);
+	else if (buildIndex(checkpointPath, dir, prefix, suffix, numOfImages, numOfBins,
+			nFeaturesToExtract, checkpointSize, prefetchThreads, &manifest, skipped != NULL) == -1)
+		return -1;
+
+	char *shardPath = (char*) malloc((strlen(checkpointPath)+16)*sizeof(char));
+	if (shardPath == NULL) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+	int ret = 0;
+	for (int shard=0; shard<manifest.numOfShards && ret == 0; shard++) {
+		spIndexShardPath(shardPath, checkpointPath, shard);
+		SPIndexShard *indexShard = spIndexShardOpen(shardPath);
+		int firstImage = shard*manifest.shardSize;
+		if (indexShard == NULL || spIndexShardFirstImage(indexShard) != firstImage ||
+				firstImage + spIndexShardNumOfImages(indexShard) > numOfImages) {
+			printf(INDEX_ERROR_MSG, shardPath);
+			ret = -1;
+		}
+		else {
+			SP_INDEX_MSG msg = spIndexShardLoad(indexShard, histDB + firstImage,
+					siftDB + firstImage, nFeatures + firstImage,
+					skipped != NULL ? skipped + firstImage : NULL);
+			if (msg != SP_INDEX_SUCCESS) {
+				printf("%s",MEMORY_ERROR);
+				ret = -1;
+			}
+		}
+		spIndexShardClose(indexShard);
+	}
+	free(shardPath);
+	return ret;
+}
+
+int findIndex(const char *indexPath, const char *dir, const char *prefix, const char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int shardSize,
+		bool skipBadImages, SPIndexManifest *manifest) {
+	// reads the manifest of an existing index and checks its build parameters
+	// and images
+	// returns 0 if the index matches, otherwise -1
+	SPIndexManifest expected;
+	if (indexPath == NULL || dir == NULL || prefix == NULL || suffix == NULL ||
+			manifest == NULL || spIndexReadManifest(indexPath, manifest) != SP_INDEX_SUCCESS ||
+			expectedManifest(dir, prefix, suffix, numOfImages, numOfBins, nFeaturesToExtract,
+					shardSize, &expected) == -1 ||
+			!spIndexManifestEqual(manifest, &expected) ||
+			(!skipBadImages && manifest->numOfSkipped > 0))
+		return -1;
+	return 0;
+}
+
+int poolHistDistances(SPShardPool *pool, int numOfImages,
+		SPPoint **qhist, sortable_index *dists, int *nFeatures) {
+	// computes histogram distances to all images using the shard worker pool
+	// also collects the number of features of every image
+	// if fails returns -1, otherwise 0
+
+	double *values = (double*) malloc(numOfImages*sizeof(double));
+	if (values == NULL) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+	SP_SHARD_POOL_MSG msg = spShardPoolHistDistances(pool, qhist, values, nFeatures);
+	if (msg != SP_SHARD_POOL_SUCCESS) {
+		if (msg == SP_SHARD_POOL_OUT_OF_MEMORY)
+			printf("%s",MEMORY_ERROR);
+		else
+			printf("%s",SHARD_WORKER_ERROR_MSG);
+		free(values);
+		return -1;
+	}
+	for (int i=0; i<numOfImages; i++) {
+		dists[i].value = values[i];
+		dists[i].index = i;
+	}
+	free(values);
+	return 0;
+}
+
+//Inner function getting a shard from the lazy index, or mapping it if there is none
+static SPIndexShard* getShard(const char *indexPath, SPLazyIndex *lazyIndex,
+		int shard, char *shardPath) {
+	// shardPath is set to the shard file name (for error messages)
+	spIndexShardPath(shardPath, indexPath, shard);
+	if (lazyIndex != NULL)
+		return spLazyIndexGetShard(lazyIndex, shard);
+	return spIndexShardOpen(shardPath);
+}
+
+//Inner function releasing a shard returned by getShard
+static void releaseShard(SPLazyIndex *lazyIndex, SPIndexShard *indexShard) {
+	// shards of the lazy index stay mapped
+	if (lazyIndex == NULL)
+		spIndexShardClose(indexShard);
+}
+
+int indexHistDistances(const char *indexPath, const SPIndexManifest *manifest, SPLazyIndex *lazyIndex,
+		SPPoint **qhist, sortable_index *dists, int *nFeatures, char *shardPath) {
+	// streams all shards and computes histogram distances to all images
+	// also collects the number of features of every image
+	// if fails returns -1, otherwise 0
+
+	double *shardDists = (double*) malloc(manifest->shardSize*sizeof(double));
+	if (shardDists == NULL) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+
+	for (int shard=0; shard<manifest->numOfShards; shard++) {
+		SPIndexShard *indexShard = getShard(indexPath, lazyIndex, shard, shardPath);
+		if (indexShard == NULL || spIndexShardHistDistances(indexShard, qhist, shardDists) != SP_INDEX_SUCCESS) {
+			printf(INDEX_ERROR_MSG, shardPath);
+			releaseShard(lazyIndex, indexShard);
+			free(shardDists);
+			return -1;
+		}
+		int firstImage = spIndexShardFirstImage(indexShard);
+		for (int i=0; i<spIndexShardNumOfImages(indexShard); i++) {
+			dists[firstImage+i].value = shardDists[i];
+			dists[firstImage+i].index = firstImage+i;
+			nFeatures[firstImage+i] = spIndexShardNumOfFeatures(indexShard, i);
+		}
+		releaseShard(lazyIndex, indexShard);
+	}
+
+	free(shardDists);
+	return 0;
+}
+
+int indexSearch(const char *indexPath, const SPIndexManifest *manifest, SPLazyIndex *lazyIndex,
+		SPPoint **qsift, int qnFeatures, SPBPQueue **queues,
+		const char *selected, char *shardPath) {
+	// streams shards with selected images and searches them for the closest sift features
+	// if fails returns -1, otherwise 0
+
+	for (int shard=0; shard<manifest->numOfShards; shard++) {
+		// skip shards with no selected images
+		if (selected != NULL) {
+			int firstImage = shard*manifest->shardSize, found = 0;
+			for (int i=firstImage; i<firstImage+manifest->shardSize && i<manifest->numOfImages; i++)
+				found = found || selected[i];
+			if (!found)
+				continue;
+		}
+
+		SPIndexShard *indexShard = getShard(indexPath, lazyIndex, shard, shardPath);
+		SP_INDEX_MSG msg = spIndexShardSearch(indexShard, qsift, qnFeatures, queues, selected);
+		releaseShard(lazyIndex, indexShard);
+		if (msg != SP_INDEX_SUCCESS) {
+			if (msg == SP_INDEX_OUT_OF_MEMORY)
+				printf("%s",MEMORY_ERROR);
+			else
+				printf(INDEX_ERROR_MSG, shardPath);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int queryAndCheckIndex(const char *indexPath, const SPIndexManifest *manifest,
+		SPShardPool *pool, SPLazyIndex *lazyIndex, int k, int cascadeCandidates, SPQueryCache *cache,
+		query_latency *latency) {
+	/**
+	 * Same as queryAndCheck, but searches an on-disk index
+	 */
+
+	if (indexPath == NULL || manifest == NULL)
+		return -1;
+	int numOfImages = manifest->numOfImages;
+
+	// allocate memory for query string, shard file name, per image arrays and rankings
+	char *query = (char*) malloc(1024*sizeof(char));
+	char *shardPath = (char*) malloc((strlen(indexPath)+16)*sizeof(char));
+	sortable_index *dists = (sortable_index*) malloc(numOfImages*sizeof(sortable_index));
+	int *nFeatures = (int*) malloc(numOfImages*sizeof(int));
+	int *ranking = (int*) malloc(2*k*sizeof(int));
+	char *skipped = (char*) malloc(numOfImages*sizeof(char));
+	char *selected = NULL;
+	if (query == NULL || shardPath == NULL || dists == NULL || nFeatures == NULL || ranking == NULL ||
+			skipped == NULL) {
+		printf("%s",MEMORY_ERROR);
+		free(query);
+		free(shardPath);
+		free(dists);
+		free(nFeatures);
+		free(ranking);
+		free(skipped);
+		return -1;
+	}
+
+	// get query and check exit character
+	getUserStr(query, ENTER_QUERY_MSG);
+	int ret = 0;
+	if (strncmp(query, EXIT_CHAR, 1024) == 0) {
+		printf("%s", EXIT_MSG);
+		ret = 1;
+	}
+	query_timer timer;
+	startQueryTimer(&timer);
+
+	// look up query in cache - nothing left to do if its rankings are cached
+	SPQueryCacheKey cacheKey, *key = NULL;
+	if (ret == 0 && cache != NULL &&
+			spQueryCacheKey(query, manifest->numOfBins, manifest->nFeaturesToExtract, k, &cacheKey))
+		key = &cacheKey;
+	if (ret == 0 && printCachedRankings(cache, key, true) == 0) {
+		recordQueryLatency(latency, &timer);
+		ret = 2;
+	}
+	if (ret != 0) {
+		free(query);
+		free(shardPath);
+		free(dists);
+		free(nFeatures);
+		free(ranking);
+		free(skipped);
+		return ret == 1 ? 1 : 0;
+	}
+
+	SPPoint **qsift = NULL;
+	SPBPQueue **queues = NULL;
+	int qnFeatures = 0;
+
+	// compare global descriptors
+	SPPoint **qhist = getQueryHist(cache, key, query, numOfImages+1, manifest->numOfBins);
+	if (qhist == NULL)
+		ret = -1;
+	endQueryStage(&timer, STAGE_HISTOGRAM);
+	if (ret == 0 && pool != NULL)
+		ret = poolHistDistances(pool, numOfImages, qhist, dists, nFeatures);
+	else if (ret == 0)
+		ret = indexHistDistances(indexPath, manifest, lazyIndex, qhist, dists, nFeatures, shardPath);
+	if (ret == 0) {
+		// skipped images have an infinite histogram distance (see spIndexShardHistDistances)
+		for (int i=0; i<numOfImages; i++)
+			skipped[i] = dists[i].value == HUGE_VAL;
+		sortAndPrint(dists, numOfImages, k, 1, OUTPUT_GLOBAL_MSG);
+		for (int i=0; i<k; i++)
+			ranking[i] = dists[i].index;
+	}
+
+	// cascade - restrict local search to closest images by global descriptors
+	if (ret == 0 && cascadeCandidates > 1 && cascadeCandidates < numOfImages) {
+		selected = (char*) calloc(numOfImages, sizeof(char));
+		if (selected == NULL) {
+			printf("%s",MEMORY_ERROR);
+			ret = -1;
+		}
+		else {
+			long totalFeatures = 0, searchedFeatures = 0;
+			for (int i=0; i<numOfImages; i++)
+				totalFeatures += nFeatures[i];
+			for (int i=0; i<cascadeCandidates; i++) {
+				selected[dists[i].index] = 1;
+				searchedFeatures += nFeatures[dists[i].index];
+			}
+			printf(CASCADE_REPORT_MSG, cascadeCandidates, numOfImages,
+					totalFeatures - searchedFeatures, totalFeatures);
+		}
+	}
+	endQueryStage(&timer, STAGE_GLOBAL);
+
+	// get sift features and a distance queue for each of them
+	if (ret == 0) {
+		qsift = getQuerySift(cache, key, query, numOfImages+1, manifest->nFeaturesToExtract, &qnFeatures);
+		if (qsift == NULL)
+			ret = -1;
+	}
+	endQueryStage(&timer, STAGE_SIFT);
+	if (ret == 0) {
+		queues = (SPBPQueue**) calloc(qnFeatures > 0 ? qnFeatures : 1, sizeof(SPBPQueue*));
+		for (int i=0; queues != NULL && i<qnFeatures; i++) {
+			queues[i] = spBPQueueCreate(k);
+			if (queues[i] == NULL)
+				ret = -1;
+		}
+		if (queues == NULL || ret == -1) {
+			printf("%s",MEMORY_ERROR);
+			ret = -1;
+		}
+	}
+
+	// compare local descriptors, sum hits, sort and print
+	if (ret == 0 && pool != NULL) {
+		SP_SHARD_POOL_MSG msg = spShardPoolSearch(pool, qsift, qnFeatures, queues, selected);
+		if (msg != SP_SHARD_POOL_SUCCESS) {
+			if (msg == SP_SHARD_POOL_OUT_OF_MEMORY)
+				printf("%s",MEMORY_ERROR);
+			else
+				printf("%s",SHARD_WORKER_ERROR_MSG);
+			ret = -1;
+		}
+	}
+	else if (ret == 0)
+		ret = indexSearch(indexPath, manifest, lazyIndex, qsift, qnFeatures, queues, selected, shardPath);
+	if (ret == 0) {
+		for (int i=0; i<numOfImages; i++) {
+			dists[i].value = 0;
+			dists[i].index = i;
+		}
+		BPQueueElement elem;
+		for (int i=0; i<qnFeatures; i++) {
+			while (spBPQueuePeek(queues[i], &elem) == SP_BPQUEUE_SUCCESS) {
+				dists[elem.index].value ++;
+				spBPQueueDequeue(queues[i]);
+			}
+		}
+		// skipped images are ranked last (below images with no votes)
+		for (int i=0; i<numOfImages; i++)
+			if (skipped[i])
+				dists[i].value = -1;
+		sortAndPrint(dists, numOfImages, k, -1, OUTPUT_LOCAL_MSG);
+		for (int i=0; i<k; i++)
+			ranking[k+i] = dists[i].index;
+		endQueryStage(&timer, STAGE_LOCAL);
+		recordQueryLatency(latency, &timer);
+		cacheQuery(cache, key, qhist, qsift, qnFeatures, ranking);
+	}
+
+	// cleanup
+	if (queues != NULL)
+		for (int i=0; i<qnFeatures; i++)
+			spBPQueueDestroy(queues[i]);
+	free(queues);
+	destroySPPoint1D(qhist, 3);
+	destroySPPoint1D(qsift, qnFeatures);
+	free(query);
+	free(shardPath);
+	free(dists);
+	free(nFeatures);
+	free(ranking);
+	free(skipped);
+	free(selected);
+	return ret;
+}
@@ -0,0 +1,132 @@
+#ifndef MAIN_INDEX_H_
+#define MAIN_INDEX_H_
+
+#include "sp_lazy_index.h"
+extern "C" {
+	#include "SPIndex.h"
+	#include "SPShardPool.h"
+}
+
+#define INDEX_ERROR_MSG "An error occurred - index file error - %s\n"
+#define SHARD_WORKER_ERROR_MSG "An error occurred - shard worker failure\n"
+#define INDEX_REUSE_MSG "Index - reusing %d shards of %d images\n"
+#define INDEX_RESUME_MSG "Index - resuming build after %d of %d shards\n"
+#define INDEX_LAZY_REPORT_MSG "Index - %d of %d shards were mapped\n"
+#define INDEX_UNSUPPORTED_MSG "An error occurred - %s is not supported by the on-disk index\n"
+
+
+/**
+ * Builds an on-disk index of the descriptors of a list of images
+ * (see preprocessing for the image naming convention)
+ *  - Images are processed in batches of shardSize images, each batch is
+ *    written to its own shard file and freed before the next batch is computed,
+ *    so memory usage is bounded by the size of a single batch
+ *  - The manifest is written last, so an index is only valid once complete
+ *  - A checkpoint ("indexPath.checkpoint") is written after each shard, so a
+ *    build which failed or was killed resumes on the next run from the first
+ *    shard not written, if it has the same parameters (a previous index at
+ *    indexPath is invalidated when the build starts)
+ *
+ * @param indexPath - the index path (shard i is written to "indexPath.i")
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param numOfImages - number of images in directory (assumed to be > 0)
+ * @param numOfBins - number of bins in histogram (assumed to be > 0 and < 256)
+ * @param nFeaturesToExtract - number of sift features to try to extract (assumed to be > 0)
+ * @param shardSize - number of images in each shard (assumed to be > 0)
+ * @param prefetchThreads - number of I/O threads reading image files ahead (see preprocessing)
+ * @param manifest - return parameter - the build parameters of the index, and
+ *                   the number of skipped images (including those of a resumed build)
+ * @param skipBadImages - if false, the build fails on an image which cannot be
+ *                        loaded, otherwise such images are skipped (see
+ *                        preprocessing) and flagged in their shards
+ * @return 0 if succeeds
+ * 	and -1 if fails:
+ *    - Any of the pointer arguments is NULL
+ *    - An error occurs during histogram or sift features calculation
+ *    - An error occurs while writing the index files
+ *    - Memory allocation failure
+ */
+int buildIndex(const char *indexPath, char *dir, char *prefix, char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int shardSize,
+		int prefetchThreads, SPIndexManifest *manifest, bool skipBadImages);
+
+/**
+ * Same as preprocessing, but the descriptors are computed through an on-disk
+ * index of checkpointSize images per shard (see buildIndex), which is then
+ * loaded into memory. A build which failed or was killed is resumed from its
+ * last checkpoint, and a complete index with the same parameters is loaded
+ * without recomputing any descriptor. Loaded descriptors are identical to
+ * the ones computed by preprocessing.
+ *
+ * @param checkpointPath - the index path
+ * @param checkpointSize - number of images in each shard (assumed to be > 0)
+ * @param skipped - see preprocessing (also loaded from a reused index)
+ * See preprocessing for the rest of the parameters
+ * @return 0 if succeeds, -1 if fails (the arrays are left in a state which
+ *         can be destroyed by destroySPPoint2D)
+ */
+int preprocessingCheckpointed(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		char *dir, char *prefix, char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int prefetchThreads,
+		const char *checkpointPath, int checkpointSize, char *skipped);
+
+/**
+ * Finds an existing index built with the given parameters (and the current
+ * sift maximum side and tiling and histogram sampling, see spSetSiftMaxSide,
+ * spSetSiftTiling and spSetHistSampling) from the same image files, so it can
+ * be searched without being rebuilt. Only the manifest is read. The image files
+ * are compared by their paths, sizes and modification times (recorded in the
+ * manifest when the index was built), so an index is rebuilt if an image was
+ * replaced, added or removed.
+ *
+ * @param indexPath - the index path
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param numOfImages - number of images
+ * @param numOfBins - number of bins in histogram
+ * @param nFeaturesToExtract - number of sift features to try to extract
+ * @param shardSize - number of images in each shard
+ * @param skipBadImages - if false, an index in which images were skipped does not match
+ * @param manifest - return parameter - the build parameters of the index
+ * @return 0 if a matching index is found, -1 otherwise
+ */
+int findIndex(const char *indexPath, const char *dir, const char *prefix, const char *suffix,
+		int numOfImages, int numOfBins, int nFeaturesToExtract, int shardSize,
+		bool skipBadImages, SPIndexManifest *manifest);
+
+/*
+ * Same as queryAndCheck, but searches an on-disk index instead of in-memory databases
+ * Shards are mapped one at a time, so memory usage is bounded by the size of a
+ * single shard and results are identical to searching the in-memory databases
+ * If a pool of shard workers is given, the search is scattered to the workers
+ * instead (with identical results)
+ * If a lazy index is given, shards are taken from it, so each shard is mapped
+ * once on its first access and stays mapped across queries
+ *
+ * @param indexPath - the index path
+ * @param manifest - the build parameters of the index
+ * @param pool - shard worker pool serving the index, or NULL to search in-process
+ * @param lazyIndex - shards mapped across queries, or NULL to map each shard
+ *                    for each search (ignored if pool is given)
+ * @param k - number of closest images to print
+ * @param cascadeCandidates - number of images kept for local search (cascade mode)
+ *                            cascade is disabled if <= 1 or >= number of images
+ * @param cache - query result cache, or NULL to disable caching
+ * @param latency - per stage latency histograms, or NULL to disable recording
+ *
+ * @return 1 if exit character is entered, 0 if succeeds
+ * 	and -1 if fails:
+ *    - Any of the pointer arguments is NULL
+ *    - An error occurs during histogram or sift features calculation
+ *    - An error occurs while reading the index files
+ *    - Memory allocation failure
+ */
+int queryAndCheckIndex(const char *indexPath, const SPIndexManifest *manifest,
+		SPShardPool *pool, SPLazyIndex *lazyIndex, int k, int cascadeCandidates, SPQueryCache *cache,
+		query_latency *latency);
+
+
+#endif /* MAIN_INDEX_H_ */
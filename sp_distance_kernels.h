@@ -0,0 +1,95 @@
+#ifndef SP_DISTANCE_KERNELS_H_
+#define SP_DISTANCE_KERNELS_H_
+
+/**
+ * SP Distance Kernels summary
+ * L2 squared distance kernels specialized at compile time for the dimensions
+ * used by the program (128 for sift features, common numbers of histogram bins),
+ * with a generic kernel for any other dimension.
+ *
+ * With a compile-time dimension the loop is fully unrolled, and the four
+ * independent partial sums let the compiler vectorize it without reassociating
+ * floating point additions itself. The summation order differs from
+ * spPointL2SquaredDistance, but the results are identical: descriptor
+ * coordinates are integers (pixel counts and quantized gradients), so every
+ * partial sum is an integer well below 2^53 and is exact in double.
+ *
+ * A kernel is a functor, kernel(p, q), selected once per scan by
+ * spL2Dispatch: the scan is compiled for each kernel type, so the kernel is
+ * inlined into the scan loop and no distance costs a call.
+ */
+
+/**
+ * L2 squared distance of two DIM dimensional coordinate arrays
+ */
+template <int DIM>
+inline double spL2SquaredFixed(const double *p, const double *q) {
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	for (int i=0; i+4<=DIM; i+=4) {
+		s0 += (p[i] - q[i])*(p[i] - q[i]);
+		s1 += (p[i+1] - q[i+1])*(p[i+1] - q[i+1]);
+		s2 += (p[i+2] - q[i+2])*(p[i+2] - q[i+2]);
+		s3 += (p[i+3] - q[i+3])*(p[i+3] - q[i+3]);
+	}
+	for (int i=DIM-DIM%4; i<DIM; i++)
+		s0 += (p[i] - q[i])*(p[i] - q[i]);
+	return (s0 + s1) + (s2 + s3);
+}
+
+/**
+ * L2 squared distance of two dim dimensional coordinate arrays
+ */
+inline double spL2SquaredGeneric(const double *p, const double *q, int dim) {
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	int i = 0;
+	for (; i+4<=dim; i+=4) {
+		s0 += (p[i] - q[i])*(p[i] - q[i]);
+		s1 += (p[i+1] - q[i+1])*(p[i+1] - q[i+1]);
+		s2 += (p[i+2] - q[i+2])*(p[i+2] - q[i+2]);
+		s3 += (p[i+3] - q[i+3])*(p[i+3] - q[i+3]);
+	}
+	for (; i<dim; i++)
+		s0 += (p[i] - q[i])*(p[i] - q[i]);
+	return (s0 + s1) + (s2 + s3);
+}
+
+/** Kernel of DIM dimensional coordinate arrays **/
+template <int DIM>
+struct SPL2Fixed {
+	double operator()(const double *p, const double *q) const {
+		return spL2SquaredFixed<DIM>(p, q);
+	}
+};
+
+/** Kernel of coordinate arrays of any dimension **/
+struct SPL2Generic {
+	int dim;
+	explicit SPL2Generic(int dim) : dim(dim) {}
+	double operator()(const double *p, const double *q) const {
+		return spL2SquaredGeneric(p, q, dim);
+	}
+};
+
+/**
+ * Runs a scan with the kernel for a dimension: calls scan(kernel) once, with
+ * a kernel specialized for dim if there is one, otherwise the generic kernel.
+ * The call operator of scan is a template on the kernel type, so its loop is
+ * instantiated (with the kernel inlined) for each kernel.
+ *
+ * @param dim - the dimension of the points
+ * @param scan - the scan, which keeps its arguments and results as members
+ */
+template <typename Scan>
+inline void spL2Dispatch(int dim, Scan &scan) {
+	switch (dim) {
+	case 8:   scan(SPL2Fixed<8>()); break;
+	case 16:  scan(SPL2Fixed<16>()); break;
+	case 32:  scan(SPL2Fixed<32>()); break;
+	case 64:  scan(SPL2Fixed<64>()); break;
+	case 128: scan(SPL2Fixed<128>()); break;
+	default:  scan(SPL2Generic(dim)); break;
+	}
+}
+
+
+#endif /* SP_DISTANCE_KERNELS_H_ */
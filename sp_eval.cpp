@@ -0,0 +1,459 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <new>
+#include <unistd.h>
+#include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
+#include "main_aux.h"
+#include "main_descriptors.h"
+extern "C" {
+	#include "SPBPriorityQueue.h"
+}
+
+/**
+ * Evaluation of the alternative local searches against the exact one.
+ *
+ * Reads the database parameters and then query image paths (until #) like ex3,
+ * and runs the local search of every query through the exact search
+ * (spBestSIFTL2SquaredDistance and votes, as in queryAndCheck), which is the
+ * ground truth, and through every configured alternative. For each one it
+ * reports the recall@K of the closest features of each query feature (as
+ * image indices, compared as multisets), the recall@K of the final image
+ * ranking, the p50/p99 latency of the local search of a query and the memory
+ * added by its data structures. The report is printed and written as JSON
+ * to EVAL_REPORT_PATH.
+ *
+ * Database and query descriptors are extracted with the resolution, tiling
+ * and sampling of ex3 (see main_descriptors.h).
+ */
+
+// number of closest features and images evaluated
+#define K 5
+// number of images kept for the local search by the cascade (0 - not evaluated)
+#define EVAL_CASCADE_CANDIDATES 0
+// number of pinned search threads on each NUMA node (0 - not evaluated)
+#define EVAL_NUMA_SEARCH_THREADS 0
+// dimension of PCA reduced features (0 - not evaluated) and candidates re-ranked
+#define EVAL_PCA_COMPONENTS 32
+#define EVAL_PCA_CANDIDATES 50
+// length of LSH codes (0 - not evaluated), hash tables and candidates re-ranked
+#define EVAL_LSH_BITS 128
+#define EVAL_LSH_TABLES 4
+#define EVAL_LSH_CANDIDATES 50
+// 1 - evaluate the half precision (fp16) sift features (0 - not evaluated)
+#define EVAL_HALF_PRECISION 1
+// branching factor (0 - not evaluated) and depth of the vocabulary tree
+#define EVAL_VOCAB_BRANCHING 8
+#define EVAL_VOCAB_DEPTH 4
+// file in which the machine readable report is written
+#define EVAL_REPORT_PATH "speval.json"
+
+#define EVAL_REPORT_MSG "%s - feature recall@%d %s, ranking recall@%d %.3f, latency p50 %.3f ms p99 %.3f ms, memory %.1f MB\n"
+#define EVAL_QUERIES_MSG "Evaluated %d queries against %d images, report written to %s\n"
+#define EVAL_NO_QUERIES_MSG "An error occurred - no queries to evaluate\n"
+#define EVAL_BACKEND_ERROR_MSG "An error occurred - the %s backend cannot be created\n"
+#define EVAL_SEARCH_ERROR_MSG "An error occurred - the %s backend failed on query %s\n"
+#define EVAL_REPORT_ERROR_MSG "An error occurred - the report cannot be written to %s\n"
+
+// a query image and the results of the exact local search
+struct eval_query {
+	std::string path;
+	SPPoint **qhist;
+	SPPoint **qsift;
+	int qnFeatures;
+	std::vector<int> neighbours;        // images of the k closest features of each feature
+	std::vector<int> numOfNeighbours;   // number of neighbours of each feature
+	std::vector<int> ranking;           // k closest images
+};
+
+// a local search and its accumulated measurements
+struct eval_backend {
+	const char *name;
+	local_search search;     // alternative local search (all NULL - exact)
+	int cascadeCandidates;   // cascade mode if > 1
+	long memoryBytes;        // memory added by the backend
+	std::vector<double> latencies;
+	long featureFound, featureTotal;
+	long rankFound, rankTotal;
+};
+
+//Inner function returning the resident memory of the process
+static long residentBytes() {
+	// 0 if unknown
+	long size = 0, resident = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL)
+		return 0;
+	if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(file);
+	return resident*sysconf(_SC_PAGESIZE);
+}
+
+//Inner function running the local search of a query by a backend
+static int evalLocalSearch(const eval_backend &backend, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, int numOfImages, int k, const eval_query &query, SPSearchScratch *scratch,
+		std::vector<int> &neighbours, std::vector<int> &numOfNeighbours, std::vector<int> &ranking) {
+	// fills the closest images of each query feature (unless the backend ranks images
+	// directly) and the k closest images, as queryAndCheck computes them
+	// if fails returns -1, otherwise 0
+	const local_search &search = backend.search;
+	int qn = query.qnFeatures;
+	std::vector<sortable_index> dists(numOfImages);
+	neighbours.assign((size_t) qn*k, -1);
+	numOfNeighbours.assign(qn, 0);
+
+	// cascade - restrict local search to closest images by global descriptors
+	SPPoint ***localDB = siftDB;
+	int *localNFeatures = nFeatures;
+	int localNumOfImages = numOfImages;
+	std::vector<char> selected;
+	std::vector<SPPoint**> candSift;
+	std::vector<int> candNFeatures;
+	if (backend.cascadeCandidates > 1 && backend.cascadeCandidates < numOfImages) {
+		for (int i=0; i<numOfImages; i++) {
+			dists[i].value = spRGBHistL2Distance(query.qhist, histDB[i]);
+			dists[i].index = i;
+		}
+		sortIndices(dists.data(), numOfImages, 1);
+		selected.assign(numOfImages, 0);
+		for (int i=0; i<backend.cascadeCandidates; i++) {
+			selected[dists[i].index] = 1;
+			candSift.push_back(siftDB[dists[i].index]);
+			candNFeatures.push_back(nFeatures[dists[i].index]);
+		}
+		localDB = candSift.data();
+		localNFeatures = candNFeatures.data();
+		localNumOfImages = backend.cascadeCandidates;
+	}
+	const char *mask = selected.empty() ? NULL : selected.data();
+
+	for (int i=0; i<numOfImages; i++) {
+		dists[i].value = 0;
+		dists[i].index = i;
+	}
+	if (search.vocabTree != NULL) {
+		std::vector<double> scores(numOfImages);
+		if (!spVocabTreeScore(search.vocabTree, query.qsift, qn, mask, scores.data(), scratch))
+			return -1;
+		for (int i=0; i<numOfImages; i++)
+			dists[i].value = scores[i];
+		numOfNeighbours.clear();
+	}
+	else if (search.numaStore != NULL) {
+		std::vector<SPBPQueue*> queues(qn, NULL);
+		bool ok = true;
+		for (int i=0; i<qn && ok; i++)
+			ok = (queues[i] = spBPQueueCreate(k)) != NULL;
+		ok = ok && spNumaStoreSearch(search.numaStore, query.qsift, qn,
+				queues.empty() ? NULL : queues.data(), mask, scratch);
+		BPQueueElement elem;
+		for (int i=0; i<qn; i++) {
+			while (ok && spBPQueuePeek(queues[i], &elem) == SP_BPQUEUE_SUCCESS) {
+				neighbours[(size_t) i*k + numOfNeighbours[i]++] = elem.index;
+				spBPQueueDequeue(queues[i]);
+			}
+			spBPQueueDestroy(queues[i]);
+		}
+		if (!ok)
+			return -1;
+	}
+	else {
+		for (int i=0; i<qn; i++) {
+			int *hits = neighbours.data() + (size_t) i*k;
+			if (search.pca != NULL)
+				numOfNeighbours[i] = spSiftPCASearch(search.pca, query.qsift[i], k, mask, hits,
+						scratch);
+			else if (search.lsh != NULL)
+				numOfNeighbours[i] = spSiftLSHSearch(search.lsh, query.qsift[i], k, mask, hits,
+						scratch);
+			else if (search.half != NULL)
+				numOfNeighbours[i] = spHalfStoreSearch(search.half, query.qsift[i], k, mask, hits,
+						scratch);
+			else
+				numOfNeighbours[i] = spBestSIFTL2SquaredDistanceInto(k, query.qsift[i], localDB,
+						localNumOfImages, localNFeatures, hits);
+			if (numOfNeighbours[i] == -1)
+				return -1;
+		}
+	}
+
+	// sum hits and rank (by descending votes, or ascending vocabulary tree distance)
+	for (size_t i=0; i<numOfNeighbours.size(); i++)
+		for (int j=0; j<numOfNeighbours[i]; j++)
+			dists[neighbours[i*k + j]].value ++;
+	sortIndices(dists.data(), numOfImages, search.vocabTree != NULL ? 1 : -1);
+	ranking.clear();
+	for (int i=0; i<k && i<numOfImages; i++)
+		ranking.push_back(dists[i].index);
+	return 0;
+}
+
+//Inner function counting the common elements of two multisets
+static long commonCount(const int *a, int na, const int *b, int nb) {
+	std::vector<int> x(a, a + na), y(b, b + nb);
+	std::sort(x.begin(), x.end());
+	std::sort(y.begin(), y.end());
+	std::vector<int> common;
+	std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(common));
+	return (long) common.size();
+}
+
+//Inner function returning a percentile of the latencies (nearest rank)
+static double percentile(std::vector<double> latencies, double p) {
+	if (latencies.empty())
+		return 0;
+	std::sort(latencies.begin(), latencies.end());
+	size_t rank = (size_t) ceil(p*latencies.size());
+	return latencies[rank > 0 ? rank-1 : 0];
+}
+
+//Inner function evaluating a backend on all queries
+static int evalBackend(eval_backend &backend, SPPoint ***histDB, SPPoint ***siftDB,
+		int *nFeatures, int numOfImages, int k, std::vector<eval_query> &queries, bool exact) {
+	// the exact backend stores its results in the queries as the ground truth
+	// if fails prints the error and returns -1, otherwise 0
+	std::vector<int> neighbours, numOfNeighbours, ranking;
+	SPSearchScratch scratch;
+	for (size_t q=0; q<queries.size(); q++) {
+		eval_query &query = queries[q];
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (evalLocalSearch(backend, histDB, siftDB, nFeatures, numOfImages, k, query, &scratch,
+				neighbours, numOfNeighbours, ranking) == -1) {
+			printf(EVAL_SEARCH_ERROR_MSG, backend.name, query.path.c_str());
+			return -1;
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		backend.latencies.push_back(elapsed.count());
+
+		if (exact) {
+			query.neighbours = neighbours;
+			query.numOfNeighbours = numOfNeighbours;
+			query.ranking = ranking;
+		}
+		for (size_t i=0; i<numOfNeighbours.size(); i++) {
+			backend.featureFound += commonCount(neighbours.data() + i*k, numOfNeighbours[i],
+					query.neighbours.data() + i*k, query.numOfNeighbours[i]);
+			backend.featureTotal += query.numOfNeighbours[i];
+		}
+		backend.rankFound += commonCount(ranking.data(), (int) ranking.size(),
+				query.ranking.data(), (int) query.ranking.size());
+		backend.rankTotal += query.ranking.size();
+	}
+	return 0;
+}
+
+//Inner function printing and writing the report
+static int writeReport(const std::vector<eval_backend> &backends, int k,
+		int numOfImages, int numOfQueries) {
+	// the report is printed even if it cannot be written
+	// if fails prints the error and returns -1, otherwise 0
+	FILE *file = fopen(EVAL_REPORT_PATH, "w");
+	if (file != NULL)
+		fprintf(file, "{\"k\": %d, \"images\": %d, \"queries\": %d, \"backends\": [", k,
+				numOfImages, numOfQueries);
+	for (size_t b=0; b<backends.size(); b++) {
+		const eval_backend &backend = backends[b];
+		double rankRecall = backend.rankTotal > 0 ? (double) backend.rankFound/backend.rankTotal : 1;
+		double p50 = percentile(backend.latencies, 0.5)*1e3;
+		double p99 = percentile(backend.latencies, 0.99)*1e3;
+		char featureRecall[32] = "null";  // no per-feature results (vocabulary tree)
+		if (backend.featureTotal > 0)
+			sprintf(featureRecall, "%.4f", (double) backend.featureFound/backend.featureTotal);
+		printf(EVAL_REPORT_MSG, backend.name, k, featureRecall, k, rankRecall, p50, p99,
+				backend.memoryBytes/1e6);
+		if (file != NULL)
+			fprintf(file, "%s\n  {\"name\": \"%s\", \"feature_recall\": %s, \"ranking_recall\": %.4f, "
+					"\"latency_ms\": {\"p50\": %.4f, \"p99\": %.4f}, \"memory_bytes\": %ld}",
+					b > 0 ? "," : "", backend.name, featureRecall, rankRecall, p50, p99,
+					backend.memoryBytes);
+	}
+	bool written = file != NULL;
+	if (file != NULL) {
+		fprintf(file, "\n]}\n");
+		written = !ferror(file);
+		written = fclose(file) == 0 && written;
+	}
+	if (!written) {
+		printf(EVAL_REPORT_ERROR_MSG, EVAL_REPORT_PATH);
+		return -1;
+	}
+	printf(EVAL_QUERIES_MSG, numOfQueries, numOfImages, EVAL_REPORT_PATH);
+	return 0;
+}
+
+int main () {
+	int ret;
+
+	// get parameters from user
+	int numOfImages, numOfBins, nFeaturesToExtract;
+	char *dir = (char*) malloc(1024*sizeof(char));
+	char *prefix = (char*) malloc(1024*sizeof(char));
+	char *suffix = (char*) malloc(1024*sizeof(char));
+	ret = getUserParams(dir, prefix, suffix, &numOfImages, &numOfBins, &nFeaturesToExtract);
+	if (ret == -1) {
+		if (dir == NULL || prefix == NULL || suffix == NULL)
+			printf("%s",MEMORY_ERROR);
+		free(dir);
+		free(prefix);
+		free(suffix);
+		return -1;
+	}
+
+	// extract descriptors of database and query images as ex3 does
+	spSetSiftMaxSide(SIFT_MAX_SIDE);
+	spSetSiftTiling(SIFT_TILE_THREADS, SIFT_TILE_OVERLAP);
+	spSetHistSampling(HIST_SAMPLE_STRIDE, HIST_SAMPLE_JITTER, HIST_DECODE_REDUCTION);
+
+	// create databases (the memory of the exact search)
+	long resident = residentBytes();
+	SPPoint ***histDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
+	SPPoint ***siftDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
+	int *nFeatures = (int*) malloc(numOfImages*sizeof(int));
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL)
+		ret = -1;
+	else
+		ret = preprocessing(histDB, siftDB, nFeatures, dir, prefix, suffix,
+				numOfImages, numOfBins, nFeaturesToExtract, 0, NULL);
+	free(dir);
+	free(prefix);
+	free(suffix);
+	if (ret == -1) {
+		if (histDB == NULL || siftDB == NULL || nFeatures == NULL)
+			printf("%s",MEMORY_ERROR);
+		destroySPPoint2D(histDB,numOfImages,NULL);
+		destroySPPoint2D(siftDB,numOfImages,nFeatures);
+		return -1;
+	}
+	long databaseBytes = residentBytes() - resident;
+
+	std::vector<eval_backend> backends;
+	std::vector<eval_query> queries;
+	try {
+		// read and extract the queries (an image which cannot be loaded is reported
+		// by the extraction)
+		char query[1024];
+		while (ret == 0 && getUserStr(query, ENTER_QUERY_MSG) == 0 &&
+				strncmp(query, EXIT_CHAR, 1024) != 0) {
+			eval_query q;
+			q.path = query;
+			q.qhist = spGetRGBHist(query, numOfImages+1, numOfBins);
+			q.qsift = q.qhist != NULL ?
+					spGetSiftDescriptors(query, numOfImages+1, nFeaturesToExtract, &q.qnFeatures) : NULL;
+			if (q.qsift == NULL) {
+				destroySPPoint1D(q.qhist, 3);
+				ret = -1;
+			}
+			else
+				queries.push_back(q);
+		}
+		if (ret == 0 && queries.empty()) {
+			printf("%s",EVAL_NO_QUERIES_MSG);
+			ret = -1;
+		}
+
+		// create the backends (the exact search first, it is the ground truth)
+		eval_backend exact = { "exact", { NULL, NULL, NULL, NULL, NULL }, 0, databaseBytes,
+				std::vector<double>(), 0, 0, 0, 0 };
+		backends.push_back(exact);
+		if (ret == 0 && EVAL_CASCADE_CANDIDATES > 0) {
+			eval_backend backend = exact;
+			backend.name = "cascade";
+			backend.cascadeCandidates = EVAL_CASCADE_CANDIDATES;
+			backend.memoryBytes = 0;
+			backends.push_back(backend);
+		}
+		if (ret == 0 && EVAL_NUMA_SEARCH_THREADS > 0) {
+			eval_backend backend = exact;
+			backend.name = "numa";
+			resident = residentBytes();
+			backend.search.numaStore = spNumaStoreCreate(siftDB, nFeatures, numOfImages,
+					0, EVAL_NUMA_SEARCH_THREADS);
+			backend.memoryBytes = residentBytes() - resident;
+			backends.push_back(backend);
+			ret = backend.search.numaStore == NULL ? -1 : 0;
+			if (ret == -1)
+				printf(EVAL_BACKEND_ERROR_MSG, backend.name);
+		}
+		if (ret == 0 && EVAL_PCA_COMPONENTS > 0) {
+			eval_backend backend = exact;
+			backend.name = "pca";
+			resident = residentBytes();
+			backend.search.pca = spSiftPCACreate(siftDB, nFeatures, numOfImages,
+					EVAL_PCA_COMPONENTS, EVAL_PCA_CANDIDATES, NULL);
+			backend.memoryBytes = residentBytes() - resident;
+			backends.push_back(backend);
+			ret = backend.search.pca == NULL ? -1 : 0;
+			if (ret == -1)
+				printf(EVAL_BACKEND_ERROR_MSG, backend.name);
+		}
+		if (ret == 0 && EVAL_LSH_BITS > 0) {
+			eval_backend backend = exact;
+			backend.name = "lsh";
+			resident = residentBytes();
+			backend.search.lsh = spSiftLSHCreate(siftDB, nFeatures, numOfImages,
+					EVAL_LSH_BITS, EVAL_LSH_TABLES, EVAL_LSH_CANDIDATES);
+			backend.memoryBytes = residentBytes() - resident;
+			backends.push_back(backend);
+			ret = backend.search.lsh == NULL ? -1 : 0;
+			if (ret == -1)
+				printf(EVAL_BACKEND_ERROR_MSG, backend.name);
+		}
+		if (ret == 0 && EVAL_HALF_PRECISION > 0) {
+			eval_backend backend = exact;
+			backend.name = "half";
+			resident = residentBytes();
+			backend.search.half = spHalfStoreCreate(NULL, siftDB, nFeatures, numOfImages);
+			backend.memoryBytes = residentBytes() - resident;
+			backends.push_back(backend);
+			ret = backend.search.half == NULL ? -1 : 0;
+			if (ret == -1)
+				printf(EVAL_BACKEND_ERROR_MSG, backend.name);
+		}
+		if (ret == 0 && EVAL_VOCAB_BRANCHING > 0) {
+			eval_backend backend = exact;
+			backend.name = "vocab";
+			resident = residentBytes();
+			backend.search.vocabTree = spVocabTreeCreate(siftDB, nFeatures, numOfImages,
+					EVAL_VOCAB_BRANCHING, EVAL_VOCAB_DEPTH);
+			backend.memoryBytes = residentBytes() - resident;
+			backends.push_back(backend);
+			ret = backend.search.vocabTree == NULL ? -1 : 0;
+			if (ret == -1)
+				printf(EVAL_BACKEND_ERROR_MSG, backend.name);
+		}
+
+		// evaluate and report
+		for (size_t b=0; b<backends.size() && ret == 0; b++)
+			ret = evalBackend(backends[b], histDB, siftDB, nFeatures, numOfImages, K, queries, b == 0);
+		if (ret == 0)
+			ret = writeReport(backends, K, numOfImages, (int) queries.size());
+	}
+	catch (std::bad_alloc &) {
+		printf("%s",MEMORY_ERROR);
+		ret = -1;
+	}
+
+	// cleanup
+	for (size_t b=0; b<backends.size(); b++) {
+		spVocabTreeDestroy(backends[b].search.vocabTree);
+		spSiftLSHDestroy(backends[b].search.lsh);
+		spSiftPCADestroy(backends[b].search.pca);
+		spHalfStoreDestroy(backends[b].search.half);
+		spNumaStoreDestroy(backends[b].search.numaStore);
+	}
+	for (size_t q=0; q<queries.size(); q++) {
+		destroySPPoint1D(queries[q].qhist, 3);
+		destroySPPoint1D(queries[q].qsift, queries[q].qnFeatures);
+	}
+	destroySPPoint2D(histDB,numOfImages,NULL);
+	destroySPPoint2D(siftDB,numOfImages,nFeatures);
+	return ret;
+}
@@ -0,0 +1,373 @@
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <immintrin.h>
+#include "sp_half_store.h"
+#include "sp_image_proc_util.h"
+
+// squared distance of float query coordinates to fp16 coordinates, accumulated in float
+typedef float (*half_kernel)(const float *query, const uint16_t *coordinates, int dim);
+
+struct sp_half_store_t {
+	int dim;
+	int numOfImages;
+	std::vector<uint16_t> features;   // numOfFeatures x dim (fp16)
+	std::vector<long> start;          // first feature of each image, and the number of features
+	long numOfInexact;
+	int numOfBins;                    // 0 if the histograms are not stored
+	std::vector<uint16_t> hist;       // numOfImages x 3 x numOfBins (bfloat16)
+	half_kernel kernel;
+};
+
+static uint16_t floatToHalf(float value) {
+	// rounds to the nearest fp16 (ties to even), overflows to infinity
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000);
+	int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (((bits >> 23) & 0xff) == 0xff) // infinity or NaN
+		return (uint16_t) (sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+	if (exponent >= 31)
+		return (uint16_t) (sign | 0x7c00);
+	if (exponent <= 0) { // subnormal (or zero) in fp16
+		if (exponent < -10)
+			return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+			half++;
+		return (uint16_t) (sign | half);
+	}
+	uint32_t half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+		half++; // may carry into the exponent (up to infinity)
+	return (uint16_t) (sign | half);
+}
+
+static float halfToFloat(uint16_t half) {
+	// converts an fp16 to float (exactly)
+	uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+	if (exponent == 0x1f)
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent != 0)
+		bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	else if (mantissa == 0)
+		bits = sign;
+	else { // subnormal in fp16, normal in float
+		exponent = 127 - 14;
+		while ((mantissa & 0x400) == 0) {
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static uint16_t floatToBfloat16(float value) {
+	// rounds to the nearest bfloat16 (ties to even)
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	if ((bits & 0x7fffffff) > 0x7f800000) // NaN
+		return (uint16_t) ((bits >> 16) | 0x40);
+	bits += 0x7fff + ((bits >> 16) & 1);
+	return (uint16_t) (bits >> 16);
+}
+
+static inline float bfloat16ToFloat(uint16_t value) {
+	// a bfloat16 is the upper half of a float
+	uint32_t bits = (uint32_t) value << 16;
+	float res;
+	memcpy(&res, &bits, sizeof(res));
+	return res;
+}
+
+__attribute__((target("avx512f")))
+static float halfL2Avx512(const float *query, const uint16_t *coordinates, int dim) {
+	// converts 16 coordinates at a time with vcvtph2ps
+	__m512 sum = _mm512_setzero_ps();
+	int i = 0;
+	for (; i+16<=dim; i+=16) {
+		__m512 x = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*) (coordinates + i)));
+		__m512 d = _mm512_sub_ps(_mm512_loadu_ps(query + i), x);
+		sum = _mm512_add_ps(sum, _mm512_mul_ps(d, d));
+	}
+	float res = _mm512_reduce_add_ps(sum);
+	for (; i<dim; i++) {
+		float d = query[i] - halfToFloat(coordinates[i]);
+		res += d*d;
+	}
+	return res;
+}
+
+__attribute__((target("avx,f16c")))
+static float halfL2F16C(const float *query, const uint16_t *coordinates, int dim) {
+	// converts 8 coordinates at a time with vcvtph2ps
+	__m256 sum = _mm256_setzero_ps();
+	int i = 0;
+	for (; i+8<=dim; i+=8) {
+		__m256 x = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (coordinates + i)));
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(query + i), x);
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, sum);
+	float res = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+			((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+	for (; i<dim; i++) {
+		float d = query[i] - halfToFloat(coordinates[i]);
+		res += d*d;
+	}
+	return res;
+}
+
+static float halfL2Generic(const float *query, const uint16_t *coordinates, int dim) {
+	// converts one coordinate at a time on CPUs without F16C
+	float res = 0;
+	for (int i=0; i<dim; i++) {
+		float d = query[i] - halfToFloat(coordinates[i]);
+		res += d*d;
+	}
+	return res;
+}
+
+static void histDistances(SPHalfStore *store, const float *query, double *dists) {
+	// distances of query (3 x numOfBins floats) to the bfloat16 histograms of all images
+	int bins = store->numOfBins;
+	for (int i=0; i<store->numOfImages; i++) {
+		const uint16_t *hist = store->hist.data() + (size_t) i*3*bins;
+		double dist = 0;
+		for (int c=0; c<3; c++) {
+			float channel = 0;
+			for (int b=0; b<bins; b++) {
+				float d = query[c*bins + b] - bfloat16ToFloat(hist[c*bins + b]);
+				channel += d*d;
+			}
+			dist += 0.33*channel;
+		}
+		dists[i] = dist;
+	}
+}
+
+SPHalfStore* spHalfStoreCreate(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		int numOfImages) {
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0)
+		return NULL;
+
+	SPHalfStore *res = new (std::nothrow) SPHalfStore;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->dim = 0;
+		res->numOfImages = numOfImages;
+		res->numOfInexact = 0;
+		res->numOfBins = 0;
+		res->start.resize(numOfImages + 1);
+		res->start[0] = 0;
+		for (int i=0; i<numOfImages; i++) {
+			res->start[i+1] = res->start[i] + nFeatures[i];
+			if (res->dim == 0 && nFeatures[i] > 0)
+				res->dim = spPointGetDimension(siftDB[i][0]);
+		}
+		if (res->dim == 0) {
+			delete res;
+			return NULL;
+		}
+
+		// sift features, counting those fp16 does not represent exactly
+		res->features.resize((size_t) res->start[numOfImages]*res->dim);
+		for (int i=0; i<numOfImages; i++)
+			for (int j=0; j<nFeatures[i]; j++) {
+				const double *data = spPointGetData(siftDB[i][j]);
+				uint16_t *feature = res->features.data() + (size_t) (res->start[i] + j)*res->dim;
+				if (spPointGetDimension(siftDB[i][j]) != res->dim) {
+					delete res;
+					return NULL;
+				}
+				bool exact = true;
+				for (int d=0; d<res->dim; d++) {
+					feature[d] = floatToHalf((float) data[d]);
+					exact = exact && (double) halfToFloat(feature[d]) == data[d];
+				}
+				if (!exact)
+					res->numOfInexact++;
+			}
+
+		// histograms
+		if (histDB != NULL) {
+			res->numOfBins = spPointGetDimension(histDB[0][0]);
+			res->hist.resize((size_t) numOfImages*3*res->numOfBins);
+			for (int i=0; i<numOfImages; i++)
+				for (int c=0; c<3; c++) {
+					const double *data = spPointGetData(histDB[i][c]);
+					uint16_t *hist = res->hist.data() + ((size_t) i*3 + c)*res->numOfBins;
+					for (int b=0; b<res->numOfBins; b++)
+						hist[b] = floatToBfloat16((float) data[b]);
+				}
+		}
+
+		if (__builtin_cpu_supports("avx512f"))
+			res->kernel = halfL2Avx512;
+		else if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+			res->kernel = halfL2F16C;
+		else
+			res->kernel = halfL2Generic;
+	}
+	catch (std::bad_alloc &) {
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spHalfStoreDestroy(SPHalfStore *store) {
+	delete store;
+}
+
+long spHalfStoreMemoryBytes(SPHalfStore *store) {
+	if (store == NULL)
+		return 0;
+	return sizeof(*store) + (store->features.capacity() + store->hist.capacity())*sizeof(uint16_t) +
+			store->start.capacity()*sizeof(long);
+}
+
+long spHalfStoreNumOfFeatures(SPHalfStore *store) {
+	if (store == NULL)
+		return 0;
+	return store->start[store->numOfImages];
+}
+
+long spHalfStoreNumOfInexact(SPHalfStore *store) {
+	if (store == NULL)
+		return 0;
+	return store->numOfInexact;
+}
+
+bool spHalfStoreHasHist(SPHalfStore *store) {
+	return store != NULL && store->numOfBins > 0;
+}
+
+int spHalfStoreSearch(SPHalfStore *store, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch) {
+	if (store == NULL || queryFeature == NULL || closest == NULL || scratch == NULL || k <= 0 ||
+			spPointGetDimension(queryFeature) != store->dim)
+		return -1;
+
+	std::vector<std::pair<double,int> > &heap = scratch->heap;  // max heap of (distance, image)
+	try {
+		scratch->reduced.resize(store->dim);
+		heap.reserve(k);
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+	float *query = scratch->reduced.data();
+	const double *data = spPointGetData(queryFeature);
+	for (int d=0; d<store->dim; d++)
+		query[d] = (float) data[d];
+
+	// keep the k smallest (distance, image) pairs, as SPBPQueue does
+	heap.clear();
+	for (int i=0; i<store->numOfImages; i++) {
+		if (selected != NULL && !selected[i])
+			continue;
+		for (long f=store->start[i]; f<store->start[i+1]; f++) {
+			std::pair<double,int> match(store->kernel(query,
+					store->features.data() + (size_t) f*store->dim, store->dim), i);
+			if ((int) heap.size() < k) {
+				heap.push_back(match);
+				std::push_heap(heap.begin(), heap.end());
+			}
+			else if (match < heap.front()) {
+				std::pop_heap(heap.begin(), heap.end());
+				heap.back() = match;
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+	}
+	std::sort_heap(heap.begin(), heap.end());
+	for (size_t j=0; j<heap.size(); j++)
+		closest[j] = heap[j].second;
+	return (int) heap.size();
+}
+
+bool spHalfStoreHistDistances(SPHalfStore *store, SPPoint **queryHist, double *dists,
+		SPSearchScratch *scratch) {
+	if (store == NULL || queryHist == NULL || dists == NULL || scratch == NULL ||
+			store->numOfBins == 0)
+		return false;
+	for (int c=0; c<3; c++)
+		if (queryHist[c] == NULL || spPointGetDimension(queryHist[c]) != store->numOfBins)
+			return false;
+
+	// the query is converted to float, not rounded to bfloat16
+	try {
+		scratch->reduced.resize(3*store->numOfBins);
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	float *query = scratch->reduced.data();
+	for (int c=0; c<3; c++) {
+		const double *data = spPointGetData(queryHist[c]);
+		for (int b=0; b<store->numOfBins; b++)
+			query[c*store->numOfBins + b] = (float) data[b];
+	}
+	histDistances(store, query, dists);
+	return true;
+}
+
+double spHalfStoreHistAgreement(SPHalfStore *store, SPPoint ***histDB, int k, int numOfSamples) {
+	if (store == NULL || histDB == NULL || store->numOfBins == 0 || k <= 0 || numOfSamples <= 0)
+		return -1;
+
+	int n = store->numOfImages;
+	int samples = std::min(numOfSamples, n);
+	int top = std::min(k, n);
+	long found = 0, total = 0;
+	try {
+		SPSearchScratch scratch;
+		std::vector<double> dists(n);
+		std::vector<std::pair<double,int> > exact(n), approx(n);
+		std::vector<int> exactTop(top), approxTop(top), common;
+		for (int s=0; s<samples; s++) {
+			int image = (int) ((long) s*n/samples);
+			if (!spHalfStoreHistDistances(store, histDB[image], dists.data(), &scratch))
+				return -1;
+			for (int i=0; i<n; i++) {
+				exact[i] = std::make_pair(spRGBHistL2Distance(histDB[image], histDB[i]), i);
+				approx[i] = std::make_pair(dists[i], i);
+			}
+			std::partial_sort(exact.begin(), exact.begin() + top, exact.end());
+			std::partial_sort(approx.begin(), approx.begin() + top, approx.end());
+			for (int j=0; j<top; j++) {
+				exactTop[j] = exact[j].second;
+				approxTop[j] = approx[j].second;
+			}
+			std::sort(exactTop.begin(), exactTop.end());
+			std::sort(approxTop.begin(), approxTop.end());
+			common.clear();
+			std::set_intersection(exactTop.begin(), exactTop.end(), approxTop.begin(), approxTop.end(),
+					std::back_inserter(common));
+			found += (long) common.size();
+			total += top;
+		}
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+	return (double) found/total;
+}
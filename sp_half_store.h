@@ -0,0 +1,156 @@
+#ifndef SP_HALF_STORE_H_
+#define SP_HALF_STORE_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Half Store summary
+ * A copy of the sift features database in half precision (IEEE fp16), and
+ * optionally of the histograms database in bfloat16, a quarter of the size of
+ * the double coordinates of SPPoint.
+ *
+ * Sift coordinates are integers below 2048 (quantized gradients), which fp16
+ * represents exactly, and the squared distance of two features is an integer
+ * below 2^24, which float accumulation computes exactly - so a search of the
+ * fp16 features gives the same result as spBestSIFTL2SquaredDistance. Features
+ * which fp16 does not represent exactly are counted (see spHalfStoreNumOfInexact).
+ *
+ * The store does not refer to the double databases once created, so the
+ * double sift features may be freed if nothing else reads them (ex3 does so
+ * when the store answers the local search).
+ *
+ * Histogram counts may exceed the fp16 range, so histograms are kept in
+ * bfloat16 (the upper half of a float: 8 bit exponent, 8 significant bits).
+ * Their distances are approximate (see spHalfStoreHistAgreement).
+ *
+ * Coordinates are converted to float inside the distance kernels, 16 at a time
+ * by AVX-512, 8 at a time by F16C, or one at a time on CPUs without either
+ * (the kernel is selected once, when the store is created).
+ *
+ * The following functions are supported:
+ *
+ * spHalfStoreCreate           - Converts the databases to half precision
+ * spHalfStoreDestroy          - Frees all resources
+ * spHalfStoreMemoryBytes      - A getter of the memory used by the store
+ * spHalfStoreNumOfFeatures    - A getter of the number of sift features
+ * spHalfStoreNumOfInexact     - A getter of the number of features changed by the conversion
+ * spHalfStoreHasHist          - Checks whether the store holds the histograms
+ * spHalfStoreSearch           - Finds the images of the closest features to a query feature
+ * spHalfStoreHistDistances    - Computes the histogram distances of a query to all images
+ * spHalfStoreHistAgreement    - Estimates the agreement of histogram rankings with the doubles
+ */
+
+/** Type for defining the store **/
+typedef struct sp_half_store_t SPHalfStore;
+
+/**
+ * Converts the sift features database to fp16, and the histograms database
+ * (if given) to bfloat16
+ *
+ * @param histDB - histograms database (3 histograms of each image), or NULL
+ *                 to store the sift features only
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @return NULL in case siftDB or nFeatures is NULL, numOfImages <= 0, the
+ *         database has no features or allocation failure occurred,
+ *         otherwise the new store
+ */
+SPHalfStore* spHalfStoreCreate(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		int numOfImages);
+
+/**
+ * Frees all resources associated with the store.
+ * If store is NULL nothing happens.
+ */
+void spHalfStoreDestroy(SPHalfStore *store);
+
+/**
+ * A getter for the memory used by the half precision copies (the double
+ * databases are owned by histDB and siftDB)
+ *
+ * @param store - the source store
+ * @return the number of bytes, 0 if store is NULL
+ */
+long spHalfStoreMemoryBytes(SPHalfStore *store);
+
+/**
+ * A getter for the number of sift features
+ *
+ * @param store - the source store
+ * @return the number of features, 0 if store is NULL
+ */
+long spHalfStoreNumOfFeatures(SPHalfStore *store);
+
+/**
+ * A getter for the number of sift features with a coordinate fp16 does not
+ * represent exactly (searches are exact if there are none)
+ *
+ * @param store - the source store
+ * @return the number of inexact features, 0 if store is NULL
+ */
+long spHalfStoreNumOfInexact(SPHalfStore *store);
+
+/**
+ * Checks whether the store holds the histograms
+ *
+ * @param store - the source store
+ * @return true if the store was created with histograms, false otherwise
+ */
+bool spHalfStoreHasHist(SPHalfStore *store);
+
+/**
+ * Finds the images of the k closest features to a query feature (same
+ * result as spBestSIFTL2SquaredDistanceInto if there are no inexact features
+ * and the query coordinates are integers below 2048)
+ *
+ * @param store - the source store
+ * @param queryFeature - the query feature
+ * @param k - number of closest features
+ * @param selected - if not NULL, only features of images i with selected[i]
+ *                   non zero are searched
+ * @param closest - an array of size k in which the image indices of the
+ *                  closest features are stored (closest first)
+ * @param scratch - the scratch space of the search (see sp_search_scratch)
+ * @return -1 if any of the pointers is NULL, k <= 0, the query dimension
+ *         does not match the database or allocation failure occurred,
+ *         otherwise the number of indices stored
+ */
+int spHalfStoreSearch(SPHalfStore *store, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch);
+
+/**
+ * Computes the distance of a query histogram to the bfloat16 histograms of
+ * all images, weighted as spRGBHistL2Distance
+ *
+ * @param store - the source store
+ * @param queryHist - the 3 histograms of the query
+ * @param dists - an array of size numOfImages in which the distances are stored
+ * @param scratch - the scratch space of the search (see sp_search_scratch)
+ * @return false if any of the pointers is NULL, the store holds no histograms,
+ *         the query number of bins does not match or allocation failure
+ *         occurred, true otherwise
+ */
+bool spHalfStoreHistDistances(SPHalfStore *store, SPPoint **queryHist, double *dists,
+		SPSearchScratch *scratch);
+
+/**
+ * Estimates the agreement of histogram rankings with the double histograms:
+ * database images (evenly spaced) are used as queries, and the fraction of
+ * the k closest images by spHalfStoreHistDistances which are also among the
+ * k closest by spRGBHistL2Distance is returned.
+ *
+ * @param store - the source store
+ * @param histDB - the histograms database the store was created from
+ * @param k - number of closest images
+ * @param numOfSamples - number of database images used as queries
+ * @return the agreement (between 0 and 1), -1 if store or histDB is NULL,
+ *         the store holds no histograms, k <= 0, numOfSamples <= 0 or
+ *         allocation failure occurred
+ */
+double spHalfStoreHistAgreement(SPHalfStore *store, SPPoint ***histDB, int k, int numOfSamples);
+
+#endif /* SP_HALF_STORE_H_ */
@@ -0,0 +1,147 @@
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "sp_hist_pyramid.h"
+#include "sp_image_proc_util.h"
+
+// relative slack of the pruning test, covering the rounding of the lower bound
+#define SP_HIST_PYRAMID_SLACK 1e-9
+
+struct sp_hist_pyramid_t {
+	int numOfBins;
+	int numOfCoarseBins;
+	int numOfImages;
+	std::vector<int> group;        // coarse bin of each fine bin
+	std::vector<double> weight;    // 1 / group size of each coarse bin
+	std::vector<double> coarse;    // numOfImages x 3 x numOfCoarseBins
+};
+
+static void coarseHist(const SPHistPyramid *pyramid, SPPoint **hist, double *coarse) {
+	// sums the fine bins of each channel into its coarse bins
+	std::fill(coarse, coarse + 3*pyramid->numOfCoarseBins, 0.0);
+	for (int c=0; c<3; c++) {
+		const double *data = spPointGetData(hist[c]);
+		for (int b=0; b<pyramid->numOfBins; b++)
+			coarse[c*pyramid->numOfCoarseBins + pyramid->group[b]] += data[b];
+	}
+}
+
+static double lowerBound(const SPHistPyramid *pyramid, const double *p, const double *q) {
+	// lower bound on spRGBHistL2Distance of the histograms of coarse bins p and q
+	double bound = 0;
+	for (int c=0; c<3; c++) {
+		double channel = 0;
+		for (int g=0; g<pyramid->numOfCoarseBins; g++) {
+			double d = p[c*pyramid->numOfCoarseBins + g] - q[c*pyramid->numOfCoarseBins + g];
+			channel += d*d*pyramid->weight[g];
+		}
+		bound += 0.33*channel;
+	}
+	return bound;
+}
+
+SPHistPyramid* spHistPyramidCreate(SPPoint ***histDB, int numOfImages, int numOfCoarseBins) {
+	if (histDB == NULL || numOfImages <= 0 || histDB[0] == NULL)
+		return NULL;
+	int numOfBins = spPointGetDimension(histDB[0][0]);
+	if (numOfCoarseBins <= 0 || numOfCoarseBins >= numOfBins)
+		return NULL;
+
+	SPHistPyramid *res = new (std::nothrow) SPHistPyramid;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->numOfBins = numOfBins;
+		res->numOfCoarseBins = numOfCoarseBins;
+		res->numOfImages = numOfImages;
+
+		// consecutive groups of fine bins, sizes differ by at most one
+		res->group.resize(numOfBins);
+		std::vector<int> sizes(numOfCoarseBins, 0);
+		for (int b=0; b<numOfBins; b++) {
+			res->group[b] = (int) ((long) b*numOfCoarseBins/numOfBins);
+			sizes[res->group[b]]++;
+		}
+		res->weight.resize(numOfCoarseBins);
+		for (int g=0; g<numOfCoarseBins; g++)
+			res->weight[g] = 1.0/sizes[g];
+
+		res->coarse.resize((size_t) numOfImages*3*numOfCoarseBins);
+		for (int i=0; i<numOfImages; i++) {
+			for (int c=0; c<3; c++)
+				if (spPointGetDimension(histDB[i][c]) != numOfBins) {
+					delete res;
+					return NULL;
+				}
+			coarseHist(res, histDB[i], res->coarse.data() + (size_t) i*3*numOfCoarseBins);
+		}
+	}
+	catch (std::bad_alloc &) {
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spHistPyramidDestroy(SPHistPyramid *pyramid) {
+	delete pyramid;
+}
+
+int spHistPyramidNumOfImages(SPHistPyramid *pyramid) {
+	if (pyramid == NULL)
+		return 0;
+	return pyramid->numOfImages;
+}
+
+int spHistPyramidSearch(SPHistPyramid *pyramid, SPPoint **queryHist, SPPoint ***histDB,
+		int k, int *closest, double *dists, SPSearchScratch *scratch) {
+	if (pyramid == NULL || queryHist == NULL || histDB == NULL || closest == NULL ||
+			dists == NULL || scratch == NULL || k <= 0)
+		return -1;
+	for (int c=0; c<3; c++)
+		if (queryHist[c] == NULL || spPointGetDimension(queryHist[c]) != pyramid->numOfBins)
+			return -1;
+
+	int numOfCoarseBins = pyramid->numOfCoarseBins;
+	int size = std::min(k, pyramid->numOfImages);
+	std::vector<double> &query = scratch->query;                 // 3 x numOfCoarseBins
+	std::vector<std::pair<double,int> > &bounds = scratch->bounds; // (lower bound, image)
+	std::vector<std::pair<double,int> > &top = scratch->heap;      // (distance, image), sorted
+	try {
+		query.resize(3*numOfCoarseBins);
+		bounds.resize(pyramid->numOfImages);
+		top.reserve(size + 1);
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+
+	// lower bounds of all images, in ascending order
+	coarseHist(pyramid, queryHist, query.data());
+	for (int i=0; i<pyramid->numOfImages; i++)
+		bounds[i] = std::make_pair(lowerBound(pyramid, query.data(),
+				pyramid->coarse.data() + (size_t) i*3*numOfCoarseBins), i);
+	std::sort(bounds.begin(), bounds.end());
+
+	// exact distances until no image left can enter the k closest
+	top.clear();
+	scratch->numOfExact = 0;
+	for (int j=0; j<pyramid->numOfImages; j++) {
+		if ((int) top.size() == size && bounds[j].first > top.back().first*(1 + SP_HIST_PYRAMID_SLACK))
+			break;
+		int image = bounds[j].second;
+		std::pair<double,int> candidate(spRGBHistL2Distance(queryHist, histDB[image]), image);
+		scratch->numOfExact++;
+		if ((int) top.size() == size && !(candidate < top.back()))
+			continue;
+		top.insert(std::upper_bound(top.begin(), top.end(), candidate), candidate);
+		if ((int) top.size() > size)
+			top.pop_back();
+	}
+
+	for (int i=0; i<size; i++) {
+		closest[i] = top[i].second;
+		dists[i] = top[i].first;
+	}
+	return size;
+}
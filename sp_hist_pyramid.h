@@ -0,0 +1,86 @@
+#ifndef SP_HIST_PYRAMID_H_
+#define SP_HIST_PYRAMID_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Histogram Pyramid summary
+ * Coarse copies of the RGB histograms database, used to prune the global
+ * search while keeping its results exact.
+ *
+ * Each coarse bin is the sum of a group of consecutive fine bins (groups
+ * differ in size by at most one bin). For a group of m fine bins whose
+ * differences between two histograms are d_1, ..., d_m, Cauchy-Schwarz gives
+ * (d_1 + ... + d_m)^2 <= m*(d_1^2 + ... + d_m^2), so summing the squared coarse
+ * differences divided by their group sizes (weighted by channel as in
+ * spRGBHistL2Distance) is a lower bound on spRGBHistL2Distance.
+ *
+ * A search computes the lower bound of every image from the coarse bins, then
+ * computes spRGBHistL2Distance for images in ascending order of lower bound,
+ * stopping once the next lower bound exceeds the k-th smallest exact distance
+ * found - no image left can be closer. The result is the same as computing
+ * spRGBHistL2Distance for all images.
+ *
+ * The following functions are supported:
+ *
+ * spHistPyramidCreate          - Builds the coarse histograms of a database
+ * spHistPyramidDestroy         - Frees all resources
+ * spHistPyramidNumOfImages     - A getter of the number of images
+ * spHistPyramidSearch          - Finds the k closest images to a query histogram
+ */
+
+/** Type for defining the coarse histograms database **/
+typedef struct sp_hist_pyramid_t SPHistPyramid;
+
+/**
+ * Builds the coarse histograms of every image by summing groups of fine bins
+ *
+ * @param histDB - histograms database (3 histograms of each image, all of
+ *                 the same number of bins)
+ * @param numOfImages - number of images
+ * @param numOfCoarseBins - number of bins of the coarse histograms
+ * @return NULL in case histDB is NULL, numOfImages <= 0, numOfCoarseBins is
+ *         not in 1, ..., number of bins - 1 or allocation failure occurred,
+ *         otherwise the new coarse histograms database
+ */
+SPHistPyramid* spHistPyramidCreate(SPPoint ***histDB, int numOfImages, int numOfCoarseBins);
+
+/**
+ * Frees all resources associated with the coarse histograms database.
+ * If pyramid is NULL nothing happens.
+ */
+void spHistPyramidDestroy(SPHistPyramid *pyramid);
+
+/**
+ * A getter for the number of images
+ *
+ * @param pyramid - the source coarse histograms database
+ * @return the number of images, 0 if pyramid is NULL
+ */
+int spHistPyramidNumOfImages(SPHistPyramid *pyramid);
+
+/**
+ * Finds the k closest images to a query histogram by spRGBHistL2Distance
+ * (ties broken by the smaller image index), computing the exact distance
+ * only for images whose lower bound does not rule them out
+ *
+ * @param pyramid - the source coarse histograms database
+ * @param queryHist - the 3 histograms of the query
+ * @param histDB - the histograms database the pyramid was built from
+ * @param k - number of closest images
+ * @param closest - an array of size k in which the closest image indices are
+ *                  stored (closest first)
+ * @param dists - an array of size k in which their distances are stored
+ * @param scratch - the scratch space of the search (see sp_search_scratch),
+ *                  its numOfExact is set to the number of exact distances computed
+ * @return -1 if any of the pointers is NULL, k <= 0, the query number of bins
+ *         does not match the database or allocation failure occurred,
+ *         otherwise the number of images stored (k, unless there are fewer images)
+ */
+int spHistPyramidSearch(SPHistPyramid *pyramid, SPPoint **queryHist, SPPoint ***histDB,
+		int k, int *closest, double *dists, SPSearchScratch *scratch);
+
+#endif /* SP_HIST_PYRAMID_H_ */
@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sp_image_prefetch.h"
+
+#define PREFETCH_READ_SIZE 65536
+
+// state of a slot in the window
+enum slot_state { SLOT_EMPTY, SLOT_READING, SLOT_READY, SLOT_FAILED };
+
+struct sp_image_prefetcher_t {
+	std::string dir, prefix, suffix;
+	int firstImage;
+	int numOfImages;
+	int window;
+	std::vector<std::vector<unsigned char> > buffers; // slot of image i is i % window
+	std::vector<slot_state> states;
+	int nextToRead;       // next image (relative to firstImage) to be claimed by a reader
+	int nextToRelease;    // oldest image not yet released
+	bool stopping;
+	std::mutex lock;
+	std::condition_variable readerCond;   // signaled when the window advances
+	std::condition_variable consumerCond; // signaled when an image is read
+	std::vector<std::thread> readers;
+};
+
+static bool readImageFile(const std::string &path, std::vector<unsigned char> &buf) {
+	// reads a whole file into buf, returns false on failure
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		buf.reserve(st.st_size);
+	}
+
+	buf.clear();
+	unsigned char chunk[PREFETCH_READ_SIZE];
+	ssize_t n;
+	while ((n = read(fd, chunk, PREFETCH_READ_SIZE)) > 0)
+		buf.insert(buf.end(), chunk, chunk + n);
+	close(fd);
+	return n == 0 && !buf.empty();
+}
+
+static void readerMain(SPImagePrefetcher *prefetcher) {
+	// claims the next image in the window, reads it and hands it to the consumer
+	std::unique_lock<std::mutex> guard(prefetcher->lock);
+	while (true) {
+		prefetcher->readerCond.wait(guard, [prefetcher] {
+			return prefetcher->stopping || prefetcher->nextToRead >= prefetcher->numOfImages ||
+					prefetcher->nextToRead < prefetcher->nextToRelease + prefetcher->window;
+		});
+		if (prefetcher->stopping || prefetcher->nextToRead >= prefetcher->numOfImages)
+			return;
+
+		int image = prefetcher->nextToRead++;
+		int slot = image % prefetcher->window;
+		prefetcher->states[slot] = SLOT_READING;
+		char name[32];
+		sprintf(name, "%d", prefetcher->firstImage + image);
+		std::string path = prefetcher->dir + prefetcher->prefix + name + prefetcher->suffix;
+
+		// read without holding the lock (the slot is owned by this reader)
+		std::vector<unsigned char> buf;
+		guard.unlock();
+		bool ok;
+		try {
+			ok = readImageFile(path, buf);
+		}
+		catch (std::bad_alloc &) {
+			ok = false;
+		}
+		guard.lock();
+
+		prefetcher->buffers[slot].swap(buf);
+		prefetcher->states[slot] = ok ? SLOT_READY : SLOT_FAILED;
+		prefetcher->consumerCond.notify_all();
+	}
+}
+
+SPImagePrefetcher* spImagePrefetcherCreate(const char *dir, const char *prefix, const char *suffix,
+		int firstImage, int numOfImages, int numOfThreads, int window) {
+	if (dir == NULL || prefix == NULL || suffix == NULL ||
+			numOfImages <= 0 || numOfThreads <= 0 || window <= 0)
+		return NULL;
+
+	SPImagePrefetcher *res = new (std::nothrow) SPImagePrefetcher;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->dir = dir;
+		res->prefix = prefix;
+		res->suffix = suffix;
+		res->firstImage = firstImage;
+		res->numOfImages = numOfImages;
+		res->window = window;
+		res->buffers.resize(window);
+		res->states.assign(window, SLOT_EMPTY);
+		res->nextToRead = 0;
+		res->nextToRelease = 0;
+		res->stopping = false;
+		for (int i=0; i<numOfThreads; i++)
+			res->readers.push_back(std::thread(readerMain, res));
+	}
+	catch (std::exception &) { // allocation or thread creation failure
+		spImagePrefetcherDestroy(res);
+		return NULL;
+	}
+	return res;
+}
+
+void spImagePrefetcherDestroy(SPImagePrefetcher *prefetcher) {
+	if (prefetcher != NULL) {
+		{
+			std::lock_guard<std::mutex> guard(prefetcher->lock);
+			prefetcher->stopping = true;
+		}
+		prefetcher->readerCond.notify_all();
+		for (size_t i=0; i<prefetcher->readers.size(); i++)
+			prefetcher->readers[i].join();
+		delete prefetcher;
+	}
+}
+
+bool spImagePrefetcherGet(SPImagePrefetcher *prefetcher, int image,
+		const unsigned char **buf, size_t *size) {
+	if (prefetcher == NULL || buf == NULL || size == NULL)
+		return false;
+	image -= prefetcher->firstImage;
+	if (image < 0 || image >= prefetcher->numOfImages)
+		return false;
+
+	std::unique_lock<std::mutex> guard(prefetcher->lock);
+	if (image < prefetcher->nextToRelease || image >= prefetcher->nextToRelease + prefetcher->window)
+		return false;
+	int slot = image % prefetcher->window;
+	prefetcher->consumerCond.wait(guard, [prefetcher, image, slot] {
+		return image < prefetcher->nextToRead &&
+				(prefetcher->states[slot] == SLOT_READY || prefetcher->states[slot] == SLOT_FAILED);
+	});
+	if (prefetcher->states[slot] == SLOT_FAILED)
+		return false;
+	*buf = prefetcher->buffers[slot].data();
+	*size = prefetcher->buffers[slot].size();
+	return true;
+}
+
+void spImagePrefetcherRelease(SPImagePrefetcher *prefetcher, int image) {
+	if (prefetcher != NULL) {
+		std::lock_guard<std::mutex> guard(prefetcher->lock);
+		image -= prefetcher->firstImage;
+		if (image != prefetcher->nextToRelease)
+			return;
+		int slot = image % prefetcher->window;
+		std::vector<unsigned char>().swap(prefetcher->buffers[slot]);
+		prefetcher->states[slot] = SLOT_EMPTY;
+		prefetcher->nextToRelease++;
+		prefetcher->readerCond.notify_all();
+	}
+}
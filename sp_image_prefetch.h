@@ -0,0 +1,80 @@
+#ifndef SP_IMAGE_PREFETCH_H_
+#define SP_IMAGE_PREFETCH_H_
+#include <cstddef>
+
+/**
+ * SP Image Prefetcher summary
+ * Reads image files into memory ahead of their decoding, so disk latency
+ * overlaps with decoding and feature extraction.
+ *
+ * Images are named by the preprocessing convention (dir, prefix, index, suffix).
+ * A pool of reader threads reads images firstImage, firstImage+1, ... in order,
+ * keeping at most window images read ahead of the oldest image not yet released.
+ * Files are opened with sequential access and will-need advice so the kernel
+ * starts readahead as soon as a reader reaches them.
+ *
+ * The following functions are supported:
+ *
+ * spImagePrefetcherCreate   - Starts reading images
+ * spImagePrefetcherDestroy  - Stops the reader threads and frees all resources
+ * spImagePrefetcherGet      - Waits for an image to be read and returns its contents
+ * spImagePrefetcherRelease  - Frees the contents of an image and advances the window
+ */
+
+/** Type for defining the prefetcher **/
+typedef struct sp_image_prefetcher_t SPImagePrefetcher;
+
+/**
+ * Starts numOfThreads reader threads reading images
+ * firstImage, ..., firstImage+numOfImages-1.
+ *
+ * @param dir - the image directory
+ * @param prefix - prefix of image name
+ * @param suffix - suffix of image name
+ * @param firstImage - index of the first image to read
+ * @param numOfImages - number of images to read
+ * @param numOfThreads - number of reader threads
+ * @param window - maximum number of images held in memory
+ * @return
+ * NULL in case any of the pointers is NULL, numOfImages, numOfThreads or
+ * window are <= 0, or allocation failure occurred
+ * Otherwise, the new prefetcher
+ */
+SPImagePrefetcher* spImagePrefetcherCreate(const char *dir, const char *prefix, const char *suffix,
+		int firstImage, int numOfImages, int numOfThreads, int window);
+
+/**
+ * Stops all reader threads (after their current read) and frees all
+ * resources associated with the prefetcher.
+ * If prefetcher is NULL nothing happens.
+ */
+void spImagePrefetcherDestroy(SPImagePrefetcher *prefetcher);
+
+/**
+ * Waits until an image is read and returns its contents.
+ * Images must be requested in order, and an image must be released before
+ * an image window places later is requested.
+ *
+ * @param prefetcher - the source prefetcher
+ * @param image - the index of the image
+ * @param buf - the address in which a pointer to the contents is stored
+ *              (valid until the image is released)
+ * @param size - the address in which the size of the contents is stored
+ * @return false if any of the arguments is NULL, image is out of range or
+ *         the image file could not be read, true otherwise
+ */
+bool spImagePrefetcherGet(SPImagePrefetcher *prefetcher, int image,
+		const unsigned char **buf, size_t *size);
+
+/**
+ * Frees the contents of the oldest image not yet released (which must be
+ * image), allowing the readers to read one more image ahead.
+ * If prefetcher is NULL nothing happens.
+ *
+ * @param prefetcher - the source prefetcher
+ * @param image - the index of the image
+ */
+void spImagePrefetcherRelease(SPImagePrefetcher *prefetcher, int image);
+
+
+#endif /* SP_IMAGE_PREFETCH_H_ */
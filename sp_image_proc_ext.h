@@ -0,0 +1,296 @@
+#ifndef SP_IMAGE_PROC_EXT_H_
+#define SP_IMAGE_PROC_EXT_H_
+#include <cstddef>
+
+// Extensions of sp_image_proc_util.h (which must not be changed)
+// implemented in sp_image_proc_util.cpp
+
+// largest number of closest features selected without a priority queue
+#define SP_TOPK_MAX_FIXED 8
+
+extern "C"{
+	#include "SPPoint.h"
+	#include "SPBPriorityQueue.h"
+}
+
+/**
+ * Same as spGetRGBHist, but decodes the image from an in-memory copy of the
+ * image file (for example, read ahead by an I/O thread) instead of reading it
+ * from disk.
+ *
+ * @param str - The name of the image, used only in error messages
+ * @param buf - The contents of the image file
+ * @param size - The size of buf in bytes
+ * @param imageIndex - The index of the given image
+ * @param nBins - The number of subdivision for the intensity histogram
+ * @return NULL if buf is NULL, the image could not be decoded or allocation error occurred,
+ *  otherwise a two dimensional array representing the histogram.
+ */
+SPPoint** spGetRGBHistFromBuffer(const char* str, const unsigned char* buf, size_t size,
+		int imageIndex, int nBins);
+
+/**
+ * Same as spGetSiftDescriptors, but decodes the image from an in-memory copy
+ * of the image file instead of reading it from disk.
+ *
+ * @param str - The name of the image, used only in error messages
+ * @param buf - The contents of the image file
+ * @param size - The size of buf in bytes
+ * @param imageIndex - The index of the given image
+ * @param nFeaturesToExtract - The number of features to retain
+ * @param nFeatures - A pointer in which the actual number of features retained will be stored.
+ * @return NULL if buf or nFeatures are NULL, nFeaturesToExtract <= 0, the image could not
+ *  be decoded or allocation error occurred, otherwise the extracted features.
+ */
+SPPoint** spGetSiftDescriptorsFromBuffer(const char* str, const unsigned char* buf, size_t size,
+		int imageIndex, int nFeaturesToExtract, int *nFeatures);
+
+/**
+ * Same as spGetRGBHist, but stores the histogram in given points instead of
+ * allocating new ones, so a query can reuse its points. Each of the 3 points
+ * is overwritten if its dimension is nBins, otherwise it is replaced by a new
+ * point (NULL points are created).
+ *
+ * @param hist - an array of 3 points (owned by the caller)
+ * See spGetRGBHist for the rest of the parameters
+ * @return 0 if succeeds, -1 if str or hist is NULL, the image cannot be
+ *  loaded or allocation error occurred
+ */
+int spGetRGBHistInto(const char* str, int imageIndex, int nBins, SPPoint** hist);
+
+/**
+ * Same as spGetSiftDescriptors, but stores the features in a given growable
+ * array of points instead of allocating new ones, so a query can reuse its
+ * points. The array is grown (by realloc) if it has fewer than the extracted
+ * number of features, and points of the right dimension are overwritten.
+ * Points past the returned number of features are left as they are.
+ *
+ * @param sift - the address of the array of points (may point to NULL)
+ * @param capacity - the address of the size of the array (updated if grown)
+ * See spGetSiftDescriptors for the rest of the parameters
+ * @return the number of features extracted, -1 if any of the pointer
+ *  arguments is NULL, nFeaturesToExtract <= 0, the image cannot be loaded
+ *  or allocation error occurred
+ */
+int spGetSiftDescriptorsInto(const char* str, int imageIndex, int nFeaturesToExtract,
+		SPPoint*** sift, int* capacity);
+
+/**
+ * Same as spBestSIFTL2SquaredDistance, but stores the image indices in a
+ * given array instead of allocating one. For kClosest <= SP_TOPK_MAX_FIXED
+ * the closest features are selected by an SPTopK specialized for kClosest,
+ * so nothing is allocated during the scan.
+ *
+ * @param closest - an array of size kClosest in which the image indices
+ *                  of the closest features are stored (closest first)
+ * See spBestSIFTL2SquaredDistance for the rest of the parameters
+ * @return -1 if closest is NULL, kClosest <= 0 or spBestSIFTL2SquaredDistance
+ *  would return NULL, otherwise the number of indices stored (kClosest, unless
+ *  the database has fewer features)
+ */
+int spBestSIFTL2SquaredDistanceInto(int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages,
+		int* nFeaturesPerImage, int* closest);
+
+/**
+ * Same as spBestSIFTL2SquaredDistanceInto, but for kClosest > SP_TOPK_MAX_FIXED
+ * the closest features are selected in a given queue (cleared first) instead
+ * of a new one, so consecutive searches allocate nothing.
+ *
+ * @param queue - a queue of maximum size kClosest, or NULL to create one
+ * See spBestSIFTL2SquaredDistanceInto for the rest of the parameters
+ * @return -1 if spBestSIFTL2SquaredDistanceInto would, or the maximum size of
+ *  a needed queue is not kClosest, otherwise the number of indices stored
+ */
+int spBestSIFTL2SquaredDistanceWithQueue(int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages,
+		int* nFeaturesPerImage, int* closest, SPBPQueue* queue);
+
+/** Type for reading the frames of a video (see spFrameReaderOpen) **/
+typedef struct sp_frame_reader_t SPFrameReader;
+
+/**
+ * Opens a video file, or an image sequence given by a printf style pattern
+ * of the frame file names (for example "frames/img%03d.png"), for reading
+ * its frames one at a time.
+ *
+ * @param str - The path of the video or the pattern of the image sequence
+ * @return NULL if str is NULL, the video cannot be opened or allocation
+ *  error occurred, otherwise the reader (positioned before the first frame)
+ */
+SPFrameReader* spFrameReaderOpen(const char* str);
+
+/**
+ * Closes a frame reader. If reader is NULL nothing happens.
+ */
+void spFrameReaderClose(SPFrameReader* reader);
+
+/**
+ * A getter for the frame rate of the video
+ *
+ * @return the frames per second of the video, 0 if reader is NULL or unknown
+ */
+double spFrameReaderFps(SPFrameReader* reader);
+
+/**
+ * Reads the next frame, which becomes the current frame of the reader.
+ *
+ * @return 1 if a frame was read, 0 if there are no more frames,
+ *  -1 if reader is NULL
+ */
+int spFrameReaderNext(SPFrameReader* reader);
+
+/**
+ * Same as spGetRGBHistInto, for the current frame of a reader
+ *
+ * @param reader - The frame reader
+ * See spGetRGBHistInto for the rest of the parameters
+ * @return 0 if succeeds, -1 if reader or hist is NULL, no frame was read
+ *  or allocation error occurred
+ */
+int spFrameReaderHistInto(SPFrameReader* reader, int imageIndex, int nBins, SPPoint** hist);
+
+/**
+ * Same as spGetSiftDescriptorsInto, for the current frame of a reader
+ *
+ * @param reader - The frame reader
+ * See spGetSiftDescriptorsInto for the rest of the parameters
+ * @return the number of features extracted, -1 if any of the pointer
+ *  arguments is NULL, nFeaturesToExtract <= 0, no frame was read or
+ *  allocation error occurred
+ */
+int spFrameReaderSiftInto(SPFrameReader* reader, int imageIndex, int nFeaturesToExtract,
+		SPPoint*** sift, int* capacity);
+
+/**
+ * Sets the maximum side of images sift features are extracted from. Larger
+ * images are downsampled (by area interpolation, keeping the aspect ratio)
+ * before detection, which also drops the finest octaves. Applies to
+ * spGetSiftDescriptors and spGetSiftDescriptorsFromBuffer, so it must be set
+ * once, before preprocessing, to treat database and query images alike.
+ *
+ * @param maxSide - the maximum side in pixels, 0 (or negative) for full resolution
+ */
+void spSetSiftMaxSide(int maxSide);
+
+/**
+ * A getter for the maximum side set by spSetSiftMaxSide
+ *
+ * @return the maximum side, 0 for full resolution
+ */
+int spGetSiftMaxSide();
+
+/**
+ * Sets the pixel sampling of RGB histograms, which are then computed from one
+ * pixel of each stride x stride block of the image instead of all pixels.
+ * The pixel is the center of the block, or if jitter is true a pixel chosen by
+ * a hash of the block position (the same for every image), which avoids
+ * aliasing with periodic patterns. If reduction is 2, 4 or 8, images are also
+ * decoded at 1/reduction of their size (JPEG decoding skips the finer
+ * frequencies) - with OpenCV before 3.2 they are decoded whole and sampled at
+ * a stride larger by reduction instead. Video frames are decoded whole.
+ * The counts are scaled to the number of pixels of the whole image and
+ * rounded, so sampled and full histograms are comparable and their
+ * coordinates stay integers (see sp_distance_kernels).
+ * Applies to spGetRGBHist and its FromBuffer and Into variants and to
+ * spFrameReaderHistInto, so it must be set once, before preprocessing, to
+ * treat database and query images alike.
+ *
+ * @param stride - the side of the sampled blocks, 1 (or less) for all pixels
+ * @param jitter - true to sample a hashed pixel of each block, false for its center
+ * @param reduction - 2, 4 or 8 to decode reduced images, otherwise 1
+ */
+void spSetHistSampling(int stride, bool jitter, int reduction);
+
+/**
+ * A getter for the stride set by spSetHistSampling
+ *
+ * @return the stride, 1 for all pixels
+ */
+int spGetHistStride();
+
+/**
+ * A getter for the jitter set by spSetHistSampling
+ *
+ * @return true if a hashed pixel of each block is sampled
+ */
+bool spGetHistJitter();
+
+/**
+ * A getter for the decoding reduction set by spSetHistSampling
+ *
+ * @return the reduction, 1 for whole images
+ */
+int spGetHistReduction();
+
+/**
+ * A getter for the part of the reduction set by spSetHistSampling which the
+ * decoder makes (with OpenCV before 3.2 images are decoded whole and the
+ * reduction is made up for by the stride)
+ *
+ * @return the reduction images are decoded at, 1 for whole images
+ */
+int spGetHistDecodedReduction();
+
+/**
+ * Sets the tiled extraction of sift features, which splits an image into a
+ * grid of at most numOfThreads tiles extracted in parallel, by the calling
+ * thread and a pool of numOfThreads-1 threads started here (and shared by the
+ * extractions of all threads).
+ * Each tile detects keypoints in its part of the image extended by overlap
+ * pixels on every side, and keeps the strongest nFeaturesToExtract keypoints
+ * of its own part only, so keypoints of the overlaps are not duplicated. The
+ * strongest nFeaturesToExtract keypoints of all tiles are retained.
+ * The parts of the tiles have sides of at least 128 pixels (smaller images
+ * are extracted whole), and are applied after spSetSiftMaxSide downsampling.
+ *
+ * The result approximates the extraction of the whole image: tiles detect
+ * keypoints without the limit of nFeaturesToExtract (which whole images apply
+ * inside the detector) and retain the strongest afterwards, and keypoints
+ * larger than the overlap (the coarsest octaves) may be missed or described
+ * differently (see benchmarkSiftTiling for the agreement of the rankings).
+ * So it must be set once, before preprocessing and while no features are
+ * extracted, to treat database and query images alike.
+ *
+ * @param numOfThreads - the maximum number of tiles, 0 or 1 for whole images
+ * @param overlap - the overlap of the tiles in pixels
+ */
+void spSetSiftTiling(int numOfThreads, int overlap);
+
+/**
+ * A getter for the maximum number of tiles set by spSetSiftTiling
+ *
+ * @return the maximum number of tiles, 0 for whole images
+ */
+int spGetSiftTileThreads();
+
+/**
+ * A getter for the overlap of the tiles set by spSetSiftTiling
+ *
+ * @return the overlap in pixels, 0 for whole images
+ */
+int spGetSiftTileOverlap();
+
+/**
+ * Returns the time the calling thread spent decoding images (reading and
+ * decompressing image files or buffers, and video frames) in spGetRGBHist,
+ * spGetSiftDescriptors, their FromBuffer and Into variants and spFrameReaderNext
+ * since the previous call, and restarts counting.
+ * Used to separate decoding from descriptor computation in latency reports.
+ *
+ * @return the decoding time in seconds
+ */
+double spTakeDecodeSeconds();
+
+/**
+ * Returns whether an image could not be loaded (a missing, unreadable or
+ * corrupt image file or buffer) by spGetRGBHist, spGetSiftDescriptors, or
+ * their FromBuffer and Into variants on the calling thread since the previous
+ * call, and clears the flag.
+ * Used to tell a bad image from an allocation failure when both return NULL.
+ *
+ * @return true if an image could not be loaded
+ */
+bool spTakeImageLoadFailed();
+
+#endif /* SP_IMAGE_PROC_EXT_H_ */
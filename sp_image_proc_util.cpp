@@ -1,11 +1,23 @@
 #include <opencv2/imgproc.hpp>//calcHist
 #include <opencv2/core.hpp>//Mat
 #include <opencv2/highgui.hpp>
+#include <opencv2/videoio.hpp>//VideoCapture
 #include <opencv2/xfeatures2d.hpp>//SiftDescriptorExtractor
 #include <cstdlib>
 #include <cstdio>
+#include <cmath>
 #include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <new>
 #include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
+#include "sp_distance_kernels.h"
+#include "sp_topk.h"
 extern "C" {
 	#include "SPBPriorityQueue.h"
 }
@@ -13,7 +25,116 @@ extern "C" {
 using namespace cv;
 
 #define IMAGE_LOADING_ERROR "Image cannot be loaded"
+#define VIDEO_LOADING_ERROR "Video cannot be opened"
 #define MEMORY_ERROR "An error occurred - allocation failure\n"
+// minimum side of the part of an image owned by a tile of the sift extraction
+#define SIFT_TILE_MIN_SIDE 128
+// alignment of the tile origins in pixels, so the first pyramid octaves of a
+// tile (each sampling every second pixel of the previous) sample the pixels of
+// the whole image octaves
+#define SIFT_TILE_ALIGN 32
+
+// maximum side of images sift features are extracted from (0 - full resolution)
+static int siftMaxSide = 0;
+
+void spSetSiftMaxSide(int maxSide) {
+	siftMaxSide = maxSide > 0 ? maxSide : 0;
+}
+
+int spGetSiftMaxSide() {
+	return siftMaxSide;
+}
+
+// pixel sampling of the RGB histograms (see spSetHistSampling)
+static int histStride = 1;
+static bool histJitter = false;
+static int histReduction = 1;
+
+void spSetHistSampling(int stride, bool jitter, int reduction) {
+	histStride = stride > 1 ? stride : 1;
+	histJitter = histStride > 1 && jitter;
+	histReduction = reduction == 2 || reduction == 4 || reduction == 8 ? reduction : 1;
+}
+
+int spGetHistStride() {
+	return histStride;
+}
+
+bool spGetHistJitter() {
+	return histJitter;
+}
+
+int spGetHistReduction() {
+	return histReduction;
+}
+
+int spGetHistDecodedReduction() {
+	// reduced decoding (IMREAD_REDUCED_COLOR_*) is available from OpenCV 3.2,
+	// otherwise images are decoded whole and sampled at a larger stride
+#if defined(CV_VERSION_MAJOR) && (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2))
+	return histReduction;
+#else
+	return 1;
+#endif
+}
+
+//Inner function returning the flags decoding a color image for its histogram
+static int histDecodeFlags() {
+#if defined(CV_VERSION_MAJOR) && (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2))
+	switch (histReduction) {
+	case 2: return IMREAD_REDUCED_COLOR_2;
+	case 4: return IMREAD_REDUCED_COLOR_4;
+	case 8: return IMREAD_REDUCED_COLOR_8;
+	}
+#endif
+	return CV_LOAD_IMAGE_COLOR;
+}
+
+// maximum number of tiles sift features are extracted from in parallel
+// (0 - whole images) and the overlap of the tiles in pixels
+static int siftTileThreads = 0;
+static int siftTileOverlap = 0;
+
+int spGetSiftTileThreads() {
+	return siftTileThreads;
+}
+
+int spGetSiftTileOverlap() {
+	return siftTileOverlap;
+}
+
+// time spent decoding images by this thread (see spTakeDecodeSeconds)
+static thread_local double decodeSeconds = 0;
+
+double spTakeDecodeSeconds() {
+	double res = decodeSeconds;
+	decodeSeconds = 0;
+	return res;
+}
+
+// set when this thread fails to load an image (see spTakeImageLoadFailed)
+static thread_local bool imageLoadFailed = false;
+
+bool spTakeImageLoadFailed() {
+	bool res = imageLoadFailed;
+	imageLoadFailed = false;
+	return res;
+}
+
+//Inner function reporting an image which cannot be loaded
+static void imageLoadingError(const char* str) {
+	printf("%s - %s\n",IMAGE_LOADING_ERROR, str);
+	imageLoadFailed = true;
+}
+
+//Inner function decoding an image file or buffer and accounting the decoding time
+static Mat decodeImage(const char* str, const unsigned char* buf, size_t size, int flags) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Mat src = buf != NULL ? imdecode(Mat(1, (int) size, CV_8U, (void*) buf), flags) : imread(str, flags);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	decodeSeconds += elapsed.count();
+	return src;
+}
 
 SPPoint* pointFromFloatMat(Mat mat, int i, int dir, int index) {
 	// creates an spPoint from the data of a given row/col in a float matrix
@@ -47,13 +168,93 @@ SPPoint* pointFromFloatMat(Mat mat, int i, int dir, int index) {
 	return res;
 }
 
-SPPoint** spGetRGBHist(const char* str,int imageIndex, int nBins) {
+//Inner function storing a row/col of a float matrix in a reusable point
+static bool storePointFromFloatMat(SPPoint **point, Mat mat, int i, int dir, int index) {
+	// overwrites *point if it has the right dimension, otherwise replaces it
+	// returns false in case of allocation failure
+	static thread_local std::vector<double> data;
+	int dim = dir == 1 ? mat.cols : mat.rows;
+	if (*point == NULL || spPointGetDimension(*point) != dim) {
+		spPointDestroy(*point);
+		*point = pointFromFloatMat(mat, i, dir, index);
+		return *point != NULL;
+	}
+	try {
+		data.resize(dim);
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	for (int j=0; j<dim; j++)
+		data[j] = double(dir == 1 ? mat.at<float>(i,j) : mat.at<float>(j,i));
+	spPointSetData(*point, data.data(), index);
+	return true;
+}
 
-	Mat src = imread(str,CV_LOAD_IMAGE_COLOR);
-	if (src.empty()) {
-		printf("%s - %s\n",IMAGE_LOADING_ERROR, str);
-		return NULL;
+//Inner function computing the RGB histogram of sampled pixels of a loaded color image
+static bool sampledHistInto(Mat src, int imageIndex, int nBins, SPPoint **hist,
+		int stride, int reduction) {
+	// one pixel of each stride x stride block is counted (a fixed pixel, or one
+	// chosen by a hash of the block if histJitter), and the counts are scaled
+	// to the number of pixels of the image before its reduction by decoding
+	// and rounded, so they stay integers as full counts are
+	// returns false in case of allocation failure
+	static thread_local std::vector<long> counts;
+	try {
+		counts.assign(3*nBins, 0);
 	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+
+	long sampled = 0;
+	for (int bi=0; bi*stride < src.rows; bi++)
+		for (int bj=0; bj*stride < src.cols; bj++) {
+			int di = stride/2, dj = stride/2;
+			if (histJitter) {
+				unsigned int h = (unsigned int) bi*0x9E3779B1u ^ (unsigned int) bj*0x85EBCA77u;
+				h ^= h >> 15;
+				h *= 0x2C1B3C6Du;
+				h ^= h >> 12;
+				di = h % stride;
+				dj = (h / stride) % stride;
+			}
+			int i = bi*stride + di, j = bj*stride + dj;
+			if (i >= src.rows || j >= src.cols)
+				continue;
+			const unsigned char *pixel = src.ptr<unsigned char>(i) + 3*j;
+			for (int c=0; c<3; c++)
+				counts[c*nBins + pixel[c]*nBins/256]++;
+			sampled++;
+		}
+
+	double scale = sampled > 0 ? (double) src.rows*src.cols*reduction*reduction/sampled : 0;
+	Mat channel_hist(nBins, 1, CV_32F);
+	for (int c=0; c<3; c++) {
+		for (int b=0; b<nBins; b++)
+			channel_hist.at<float>(b,0) = (float) std::floor(counts[c*nBins + b]*scale + 0.5);
+
+		// store in spPoint, flip direction to get rgb instead of bgr
+		if (!storePointFromFloatMat(hist + 2-c, channel_hist, 0, 0, imageIndex)) {
+			printf("%s",MEMORY_ERROR);
+			return false;
+		}
+	}
+	return true;
+}
+
+//Inner function computing the RGB histogram of a loaded color image into reusable points
+static bool rgbHistIntoFromMat(Mat src, int imageIndex, int nBins, SPPoint **hist,
+		int reduction) {
+	// hist is an array of 3 points (NULL points are created)
+	// reduction is the reduction src was decoded at (see spSetHistSampling)
+	// returns false in case of allocation failure
+
+	// sample pixels (see spSetHistSampling), a reduction src was not decoded
+	// at is made up for by a larger stride
+	int stride = histStride*histReduction/reduction;
+	if (stride > 1 || reduction > 1)
+		return sampledHistInto(src, imageIndex, nBins, hist, stride, reduction);
 
 	/// Separate the image in 3 places ( B, G and R )
 	std::vector<Mat> bgr_planes;
@@ -63,56 +264,330 @@ SPPoint** spGetRGBHist(const char* str,int imageIndex, int nBins) {
 	float range[] = { 0, 256 };
 	const float* histRange = { range };
 
-	// Compute the histograms:
-	SPPoint **hist = (SPPoint**) malloc(3*sizeof(SPPoint*));
-	if (hist == NULL) {
-		printf("%s",MEMORY_ERROR);
-		return NULL;
-	}
-
 	Mat channel_hist;
 	for (int i=0; i<3; i++) {
 		// compute histogram
 		calcHist(&bgr_planes[i], 1, 0, Mat(), channel_hist, 1, &nBins, &histRange);
 
-		// create spPoint, flip direction to get rgb instead of bgr
-		hist[2-i] = pointFromFloatMat(channel_hist, 0, 0, imageIndex);
-
-		// in case of allocation failure
-		if (hist[2-i] == NULL) {
+		// store in spPoint, flip direction to get rgb instead of bgr
+		if (!storePointFromFloatMat(hist + 2-i, channel_hist, 0, 0, imageIndex)) {
 			printf("%s",MEMORY_ERROR);
-			for (int j=0; j<i; j++)
-				free(hist[j]);
-			free(hist);
-			return NULL;
+			return false;
 		}
 	}
+	return true;
+}
+
+SPPoint** rgbHistFromMat(Mat src, int imageIndex, int nBins, int reduction) {
+	// computes the RGB histogram of a loaded color image (see spGetRGBHist)
 
+	// Compute the histograms:
+	SPPoint **hist = (SPPoint**) calloc(3, sizeof(SPPoint*));
+	if (hist == NULL) {
+		printf("%s",MEMORY_ERROR);
+		return NULL;
+	}
+	if (!rgbHistIntoFromMat(src, imageIndex, nBins, hist, reduction)) {
+		for (int i=0; i<3; i++)
+			spPointDestroy(hist[i]);
+		free(hist);
+		return NULL;
+	}
 	return hist;
 }
 
-double spRGBHistL2Distance(SPPoint** rgbHistA, SPPoint** rgbHistB) {
-	if (rgbHistA == NULL || rgbHistB == NULL)
-		return -1;
+SPPoint** spGetRGBHist(const char* str,int imageIndex, int nBins) {
 
-	int i;
-	double dist = 0;
-	for (i=0; i<3; i++)
-		dist += 0.33*spPointL2SquaredDistance(rgbHistA[i],rgbHistB[i]);
-	return dist;
+	Mat src = decodeImage(str, NULL, 0, histDecodeFlags());
+	if (src.empty()) {
+		imageLoadingError(str);
+		return NULL;
+	}
+
+	return rgbHistFromMat(src, imageIndex, nBins, spGetHistDecodedReduction());
 }
 
-SPPoint** spGetSiftDescriptors(const char* str, int imageIndex, int nFeaturesToExtract, int *nFeatures) {
+SPPoint** spGetRGBHistFromBuffer(const char* str, const unsigned char* buf, size_t size,
+		int imageIndex, int nBins) {
 
-	if (str == NULL || nFeatures == NULL || nFeaturesToExtract <= 0)
+	if (buf == NULL)
 		return NULL;
 
-	Mat src = imread(str,CV_LOAD_IMAGE_GRAYSCALE);
+	Mat src = decodeImage(str, buf, size, histDecodeFlags());
 	if (src.empty()) {
-		printf("%s - %s\n",IMAGE_LOADING_ERROR, str);
+		imageLoadingError(str);
 		return NULL;
 	}
 
+	return rgbHistFromMat(src, imageIndex, nBins, spGetHistDecodedReduction());
+}
+
+// the channel distances of two histograms (see spL2Dispatch)
+struct histDistanceScan {
+	SPPoint** rgbHistA;
+	SPPoint** rgbHistB;
+	double dist;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		for (int i=0; i<3; i++)
+			dist += 0.33*kernel(spPointGetData(rgbHistA[i]),spPointGetData(rgbHistB[i]));
+	}
+};
+
+double spRGBHistL2Distance(SPPoint** rgbHistA, SPPoint** rgbHistB) {
+	if (rgbHistA == NULL || rgbHistB == NULL)
+		return -1;
+
+	histDistanceScan scan = { rgbHistA, rgbHistB, 0 };
+	spL2Dispatch(spPointGetDimension(rgbHistA[0]), scan);
+	return scan.dist;
+}
+
+// a tile of the sift extraction (see spSetSiftTiling)
+struct siftTile {
+	Rect core;                  // the part of the image whose keypoints the tile keeps
+	Rect roi;                   // the core extended by the overlap, on which sift runs
+	std::vector<KeyPoint> kp;   // the kept keypoints (coordinates in roi)
+	Mat desc;                   // their descriptors, one per row
+	bool failed;
+};
+
+//Inner function extracting the sift descriptors of a tile
+static void siftTileMain(const Mat *src, siftTile *tile, int nFeaturesToExtract) {
+	// keypoints are detected in the whole roi, and only the strongest
+	// nFeaturesToExtract of those inside the core are kept, so a keypoint of
+	// an overlap is kept by one tile only
+	try {
+		Mat part = (*src)(tile->roi);
+		Ptr<xfeatures2d::SiftDescriptorExtractor> detect = xfeatures2d::SIFT::create();
+		detect->detect(part, tile->kp, Mat());
+		size_t n = 0;
+		for (size_t i=0; i<tile->kp.size(); i++) {
+			float x = tile->kp[i].pt.x + tile->roi.x, y = tile->kp[i].pt.y + tile->roi.y;
+			if (x >= tile->core.x && x < tile->core.x + tile->core.width &&
+					y >= tile->core.y && y < tile->core.y + tile->core.height)
+				tile->kp[n++] = tile->kp[i];
+		}
+		tile->kp.resize(n);
+		KeyPointsFilter::retainBest(tile->kp, nFeaturesToExtract);
+		detect->compute(part, tile->kp, tile->desc);
+		tile->failed = tile->desc.rows != (int) tile->kp.size();
+	}
+	catch (std::exception &) { // allocation failure
+		tile->failed = true;
+	}
+}
+
+// a tile waiting for a thread of the tile pool
+struct siftTileTask {
+	const Mat *src;
+	siftTile *tile;
+	int nFeaturesToExtract;
+	int *pending;   // tiles of the same image not yet extracted
+};
+
+// the threads extracting tiles, started by spSetSiftTiling and shared by the
+// images of all threads (stopped at exit)
+struct siftTilePool {
+	std::mutex lock;
+	std::condition_variable workCond;  // signaled when tiles are queued (or on stop)
+	std::condition_variable doneCond;  // signaled when the last tile of an image is extracted
+	std::deque<siftTileTask> tasks;
+	std::vector<std::thread> threads;
+	bool stopping;
+
+	siftTilePool() : stopping(false) {}
+	~siftTilePool();
+};
+
+static siftTilePool tilePool;
+
+//Inner function extracting a queued tile, with the pool lock held by guard
+static void runSiftTileTask(std::unique_lock<std::mutex> &guard) {
+	// the lock is released while the tile is extracted
+	siftTileTask task = tilePool.tasks.front();
+	tilePool.tasks.pop_front();
+	guard.unlock();
+	siftTileMain(task.src, task.tile, task.nFeaturesToExtract);
+	guard.lock();
+	if (--*task.pending == 0)
+		tilePool.doneCond.notify_all();
+}
+
+//Inner function of the threads of the tile pool, extracting queued tiles until stopped
+static void siftTileWorkerMain() {
+	std::unique_lock<std::mutex> guard(tilePool.lock);
+	while (true) {
+		tilePool.workCond.wait(guard, [] {
+			return tilePool.stopping || !tilePool.tasks.empty();
+		});
+		if (tilePool.stopping)
+			return;
+		runSiftTileTask(guard);
+	}
+}
+
+//Inner function stopping the threads of the tile pool (no tile may be queued)
+static void stopSiftTilePool() {
+	{
+		std::lock_guard<std::mutex> guard(tilePool.lock);
+		tilePool.stopping = true;
+	}
+	tilePool.workCond.notify_all();
+	for (size_t t=0; t<tilePool.threads.size(); t++)
+		tilePool.threads[t].join();
+	tilePool.threads.clear();
+	tilePool.stopping = false;
+}
+
+siftTilePool::~siftTilePool() {
+	stopSiftTilePool();
+}
+
+void spSetSiftTiling(int numOfThreads, int overlap) {
+	siftTileThreads = numOfThreads > 1 ? numOfThreads : 0;
+	siftTileOverlap = siftTileThreads > 0 && overlap > 0 ? overlap : 0;
+
+	// the calling thread of an extraction extracts tiles too, so the pool has
+	// one thread less than tiles (if threads cannot be created, the tiles
+	// are extracted by fewer threads)
+	stopSiftTilePool();
+	try {
+		for (int t=1; t<siftTileThreads; t++)
+			tilePool.threads.push_back(std::thread(siftTileWorkerMain));
+	}
+	catch (std::exception &) {
+	}
+}
+
+//Inner function choosing the grid of tiles an image is split into
+static void siftTileGrid(int cols, int rows, int *tilesX, int *tilesY) {
+	// the most tiles (at most siftTileThreads) whose cores have sides of at least
+	// SIFT_TILE_MIN_SIDE, and of those the closest to square tiles
+	*tilesX = 1;
+	*tilesY = 1;
+	double bestRatio = 0;
+	for (int tx=1; tx<=siftTileThreads && cols/tx >= SIFT_TILE_MIN_SIDE; tx++) {
+		int ty = std::min(siftTileThreads/tx, rows/SIFT_TILE_MIN_SIDE);
+		if (ty < 1)
+			break;
+		double width = (double) cols/tx, height = (double) rows/ty;
+		double ratio = width > height ? width/height : height/width;
+		if (tx*ty > *tilesX * *tilesY || (tx*ty == *tilesX * *tilesY && ratio < bestRatio)) {
+			*tilesX = tx;
+			*tilesY = ty;
+			bestRatio = ratio;
+		}
+	}
+}
+
+//Inner function extracting the sift descriptors of a loaded grayscale image from tiles in parallel
+static bool tiledSiftMat(Mat src, int nFeaturesToExtract, int tilesX, int tilesY, Mat *res) {
+	// the strongest nFeaturesToExtract keypoints of all tiles are kept
+	// returns false in case of allocation failure (of any tile)
+	std::vector<siftTile> tiles;
+	std::vector<std::pair<float, std::pair<int,int> > > order; // (-response, (tile, row))
+	try {
+		tiles.resize(tilesX*tilesY);
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	for (int ty=0; ty<tilesY; ty++)
+		for (int tx=0; tx<tilesX; tx++) {
+			siftTile &tile = tiles[ty*tilesX + tx];
+			int x0 = (int) ((long) tx*src.cols/tilesX), x1 = (int) ((long) (tx+1)*src.cols/tilesX);
+			int y0 = (int) ((long) ty*src.rows/tilesY), y1 = (int) ((long) (ty+1)*src.rows/tilesY);
+			tile.core = Rect(x0, y0, x1-x0, y1-y0);
+			int rx0 = std::max(x0 - siftTileOverlap, 0) / SIFT_TILE_ALIGN * SIFT_TILE_ALIGN;
+			int ry0 = std::max(y0 - siftTileOverlap, 0) / SIFT_TILE_ALIGN * SIFT_TILE_ALIGN;
+			int rx1 = std::min(x1 + siftTileOverlap, src.cols), ry1 = std::min(y1 + siftTileOverlap, src.rows);
+			tile.roi = Rect(rx0, ry0, rx1-rx0, ry1-ry0);
+			tile.failed = false;
+		}
+
+	// the other tiles are queued for the tile pool and the first is extracted
+	// by the calling thread, which then extracts queued tiles (of any image)
+	// until those of this image are done
+	int pending = 0;          // queued tiles not yet extracted (guarded by the pool lock)
+	size_t numOfQueued = 0;
+	try {
+		std::lock_guard<std::mutex> guard(tilePool.lock);
+		for (size_t t=1; t<tiles.size(); t++) {
+			siftTileTask task = { &src, &tiles[t], nFeaturesToExtract, &pending };
+			tilePool.tasks.push_back(task);
+			pending++;
+			numOfQueued++;
+		}
+	}
+	catch (std::bad_alloc &) {
+		// the tiles which could not be queued are extracted below
+	}
+	tilePool.workCond.notify_all();
+	siftTileMain(&src, &tiles[0], nFeaturesToExtract);
+	for (size_t t=numOfQueued+1; t<tiles.size(); t++)
+		siftTileMain(&src, &tiles[t], nFeaturesToExtract);
+	{
+		std::unique_lock<std::mutex> guard(tilePool.lock);
+		while (pending > 0) {
+			if (!tilePool.tasks.empty())
+				runSiftTileTask(guard);
+			else
+				tilePool.doneCond.wait(guard);
+		}
+	}
+
+	// merge the tiles by descending response
+	int dim = 0;
+	try {
+		for (size_t t=0; t<tiles.size(); t++) {
+			if (tiles[t].failed)
+				return false;
+			for (int r=0; r<tiles[t].desc.rows; r++)
+				order.push_back(std::make_pair(-tiles[t].kp[r].response, std::make_pair((int) t, r)));
+			if (tiles[t].desc.rows > 0)
+				dim = tiles[t].desc.cols;
+		}
+		std::sort(order.begin(), order.end());
+		int n = std::min((int) order.size(), nFeaturesToExtract);
+		*res = n > 0 ? Mat(n, dim, CV_32F) : Mat();
+		for (int i=0; i<n; i++) {
+			const Mat &desc = tiles[order[i].second.first].desc;
+			int r = order[i].second.second;
+			for (int j=0; j<dim; j++)
+				res->at<float>(i,j) = desc.at<float>(r,j);
+		}
+	}
+	catch (std::exception &) {
+		return false;
+	}
+	return true;
+}
+
+//Inner function extracting the sift descriptors of a loaded grayscale image into a matrix
+static Mat siftMat(Mat src, int nFeaturesToExtract) {
+	// one descriptor per row
+
+	// downsample large images (see spSetSiftMaxSide)
+	int side = src.rows > src.cols ? src.rows : src.cols;
+	if (siftMaxSide > 0 && side > siftMaxSide) {
+		double scale = (double) siftMaxSide / side;
+		Mat scaled;
+		resize(src, scaled, Size(), scale, scale, INTER_AREA);
+		src = scaled;
+	}
+
+	// extract features from tiles in parallel (see spSetSiftTiling), or from
+	// the whole image if it is too small to be split or a tile failed
+	if (siftTileThreads > 1) {
+		int tilesX, tilesY;
+		Mat tiled;
+		siftTileGrid(src.cols, src.rows, &tilesX, &tilesY);
+		if (tilesX*tilesY > 1 && tiledSiftMat(src, nFeaturesToExtract, tilesX, tilesY, &tiled))
+			return tiled;
+	}
+
 	// extract features
 	std::vector<cv::KeyPoint> kp1;
 	Mat ds1;
@@ -120,6 +595,12 @@ SPPoint** spGetSiftDescriptors(const char* str, int imageIndex, int nFeaturesToE
 			xfeatures2d::SIFT::create(nFeaturesToExtract);
 	detect->detect(src, kp1, Mat());
 	detect->compute(src, kp1, ds1);
+	return ds1;
+}
+
+SPPoint** siftFromMat(Mat src, int imageIndex, int nFeaturesToExtract, int *nFeatures) {
+	// extracts sift features of a loaded grayscale image (see spGetSiftDescriptors)
+	Mat ds1 = siftMat(src, nFeaturesToExtract);
 
 	// allocate sift descriptors array
 	*nFeatures = ds1.rows;
@@ -146,49 +627,292 @@ SPPoint** spGetSiftDescriptors(const char* str, int imageIndex, int nFeaturesToE
 	return sift_desc;
 }
 
-int* spBestSIFTL2SquaredDistance(int kClosest, SPPoint* queryFeature,
-		SPPoint*** databaseFeatures, int numberOfImages,
-		int* nFeaturesPerImage) {
+//Inner function extracting the sift descriptors of a loaded grayscale image into reusable points
+static int siftIntoFromMat(Mat src, int imageIndex, int nFeaturesToExtract,
+		SPPoint*** sift, int* capacity) {
+	// see spGetSiftDescriptorsInto
+	Mat ds1 = siftMat(src, nFeaturesToExtract);
+
+	// grow the array (new entries are NULL until stored)
+	int nFeatures = ds1.rows;
+	if (nFeatures > *capacity) {
+		SPPoint **grown = (SPPoint**) realloc(*sift, nFeatures*sizeof(SPPoint*));
+		if (grown == NULL) {
+			printf("%s",MEMORY_ERROR);
+			return -1;
+		}
+		for (int i=*capacity; i<nFeatures; i++)
+			grown[i] = NULL;
+		*sift = grown;
+		*capacity = nFeatures;
+	}
+	for (int i=0; i<nFeatures; i++)
+		if (!storePointFromFloatMat(*sift + i, ds1, i, 1, imageIndex)) {
+			printf("%s",MEMORY_ERROR);
+			return -1;
+		}
+	return nFeatures;
+}
 
-	if (queryFeature == NULL || databaseFeatures == NULL ||
-			nFeaturesPerImage == NULL || numberOfImages <= 1)
+SPPoint** spGetSiftDescriptors(const char* str, int imageIndex, int nFeaturesToExtract, int *nFeatures) {
+
+	if (str == NULL || nFeatures == NULL || nFeaturesToExtract <= 0)
+		return NULL;
+
+	Mat src = decodeImage(str, NULL, 0, CV_LOAD_IMAGE_GRAYSCALE);
+	if (src.empty()) {
+		imageLoadingError(str);
+		return NULL;
+	}
+
+	return siftFromMat(src, imageIndex, nFeaturesToExtract, nFeatures);
+}
+
+SPPoint** spGetSiftDescriptorsFromBuffer(const char* str, const unsigned char* buf, size_t size,
+		int imageIndex, int nFeaturesToExtract, int *nFeatures) {
+
+	if (buf == NULL || nFeatures == NULL || nFeaturesToExtract <= 0)
+		return NULL;
+
+	Mat src = decodeImage(str, buf, size, CV_LOAD_IMAGE_GRAYSCALE);
+	if (src.empty()) {
+		imageLoadingError(str);
+		return NULL;
+	}
+
+	return siftFromMat(src, imageIndex, nFeaturesToExtract, nFeatures);
+}
+
+int spGetRGBHistInto(const char* str, int imageIndex, int nBins, SPPoint** hist) {
+
+	if (str == NULL || hist == NULL)
+		return -1;
+
+	Mat src = decodeImage(str, NULL, 0, histDecodeFlags());
+	if (src.empty()) {
+		imageLoadingError(str);
+		return -1;
+	}
+
+	return rgbHistIntoFromMat(src, imageIndex, nBins, hist, spGetHistDecodedReduction()) ? 0 : -1;
+}
+
+int spGetSiftDescriptorsInto(const char* str, int imageIndex, int nFeaturesToExtract,
+		SPPoint*** sift, int* capacity) {
+
+	if (str == NULL || sift == NULL || capacity == NULL || nFeaturesToExtract <= 0)
+		return -1;
+
+	Mat src = decodeImage(str, NULL, 0, CV_LOAD_IMAGE_GRAYSCALE);
+	if (src.empty()) {
+		imageLoadingError(str);
+		return -1;
+	}
+
+	return siftIntoFromMat(src, imageIndex, nFeaturesToExtract, sift, capacity);
+}
+
+struct sp_frame_reader_t {
+	VideoCapture capture;
+	Mat frame;      // the current frame (color)
+	Mat gray;       // the current frame converted to grayscale (reused)
+	bool hasGray;   // gray holds the current frame
+};
+
+SPFrameReader* spFrameReaderOpen(const char* str) {
+	if (str == NULL)
+		return NULL;
+
+	SPFrameReader *res = new (std::nothrow) SPFrameReader;
+	if (res == NULL) {
+		printf("%s",MEMORY_ERROR);
 		return NULL;
+	}
+	if (!res->capture.open(str) || !res->capture.isOpened()) {
+		printf("%s - %s\n",VIDEO_LOADING_ERROR, str);
+		delete res;
+		return NULL;
+	}
+	res->hasGray = false;
+	return res;
+}
+
+void spFrameReaderClose(SPFrameReader* reader) {
+	if (reader != NULL)
+		reader->capture.release();
+	delete reader;
+}
+
+double spFrameReaderFps(SPFrameReader* reader) {
+	if (reader == NULL)
+		return 0;
+	double fps = reader->capture.get(CAP_PROP_FPS);
+	return fps > 0 ? fps : 0;
+}
+
+int spFrameReaderNext(SPFrameReader* reader) {
+	if (reader == NULL)
+		return -1;
 
+	// reading and decompressing a frame is accounted as decoding
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool read = reader->capture.read(reader->frame) && !reader->frame.empty();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	decodeSeconds += elapsed.count();
+	reader->hasGray = false;
+	return read ? 1 : 0;
+}
+
+int spFrameReaderHistInto(SPFrameReader* reader, int imageIndex, int nBins, SPPoint** hist) {
+	if (reader == NULL || hist == NULL || reader->frame.empty())
+		return -1;
+	return rgbHistIntoFromMat(reader->frame, imageIndex, nBins, hist, 1) ? 0 : -1;
+}
+
+int spFrameReaderSiftInto(SPFrameReader* reader, int imageIndex, int nFeaturesToExtract,
+		SPPoint*** sift, int* capacity) {
+	if (reader == NULL || sift == NULL || capacity == NULL || nFeaturesToExtract <= 0 ||
+			reader->frame.empty())
+		return -1;
+	if (!reader->hasGray) {
+		cvtColor(reader->frame, reader->gray, COLOR_BGR2GRAY);
+		reader->hasGray = true;
+	}
+	return siftIntoFromMat(reader->gray, imageIndex, nFeaturesToExtract, sift, capacity);
+}
+
+template <int K, typename Kernel>
+static int bestSIFTFixedK(const Kernel &kernel, SPPoint* queryFeature, SPPoint*** databaseFeatures,
+		int numberOfImages, int* nFeaturesPerImage, int* closest) {
+	// scans all database features keeping the K closest in an SPTopK
+	// returns the number of indices stored in closest
+
+	SPTopK<K> top;
+	top.clear();
+	const double *query = spPointGetData(queryFeature);
+	for (int i=0; i<numberOfImages; i++)
+		for (int j=0; j<nFeaturesPerImage[i]; j++)
+			top.push(spPointGetIndex(databaseFeatures[i][j]),
+					kernel(query,spPointGetData(databaseFeatures[i][j])));
+
+	for (int i=0; i<top.size(); i++)
+		closest[i] = top.index[i];
+	return top.size();
+}
+
+template <typename Kernel>
+static int bestSIFTQueue(const Kernel &kernel, int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages, int* nFeaturesPerImage, int* closest,
+		SPBPQueue* queue) {
+	// scans all database features keeping the kClosest closest in an SPBPQueue
+	// (queue if given, otherwise a new one)
+	// returns the number of indices stored in closest, -1 on allocation failure
 
 	// allocate distance queue
-	SPBPQueue* distanceQueue = spBPQueueCreate(kClosest);
+	SPBPQueue* distanceQueue = queue != NULL ? queue : spBPQueueCreate(kClosest);
 	if (distanceQueue == NULL) {
 		printf("%s",MEMORY_ERROR);
-		return NULL;
+		return -1;
 	}
+	spBPQueueClear(distanceQueue);
 
 	int index;
 	double dist;
+	const double *query = spPointGetData(queryFeature);
 	// fill  distance queue with indices of kClosest features
 	for (int i=0; i<numberOfImages; i++) {
 		for (int j=0; j<nFeaturesPerImage[i]; j++) {
-			dist = spPointL2SquaredDistance(queryFeature,databaseFeatures[i][j]);
+			dist = kernel(query,spPointGetData(databaseFeatures[i][j]));
 			index = spPointGetIndex(databaseFeatures[i][j]);
 			spBPQueueEnqueue(distanceQueue, index, dist);
 		}
 	}
 
+	// populate array of closest image indices
+	BPQueueElement elem;
+	int n = 0;
+	while (spBPQueuePeek(distanceQueue, &elem) == SP_BPQUEUE_SUCCESS) {
+		closest[n++] = elem.index;
+		spBPQueueDequeue(distanceQueue);
+	}
+	if (distanceQueue != queue)
+		spBPQueueDestroy(distanceQueue);
+
+	return n;
+}
+
+// a scan of spBestSIFTL2SquaredDistanceWithQueue (see spL2Dispatch)
+struct bestSIFTScan {
+	int kClosest;
+	SPPoint* queryFeature;
+	SPPoint*** databaseFeatures;
+	int numberOfImages;
+	int* nFeaturesPerImage;
+	int* closest;
+	SPBPQueue* queue;
+	int found;   // number of indices stored in closest, -1 on allocation failure
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		// small k - select without a priority queue (cases up to SP_TOPK_MAX_FIXED)
+		switch (kClosest) {
+		case 1: found = bestSIFTFixedK<1>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 2: found = bestSIFTFixedK<2>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 3: found = bestSIFTFixedK<3>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 4: found = bestSIFTFixedK<4>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 5: found = bestSIFTFixedK<5>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 6: found = bestSIFTFixedK<6>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 7: found = bestSIFTFixedK<7>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		case 8: found = bestSIFTFixedK<8>(kernel, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest); break;
+		default: found = bestSIFTQueue(kernel, kClosest, queryFeature, databaseFeatures, numberOfImages, nFeaturesPerImage, closest, queue); break;
+		}
+	}
+};
+
+int spBestSIFTL2SquaredDistanceInto(int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages,
+		int* nFeaturesPerImage, int* closest) {
+	return spBestSIFTL2SquaredDistanceWithQueue(kClosest, queryFeature, databaseFeatures,
+			numberOfImages, nFeaturesPerImage, closest, NULL);
+}
+
+int spBestSIFTL2SquaredDistanceWithQueue(int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages,
+		int* nFeaturesPerImage, int* closest, SPBPQueue* queue) {
+
+	if (queryFeature == NULL || databaseFeatures == NULL ||
+			nFeaturesPerImage == NULL || numberOfImages <= 1 ||
+			closest == NULL || kClosest <= 0 ||
+			(queue != NULL && kClosest > SP_TOPK_MAX_FIXED && spBPQueueGetMaxSize(queue) != kClosest))
+		return -1;
+
+	// the kernel for the feature dimension, and then the selection for k, are
+	// chosen once for the whole scan
+	bestSIFTScan scan = { kClosest, queryFeature, databaseFeatures, numberOfImages,
+			nFeaturesPerImage, closest, queue, -1 };
+	spL2Dispatch(spPointGetDimension(queryFeature), scan);
+	return scan.found;
+}
+
+int* spBestSIFTL2SquaredDistance(int kClosest, SPPoint* queryFeature,
+		SPPoint*** databaseFeatures, int numberOfImages,
+		int* nFeaturesPerImage) {
+
+	if (queryFeature == NULL || databaseFeatures == NULL ||
+			nFeaturesPerImage == NULL || numberOfImages <= 1 || kClosest <= 0)
+		return NULL;
+
 	// allocate array of closest image indices
 	int *closest = (int*) malloc(kClosest * sizeof(int));
 	if (closest == NULL) {
 		printf("%s",MEMORY_ERROR);
-		spBPQueueDestroy(distanceQueue);
 		return NULL;
 	}
 
-	// populate array of closest image indices
-	BPQueueElement elem;
-	for (int i=0; i<kClosest; i++) { // assume distanceQueue is full
-		spBPQueuePeek(distanceQueue, &elem);
-		closest[i] = elem.index;
-		spBPQueueDequeue(distanceQueue);
+	if (spBestSIFTL2SquaredDistanceInto(kClosest, queryFeature, databaseFeatures,
+			numberOfImages, nFeaturesPerImage, closest) == -1) {
+		free(closest);
+		return NULL;
 	}
-	spBPQueueDestroy(distanceQueue);
-
 	return closest;
 }
@@ -0,0 +1,93 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <new>
+#include "sp_lazy_index.h"
+
+struct sp_lazy_index_t {
+	std::string path;
+	std::vector<SPIndexShard*> shards; // NULL until mapped
+	int numOfOpenShards;
+	bool stopping;
+	std::mutex lock;                   // guards shards, numOfOpenShards and stopping
+	std::thread warmUp;
+};
+
+static void warmUpMain(SPLazyIndex *index) {
+	// maps the shards in order and faults in their pages
+	for (int shard=0; shard<(int) index->shards.size(); shard++) {
+		{
+			std::lock_guard<std::mutex> guard(index->lock);
+			if (index->stopping)
+				return;
+		}
+		// pages are faulted in without holding the lock (shards are only
+		// unmapped after this thread is joined)
+		spIndexShardWarmUp(spLazyIndexGetShard(index, shard));
+	}
+}
+
+SPLazyIndex* spLazyIndexCreate(const char *path, const SPIndexManifest *manifest, bool warmUp) {
+	if (path == NULL || manifest == NULL || manifest->numOfShards <= 0)
+		return NULL;
+
+	SPLazyIndex *res = new (std::nothrow) SPLazyIndex;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->path = path;
+		res->shards.assign(manifest->numOfShards, NULL);
+		res->numOfOpenShards = 0;
+		res->stopping = false;
+		if (warmUp)
+			res->warmUp = std::thread(warmUpMain, res);
+	}
+	catch (std::exception &) { // allocation or thread creation failure
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spLazyIndexDestroy(SPLazyIndex *index) {
+	if (index != NULL) {
+		{
+			std::lock_guard<std::mutex> guard(index->lock);
+			index->stopping = true;
+		}
+		if (index->warmUp.joinable())
+			index->warmUp.join();
+		for (size_t i=0; i<index->shards.size(); i++)
+			spIndexShardClose(index->shards[i]);
+		delete index;
+	}
+}
+
+SPIndexShard* spLazyIndexGetShard(SPLazyIndex *index, int shard) {
+	if (index == NULL || shard < 0 || shard >= (int) index->shards.size())
+		return NULL;
+
+	std::lock_guard<std::mutex> guard(index->lock);
+	if (index->shards[shard] == NULL) {
+		// mapping reads only the shard header, so holding the lock is short
+		try {
+			std::vector<char> shardPath(index->path.size() + 16);
+			spIndexShardPath(shardPath.data(), index->path.c_str(), shard);
+			index->shards[shard] = spIndexShardOpen(shardPath.data());
+		}
+		catch (std::bad_alloc &) {
+			return NULL;
+		}
+		if (index->shards[shard] != NULL)
+			index->numOfOpenShards++;
+	}
+	return index->shards[shard];
+}
+
+int spLazyIndexNumOfOpenShards(SPLazyIndex *index) {
+	if (index == NULL)
+		return 0;
+	std::lock_guard<std::mutex> guard(index->lock);
+	return index->numOfOpenShards;
+}
@@ -0,0 +1,77 @@
+#ifndef SP_LAZY_INDEX_H_
+#define SP_LAZY_INDEX_H_
+
+extern "C" {
+	#include "SPIndex.h"
+}
+
+/**
+ * SP Lazy Index summary
+ * Keeps the shards of an on-disk index (see SPIndex.h) mapped across queries,
+ * mapping each shard on its first access instead of all of them at startup.
+ *
+ * Creating a lazy index opens no file, so queries can be answered right after
+ * launch. A shard is mapped the first time a search needs it and stays mapped
+ * until the lazy index is destroyed, and since pages of a mapped shard are
+ * faulted in only when read, memory is only committed for the parts of the
+ * shards actually searched.
+ *
+ * Optionally a background thread warms the index up: it maps the shards in
+ * order and faults in all their pages (see spIndexShardWarmUp), so the first
+ * searches of a shard warmed up before them do not wait for the disk.
+ * Searches and the warm-up thread may access shards concurrently.
+ *
+ * The following functions are supported:
+ *
+ * spLazyIndexCreate             - Creates a lazy index (and starts the warm-up)
+ * spLazyIndexDestroy            - Stops the warm-up, unmaps all shards and frees all resources
+ * spLazyIndexGetShard           - Returns a shard, mapping it on first access
+ * spLazyIndexNumOfOpenShards    - A getter of the number of mapped shards
+ */
+
+/** Type for defining the lazy index **/
+typedef struct sp_lazy_index_t SPLazyIndex;
+
+/**
+ * Creates a lazy index of the index path. No shard is mapped.
+ *
+ * @param path - the index path
+ * @param manifest - the build parameters of the index
+ * @param warmUp - if true, a background thread maps and faults in all shards
+ * @return
+ * NULL in case any of the pointers is NULL, the index has no shards or
+ * allocation failure occurred
+ * Otherwise, the new lazy index
+ */
+SPLazyIndex* spLazyIndexCreate(const char *path, const SPIndexManifest *manifest, bool warmUp);
+
+/**
+ * Stops the warm-up thread (after the shard it is warming up), unmaps all
+ * shards and frees all resources associated with the lazy index.
+ * If index is NULL nothing happens.
+ */
+void spLazyIndexDestroy(SPLazyIndex *index);
+
+/**
+ * Returns a shard of the index, mapping it if it was not accessed before.
+ * The shard stays valid until the lazy index is destroyed and must not be
+ * closed by the caller. A shard which fails to map is not remembered, so it
+ * is mapped again on its next access.
+ *
+ * @param index - the source lazy index
+ * @param shard - the shard number
+ * @return NULL if index is NULL, shard is out of range or the shard file
+ *         could not be mapped, otherwise the shard
+ */
+SPIndexShard* spLazyIndexGetShard(SPLazyIndex *index, int shard);
+
+/**
+ * A getter for the number of shards mapped so far
+ *
+ * @param index - the source lazy index
+ * @return the number of mapped shards, 0 if index is NULL
+ */
+int spLazyIndexNumOfOpenShards(SPLazyIndex *index);
+
+
+#endif /* SP_LAZY_INDEX_H_ */
@@ -0,0 +1,405 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#include <sched.h>
+#include <dirent.h>
+#include "sp_numa_store.h"
+#include "sp_distance_kernels.h"
+
+#define NUMA_STORE_NODE_DIR "/sys/devices/system/node"
+// number of database features scanned for all query features before moving on
+// (a block of 128 dimensional features stays in the L2 cache)
+#define NUMA_STORE_BLOCK 256
+
+struct numa_partition {
+	std::vector<int> cpus;  // CPUs of the node owning the partition
+	double *features;       // count*dim coordinates, first touched on the node
+	int *images;            // image index of each feature
+	long count;
+};
+
+struct numa_worker {
+	int partition;
+	long begin, end;                 // slice of the partition features
+	std::vector<SPBPQueue*> queues;  // k closest features of each query feature
+	long scanned;                    // number of features scanned in the last search
+	bool failed;
+};
+
+struct sp_numa_store_t {
+	int dim;
+	std::vector<numa_partition> partitions;
+	std::vector<numa_worker> workers;
+	std::vector<std::thread> threads;
+	std::mutex searchLock;             // held by a search for its whole duration
+	std::mutex lock;
+	std::condition_variable workCond;  // signaled when a search starts (or on destroy)
+	std::condition_variable doneCond;  // signaled when the last worker finishes
+	long generation;                   // incremented on every search
+	int pending;                       // number of workers still searching
+	bool stopping;
+	// current search
+	const double *queries;
+	int numOfQueries;
+	int k;
+	const char *selected;
+};
+
+static void pinToCpus(const std::vector<int> &cpus) {
+	// restricts the calling thread to cpus (failure only loses locality)
+	if (cpus.empty())
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i=0; i<cpus.size(); i++)
+		CPU_SET(cpus[i], &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+static bool parseCpuList(const char *path, const cpu_set_t &allowed, std::vector<int> &cpus) {
+	// parses a kernel cpu list ("0-3,8,10-11") keeping allowed CPUs only
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		return false;
+	int first, last;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		int c = fgetc(file);
+		if (c == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			c = fgetc(file);
+		}
+		for (int cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		if (c != ',')
+			break;
+	}
+	fclose(file);
+	return true;
+}
+
+static void readTopology(std::vector<std::vector<int> > &nodes) {
+	// reads the CPUs of every NUMA node, or a single node holding all allowed
+	// CPUs if the topology is unavailable
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &allowed);
+
+	std::vector<int> ids;
+	DIR *dir = opendir(NUMA_STORE_NODE_DIR);
+	if (dir != NULL) {
+		struct dirent *entry;
+		int id;
+		char rest;
+		while ((entry = readdir(dir)) != NULL)
+			if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1)
+				ids.push_back(id);
+		closedir(dir);
+	}
+	std::sort(ids.begin(), ids.end());
+
+	char path[256];
+	for (size_t i=0; i<ids.size(); i++) {
+		std::vector<int> cpus;
+		sprintf(path, "%s/node%d/cpulist", NUMA_STORE_NODE_DIR, ids[i]);
+		if (parseCpuList(path, allowed, cpus) && !cpus.empty())
+			nodes.push_back(cpus);
+	}
+	if (nodes.empty()) {
+		std::vector<int> cpus;
+		for (int cpu=0; cpu<CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		nodes.push_back(cpus);
+	}
+}
+
+static void fillPartition(numa_partition *partition, SPPoint ***siftDB, int *nFeatures,
+		int firstImage, int lastImage, int dim) {
+	// allocates and copies the features of images firstImage, ..., lastImage-1
+	// on a thread pinned to the node, so the pages are placed on the node
+	pinToCpus(partition->cpus);
+	partition->features = (double*) malloc((partition->count > 0 ? partition->count : 1)*dim*sizeof(double));
+	partition->images = (int*) malloc((partition->count > 0 ? partition->count : 1)*sizeof(int));
+	if (partition->features == NULL || partition->images == NULL)
+		return;
+	long f = 0;
+	for (int i=firstImage; i<lastImage; i++) {
+		for (int j=0; j<nFeatures[i]; j++, f++) {
+			for (int d=0; d<dim; d++)
+				partition->features[f*dim+d] = spPointGetAxisCoor(siftDB[i][j], d);
+			partition->images[f] = spPointGetIndex(siftDB[i][j]);
+		}
+	}
+}
+
+// the scan of a worker slice (see spL2Dispatch)
+struct numa_slice_scan {
+	SPNumaStore *store;
+	numa_worker *worker;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		const numa_partition &partition = store->partitions[worker->partition];
+		const int dim = store->dim;
+		for (long block=worker->begin; block<worker->end; block+=NUMA_STORE_BLOCK) {
+			long blockEnd = std::min(block + NUMA_STORE_BLOCK, worker->end);
+			for (int q=0; q<store->numOfQueries; q++) {
+				const double *query = store->queries + (long) q*dim;
+				for (long f=block; f<blockEnd; f++) {
+					int image = partition.images[f];
+					if (store->selected != NULL && !store->selected[image])
+						continue;
+					double dist = kernel(query, partition.features + f*dim);
+					spBPQueueEnqueue(worker->queues[q], image, dist);
+				}
+			}
+			for (long f=block; f<blockEnd; f++)
+				if (store->selected == NULL || store->selected[partition.images[f]])
+					worker->scanned++;
+		}
+	}
+};
+
+static bool scanSlice(SPNumaStore *store, numa_worker *worker) {
+	// finds the k closest features of the worker slice to every query feature
+	try {
+		if (worker->queues.empty() || spBPQueueGetMaxSize(worker->queues[0]) != store->k) {
+			for (size_t i=0; i<worker->queues.size(); i++)
+				spBPQueueDestroy(worker->queues[i]);
+			worker->queues.clear();
+		}
+		while ((int) worker->queues.size() < store->numOfQueries) {
+			SPBPQueue *queue = spBPQueueCreate(store->k);
+			if (queue == NULL)
+				return false;
+			worker->queues.push_back(queue);
+		}
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+
+	worker->scanned = 0;
+	for (int q=0; q<store->numOfQueries; q++)
+		spBPQueueClear(worker->queues[q]);
+	numa_slice_scan scan = { store, worker };
+	spL2Dispatch(store->dim, scan);
+	return true;
+}
+
+static void workerMain(SPNumaStore *store, int index) {
+	// waits for searches and scans the worker slice on the node's CPUs
+	numa_worker *worker = &store->workers[index];
+	pinToCpus(store->partitions[worker->partition].cpus);
+	long seen = 0;
+	std::unique_lock<std::mutex> guard(store->lock);
+	while (true) {
+		store->workCond.wait(guard, [store, seen] {
+			return store->stopping || store->generation != seen;
+		});
+		if (store->stopping)
+			return;
+		seen = store->generation;
+		guard.unlock();
+		worker->failed = !scanSlice(store, worker);
+		guard.lock();
+		if (--store->pending == 0)
+			store->doneCond.notify_all();
+	}
+}
+
+SPNumaStore* spNumaStoreCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfNodes, int threadsPerNode) {
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0 ||
+			numOfNodes < 0 || threadsPerNode <= 0)
+		return NULL;
+
+	SPNumaStore *res = new (std::nothrow) SPNumaStore;
+	if (res == NULL)
+		return NULL;
+	res->dim = 0;
+	res->generation = 0;
+	res->pending = 0;
+	res->stopping = false;
+
+	try {
+		std::vector<std::vector<int> > nodes;
+		readTopology(nodes);
+		if (numOfNodes == 0)
+			numOfNodes = (int) nodes.size();
+
+		long totalFeatures = 0;
+		for (int i=0; i<numOfImages; i++) {
+			totalFeatures += nFeatures[i];
+			if (res->dim == 0 && nFeatures[i] > 0)
+				res->dim = spPointGetDimension(siftDB[i][0]);
+		}
+
+		// split images into contiguous ranges of about the same number of features
+		std::vector<int> firstImage(numOfNodes + 1, numOfImages);
+		firstImage[0] = 0;
+		res->partitions.resize(numOfNodes);
+		long sum = 0;
+		for (int p=0, i=0; p<numOfNodes; p++) {
+			firstImage[p] = i;
+			numa_partition &partition = res->partitions[p];
+			partition.cpus = nodes[p % nodes.size()];
+			partition.features = NULL;
+			partition.images = NULL;
+			partition.count = 0;
+			for (; i<numOfImages && (p == numOfNodes-1 || sum < totalFeatures*(p+1)/numOfNodes); i++) {
+				partition.count += nFeatures[i];
+				sum += nFeatures[i];
+			}
+		}
+
+		// copy each partition on its node
+		std::vector<std::thread> fillers;
+		for (int p=0; p<numOfNodes; p++)
+			fillers.push_back(std::thread(fillPartition, &res->partitions[p], siftDB, nFeatures,
+					firstImage[p], firstImage[p+1], res->dim));
+		for (size_t p=0; p<fillers.size(); p++)
+			fillers[p].join();
+		for (int p=0; p<numOfNodes; p++) {
+			if (res->partitions[p].features == NULL || res->partitions[p].images == NULL) {
+				spNumaStoreDestroy(res);
+				return NULL;
+			}
+		}
+
+		// split each partition among the node's workers
+		for (int p=0; p<numOfNodes; p++) {
+			long count = res->partitions[p].count;
+			for (int t=0; t<threadsPerNode; t++) {
+				numa_worker worker;
+				worker.partition = p;
+				worker.begin = count*t/threadsPerNode;
+				worker.end = count*(t+1)/threadsPerNode;
+				worker.scanned = 0;
+				worker.failed = false;
+				res->workers.push_back(worker);
+			}
+		}
+		for (size_t w=0; w<res->workers.size(); w++)
+			res->threads.push_back(std::thread(workerMain, res, (int) w));
+	}
+	catch (std::exception &) { // allocation or thread creation failure
+		spNumaStoreDestroy(res);
+		return NULL;
+	}
+	return res;
+}
+
+void spNumaStoreDestroy(SPNumaStore *store) {
+	if (store != NULL) {
+		{
+			std::lock_guard<std::mutex> guard(store->lock);
+			store->stopping = true;
+		}
+		store->workCond.notify_all();
+		for (size_t i=0; i<store->threads.size(); i++)
+			store->threads[i].join();
+		for (size_t i=0; i<store->workers.size(); i++)
+			for (size_t q=0; q<store->workers[i].queues.size(); q++)
+				spBPQueueDestroy(store->workers[i].queues[q]);
+		for (size_t p=0; p<store->partitions.size(); p++) {
+			free(store->partitions[p].features);
+			free(store->partitions[p].images);
+		}
+		delete store;
+	}
+}
+
+int spNumaStoreNumOfNodes(SPNumaStore *store) {
+	if (store == NULL)
+		return 0;
+	return (int) store->partitions.size();
+}
+
+long spNumaStoreMemoryBytes(SPNumaStore *store) {
+	if (store == NULL)
+		return 0;
+	long bytes = sizeof(*store);
+	for (size_t p=0; p<store->partitions.size(); p++) {
+		long count = store->partitions[p].count > 0 ? store->partitions[p].count : 1;
+		bytes += count*store->dim*sizeof(double) + count*sizeof(int);
+	}
+	return bytes;
+}
+
+bool spNumaStoreSearch(SPNumaStore *store, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected, SPSearchScratch *scratch) {
+	if (store == NULL || queries == NULL || queues == NULL || scratch == NULL)
+		return false;
+	scratch->scanBytes = 0;
+	scratch->scanSeconds = 0;
+	if (numOfQueries <= 0)
+		return true;
+
+	// flatten query features
+	const int dim = store->dim;
+	try {
+		scratch->query.resize((long) numOfQueries*dim);
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	double *flat = scratch->query.data();
+	for (int q=0; q<numOfQueries; q++) {
+		if (spPointGetDimension(queries[q]) != dim)
+			return false;
+		for (int d=0; d<dim; d++)
+			flat[(long) q*dim+d] = spPointGetAxisCoor(queries[q], d);
+	}
+
+	// start all workers and wait for them (the workers and their queues serve
+	// one search at a time, concurrent searches wait for the previous ones)
+	std::lock_guard<std::mutex> search(store->searchLock);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> guard(store->lock);
+		store->queries = flat;
+		store->numOfQueries = numOfQueries;
+		store->k = spBPQueueGetMaxSize(queues[0]);
+		store->selected = selected;
+		store->pending = (int) store->workers.size();
+		store->generation++;
+		store->workCond.notify_all();
+		store->doneCond.wait(guard, [store] { return store->pending == 0; });
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	// merge the closest features found by each worker
+	bool ok = true;
+	long scanned = 0;
+	BPQueueElement elem;
+	for (size_t w=0; w<store->workers.size(); w++) {
+		numa_worker &worker = store->workers[w];
+		if (worker.failed) {
+			ok = false;
+			continue;
+		}
+		scanned += worker.scanned;
+		for (int q=0; q<numOfQueries; q++) {
+			while (spBPQueuePeek(worker.queues[q], &elem) == SP_BPQUEUE_SUCCESS) {
+				spBPQueueEnqueue(queues[q], elem.index, elem.value);
+				spBPQueueDequeue(worker.queues[q]);
+			}
+		}
+	}
+	scratch->scanBytes = (double) scanned*dim*sizeof(double);
+	scratch->scanSeconds = elapsed.count();
+	return ok;
+}
@@ -0,0 +1,103 @@
+#ifndef SP_NUMA_STORE_H_
+#define SP_NUMA_STORE_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+	#include "SPBPriorityQueue.h"
+}
+
+/**
+ * SP NUMA Store summary
+ * A copy of the sift feature database partitioned across NUMA nodes, searched
+ * by worker threads pinned to the node owning their partition.
+ *
+ * Images are split into one contiguous range per node (balanced by number of
+ * features). The features of each range are copied into a flat array by a
+ * thread pinned to the node's CPUs, so the pages are placed on that node by
+ * the kernel's first-touch policy. Each node then runs threadsPerNode search
+ * workers pinned to its CPUs, each scanning a slice of its node's array only.
+ * Every worker keeps its own k closest features per query feature and the
+ * results are merged with bounded priority queues, so ties are broken exactly
+ * as in spBestSIFTL2SquaredDistance. The workers serve one search at a time:
+ * concurrent searches are safe and wait for each other.
+ *
+ * Nodes and their CPUs are read from /sys/devices/system/node. If more nodes
+ * are requested than exist (or the topology is unavailable), partitions share
+ * the existing CPUs, which still gives a parallel search.
+ *
+ * The following functions are supported:
+ *
+ * spNumaStoreCreate      - Partitions the database and starts the pinned workers
+ * spNumaStoreDestroy     - Stops the workers and frees all resources
+ * spNumaStoreNumOfNodes  - A getter of the number of partitions
+ * spNumaStoreMemoryBytes - A getter of the memory used by the partitioned copy
+ * spNumaStoreSearch      - Finds the closest sift features to query features
+ */
+
+/** Type for defining the store **/
+typedef struct sp_numa_store_t SPNumaStore;
+
+/**
+ * Partitions the sift feature database across NUMA nodes and starts
+ * threadsPerNode pinned search workers on each node.
+ *
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @param numOfNodes - number of partitions, if 0 the number of NUMA nodes is used
+ * @param threadsPerNode - number of search workers on each node (must be > 0)
+ * @return
+ * NULL in case any of the pointers is NULL, numOfImages <= 0, numOfNodes < 0,
+ * threadsPerNode <= 0, or allocation or thread creation failure occurred
+ * Otherwise, the new store
+ */
+SPNumaStore* spNumaStoreCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfNodes, int threadsPerNode);
+
+/**
+ * Stops all workers and frees all resources associated with the store.
+ * If store is NULL nothing happens.
+ */
+void spNumaStoreDestroy(SPNumaStore *store);
+
+/**
+ * A getter for the number of partitions (nodes) of the store
+ *
+ * @param store - the source store
+ * @return the number of partitions, 0 if store is NULL
+ */
+int spNumaStoreNumOfNodes(SPNumaStore *store);
+
+/**
+ * A getter for the memory used by the partitioned copy of the features
+ *
+ * @param store - the source store
+ * @return the number of bytes (over all nodes), 0 if store is NULL
+ */
+long spNumaStoreMemoryBytes(SPNumaStore *store);
+
+/**
+ * Finds the closest sift features in the store to each query feature.
+ * The results of all workers are enqueued to queues[i] for query feature i,
+ * so the queues hold the same elements as after enqueuing every database
+ * feature (as spBestSIFTL2SquaredDistance does).
+ *
+ * @param store - the source store
+ * @param queries - the query features
+ * @param numOfQueries - number of query features
+ * @param queues - a bounded priority queue for each query feature
+ *                 (all of the same maximum size)
+ * @param selected - if not NULL, only images i for which selected[i] is
+ *                   non zero are searched
+ * @param scratch - the scratch space of the search (see sp_search_scratch),
+ *                  its scanBytes and scanSeconds are set to the number of
+ *                  descriptor bytes scanned and the wall time of the scan
+ * @return false if any of store, queries, queues, scratch is NULL, the feature
+ *         dimensions do not match or allocation failure occurred, true otherwise
+ */
+bool spNumaStoreSearch(SPNumaStore *store, SPPoint **queries, int numOfQueries,
+		SPBPQueue **queues, const char *selected, SPSearchScratch *scratch);
+
+
+#endif /* SP_NUMA_STORE_H_ */
@@ -0,0 +1,400 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include "sp_image_proc_util.h"
+#include "sp_image_proc_ext.h"
+#include "main_aux.h"
+
+/**
+ * Replay of a recorded query trace against the database.
+ *
+ * Reads the database parameters like ex3 (no queries are read), preprocesses
+ * the database and replays the queries of the trace written by ex3 with
+ * QUERY_TRACE, keeping their recorded arrival times (scaled by REPLAY_RATE) so
+ * the load of the recorded session is reproduced. The database parameters
+ * must be those of the trace.
+ *
+ * Queries are answered as recorded: descriptors are extracted with the
+ * recorded resolution, tiling and sampling, database images which cannot be
+ * loaded are skipped if they were when recorded, and the recorded coarse
+ * histograms and alternative local search are created from the database (PCA
+ * is trained again rather than loaded from the model file of ex3). They are
+ * shared by REPLAY_THREADS workers answering queries through answerQuery,
+ * each with a context (and search scratch) of its own, and rankings are not
+ * printed. The query cache cannot be shared by concurrent queries, so a trace
+ * recorded with a cache is replayed with one only by a single worker and
+ * refused otherwise.
+ *
+ * The report compares the stage latencies recorded in the trace with the
+ * replayed ones, and gives the percentiles of the response time of the
+ * replayed queries (from their scheduled arrival, so waiting for a free
+ * worker is included) and the replayed throughput. Queries whose image
+ * contents changed since the trace was recorded are counted.
+ */
+
+// file from which the trace is read
+#define REPLAY_TRACE_PATH "sptrace"
+// number of threads answering queries concurrently
+#define REPLAY_THREADS 4
+// arrival rate relative to the recorded one (2.0 - twice as fast,
+// 0 - all queries arrive at once)
+#define REPLAY_RATE 1.0
+
+#define REPLAY_REPORT_MSG "Replay - %d queries (%d failed, %d changed since recorded) by %d threads in %.3f s, %.1f queries per second (recorded %.1f)\n"
+#define REPLAY_TRACE_ERROR_MSG "An error occurred - the query trace cannot be read\n"
+#define REPLAY_PARAMS_ERROR_MSG "An error occurred - the trace was recorded with %d images, %d bins and %d features, not %d, %d and %d\n"
+#define REPLAY_CACHE_ERROR_MSG "An error occurred - the trace was recorded with a query cache, which concurrent queries cannot share (REPLAY_THREADS must be 1)\n"
+#define REPLAY_SEARCH_ERROR_MSG "An error occurred - the recorded search structures cannot be created\n"
+#define REPLAY_THREAD_ERROR_MSG "An error occurred - the replay threads cannot be started\n"
+#define REPLAY_NO_QUERIES_MSG "An error occurred - no queries to replay\n"
+
+// the search structures the trace was recorded with, created from the database
+// (members are NULL and disabled if not recorded)
+struct replay_search {
+	local_search localSearch;
+	SPHistPyramid *histPyramid;
+	SPQueryCache *cache;          // only if replayed by a single worker
+};
+
+// state shared by the replay workers
+struct replay_state {
+	const std::vector<SPQueryTraceRecord> *records;
+	SPPoint ***histDB;
+	SPPoint ***siftDB;
+	int *nFeatures;
+	const char *skipped;           // NULL if bad images were not skipped when recorded
+	int numOfImages, numOfBins, nFeaturesToExtract;
+	int k, cascadeCandidates;
+	replay_search *search;
+	std::chrono::steady_clock::time_point start;
+	std::atomic<size_t> next;      // index of the next record to answer
+	std::atomic<int> failed;
+};
+
+// a replay worker and its measurements
+struct replay_worker {
+	query_context context;
+	query_latency latency;   // stage latencies of the replayed queries
+	SPLatency *response;     // scheduled arrival to completion
+	std::thread thread;
+};
+
+//Inner function answering queries of the trace until none are left
+static void replayQueries(replay_state *state, replay_worker *worker) {
+	const std::vector<SPQueryTraceRecord> &records = *state->records;
+	const double rate = REPLAY_RATE;   // (not divided by as a constant, which may be 0)
+	for (size_t r = state->next++; r < records.size(); r = state->next++) {
+		// wait for the scheduled arrival of the query
+		std::chrono::steady_clock::time_point arrival = state->start;
+		if (rate > 0)
+			arrival += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(records[r].time/rate));
+		std::this_thread::sleep_until(arrival);
+
+		replay_search *search = state->search;
+		if (answerQuery(records[r].path, state->histDB, state->siftDB, state->nFeatures,
+				state->skipped, state->k, state->numOfImages, state->numOfBins, state->nFeaturesToExtract,
+				state->cascadeCandidates, search->histPyramid, search->cache, &search->localSearch,
+				&worker->latency, NULL, &worker->context) == -1)
+			state->failed++;
+		std::chrono::duration<double> response = std::chrono::steady_clock::now() - arrival;
+		spLatencyRecord(worker->response, response.count());
+	}
+}
+
+//Inner function freeing the recorded search structures
+static void destroyReplaySearch(replay_search *search) {
+	spQueryCacheDestroy(search->cache);
+	spHistPyramidDestroy(search->histPyramid);
+	spVocabTreeDestroy(search->localSearch.vocabTree);
+	spSiftLSHDestroy(search->localSearch.lsh);
+	spSiftPCADestroy(search->localSearch.pca);
+	spHalfStoreDestroy(search->localSearch.half);
+	spNumaStoreDestroy(search->localSearch.numaStore);
+}
+
+//Inner function creating the recorded search structures from the databases
+static int createReplaySearch(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		int numOfImages, const SPQueryTraceParams *params, replay_search *search) {
+	// creates them as ex3 did (see createDerivedSearch there)
+	// if fails returns -1 (with nothing left to free), otherwise 0
+	local_search none = { NULL, NULL, NULL, NULL, NULL };
+	search->localSearch = none;
+	search->histPyramid = NULL;
+	search->cache = NULL;
+	local_search &localSearch = search->localSearch;
+	int ret = 0;
+	if (params->numaSearchThreads > 0) {
+		localSearch.numaStore = spNumaStoreCreate(siftDB, nFeatures, numOfImages,
+				params->numaNodes, params->numaSearchThreads);
+		ret = localSearch.numaStore == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->halfPrecision > 0) {
+		localSearch.half = spHalfStoreCreate(params->halfPrecision == 2 ? histDB : NULL, siftDB,
+				nFeatures, numOfImages);
+		ret = localSearch.half == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->pcaComponents > 0) {
+		localSearch.pca = spSiftPCACreate(siftDB, nFeatures, numOfImages,
+				params->pcaComponents, params->pcaCandidates, NULL);
+		ret = localSearch.pca == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->lshBits > 0) {
+		localSearch.lsh = spSiftLSHCreate(siftDB, nFeatures, numOfImages,
+				params->lshBits, params->lshTables, params->lshCandidates);
+		ret = localSearch.lsh == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->vocabBranching > 0) {
+		localSearch.vocabTree = spVocabTreeCreate(siftDB, nFeatures, numOfImages,
+				params->vocabBranching, params->vocabDepth);
+		ret = localSearch.vocabTree == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->histCoarseBins > 0) {
+		search->histPyramid = spHistPyramidCreate(histDB, numOfImages, params->histCoarseBins);
+		ret = search->histPyramid == NULL ? -1 : 0;
+	}
+	if (ret == 0 && params->queryCacheSize > 0) {
+		search->cache = spQueryCacheCreate(params->queryCacheSize);
+		ret = search->cache == NULL ? -1 : 0;
+	}
+	if (ret == -1)
+		destroyReplaySearch(search);
+	return ret;
+}
+
+//Inner function reading the records of a trace
+static int readTrace(SPQueryTrace *trace, std::vector<SPQueryTraceRecord> &records) {
+	// if fails returns -1, otherwise 0
+	SPQueryTraceRecord record;
+	SP_QUERY_TRACE_MSG msg;
+	while ((msg = spQueryTraceNext(trace, &record)) == SP_QUERY_TRACE_SUCCESS)
+		records.push_back(record);
+	return msg == SP_QUERY_TRACE_END ? 0 : -1;
+}
+
+//Inner function counting the queries whose image contents changed since recorded
+static int changedQueries(const std::vector<SPQueryTraceRecord> &records,
+		const SPQueryTraceParams *params) {
+	int changed = 0;
+	SPQueryCacheKey key;
+	for (size_t r=0; r<records.size(); r++)
+		if (records[r].hash != 0 && (!spQueryCacheKey(records[r].path, params->numOfBins,
+				params->nFeaturesToExtract, params->k, &key) || key.hash != records[r].hash))
+			changed++;
+	return changed;
+}
+
+//Inner function running the workers and printing the report
+static int replay(replay_state *state, const SPQueryTraceParams *params) {
+	// if fails prints the error and returns -1, otherwise 0
+	const std::vector<SPQueryTraceRecord> &records = *state->records;
+	int changed = changedQueries(records, params);
+
+	// recorded stage latencies (the stages of a query which ran)
+	query_latency recorded;
+	if (createQueryLatency(&recorded, 0) == -1) {
+		printf("%s",MEMORY_ERROR);
+		return -1;
+	}
+	for (size_t r=0; r<records.size(); r++)
+		for (int s=0; s<NUM_OF_STAGES; s++)
+			if (records[r].stageSeconds[s] >= 0)
+				spLatencyRecord(recorded.stages[s], records[r].stageSeconds[s]);
+
+	std::vector<replay_worker> workers(REPLAY_THREADS);
+	int ret = 0, numOfCreated = 0;
+	for (int w=0; w<REPLAY_THREADS && ret == 0; w++) {
+		initQueryContext(&workers[w].context);
+		workers[w].context.quiet = true;
+		workers[w].response = spLatencyCreate();
+		ret = workers[w].response == NULL ? -1 : createQueryLatency(&workers[w].latency, 0);
+		if (ret == -1) {
+			printf("%s",MEMORY_ERROR);
+			spLatencyDestroy(workers[w].response);
+		}
+		else
+			numOfCreated++;
+	}
+
+	// replay (each worker answers the next query when it is free)
+	double seconds = 0;
+	if (ret == 0) {
+		state->start = std::chrono::steady_clock::now();
+		try {
+			for (int w=0; w<REPLAY_THREADS; w++)
+				workers[w].thread = std::thread(replayQueries, state, &workers[w]);
+		}
+		catch (std::exception &) {
+			// no new queries are taken, the started workers finish their current ones
+			printf("%s",REPLAY_THREAD_ERROR_MSG);
+			state->next = records.size();
+			ret = -1;
+		}
+		for (int w=0; w<REPLAY_THREADS; w++)
+			if (workers[w].thread.joinable())
+				workers[w].thread.join();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - state->start;
+		seconds = elapsed.count();
+	}
+
+	// merge the measurements of the workers and report
+	if (ret == 0) {
+		for (int w=1; w<REPLAY_THREADS; w++) {
+			for (int s=0; s<NUM_OF_STAGES; s++)
+				spLatencyMerge(workers[0].latency.stages[s], workers[w].latency.stages[s]);
+			spLatencyMerge(workers[0].response, workers[w].response);
+		}
+		SPLatency *response = workers[0].response;
+		int numOfQueries = (int) records.size();
+		double recordedSeconds = records.back().time;
+		printf("Recorded:\n");
+		printQueryLatency(&recorded);
+		printf("Replayed:\n");
+		printQueryLatency(&workers[0].latency);
+		printf(LATENCY_REPORT_MSG, "response", spLatencyCount(response),
+				spLatencyPercentile(response, 0.5)*1e3, spLatencyPercentile(response, 0.9)*1e3,
+				spLatencyPercentile(response, 0.99)*1e3, spLatencyPercentile(response, 0.999)*1e3,
+				spLatencyMax(response)*1e3);
+		printf(REPLAY_REPORT_MSG, numOfQueries, (int) state->failed, changed, REPLAY_THREADS,
+				seconds, seconds > 0 ? numOfQueries/seconds : 0.0,
+				recordedSeconds > 0 ? numOfQueries/recordedSeconds : 0.0);
+	}
+
+	for (int w=0; w<numOfCreated; w++) {
+		destroyQueryContext(&workers[w].context);
+		destroyQueryLatency(&workers[w].latency);
+		spLatencyDestroy(workers[w].response);
+	}
+	destroyQueryLatency(&recorded);
+	return ret;
+}
+
+int main () {
+	int ret;
+
+	// get parameters from user
+	int numOfImages, numOfBins, nFeaturesToExtract;
+	char *dir = (char*) malloc(1024*sizeof(char));
+	char *prefix = (char*) malloc(1024*sizeof(char));
+	char *suffix = (char*) malloc(1024*sizeof(char));
+	ret = getUserParams(dir, prefix, suffix, &numOfImages, &numOfBins, &nFeaturesToExtract);
+	if (ret == -1) {
+		if (dir == NULL || prefix == NULL || suffix == NULL)
+			printf("%s",MEMORY_ERROR);
+		free(dir);
+		free(prefix);
+		free(suffix);
+		return -1;
+	}
+
+	// open the trace (its queries must be answered with the same database and descriptors)
+	SPQueryTraceParams params;
+	SPQueryTrace *trace = spQueryTraceOpen(REPLAY_TRACE_PATH, &params);
+	if (trace == NULL)
+		printf("%s",REPLAY_TRACE_ERROR_MSG);
+	else if (params.numOfImages != numOfImages || params.numOfBins != numOfBins ||
+			params.nFeaturesToExtract != nFeaturesToExtract) {
+		printf(REPLAY_PARAMS_ERROR_MSG, params.numOfImages, params.numOfBins,
+				params.nFeaturesToExtract, numOfImages, numOfBins, nFeaturesToExtract);
+		spQueryTraceClose(trace);
+		trace = NULL;
+	}
+	else if (params.queryCacheSize > 0 && REPLAY_THREADS > 1) {
+		printf("%s",REPLAY_CACHE_ERROR_MSG);
+		spQueryTraceClose(trace);
+		trace = NULL;
+	}
+	if (trace == NULL) {
+		free(dir);
+		free(prefix);
+		free(suffix);
+		return -1;
+	}
+
+	// extract descriptors of database and query images as they were recorded
+	spSetSiftMaxSide(params.siftMaxSide);
+	spSetSiftTiling(params.siftTileThreads, params.siftTileOverlap);
+	spSetHistSampling(params.histSampleStride, params.histSampleJitter != 0,
+			params.histDecodeReduction);
+
+	// create databases and the recorded search structures
+	SPPoint ***histDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
+	SPPoint ***siftDB = (SPPoint***) malloc(numOfImages*sizeof(SPPoint**));
+	int *nFeatures = (int*) malloc(numOfImages*sizeof(int));
+	// images skipped by preprocessing (NULL and disabled if not skipped when recorded)
+	char *skipped = params.skipBadImages ? (char*) malloc(numOfImages*sizeof(char)) : NULL;
+	bool allocated = histDB != NULL && siftDB != NULL && nFeatures != NULL &&
+			(!params.skipBadImages || skipped != NULL);
+	if (!allocated)
+		ret = -1;
+	else
+		ret = preprocessing(histDB, siftDB, nFeatures, dir, prefix, suffix,
+				numOfImages, numOfBins, nFeaturesToExtract, 0, skipped);
+	free(dir);
+	free(prefix);
+	free(suffix);
+	int numOfSkipped = ret == 0 ? numOfSkippedImages(skipped, numOfImages) : 0;
+	if (numOfSkipped > 0)
+		printf(SKIPPED_REPORT_MSG, numOfSkipped, numOfImages);
+	replay_search search;
+	if (ret == 0 && createReplaySearch(histDB, siftDB, nFeatures, numOfImages, &params,
+			&search) == -1) {
+		printf("%s",REPLAY_SEARCH_ERROR_MSG);
+		ret = -1;
+	}
+	else if (!allocated)
+		printf("%s",MEMORY_ERROR);
+	if (ret == -1) {
+		spQueryTraceClose(trace);
+		destroySPPoint2D(histDB,numOfImages,NULL);
+		destroySPPoint2D(siftDB,numOfImages,nFeatures);
+		free(skipped);
+		return -1;
+	}
+
+	try {
+		// read the queries and replay them
+		std::vector<SPQueryTraceRecord> records;
+		ret = readTrace(trace, records);
+		if (ret == -1)
+			printf("%s",REPLAY_TRACE_ERROR_MSG);
+		else if (records.empty()) {
+			printf("%s",REPLAY_NO_QUERIES_MSG);
+			ret = -1;
+		}
+		else {
+			replay_state state;
+			state.records = &records;
+			state.histDB = histDB;
+			state.siftDB = siftDB;
+			state.nFeatures = nFeatures;
+			state.skipped = skipped;
+			state.numOfImages = numOfImages;
+			state.numOfBins = numOfBins;
+			state.nFeaturesToExtract = nFeaturesToExtract;
+			state.k = params.k;
+			state.cascadeCandidates = params.cascadeCandidates;
+			state.search = &search;
+			state.next = 0;
+			state.failed = 0;
+			ret = replay(&state, &params);
+		}
+	}
+	catch (std::bad_alloc &) {
+		printf("%s",MEMORY_ERROR);
+		ret = -1;
+	}
+
+	// cleanup
+	spQueryTraceClose(trace);
+	destroyReplaySearch(&search);
+	destroySPPoint2D(histDB,numOfImages,NULL);
+	destroySPPoint2D(siftDB,numOfImages,nFeatures);
+	free(skipped);
+	return ret;
+}
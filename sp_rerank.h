@@ -0,0 +1,152 @@
+#ifndef SP_RERANK_H_
+#define SP_RERANK_H_
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "sp_distance_kernels.h"
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Re-rank summary
+ * The exact stage shared by the candidate searches (see sp_sift_pca and
+ * sp_sift_lsh): candidate features found by a cheap approximate distance are
+ * re-ranked by their exact distance to the query feature, and the recall of
+ * such a search is estimated on database features.
+ *
+ * Matches are ordered by value and then by image, exactly as in SPBPQueue.
+ */
+
+/** A database feature found by a search **/
+struct SPRerankMatch {
+	double value;   // exact L2 squared distance to the query feature
+	int image;
+	int feature;    // position of the feature in the searched database
+	bool operator<(const SPRerankMatch &other) const {
+		return value < other.value || (value == other.value && image < other.image);
+	}
+};
+
+/** The exact distances of spRerankCandidates (see spL2Dispatch) **/
+template <typename T>
+struct SPRerankScan {
+	const double *queryFeature;
+	const std::vector<std::pair<T,int> > *candidates;
+	const std::vector<SPPoint*> *features;
+	const std::vector<int> *images;
+	std::vector<SPRerankMatch> *matches;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		for (size_t i=0; i<candidates->size(); i++) {
+			SPRerankMatch match;
+			match.feature = (*candidates)[i].second;
+			match.image = (*images)[match.feature];
+			match.value = kernel(queryFeature, spPointGetData((*features)[match.feature]));
+			matches->push_back(match);
+		}
+	}
+};
+
+/**
+ * Re-ranks candidate features by their exact distance to a query feature
+ *
+ * @param queryFeature - the query coordinates
+ * @param candidates - (approximate distance, feature) pairs
+ * @param features - the database features
+ * @param images - the image index of each database feature
+ * @param dim - the feature dimension
+ * @param k - number of closest candidates kept
+ * @param matches - filled with the k closest candidates (closest first)
+ */
+template <typename T>
+inline void spRerankCandidates(const double *queryFeature,
+		const std::vector<std::pair<T,int> > &candidates, const std::vector<SPPoint*> &features,
+		const std::vector<int> &images, int dim, int k, std::vector<SPRerankMatch> &matches) {
+	matches.clear();
+	SPRerankScan<T> scan = { queryFeature, &candidates, &features, &images, &matches };
+	spL2Dispatch(dim, scan);
+	size_t n = std::min((size_t) k, matches.size());
+	std::partial_sort(matches.begin(), matches.begin() + n, matches.end());
+	matches.resize(n);
+}
+
+/**
+ * Type of a candidate search measured by spRerankRecall: fills matches with
+ * the k closest features to queryFeature (closest first), skipping the
+ * features of excludeImage
+ */
+typedef void (*SPRerankSearch)(void *index, const double *queryFeature, int k,
+		int excludeImage, std::vector<SPRerankMatch> &matches);
+
+/** The sampled queries of spRerankRecall (see spL2Dispatch) **/
+struct SPRerankRecallScan {
+	const std::vector<SPPoint*> *features;
+	const std::vector<int> *images;
+	int k;
+	int numOfSamples;
+	SPRerankSearch search;
+	void *index;
+	long found, total;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		// may throw std::bad_alloc
+		size_t numOfFeatures = features->size();
+		std::vector<double> exact;
+		std::vector<SPRerankMatch> matches;
+		for (int s=0; s<numOfSamples; s++) {
+			size_t sample = s*numOfFeatures/numOfSamples;
+			const double *query = spPointGetData((*features)[sample]);
+			int image = (*images)[sample];
+
+			// distance of the k-th closest feature of another image
+			exact.clear();
+			for (size_t f=0; f<numOfFeatures; f++)
+				if ((*images)[f] != image)
+					exact.push_back(kernel(query, spPointGetData((*features)[f])));
+			if (exact.empty())
+				continue;
+			size_t n = std::min((size_t) k, exact.size());
+			std::nth_element(exact.begin(), exact.begin() + (n-1), exact.end());
+			double kth = exact[n-1];
+
+			// count returned features which are truly among the k closest
+			search(index, query, k, image, matches);
+			for (size_t i=0; i<matches.size(); i++)
+				if (matches[i].value <= kth)
+					found++;
+			total += n;
+		}
+	}
+};
+
+/**
+ * Estimates the recall of a candidate search: numOfSamples evenly spaced
+ * database features are used as queries (excluding their own image), and the
+ * fraction of the k closest features which the search returns is computed.
+ *
+ * @param features - the database features
+ * @param images - the image index of each database feature
+ * @param dim - the feature dimension
+ * @param k - number of closest features
+ * @param numOfSamples - number of sampled query features
+ * @param search - the candidate search
+ * @param index - the searched structure, passed to search
+ * @return the recall (between 0 and 1), -1 in case allocation failure occurred
+ */
+inline double spRerankRecall(const std::vector<SPPoint*> &features, const std::vector<int> &images,
+		int dim, int k, int numOfSamples, SPRerankSearch search, void *index) {
+	SPRerankRecallScan scan = { &features, &images, k, numOfSamples, search, index, 0, 0 };
+	try {
+		spL2Dispatch(dim, scan);
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+	return scan.total > 0 ? (double) scan.found/scan.total : 1;
+}
+
+
+#endif /* SP_RERANK_H_ */
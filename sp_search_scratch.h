@@ -0,0 +1,45 @@
+#ifndef SP_SEARCH_SCRATCH_H_
+#define SP_SEARCH_SCRATCH_H_
+#include <stdint.h>
+#include <vector>
+#include <utility>
+#include "sp_rerank.h"
+
+/**
+ * SP Search Scratch summary
+ * The scratch space and statistics of a search of the alternative databases
+ * (sp_vocab_tree, sp_sift_pca, sp_sift_lsh, sp_half_store, sp_hist_pyramid
+ * and sp_numa_store). A search only reads its database and keeps everything
+ * it writes in the scratch passed to it, so concurrent searches of the same
+ * database are safe as long as each has a scratch of its own.
+ *
+ * A scratch may be passed to searches of any of the databases. Its buffers
+ * grow to the largest search made with it and are reused afterwards, so
+ * searches with a warm scratch do not allocate.
+ */
+struct SPSearchScratch {
+	// the query (a projected, encoded or converted feature or histogram)
+	std::vector<double> query;
+	std::vector<float> reduced;
+	std::vector<uint64_t> code;
+	// candidates
+	std::vector<std::pair<double,int> > heap;     // (distance, feature or image)
+	std::vector<std::pair<double,int> > bounds;   // (lower bound, image)
+	std::vector<std::pair<int,int> > hamming;     // (Hamming distance, feature)
+	std::vector<int> ids;
+	std::vector<int> stamps;                      // search number in which each feature was collected
+	int stamp;
+	std::vector<SPRerankMatch> matches;
+	// visual words of the query and their weights
+	std::vector<int> words;
+	std::vector<std::pair<int,double> > histogram;
+	// statistics of the last search
+	int numOfExact;        // exact distances computed by spHistPyramidSearch
+	double scanBytes;      // bytes of database features scanned by spNumaStoreSearch
+	double scanSeconds;    // and the time it took
+
+	SPSearchScratch() : stamp(0), numOfExact(0), scanBytes(0), scanSeconds(0) {}
+};
+
+
+#endif /* SP_SEARCH_SCRATCH_H_ */
@@ -0,0 +1,461 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <new>
+#include "sp_hist_pyramid.h"
+#include "sp_half_store.h"
+#include "sp_numa_store.h"
+#include "sp_sift_pca.h"
+#include "sp_sift_lsh.h"
+#include "sp_vocab_tree.h"
+#include "main_aux.h"
+extern "C" {
+	#include "SPPoint.h"
+	#include "SPBPriorityQueue.h"
+}
+
+/**
+ * Test of the scratch spaces of the alternative searches (see sp_search_scratch)
+ * and of the query contexts (see query_context).
+ *
+ * Builds every alternative database from a synthetic database, then checks
+ * for each of them that:
+ * - searches with a warm scratch space allocate nothing (malloc, calloc and
+ *   realloc are counted, operator new allocates through malloc)
+ * - searches of the same database by concurrent threads, each with a scratch
+ *   space of its own, give the results of sequential searches
+ *
+ * Then checks that the ranking stages of a query (globalRanking and
+ * localRanking with the exact scan, by the fixed top-k selection, the
+ * cascade and the priority queue) allocate nothing with a warm query
+ * context, whose descriptor points are overwritten by each query as
+ * extraction overwrites them, and give the rankings of the warm-up.
+ *
+ * Last checks that an image skipped by preprocessing (the first, with no
+ * sift features) is ranked last by both stages, below the images which
+ * get no votes.
+ *
+ * Prints a line per database and configuration and returns 0 if all checks
+ * pass, -1 otherwise.
+ */
+
+#define TEST_IMAGES 40
+#define TEST_FEATURES 30
+#define TEST_DIM 128
+#define TEST_BINS 16
+#define TEST_K 5
+#define TEST_THREADS 4
+// number of times each thread repeats the queries
+#define TEST_ROUNDS 20
+// images kept by the cascade of the query context test
+#define TEST_CASCADE 10
+// k selected by a priority queue (more than SP_TOPK_MAX_FIXED)
+#define TEST_QUEUE_K 12
+
+#define TEST_RESULT_MSG "%-8s allocations %ld, concurrent results %s - %s\n"
+#define TEST_CONTEXT_MSG "%-8s allocations %ld, rankings %s - %s\n"
+#define TEST_SKIPPED_MSG "%-8s global rank %d, local rank %d of %d - %s\n"
+#define TEST_CREATE_ERROR_MSG "An error occurred - the %s database cannot be created\n"
+
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t count, size_t size);
+	void *__libc_realloc(void *ptr, size_t size);
+}
+
+static std::atomic<bool> counting(false);
+static std::atomic<long> allocations(0);
+
+void *malloc(size_t size) {
+	if (counting)
+		allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	if (counting)
+		allocations++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (counting)
+		allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+enum test_backend {
+	BACKEND_VOCAB,
+	BACKEND_PCA,
+	BACKEND_LSH,
+	BACKEND_HALF,
+	BACKEND_HALF_HIST,
+	BACKEND_PYRAMID,
+	BACKEND_NUMA,
+	NUM_OF_BACKENDS
+};
+
+static const char *backendNames[NUM_OF_BACKENDS] = { "vocab", "pca", "lsh", "half",
+		"halfhist", "pyramid", "numa" };
+
+// the databases and the searches
+struct test_state {
+	SPPoint ***histDB;
+	SPPoint ***siftDB;
+	int *nFeatures;
+	SPVocabTree *vocabTree;
+	SPSiftPCA *pca;
+	SPSiftLSH *lsh;
+	SPHalfStore *half;
+	SPHistPyramid *pyramid;
+	SPNumaStore *numaStore;
+};
+
+// a searching thread and its buffers (allocated before searching)
+struct test_worker {
+	SPSearchScratch scratch;
+	std::vector<double> dists;        // numOfImages
+	std::vector<int> closest;         // k
+	std::vector<SPBPQueue*> queues;   // a queue for each query feature
+	std::vector<double> results;      // of all queries, TEST_IMAGES*TEST_IMAGES values
+	bool failed;
+};
+
+//Inner function drawing the synthetic databases (integer coordinates, as sift and histograms)
+static bool createDatabases(test_state *state) {
+	state->histDB = (SPPoint***) calloc(TEST_IMAGES, sizeof(SPPoint**));
+	state->siftDB = (SPPoint***) calloc(TEST_IMAGES, sizeof(SPPoint**));
+	state->nFeatures = (int*) calloc(TEST_IMAGES, sizeof(int));
+	if (state->histDB == NULL || state->siftDB == NULL || state->nFeatures == NULL)
+		return false;
+	unsigned int seed = 12345;
+	double data[TEST_DIM];
+	for (int i=0; i<TEST_IMAGES; i++) {
+		state->histDB[i] = (SPPoint**) calloc(3, sizeof(SPPoint*));
+		state->siftDB[i] = (SPPoint**) calloc(TEST_FEATURES, sizeof(SPPoint*));
+		if (state->histDB[i] == NULL || state->siftDB[i] == NULL)
+			return false;
+		for (int c=0; c<3; c++) {
+			for (int b=0; b<TEST_BINS; b++)
+				data[b] = rand_r(&seed)%100;
+			if ((state->histDB[i][c] = spPointCreate(data, TEST_BINS, i)) == NULL)
+				return false;
+		}
+		for (int j=0; j<TEST_FEATURES; j++) {
+			for (int d=0; d<TEST_DIM; d++)
+				data[d] = rand_r(&seed)%64 + (i%4)*32;
+			if ((state->siftDB[i][j] = spPointCreate(data, TEST_DIM, i)) == NULL)
+				return false;
+			state->nFeatures[i]++;
+		}
+	}
+	return true;
+}
+
+//Inner function freeing the synthetic databases
+static void destroyDatabases(test_state *state) {
+	for (int i=0; i<TEST_IMAGES; i++) {
+		for (int c=0; state->histDB != NULL && state->histDB[i] != NULL && c<3; c++)
+			spPointDestroy(state->histDB[i][c]);
+		for (int j=0; state->siftDB != NULL && state->siftDB[i] != NULL && j<TEST_FEATURES; j++)
+			spPointDestroy(state->siftDB[i][j]);
+		if (state->histDB != NULL)
+			free(state->histDB[i]);
+		if (state->siftDB != NULL)
+			free(state->siftDB[i]);
+	}
+	free(state->histDB);
+	free(state->siftDB);
+	free(state->nFeatures);
+}
+
+//Inner function searching the database of a backend with query image i
+static bool search(test_state *state, int backend, int i, test_worker *worker) {
+	// stores TEST_IMAGES result values of the query in worker->results
+	double *out = worker->results.data() + (size_t) i*TEST_IMAGES;
+	for (int j=0; j<TEST_IMAGES; j++)
+		out[j] = 0;
+	SPSearchScratch *scratch = &worker->scratch;
+	int *closest = worker->closest.data();
+	if (backend == BACKEND_VOCAB) {
+		if (!spVocabTreeScore(state->vocabTree, state->siftDB[i], TEST_FEATURES, NULL, out, scratch))
+			return false;
+	}
+	else if (backend == BACKEND_HALF_HIST) {
+		if (!spHalfStoreHistDistances(state->half, state->histDB[i], out, scratch))
+			return false;
+	}
+	else if (backend == BACKEND_PYRAMID) {
+		int n = spHistPyramidSearch(state->pyramid, state->histDB[i], state->histDB, TEST_K,
+				closest, worker->dists.data(), scratch);
+		if (n == -1)
+			return false;
+		for (int j=0; j<n; j++)
+			out[closest[j]] = j+1;
+	}
+	else if (backend == BACKEND_NUMA) {
+		for (int f=0; f<TEST_FEATURES; f++)
+			spBPQueueClear(worker->queues[f]);
+		if (!spNumaStoreSearch(state->numaStore, state->siftDB[i], TEST_FEATURES,
+				worker->queues.data(), NULL, scratch))
+			return false;
+		BPQueueElement elem;
+		for (int f=0; f<TEST_FEATURES; f++)
+			while (spBPQueuePeek(worker->queues[f], &elem) == SP_BPQUEUE_SUCCESS) {
+				out[elem.index]++;
+				spBPQueueDequeue(worker->queues[f]);
+			}
+	}
+	else {
+		// votes of the closest features of each query feature
+		for (int f=0; f<TEST_FEATURES; f++) {
+			SPPoint *feature = state->siftDB[i][f];
+			int n;
+			if (backend == BACKEND_PCA)
+				n = spSiftPCASearch(state->pca, feature, TEST_K, NULL, closest, scratch);
+			else if (backend == BACKEND_LSH)
+				n = spSiftLSHSearch(state->lsh, feature, TEST_K, NULL, closest, scratch);
+			else
+				n = spHalfStoreSearch(state->half, feature, TEST_K, NULL, closest, scratch);
+			if (n == -1)
+				return false;
+			for (int j=0; j<n; j++)
+				out[closest[j]]++;
+		}
+	}
+	return true;
+}
+
+//Inner function searching all query images TEST_ROUNDS times
+static void searchAll(test_state *state, int backend, test_worker *worker) {
+	for (int r=0; r<TEST_ROUNDS && !worker->failed; r++)
+		for (int i=0; i<TEST_IMAGES && !worker->failed; i++)
+			worker->failed = !search(state, backend, i, worker);
+}
+
+//Inner function allocating the buffers of a worker
+static bool createWorker(test_worker *worker) {
+	try {
+		worker->dists.resize(TEST_IMAGES);
+		worker->closest.resize(TEST_K);
+		worker->results.resize((size_t) TEST_IMAGES*TEST_IMAGES);
+		worker->queues.assign(TEST_FEATURES, NULL);
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	for (int f=0; f<TEST_FEATURES; f++)
+		if ((worker->queues[f] = spBPQueueCreate(TEST_K)) == NULL)
+			return false;
+	worker->failed = false;
+	return true;
+}
+
+//Inner function freeing the queues of a worker
+static void destroyWorker(test_worker *worker) {
+	for (size_t f=0; f<worker->queues.size(); f++)
+		spBPQueueDestroy(worker->queues[f]);
+}
+
+//Inner function testing a backend
+static bool testBackend(test_state *state, int backend) {
+	// returns true if the checks pass
+	std::vector<test_worker> workers(TEST_THREADS + 1);
+	bool ok = true;
+	for (size_t w=0; w<workers.size(); w++)
+		ok = createWorker(&workers[w]) && ok;
+
+	// steady state - a warm scratch space does not allocate
+	long counted = -1;
+	if (ok) {
+		test_worker *sequential = &workers[TEST_THREADS];
+		for (int i=0; i<TEST_IMAGES && ok; i++)
+			ok = search(state, backend, i, sequential);
+		allocations = 0;
+		counting = true;
+		searchAll(state, backend, sequential);
+		counting = false;
+		counted = allocations;
+		ok = ok && !sequential->failed;
+	}
+
+	// concurrent searches, each thread with its own scratch space
+	bool same = ok;
+	if (ok) {
+		std::vector<std::thread> threads;
+		try {
+			for (int w=0; w<TEST_THREADS; w++)
+				threads.push_back(std::thread(searchAll, state, backend, &workers[w]));
+		}
+		catch (std::exception &) {
+			ok = false;
+		}
+		for (size_t t=0; t<threads.size(); t++)
+			threads[t].join();
+		for (int w=0; w<TEST_THREADS && ok; w++)
+			same = same && !workers[w].failed &&
+					workers[w].results == workers[TEST_THREADS].results;
+	}
+
+	bool passed = ok && counted == 0 && same;
+	printf(TEST_RESULT_MSG, backendNames[backend], counted, ok ? (same ? "same" : "differ") : "failed",
+			passed ? "PASS" : "FAIL");
+	for (size_t w=0; w<workers.size(); w++)
+		destroyWorker(&workers[w]);
+	return passed;
+}
+
+//Inner function overwriting the query descriptors of a context with those of image i
+static void setQuery(test_state *state, int i, query_context *context) {
+	// as spGetRGBHistInto and spGetSiftDescriptorsInto overwrite the points of
+	// the previous query
+	for (int c=0; c<3; c++)
+		spPointSetData(context->qhist[c], spPointGetData(state->histDB[i][c]), TEST_IMAGES);
+	for (int j=0; j<TEST_FEATURES; j++)
+		spPointSetData(context->qsift[j], spPointGetData(state->siftDB[i][j]), TEST_IMAGES);
+}
+
+//Inner function ranking all query images with a query context
+static bool rankAll(test_state *state, int k, int cascadeCandidates, query_context *context,
+		int *rankings) {
+	// stores the 2k ranked images of each query in rankings
+	// returns false if a ranking fails or the closest image by global
+	// descriptors is not the query image
+	for (int i=0; i<TEST_IMAGES; i++) {
+		setQuery(state, i, context);
+		globalRanking(state->histDB, NULL, TEST_IMAGES, k, cascadeCandidates, NULL, NULL,
+				context->qhist, context);
+		if (localRanking(state->siftDB, state->nFeatures, NULL, k, TEST_IMAGES, cascadeCandidates,
+				NULL, context->qsift, TEST_FEATURES, context) == -1 || context->ranking[0] != i)
+			return false;
+		for (int j=0; j<2*k; j++)
+			rankings[(size_t) i*2*k + j] = context->ranking[j];
+	}
+	return true;
+}
+
+//Inner function testing the ranking stages of a query with a warm query context
+static bool testQueryContext(test_state *state, const char *name, int k, int cascadeCandidates) {
+	// returns true if the checks pass
+	query_context context;
+	initQueryContext(&context);
+	context.quiet = true;
+	std::vector<int> warm, steady;
+	bool ok = reserveQueryContext(&context, TEST_IMAGES, k) == 0;
+	try {
+		warm.resize((size_t) TEST_IMAGES*2*k);
+		steady.resize((size_t) TEST_IMAGES*2*k);
+	}
+	catch (std::bad_alloc &) {
+		ok = false;
+	}
+	// the points extraction creates for the first query
+	for (int c=0; c<3 && ok; c++)
+		ok = (context.qhist[c] = spPointCopy(state->histDB[0][c])) != NULL;
+	if (ok) {
+		ok = (context.qsift = (SPPoint**) calloc(TEST_FEATURES, sizeof(SPPoint*))) != NULL;
+		context.siftCapacity = ok ? TEST_FEATURES : 0;
+	}
+	for (int j=0; j<TEST_FEATURES && ok; j++)
+		ok = (context.qsift[j] = spPointCopy(state->siftDB[0][j])) != NULL;
+
+	long counted = -1;
+	bool same = false;
+	if (ok && rankAll(state, k, cascadeCandidates, &context, warm.data())) {
+		allocations = 0;
+		counting = true;
+		ok = rankAll(state, k, cascadeCandidates, &context, steady.data());
+		counting = false;
+		counted = allocations;
+		same = ok && steady == warm;
+	}
+	else
+		ok = false;
+
+	bool passed = ok && counted == 0 && same;
+	printf(TEST_CONTEXT_MSG, name, counted, ok ? (same ? "same" : "differ") : "failed",
+			passed ? "PASS" : "FAIL");
+	destroyQueryContext(&context);
+	return passed;
+}
+
+//Inner function testing the ranks of a skipped image
+static bool testSkipped(test_state *state, const char *name) {
+	// image 0 is skipped (so it has no features) and the last image is the
+	// query, with a single feature so most images get no votes
+	// returns true if the checks pass
+	const int query = TEST_IMAGES - 1;
+	query_context context;
+	initQueryContext(&context);
+	context.quiet = true;
+	char skipped[TEST_IMAGES] = { 1 };
+	int nFeatures[TEST_IMAGES];
+	for (int i=0; i<TEST_IMAGES; i++)
+		nFeatures[i] = i == 0 ? 0 : state->nFeatures[i];
+	SPPoint *qhist[3] = { state->histDB[query][0], state->histDB[query][1],
+			state->histDB[query][2] };
+	int globalRank = -1, localRank = -1;
+	bool ok = reserveQueryContext(&context, TEST_IMAGES, TEST_K) == 0;
+	if (ok) {
+		globalRanking(state->histDB, skipped, TEST_IMAGES, TEST_K, 0, NULL, NULL, qhist, &context);
+		for (int i=0; i<TEST_IMAGES; i++)
+			if (context.dists[i].index == 0)
+				globalRank = i;
+		ok = localRanking(state->siftDB, nFeatures, skipped, TEST_K, TEST_IMAGES, 0, NULL,
+				state->siftDB[query], 1, &context) == 0;
+		for (int i=0; ok && i<TEST_IMAGES; i++)
+			if (context.dists[i].index == 0)
+				localRank = i;
+	}
+
+	bool passed = ok && globalRank == TEST_IMAGES - 1 && localRank == TEST_IMAGES - 1;
+	printf(TEST_SKIPPED_MSG, name, globalRank, localRank, TEST_IMAGES, passed ? "PASS" : "FAIL");
+	destroyQueryContext(&context);
+	return passed;
+}
+
+int main() {
+	test_state state = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+	if (!createDatabases(&state)) {
+		printf(TEST_CREATE_ERROR_MSG, "synthetic");
+		destroyDatabases(&state);
+		return -1;
+	}
+	state.vocabTree = spVocabTreeCreate(state.siftDB, state.nFeatures, TEST_IMAGES, 4, 2);
+	state.pca = spSiftPCACreate(state.siftDB, state.nFeatures, TEST_IMAGES, 16, 50, NULL);
+	state.lsh = spSiftLSHCreate(state.siftDB, state.nFeatures, TEST_IMAGES, 128, 4, 50);
+	state.half = spHalfStoreCreate(state.histDB, state.siftDB, state.nFeatures, TEST_IMAGES);
+	state.pyramid = spHistPyramidCreate(state.histDB, TEST_IMAGES, 4);
+	state.numaStore = spNumaStoreCreate(state.siftDB, state.nFeatures, TEST_IMAGES, 2, 2);
+	const void *databases[NUM_OF_BACKENDS] = { state.vocabTree, state.pca, state.lsh, state.half,
+			state.half, state.pyramid, state.numaStore };
+
+	int ret = 0;
+	for (int b=0; b<NUM_OF_BACKENDS; b++) {
+		if (databases[b] == NULL) {
+			printf(TEST_CREATE_ERROR_MSG, backendNames[b]);
+			ret = -1;
+		}
+		else if (!testBackend(&state, b))
+			ret = -1;
+	}
+	if (!testQueryContext(&state, "context", TEST_K, 0))
+		ret = -1;
+	if (!testQueryContext(&state, "cascade", TEST_K, TEST_CASCADE))
+		ret = -1;
+	if (!testQueryContext(&state, "queue", TEST_QUEUE_K, 0))
+		ret = -1;
+	if (!testSkipped(&state, "skipped"))
+		ret = -1;
+
+	spVocabTreeDestroy(state.vocabTree);
+	spSiftPCADestroy(state.pca);
+	spSiftLSHDestroy(state.lsh);
+	spHalfStoreDestroy(state.half);
+	spHistPyramidDestroy(state.pyramid);
+	spNumaStoreDestroy(state.numaStore);
+	destroyDatabases(&state);
+	return ret;
+}
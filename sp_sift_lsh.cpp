@@ -0,0 +1,281 @@
+#include <cstdlib>
+#include <climits>
+#include <cmath>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <new>
+#include "sp_sift_lsh.h"
+#include "sp_distance_kernels.h"
+#include "sp_rerank.h"
+
+// seed of the random projections (fixed, so codes are the same on every run)
+#define SP_LSH_SEED 20160501
+// number of code bits keying each hash table
+#define SP_LSH_KEY_BITS 16
+// maximum number of database features used to compute the bit thresholds
+#define SP_LSH_TRAIN_FEATURES 20000
+
+// computes the Hamming distance of the query code to the codes of ids
+typedef void (*hamming_scan)(const uint64_t *query, const uint64_t *codes, int words,
+		const std::vector<int> &ids, std::vector<std::pair<int,int> > &out);
+
+struct sp_sift_lsh_t {
+	int dim;
+	int numOfBits;
+	int numOfWords;      // 64 bit words per code
+	int numOfTables;
+	int numOfCandidates;
+	std::vector<double> projections;  // numOfBits x dim (row major)
+	std::vector<double> thresholds;   // median projection of each bit
+	std::vector<uint64_t> codes;      // numOfFeatures x numOfWords
+	std::vector<SPPoint*> features;   // database features (owned by siftDB)
+	std::vector<int> images;          // image index of each feature
+	std::vector<std::vector<int> > bucketStart;  // per table, 2^SP_LSH_KEY_BITS+1 offsets into bucketIds
+	std::vector<std::vector<int> > bucketIds;    // per table, feature ids sorted by key
+	hamming_scan scan;
+};
+
+// an encoded database and the scratch space of the searches measured by spRerankRecall
+struct lsh_recall_index {
+	SPSiftLSH *lsh;
+	SPSearchScratch *scratch;
+};
+
+//Inner function computing Hamming distances, inlined into each scan below
+__attribute__((always_inline))
+static inline void hammingScanBody(const uint64_t *query, const uint64_t *codes, int words,
+		const std::vector<int> &ids, std::vector<std::pair<int,int> > &out) {
+	out.clear();
+	for (size_t i=0; i<ids.size(); i++) {
+		const uint64_t *code = codes + (size_t) ids[i]*words;
+		int dist = 0;
+		for (int w=0; w<words; w++)
+			dist += __builtin_popcountll(query[w] ^ code[w]);
+		out.push_back(std::make_pair(dist, ids[i]));
+	}
+}
+
+__attribute__((target("popcnt")))
+static void hammingScanPopcnt(const uint64_t *query, const uint64_t *codes, int words,
+		const std::vector<int> &ids, std::vector<std::pair<int,int> > &out) {
+	// Hamming distances using the popcnt instruction
+	hammingScanBody(query, codes, words, ids, out);
+}
+
+static void hammingScanGeneric(const uint64_t *query, const uint64_t *codes, int words,
+		const std::vector<int> &ids, std::vector<std::pair<int,int> > &out) {
+	// Hamming distances on CPUs without popcnt
+	hammingScanBody(query, codes, words, ids, out);
+}
+
+static void encode(SPSiftLSH *lsh, const double *feature, uint64_t *code) {
+	// sets the bits of the projections above their thresholds
+	for (int w=0; w<lsh->numOfWords; w++)
+		code[w] = 0;
+	for (int b=0; b<lsh->numOfBits; b++) {
+		const double *projection = lsh->projections.data() + (size_t) b*lsh->dim;
+		double sum = 0;
+		for (int d=0; d<lsh->dim; d++)
+			sum += projection[d]*feature[d];
+		if (sum > lsh->thresholds[b])
+			code[b/64] |= (uint64_t) 1 << (b%64);
+	}
+}
+
+static int tableKey(const uint64_t *code, int table) {
+	// bits SP_LSH_KEY_BITS*table, ..., SP_LSH_KEY_BITS*(table+1)-1 of a code
+	int bit = table*SP_LSH_KEY_BITS;
+	return (int) ((code[bit/64] >> (bit%64)) & ((1 << SP_LSH_KEY_BITS) - 1));
+}
+
+static void search(SPSiftLSH *lsh, const double *queryFeature, int k, const char *selected,
+		int excludeImage, SPSearchScratch *scratch, std::vector<SPRerankMatch> &matches) {
+	// fills matches with the k closest candidates (closest first)
+	// skipping images which are not selected and excludeImage
+	scratch->code.resize(lsh->numOfWords);
+	uint64_t *query = scratch->code.data();
+	encode(lsh, queryFeature, query);
+
+	// collect features sharing a bucket with the query (a feature is collected
+	// once, stamps[f] is the number of the search which collected it last)
+	std::vector<int> &ids = scratch->ids;
+	std::vector<int> &stamps = scratch->stamps;
+	ids.clear();
+	if (stamps.size() < lsh->features.size())
+		stamps.resize(lsh->features.size(), 0);
+	if (scratch->stamp == INT_MAX) { // stamps would wrap around
+		std::fill(stamps.begin(), stamps.end(), 0);
+		scratch->stamp = 0;
+	}
+	const int stamp = ++scratch->stamp;
+	for (int t=0; t<lsh->numOfTables; t++) {
+		int key = tableKey(query, t);
+		for (int i=lsh->bucketStart[t][key]; i<lsh->bucketStart[t][key+1]; i++) {
+			int f = lsh->bucketIds[t][i];
+			int image = lsh->images[f];
+			if (stamps[f] == stamp || (selected != NULL && !selected[image]) ||
+					image == excludeImage)
+				continue;
+			stamps[f] = stamp;
+			ids.push_back(f);
+		}
+	}
+	if ((int) ids.size() < k) { // too few collected - scan all codes
+		ids.clear();
+		for (size_t f=0; f<lsh->features.size(); f++) {
+			int image = lsh->images[f];
+			if ((selected == NULL || selected[image]) && image != excludeImage)
+				ids.push_back((int) f);
+		}
+	}
+
+	// closest candidates by Hamming distance
+	std::vector<std::pair<int,int> > &candidates = scratch->hamming;
+	lsh->scan(query, lsh->codes.data(), lsh->numOfWords, ids, candidates);
+	if ((int) candidates.size() > lsh->numOfCandidates) {
+		std::nth_element(candidates.begin(), candidates.begin() + lsh->numOfCandidates, candidates.end());
+		candidates.resize(lsh->numOfCandidates);
+	}
+
+	// re-rank candidates by exact distance
+	spRerankCandidates(queryFeature, candidates, lsh->features, lsh->images, lsh->dim, k, matches);
+}
+
+//Inner function searching a sampled database feature (see spRerankRecall)
+static void recallSearch(void *index, const double *queryFeature, int k,
+		int excludeImage, std::vector<SPRerankMatch> &matches) {
+	lsh_recall_index *recall = (lsh_recall_index*) index;
+	search(recall->lsh, queryFeature, k, NULL, excludeImage, recall->scratch, matches);
+}
+
+SPSiftLSH* spSiftLSHCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfBits, int numOfTables, int numOfCandidates) {
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0 ||
+			numOfBits < 64 || numOfBits > 256 || numOfBits%64 != 0 ||
+			numOfTables < 0 || numOfTables > numOfBits/SP_LSH_KEY_BITS || numOfCandidates <= 0)
+		return NULL;
+
+	SPSiftLSH *res = new (std::nothrow) SPSiftLSH;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->dim = 0;
+		res->numOfBits = numOfBits;
+		res->numOfWords = numOfBits/64;
+		res->numOfTables = numOfTables;
+		res->numOfCandidates = numOfCandidates;
+		for (int i=0; i<numOfImages; i++) {
+			for (int j=0; j<nFeatures[i]; j++) {
+				res->features.push_back(siftDB[i][j]);
+				res->images.push_back(spPointGetIndex(siftDB[i][j]));
+			}
+		}
+		if (res->features.empty()) {
+			delete res;
+			return NULL;
+		}
+		res->dim = spPointGetDimension(res->features[0]);
+		size_t numOfFeatures = res->features.size();
+
+		// random directions, thresholds at the median projection of evenly spaced features
+		std::mt19937 rng(SP_LSH_SEED);
+		std::normal_distribution<double> normal(0, 1);
+		res->projections.resize((size_t) numOfBits*res->dim);
+		for (size_t i=0; i<res->projections.size(); i++)
+			res->projections[i] = normal(rng);
+		size_t numOfSamples = std::min(numOfFeatures, (size_t) SP_LSH_TRAIN_FEATURES);
+		std::vector<double> values(numOfSamples);
+		res->thresholds.resize(numOfBits);
+		for (int b=0; b<numOfBits; b++) {
+			const double *projection = res->projections.data() + (size_t) b*res->dim;
+			for (size_t s=0; s<numOfSamples; s++) {
+				const double *feature = spPointGetData(res->features[s*numOfFeatures/numOfSamples]);
+				double sum = 0;
+				for (int d=0; d<res->dim; d++)
+					sum += projection[d]*feature[d];
+				values[s] = sum;
+			}
+			std::nth_element(values.begin(), values.begin() + numOfSamples/2, values.end());
+			res->thresholds[b] = values[numOfSamples/2];
+		}
+
+		// encode the database
+		res->codes.resize(numOfFeatures*res->numOfWords);
+		for (size_t f=0; f<numOfFeatures; f++)
+			encode(res, spPointGetData(res->features[f]), res->codes.data() + f*res->numOfWords);
+
+		// hash tables (buckets sorted by key)
+		res->bucketStart.resize(numOfTables);
+		res->bucketIds.resize(numOfTables);
+		for (int t=0; t<numOfTables; t++) {
+			std::vector<int> &start = res->bucketStart[t];
+			start.assign((1 << SP_LSH_KEY_BITS) + 1, 0);
+			for (size_t f=0; f<numOfFeatures; f++)
+				start[tableKey(res->codes.data() + f*res->numOfWords, t) + 1]++;
+			for (size_t key=1; key<start.size(); key++)
+				start[key] += start[key-1];
+			std::vector<int> next(start.begin(), start.end() - 1);
+			res->bucketIds[t].resize(numOfFeatures);
+			for (size_t f=0; f<numOfFeatures; f++)
+				res->bucketIds[t][next[tableKey(res->codes.data() + f*res->numOfWords, t)]++] = (int) f;
+		}
+
+		res->scan = __builtin_cpu_supports("popcnt") ? hammingScanPopcnt : hammingScanGeneric;
+	}
+	catch (std::bad_alloc &) {
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spSiftLSHDestroy(SPSiftLSH *lsh) {
+	delete lsh;
+}
+
+int spSiftLSHNumOfBits(SPSiftLSH *lsh) {
+	if (lsh == NULL)
+		return 0;
+	return lsh->numOfBits;
+}
+
+long spSiftLSHMemoryBytes(SPSiftLSH *lsh) {
+	if (lsh == NULL)
+		return 0;
+	long bytes = sizeof(*lsh) + (lsh->projections.capacity() + lsh->thresholds.capacity())*sizeof(double) +
+			lsh->codes.capacity()*sizeof(uint64_t) + lsh->features.capacity()*sizeof(SPPoint*) +
+			lsh->images.capacity()*sizeof(int);
+	for (size_t t=0; t<lsh->bucketStart.size(); t++)
+		bytes += lsh->bucketStart[t].capacity()*sizeof(int);
+	for (size_t t=0; t<lsh->bucketIds.size(); t++)
+		bytes += lsh->bucketIds[t].capacity()*sizeof(int);
+	return bytes;
+}
+
+int spSiftLSHSearch(SPSiftLSH *lsh, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch) {
+	if (lsh == NULL || queryFeature == NULL || closest == NULL || scratch == NULL || k <= 0 ||
+			spPointGetDimension(queryFeature) != lsh->dim)
+		return -1;
+	std::vector<SPRerankMatch> &matches = scratch->matches;
+	try {
+		search(lsh, spPointGetData(queryFeature), k, selected, -1, scratch, matches);
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+	for (size_t i=0; i<matches.size(); i++)
+		closest[i] = matches[i].image;
+	return (int) matches.size();
+}
+
+double spSiftLSHRecall(SPSiftLSH *lsh, int k, int numOfSamples) {
+	if (lsh == NULL || k <= 0 || numOfSamples <= 0)
+		return -1;
+	SPSearchScratch scratch;
+	lsh_recall_index recall = { lsh, &scratch };
+	return spRerankRecall(lsh->features, lsh->images, lsh->dim, k, numOfSamples, recallSearch,
+			&recall);
+}
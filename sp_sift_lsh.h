@@ -0,0 +1,116 @@
+#ifndef SP_SIFT_LSH_H_
+#define SP_SIFT_LSH_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Sift LSH summary
+ * Binary codes of the sift feature database (random projection locality
+ * sensitive hashing), used to find candidate features by Hamming distance
+ * before an exact search among them.
+ *
+ * Bit b of the code of a feature is set if the projection of the feature on
+ * a random direction b is above the median projection of the database, so
+ * features close in L2 distance tend to differ in few bits. Codes are stored
+ * in 64 bit words and compared with popcount (the popcnt instruction when the
+ * CPU supports it, checked at runtime).
+ *
+ * Candidates are collected from numOfTables hash tables, table t keyed by
+ * bits 16t, ..., 16t+15 of the codes: a feature is a candidate if it shares a
+ * bucket with the query in any table. If the tables yield fewer than k
+ * candidates (or numOfTables is 0) all codes are scanned. The numOfCandidates
+ * candidates closest in Hamming distance are re-ranked by their exact
+ * distance to the query feature.
+ *
+ * The following functions are supported:
+ *
+ * spSiftLSHCreate      - Draws the projections and encodes the database
+ * spSiftLSHDestroy     - Frees all resources
+ * spSiftLSHNumOfBits   - A getter of the code length
+ * spSiftLSHMemoryBytes - A getter of the memory used by the codes and tables
+ * spSiftLSHSearch      - Finds the images of the closest features to a query feature
+ * spSiftLSHRecall      - Estimates the recall of the search on database features
+ */
+
+/** Type for defining the encoded database **/
+typedef struct sp_sift_lsh_t SPSiftLSH;
+
+/**
+ * Draws numOfBits random projections (with a fixed seed, so codes are the same
+ * on every run) and encodes all database features.
+ *
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @param numOfBits - code length (a multiple of 64, between 64 and 256)
+ * @param numOfTables - number of hash tables (between 0 and numOfBits/16)
+ * @param numOfCandidates - number of candidates re-ranked by each search
+ * @return
+ * NULL in case any of the arrays is NULL, the database has no features,
+ * any of the numbers is out of range or allocation failure occurred
+ * Otherwise, the new encoded database
+ */
+SPSiftLSH* spSiftLSHCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfBits, int numOfTables, int numOfCandidates);
+
+/**
+ * Frees all resources associated with the encoded database.
+ * If lsh is NULL nothing happens.
+ */
+void spSiftLSHDestroy(SPSiftLSH *lsh);
+
+/**
+ * A getter for the code length
+ *
+ * @param lsh - the source encoded database
+ * @return the number of bits, 0 if lsh is NULL
+ */
+int spSiftLSHNumOfBits(SPSiftLSH *lsh);
+
+/**
+ * A getter for the memory used by the projections, the codes and the bucket
+ * tables (the full features are owned by siftDB)
+ *
+ * @param lsh - the source encoded database
+ * @return the number of bytes, 0 if lsh is NULL
+ */
+long spSiftLSHMemoryBytes(SPSiftLSH *lsh);
+
+/**
+ * Finds the images of the k closest features to a query feature (same
+ * result as spBestSIFTL2SquaredDistanceInto when the k closest features are
+ * among the candidates)
+ *
+ * @param lsh - the source encoded database
+ * @param queryFeature - the query feature
+ * @param k - number of closest features
+ * @param selected - if not NULL, only features of images i with selected[i]
+ *                   non zero are searched
+ * @param closest - an array of size k in which the image indices of the
+ *                  closest features are stored (closest first)
+ * @param scratch - the scratch space of the search (see sp_search_scratch)
+ * @return -1 if any of the pointers is NULL, k <= 0, the query dimension
+ *         does not match the database or allocation failure occurred,
+ *         otherwise the number of indices stored
+ */
+int spSiftLSHSearch(SPSiftLSH *lsh, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch);
+
+/**
+ * Estimates the recall of spSiftLSHSearch: database features (evenly spaced)
+ * are used as queries against the features of all other images, and the
+ * fraction of returned features which are truly among the k closest is returned.
+ *
+ * @param lsh - the source encoded database
+ * @param k - number of closest features
+ * @param numOfSamples - number of database features used as queries
+ * @return the recall (between 0 and 1), -1 if lsh is NULL, k <= 0,
+ *         numOfSamples <= 0 or allocation failure occurred
+ */
+double spSiftLSHRecall(SPSiftLSH *lsh, int k, int numOfSamples);
+
+
+#endif /* SP_SIFT_LSH_H_ */
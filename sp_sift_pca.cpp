@@ -0,0 +1,286 @@
+#include <opencv2/core.hpp>//PCA
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "sp_sift_pca.h"
+#include "sp_distance_kernels.h"
+#include "sp_rerank.h"
+#include "sp_image_proc_ext.h"
+
+using namespace cv;
+
+#define SP_PCA_MAGIC 0x41435053
+#define SP_PCA_VERSION 2
+#define SP_PCA_HEADER_SIZE 8
+// maximum number of database features the projection is trained on
+#define SP_PCA_TRAIN_FEATURES 20000
+
+// the database and extraction settings a model was trained for
+struct pca_model_source {
+	int numOfImages;
+	int64_t numOfFeatures;
+	uint64_t checksum;       // of the coordinates and images of all database features
+};
+
+struct sp_sift_pca_t {
+	int dim;
+	int numOfComponents;
+	int numOfCandidates;
+	std::vector<double> mean;        // dim
+	std::vector<double> components;  // numOfComponents x dim (row major)
+	std::vector<float> reduced;      // numOfFeatures x numOfComponents
+	std::vector<SPPoint*> features;  // database features (owned by siftDB)
+	std::vector<int> images;         // image index of each feature
+	pca_model_source source;
+};
+
+// a reduced database and the scratch space of the searches measured by spRerankRecall
+struct pca_recall_index {
+	SPSiftPCA *pca;
+	SPSearchScratch *scratch;
+};
+
+//Inner function hashing the database features (64 bit FNV-1a over 8 byte words)
+static uint64_t featuresChecksum(SPSiftPCA *pca) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t f=0; f<pca->features.size(); f++) {
+		const double *feature = spPointGetData(pca->features[f]);
+		for (int d=0; d<pca->dim; d++) {
+			uint64_t word;
+			memcpy(&word, feature + d, sizeof(word));
+			hash = (hash ^ word)*1099511628211ULL;
+		}
+		hash = (hash ^ (uint64_t) pca->images[f])*1099511628211ULL;
+	}
+	return hash;
+}
+
+//Inner function filling the header of the model of a reduced database
+static void modelHeader(SPSiftPCA *pca, int32_t *header) {
+	// the sift settings are stored so a model is not reused across extraction
+	// settings, the checksum so it is not reused across databases
+	header[0] = SP_PCA_MAGIC;
+	header[1] = SP_PCA_VERSION;
+	header[2] = pca->dim;
+	header[3] = pca->numOfComponents;
+	header[4] = pca->source.numOfImages;
+	header[5] = spGetSiftMaxSide();
+	header[6] = spGetSiftTileThreads();
+	header[7] = spGetSiftTileOverlap();
+}
+
+static bool loadModel(SPSiftPCA *pca, const char *path) {
+	// loads a model trained for the same dimensions, database and sift settings,
+	// returns false if there is none
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	int32_t header[SP_PCA_HEADER_SIZE], expected[SP_PCA_HEADER_SIZE];
+	pca_model_source source;
+	modelHeader(pca, expected);
+	bool ok = fread(header, sizeof(int32_t), SP_PCA_HEADER_SIZE, file) == SP_PCA_HEADER_SIZE &&
+			memcmp(header, expected, sizeof(header)) == 0 &&
+			fread(&source.numOfFeatures, sizeof(int64_t), 1, file) == 1 &&
+			fread(&source.checksum, sizeof(uint64_t), 1, file) == 1 &&
+			source.numOfFeatures == pca->source.numOfFeatures &&
+			source.checksum == pca->source.checksum;
+	if (ok) {
+		pca->mean.resize(pca->dim);
+		pca->components.resize((size_t) pca->numOfComponents*pca->dim);
+		ok = fread(pca->mean.data(), sizeof(double), pca->mean.size(), file) == pca->mean.size() &&
+				fread(pca->components.data(), sizeof(double), pca->components.size(), file) ==
+						pca->components.size();
+	}
+	fclose(file);
+	return ok;
+}
+
+static void saveModel(SPSiftPCA *pca, const char *path) {
+	// saves the model (failure only means training again on the next run)
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return;
+	int32_t header[SP_PCA_HEADER_SIZE];
+	modelHeader(pca, header);
+	bool ok = fwrite(header, sizeof(int32_t), SP_PCA_HEADER_SIZE, file) == SP_PCA_HEADER_SIZE &&
+			fwrite(&pca->source.numOfFeatures, sizeof(int64_t), 1, file) == 1 &&
+			fwrite(&pca->source.checksum, sizeof(uint64_t), 1, file) == 1 &&
+			fwrite(pca->mean.data(), sizeof(double), pca->mean.size(), file) == pca->mean.size() &&
+			fwrite(pca->components.data(), sizeof(double), pca->components.size(), file) ==
+					pca->components.size();
+	if (fclose(file) != 0 || !ok)
+		remove(path);
+}
+
+static void trainModel(SPSiftPCA *pca) {
+	// trains the projection on at most SP_PCA_TRAIN_FEATURES evenly spaced features
+	// (coordinates are integers, so float training data is exact)
+	size_t numOfFeatures = pca->features.size();
+	int rows = (int) std::min(numOfFeatures, (size_t) SP_PCA_TRAIN_FEATURES);
+	Mat data(rows, pca->dim, CV_32F);
+	for (int r=0; r<rows; r++) {
+		const double *feature = spPointGetData(pca->features[r*numOfFeatures/rows]);
+		for (int d=0; d<pca->dim; d++)
+			data.at<float>(r,d) = (float) feature[d];
+	}
+	PCA trained(data, Mat(), PCA::DATA_AS_ROW, pca->numOfComponents);
+
+	pca->mean.resize(pca->dim);
+	pca->components.resize((size_t) pca->numOfComponents*pca->dim);
+	for (int d=0; d<pca->dim; d++)
+		pca->mean[d] = trained.mean.at<float>(0,d);
+	for (int c=0; c<pca->numOfComponents; c++)
+		for (int d=0; d<pca->dim; d++)
+			pca->components[(size_t) c*pca->dim+d] = trained.eigenvectors.at<float>(c,d);
+}
+
+static void project(SPSiftPCA *pca, const double *feature, float *out) {
+	// projects a feature on the components
+	for (int c=0; c<pca->numOfComponents; c++) {
+		const double *component = pca->components.data() + (size_t) c*pca->dim;
+		double sum = 0;
+		for (int d=0; d<pca->dim; d++)
+			sum += component[d]*(feature[d] - pca->mean[d]);
+		out[c] = (float) sum;
+	}
+}
+
+static void search(SPSiftPCA *pca, const double *queryFeature, int k, const char *selected,
+		int excludeImage, SPSearchScratch *scratch, std::vector<SPRerankMatch> &matches) {
+	// fills matches with the k closest candidates (closest first)
+	// skipping images which are not selected and excludeImage
+
+	// closest features by reduced distance (a max heap of (reduced distance, feature))
+	const int m = pca->numOfComponents;
+	scratch->reduced.resize(m);
+	float *query = scratch->reduced.data();
+	project(pca, queryFeature, query);
+	std::vector<std::pair<double,int> > &heap = scratch->heap;
+	heap.clear();
+	for (size_t f=0; f<pca->features.size(); f++) {
+		int image = pca->images[f];
+		if ((selected != NULL && !selected[image]) || image == excludeImage)
+			continue;
+		const float *reduced = pca->reduced.data() + f*m;
+		double dist = 0;
+		for (int c=0; c<m; c++)
+			dist += (double) (query[c] - reduced[c])*(query[c] - reduced[c]);
+		std::pair<double,int> candidate(dist, (int) f);
+		if ((int) heap.size() < pca->numOfCandidates) {
+			heap.push_back(candidate);
+			std::push_heap(heap.begin(), heap.end());
+		}
+		else if (candidate < heap.front()) {
+			std::pop_heap(heap.begin(), heap.end());
+			heap.back() = candidate;
+			std::push_heap(heap.begin(), heap.end());
+		}
+	}
+
+	// re-rank candidates by exact distance
+	spRerankCandidates(queryFeature, heap, pca->features, pca->images, pca->dim, k, matches);
+}
+
+//Inner function searching a sampled database feature (see spRerankRecall)
+static void recallSearch(void *index, const double *queryFeature, int k,
+		int excludeImage, std::vector<SPRerankMatch> &matches) {
+	pca_recall_index *recall = (pca_recall_index*) index;
+	search(recall->pca, queryFeature, k, NULL, excludeImage, recall->scratch, matches);
+}
+
+SPSiftPCA* spSiftPCACreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfComponents, int numOfCandidates, const char *modelPath) {
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0 ||
+			numOfComponents <= 0 || numOfCandidates <= 0)
+		return NULL;
+
+	SPSiftPCA *res = new (std::nothrow) SPSiftPCA;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->dim = 0;
+		res->numOfComponents = numOfComponents;
+		res->numOfCandidates = numOfCandidates;
+		for (int i=0; i<numOfImages; i++) {
+			for (int j=0; j<nFeatures[i]; j++) {
+				res->features.push_back(siftDB[i][j]);
+				res->images.push_back(spPointGetIndex(siftDB[i][j]));
+			}
+		}
+		if (!res->features.empty())
+			res->dim = spPointGetDimension(res->features[0]);
+		if (numOfComponents >= res->dim || (int) res->features.size() < numOfComponents) {
+			delete res;
+			return NULL;
+		}
+
+		// load or train the projection
+		res->source.numOfImages = numOfImages;
+		res->source.numOfFeatures = (int64_t) res->features.size();
+		res->source.checksum = featuresChecksum(res);
+		if (modelPath == NULL || !loadModel(res, modelPath)) {
+			trainModel(res);
+			if (modelPath != NULL)
+				saveModel(res, modelPath);
+		}
+
+		// reduce the database
+		res->reduced.resize(res->features.size()*numOfComponents);
+		for (size_t f=0; f<res->features.size(); f++)
+			project(res, spPointGetData(res->features[f]), res->reduced.data() + f*numOfComponents);
+	}
+	catch (std::exception &) { // allocation failure (or training failure in OpenCV)
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spSiftPCADestroy(SPSiftPCA *pca) {
+	delete pca;
+}
+
+int spSiftPCANumOfComponents(SPSiftPCA *pca) {
+	if (pca == NULL)
+		return 0;
+	return pca->numOfComponents;
+}
+
+long spSiftPCAMemoryBytes(SPSiftPCA *pca) {
+	if (pca == NULL)
+		return 0;
+	return sizeof(*pca) + (pca->mean.capacity() + pca->components.capacity())*sizeof(double) +
+			pca->reduced.capacity()*sizeof(float) +
+			pca->features.capacity()*sizeof(SPPoint*) + pca->images.capacity()*sizeof(int);
+}
+
+int spSiftPCASearch(SPSiftPCA *pca, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch) {
+	if (pca == NULL || queryFeature == NULL || closest == NULL || scratch == NULL || k <= 0 ||
+			spPointGetDimension(queryFeature) != pca->dim)
+		return -1;
+	std::vector<SPRerankMatch> &matches = scratch->matches;
+	try {
+		search(pca, spPointGetData(queryFeature), k, selected, -1, scratch, matches);
+	}
+	catch (std::bad_alloc &) {
+		return -1;
+	}
+	for (size_t i=0; i<matches.size(); i++)
+		closest[i] = matches[i].image;
+	return (int) matches.size();
+}
+
+double spSiftPCARecall(SPSiftPCA *pca, int k, int numOfSamples) {
+	if (pca == NULL || k <= 0 || numOfSamples <= 0)
+		return -1;
+	SPSearchScratch scratch;
+	pca_recall_index recall = { pca, &scratch };
+	return spRerankRecall(pca->features, pca->images, pca->dim, k, numOfSamples, recallSearch,
+			&recall);
+}
@@ -0,0 +1,119 @@
+#ifndef SP_SIFT_PCA_H_
+#define SP_SIFT_PCA_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Sift PCA summary
+ * A copy of the sift feature database reduced by PCA to a few dimensions,
+ * used to find candidate features cheaply before an exact search among them.
+ *
+ * The projection is trained on (a sample of) the database features with
+ * cv::PCA and saved to a model file, which is loaded instead of training
+ * again on the next run. The model records the number of images and features
+ * and a checksum of the database it was trained on, and the sift extraction
+ * settings (see spSetSiftMaxSide and spSetSiftTiling), and is trained again
+ * if any of them changed. Reduced features are
+ * stored as floats in one flat array, so a scan reads 32 or 64 floats per
+ * feature instead of 128 doubles.
+ *
+ * A search scans the reduced features for the numOfCandidates closest ones,
+ * then re-ranks the candidates by their exact (full dimension) distance to
+ * the query feature. The result equals the exact search whenever the k closest
+ * features are among the candidates; spSiftPCARecall measures how often they are.
+ *
+ * The following functions are supported:
+ *
+ * spSiftPCACreate          - Loads or trains the projection and reduces the database
+ * spSiftPCADestroy         - Frees all resources
+ * spSiftPCANumOfComponents - A getter of the reduced dimension
+ * spSiftPCAMemoryBytes     - A getter of the memory used by the reduced database
+ * spSiftPCASearch          - Finds the images of the closest features to a query feature
+ * spSiftPCARecall          - Estimates the recall of the search on database features
+ */
+
+/** Type for defining the reduced database **/
+typedef struct sp_sift_pca_t SPSiftPCA;
+
+/**
+ * Loads the projection from modelPath if it holds one of the same dimensions
+ * trained on the same database with the current sift settings, otherwise
+ * trains it on siftDB and saves it to modelPath. Then projects all database
+ * features.
+ *
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @param numOfComponents - the reduced dimension (less than the feature dimension)
+ * @param numOfCandidates - number of candidates re-ranked by each search
+ * @param modelPath - path of the model file, or NULL to always train and not save
+ * @return
+ * NULL in case any of the arrays is NULL, the database has fewer features than
+ * numOfComponents, numOfComponents is not in 1, ..., dim-1, numOfCandidates <= 0
+ * or allocation failure occurred
+ * Otherwise, the new reduced database (failure to save the model is ignored)
+ */
+SPSiftPCA* spSiftPCACreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int numOfComponents, int numOfCandidates, const char *modelPath);
+
+/**
+ * Frees all resources associated with the reduced database.
+ * If pca is NULL nothing happens.
+ */
+void spSiftPCADestroy(SPSiftPCA *pca);
+
+/**
+ * A getter for the reduced dimension
+ *
+ * @param pca - the source reduced database
+ * @return the number of components, 0 if pca is NULL
+ */
+int spSiftPCANumOfComponents(SPSiftPCA *pca);
+
+/**
+ * A getter for the memory used by the projection and the reduced features
+ * (the full features are owned by siftDB)
+ *
+ * @param pca - the source reduced database
+ * @return the number of bytes, 0 if pca is NULL
+ */
+long spSiftPCAMemoryBytes(SPSiftPCA *pca);
+
+/**
+ * Finds the images of the k closest features to a query feature (same
+ * result as spBestSIFTL2SquaredDistanceInto when the k closest features are
+ * among the candidates)
+ *
+ * @param pca - the source reduced database
+ * @param queryFeature - the query feature
+ * @param k - number of closest features
+ * @param selected - if not NULL, only features of images i with selected[i]
+ *                   non zero are searched
+ * @param closest - an array of size k in which the image indices of the
+ *                  closest features are stored (closest first)
+ * @param scratch - the scratch space of the search (see sp_search_scratch)
+ * @return -1 if any of the pointers is NULL, k <= 0, the query dimension
+ *         does not match the database or allocation failure occurred,
+ *         otherwise the number of indices stored
+ */
+int spSiftPCASearch(SPSiftPCA *pca, SPPoint *queryFeature, int k,
+		const char *selected, int *closest, SPSearchScratch *scratch);
+
+/**
+ * Estimates the recall of spSiftPCASearch: database features (evenly spaced)
+ * are used as queries against the features of all other images, and the
+ * fraction of returned features which are truly among the k closest is returned.
+ *
+ * @param pca - the source reduced database
+ * @param k - number of closest features
+ * @param numOfSamples - number of database features used as queries
+ * @return the recall (between 0 and 1), -1 if pca is NULL, k <= 0,
+ *         numOfSamples <= 0 or allocation failure occurred
+ */
+double spSiftPCARecall(SPSiftPCA *pca, int k, int numOfSamples);
+
+
+#endif /* SP_SIFT_PCA_H_ */
@@ -0,0 +1,324 @@
+#include <cstdlib>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "sp_snapshot_db.h"
+
+struct snapshot_version {
+	std::vector<SPPoint**> hist;
+	std::vector<SPPoint**> sift;
+	std::vector<int> nFeatures;
+	std::vector<char> skipped;
+	void *derived;           // structures derived from the databases (or NULL)
+};
+
+struct retired_version {
+	snapshot_version *version;
+	unsigned long epoch;     // epoch of the swap which replaced the version
+	std::vector<int> freed;  // images whose descriptors are freed with the version
+};
+
+struct sp_snapshot_db_t {
+	std::atomic<snapshot_version*> current;
+	std::atomic<unsigned long> epoch;    // starts at 1, incremented on every swap
+	std::atomic<unsigned long> slots[SP_SNAPSHOT_DB_MAX_READERS]; // epoch of each reader, 0 if idle
+	std::mutex writeLock;                // serializes writers, guards retired
+	std::vector<retired_version> retired;
+	SPSnapshotDerive derive;
+	SPSnapshotDeriveFree deriveFree;
+	void *arg;
+};
+
+//Inner function freeing the descriptors of an image
+static void freeImage(SPPoint **hist, SPPoint **sift, int nFeatures) {
+	if (hist != NULL)
+		for (int c=0; c<3; c++)
+			spPointDestroy(hist[c]);
+	if (sift != NULL)
+		for (int i=0; i<nFeatures; i++)
+			spPointDestroy(sift[i]);
+	free(hist);
+	free(sift);
+}
+
+//Inner function freeing the derived structures of a version
+static void freeDerived(SPSnapshotDB *db, snapshot_version *version) {
+	if (version->derived != NULL && db->deriveFree != NULL)
+		db->deriveFree(version->derived, db->arg);
+	version->derived = NULL;
+}
+
+//Inner function deriving the structures of a new version
+static bool deriveVersion(SPSnapshotDB *db, snapshot_version *version) {
+	// if fails returns false (version->derived is NULL)
+	version->derived = NULL;
+	if (db->derive == NULL)
+		return true;
+	SPSnapshot view;
+	view.histDB = version->hist.data();
+	view.siftDB = version->sift.data();
+	view.nFeatures = version->nFeatures.data();
+	view.skipped = version->skipped.data();
+	view.numOfImages = (int) version->hist.size();
+	view.derived = NULL;
+	view.slot = -1;
+	version->derived = db->derive(&view, db->arg);
+	return version->derived != NULL;
+}
+
+//Inner function freeing the retired versions no reader can still refer to
+static void reclaim(SPSnapshotDB *db) {
+	// a reader holding a version replaced at epoch e entered before e
+	unsigned long oldest = 0;
+	for (int slot=0; slot<SP_SNAPSHOT_DB_MAX_READERS; slot++) {
+		unsigned long epoch = db->slots[slot].load();
+		if (epoch != 0 && (oldest == 0 || epoch < oldest))
+			oldest = epoch;
+	}
+	size_t kept = 0;
+	for (size_t r=0; r<db->retired.size(); r++) {
+		retired_version &retired = db->retired[r];
+		if (oldest != 0 && retired.epoch > oldest) {
+			if (kept != r)
+				db->retired[kept] = std::move(retired);
+			kept++;
+			continue;
+		}
+		// the derived structures may refer to the descriptors, so they go first
+		freeDerived(db, retired.version);
+		for (size_t i=0; i<retired.freed.size(); i++) {
+			int image = retired.freed[i];
+			freeImage(retired.version->hist[image], retired.version->sift[image],
+					retired.version->nFeatures[image]);
+		}
+		delete retired.version;
+	}
+	db->retired.resize(kept);
+}
+
+//Inner function publishing next in place of the current version
+static void publish(SPSnapshotDB *db, snapshot_version *next, std::vector<int> &freed) {
+	// db->retired must have room for one more version (so nothing throws)
+	snapshot_version *previous = db->current.exchange(next);
+	unsigned long epoch = db->epoch.fetch_add(1) + 1;
+	db->retired.push_back(retired_version());
+	db->retired.back().version = previous;
+	db->retired.back().epoch = epoch;
+	db->retired.back().freed.swap(freed);
+	reclaim(db);
+}
+
+//Inner function creating a copy of a point with another image index
+static SPPoint* renumberedPoint(SPPoint *point, int index) {
+	return spPointCreate(const_cast<double*>(spPointGetData(point)),
+			spPointGetDimension(point), index);
+}
+
+//Inner function creating copies of the descriptors of an image with another image index
+static bool renumberedImage(SPPoint **hist, SPPoint **sift, int nFeatures, int index,
+		SPPoint ***newHist, SPPoint ***newSift) {
+	// if fails nothing is left allocated
+	*newHist = (SPPoint**) calloc(3, sizeof(SPPoint*));
+	*newSift = (SPPoint**) calloc(nFeatures > 0 ? nFeatures : 1, sizeof(SPPoint*));
+	bool ok = *newHist != NULL && *newSift != NULL;
+	for (int c=0; ok && c<3; c++)
+		ok = ((*newHist)[c] = renumberedPoint(hist[c], index)) != NULL;
+	for (int i=0; ok && i<nFeatures; i++)
+		ok = ((*newSift)[i] = renumberedPoint(sift[i], index)) != NULL;
+	if (!ok) {
+		freeImage(*newHist, *newSift, nFeatures);
+		*newHist = NULL;
+		*newSift = NULL;
+	}
+	return ok;
+}
+
+SPSnapshotDB* spSnapshotDBCreate(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int numOfImages, void *derived, SPSnapshotDerive derive,
+		SPSnapshotDeriveFree deriveFree, void *arg) {
+	if (histDB == NULL || siftDB == NULL || nFeatures == NULL || numOfImages < 0)
+		return NULL;
+
+	SPSnapshotDB *res = new (std::nothrow) SPSnapshotDB;
+	if (res == NULL)
+		return NULL;
+	snapshot_version *version = new (std::nothrow) snapshot_version;
+	if (version == NULL) {
+		delete res;
+		return NULL;
+	}
+	try {
+		version->hist.assign(histDB, histDB + numOfImages);
+		version->sift.assign(siftDB, siftDB + numOfImages);
+		version->nFeatures.assign(nFeatures, nFeatures + numOfImages);
+		if (skipped != NULL)
+			version->skipped.assign(skipped, skipped + numOfImages);
+		else
+			version->skipped.assign(numOfImages, 0);
+	}
+	catch (std::bad_alloc &) {
+		delete version;
+		delete res;
+		return NULL;
+	}
+	version->derived = derived;
+	res->derive = derive;
+	res->deriveFree = deriveFree;
+	res->arg = arg;
+	res->current.store(version);
+	res->epoch.store(1);
+	for (int slot=0; slot<SP_SNAPSHOT_DB_MAX_READERS; slot++)
+		res->slots[slot].store(0);
+	return res;
+}
+
+void spSnapshotDBDestroy(SPSnapshotDB *db) {
+	if (db != NULL) {
+		// with no snapshot held, every retired version is reclaimed
+		reclaim(db);
+		snapshot_version *version = db->current.load();
+		freeDerived(db, version);
+		for (size_t i=0; i<version->hist.size(); i++)
+			freeImage(version->hist[i], version->sift[i], version->nFeatures[i]);
+		delete version;
+		delete db;
+	}
+}
+
+bool spSnapshotDBAcquire(SPSnapshotDB *db, SPSnapshot *snapshot) {
+	if (db == NULL || snapshot == NULL)
+		return false;
+
+	// claim an idle slot with the current epoch before reading the version, so
+	// a writer replacing this version sees the slot and keeps the version
+	int start = (int) (std::hash<std::thread::id>()(std::this_thread::get_id()) %
+			SP_SNAPSHOT_DB_MAX_READERS);
+	for (int slot=start; ; slot=(slot+1) % SP_SNAPSHOT_DB_MAX_READERS) {
+		unsigned long idle = 0;
+		if (db->slots[slot].compare_exchange_strong(idle, db->epoch.load())) {
+			snapshot->slot = slot;
+			break;
+		}
+		if ((slot+1) % SP_SNAPSHOT_DB_MAX_READERS == start) // all slots held
+			std::this_thread::yield();
+	}
+	snapshot_version *version = db->current.load();
+	snapshot->histDB = version->hist.data();
+	snapshot->siftDB = version->sift.data();
+	snapshot->nFeatures = version->nFeatures.data();
+	snapshot->skipped = version->skipped.data();
+	snapshot->numOfImages = (int) version->hist.size();
+	snapshot->derived = version->derived;
+	return true;
+}
+
+void spSnapshotDBRelease(SPSnapshotDB *db, SPSnapshot *snapshot) {
+	if (db != NULL && snapshot != NULL && snapshot->slot >= 0 &&
+			snapshot->slot < SP_SNAPSHOT_DB_MAX_READERS) {
+		db->slots[snapshot->slot].store(0);
+		snapshot->slot = -1;
+	}
+}
+
+int spSnapshotDBAppend(SPSnapshotDB *db, SPPoint **hist, SPPoint **sift, int nFeatures) {
+	if (db == NULL || hist == NULL || sift == NULL || nFeatures < 0)
+		return -1;
+
+	std::lock_guard<std::mutex> guard(db->writeLock);
+	snapshot_version *current = db->current.load();
+	snapshot_version *next = new (std::nothrow) snapshot_version;
+	if (next == NULL)
+		return -1;
+	std::vector<int> freed;
+	try {
+		next->hist.reserve(current->hist.size() + 1);
+		next->sift.reserve(current->sift.size() + 1);
+		next->nFeatures.reserve(current->nFeatures.size() + 1);
+		next->skipped.reserve(current->skipped.size() + 1);
+		next->hist = current->hist;
+		next->sift = current->sift;
+		next->nFeatures = current->nFeatures;
+		next->skipped = current->skipped;
+		next->hist.push_back(hist);
+		next->sift.push_back(sift);
+		next->nFeatures.push_back(nFeatures);
+		next->skipped.push_back(0);
+		db->retired.reserve(db->retired.size() + 1);
+	}
+	catch (std::bad_alloc &) {
+		delete next;
+		return -1;
+	}
+	if (!deriveVersion(db, next)) {
+		delete next;
+		return -1;
+	}
+	// the descriptors of all images are shared, none is freed with current
+	publish(db, next, freed);
+	return (int) next->hist.size() - 1;
+}
+
+int spSnapshotDBCompact(SPSnapshotDB *db, const char *removed, int numOfImages) {
+	if (db == NULL || removed == NULL)
+		return -1;
+
+	std::lock_guard<std::mutex> guard(db->writeLock);
+	snapshot_version *current = db->current.load();
+	if (numOfImages != (int) current->hist.size())
+		return -1;
+	snapshot_version *next = new (std::nothrow) snapshot_version;
+	if (next == NULL)
+		return -1;
+	std::vector<int> freed;
+	bool ok = true;
+	try {
+		db->retired.reserve(db->retired.size() + 1);
+		next->hist.reserve(numOfImages);
+		next->sift.reserve(numOfImages);
+		next->nFeatures.reserve(numOfImages);
+		next->skipped.reserve(numOfImages);
+		for (int i=0; ok && i<numOfImages; i++) {
+			int index = (int) next->hist.size();
+			SPPoint **hist = current->hist[i], **sift = current->sift[i];
+			if (removed[i]) {
+				freed.push_back(i);
+				continue;
+			}
+			if (index != i) { // renumbered
+				freed.push_back(i);
+				ok = renumberedImage(hist, sift, current->nFeatures[i], index, &hist, &sift);
+				if (!ok)
+					break;
+			}
+			next->hist.push_back(hist);
+			next->sift.push_back(sift);
+			next->nFeatures.push_back(current->nFeatures[i]);
+			next->skipped.push_back(current->skipped[i]);
+		}
+	}
+	catch (std::bad_alloc &) {
+		ok = false;
+	}
+	ok = ok && deriveVersion(db, next);
+	if (!ok) {
+		// free the copies created so far (images past their original index)
+		for (size_t j=0; j<next->hist.size(); j++)
+			if (next->hist[j] != current->hist[j])
+				freeImage(next->hist[j], next->sift[j], next->nFeatures[j]);
+		delete next;
+		return -1;
+	}
+	publish(db, next, freed);
+	return (int) next->hist.size();
+}
+
+int spSnapshotDBNumOfRetired(SPSnapshotDB *db) {
+	if (db == NULL)
+		return 0;
+	std::lock_guard<std::mutex> guard(db->writeLock);
+	return (int) db->retired.size();
+}
@@ -0,0 +1,164 @@
+#ifndef SP_SNAPSHOT_DB_H_
+#define SP_SNAPSHOT_DB_H_
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Snapshot Database summary
+ * The histograms and sift features databases, published as immutable
+ * versions so queries never block on images being added or removed.
+ *
+ * A query acquires a snapshot: the databases as of the latest published
+ * version, which stay valid and unchanged until the snapshot is released,
+ * whatever writers do meanwhile. Acquiring and releasing only publish the
+ * current epoch in a reader slot with atomic operations - readers take no
+ * lock and never wait for writers.
+ *
+ * Writers (serialized among themselves) build a new version next to the
+ * current one and publish it with an atomic pointer swap, RCU style:
+ * - appending an image copies the arrays of image pointers, the descriptors
+ *   of the existing images are shared with the previous version
+ * - compacting removes images and renumbers the following ones, creating
+ *   renumbered copies of their descriptors (the image index is stored in
+ *   every SPPoint)
+ * The previous version and the descriptors it alone refers to are retired
+ * with the epoch of the swap, and freed once every reader slot is idle or
+ * holds a later epoch (epoch-based reclamation).
+ *
+ * Structures derived from the databases (search structures pointing into
+ * them, or numbering images as they do) belong to a version: a writer
+ * derives them for the new version before publishing it, and they are freed
+ * with the version, so a snapshot always holds the derived structures of
+ * its own databases.
+ *
+ * The following functions are supported:
+ *
+ * spSnapshotDBCreate           - Creates a database owning the given descriptors
+ * spSnapshotDBDestroy          - Frees all versions and descriptors
+ * spSnapshotDBAcquire          - Acquires a snapshot of the latest version (readers)
+ * spSnapshotDBRelease          - Releases a snapshot (readers)
+ * spSnapshotDBAppend           - Adds an image (writers)
+ * spSnapshotDBCompact          - Removes images (writers)
+ * spSnapshotDBNumOfRetired     - A getter of the number of versions awaiting reclamation
+ */
+
+/** Maximum number of snapshots held at the same time **/
+#define SP_SNAPSHOT_DB_MAX_READERS 64
+
+/** Type for defining the database **/
+typedef struct sp_snapshot_db_t SPSnapshotDB;
+
+/** A consistent version of the databases, as passed to queryAndCheck **/
+typedef struct sp_snapshot_t {
+	SPPoint ***histDB;   // 3 histograms of each image
+	SPPoint ***siftDB;   // sift features of each image
+	int *nFeatures;      // number of sift features of each image
+	char *skipped;       // flag of each image skipped by preprocessing (see preprocessing)
+	int numOfImages;
+	void *derived;       // structures derived from the databases of the version (or NULL)
+	int slot;            // reader slot held by the snapshot
+} SPSnapshot;
+
+/**
+ * Type of a function deriving structures from the databases of a new
+ * version (its derived and slot members are not set), called by writers
+ * before the version is published. Returns NULL if fails.
+ */
+typedef void* (*SPSnapshotDerive)(const SPSnapshot *version, void *arg);
+
+/** Type of a function freeing derived structures **/
+typedef void (*SPSnapshotDeriveFree)(void *derived, void *arg);
+
+/**
+ * Creates a database whose first version holds the given images.
+ * The database takes ownership of the descriptors of each image (histDB[i],
+ * siftDB[i] and their points), while the histDB, siftDB and nFeatures arrays
+ * themselves are copied and remain owned by the caller.
+ *
+ * @param histDB - histograms database (3 histograms of each image)
+ * @param siftDB - sift features database
+ * @param nFeatures - number of features of each image
+ * @param skipped - flag of each image skipped by preprocessing, or NULL if
+ *                  none was skipped (copied, images added later are not skipped)
+ * @param numOfImages - number of images
+ * @param derived - structures derived from the given databases (owned by the
+ *                  database on success), or NULL
+ * @param derive - the function deriving the structures of new versions, or
+ *                 NULL if versions have no derived structures
+ * @param deriveFree - the function freeing derived structures, or NULL if
+ *                     they are not freed
+ * @param arg - passed to derive and deriveFree
+ * @return NULL if any of histDB, siftDB, nFeatures is NULL, numOfImages < 0 or
+ *         allocation failure occurred (ownership is not taken), otherwise the database
+ */
+SPSnapshotDB* spSnapshotDBCreate(SPPoint ***histDB, SPPoint ***siftDB, int *nFeatures,
+		const char *skipped, int numOfImages, void *derived, SPSnapshotDerive derive,
+		SPSnapshotDeriveFree deriveFree, void *arg);
+
+/**
+ * Frees all versions of the database and all descriptors.
+ * No snapshot may be held. If db is NULL nothing happens.
+ */
+void spSnapshotDBDestroy(SPSnapshotDB *db);
+
+/**
+ * Acquires a snapshot of the latest published version, which stays valid
+ * until released. Lock-free: only waits if SP_SNAPSHOT_DB_MAX_READERS
+ * snapshots are held at the same time.
+ *
+ * @param db - the source database
+ * @param snapshot - the address in which the snapshot is stored
+ * @return false if any of the arguments is NULL, true otherwise
+ */
+bool spSnapshotDBAcquire(SPSnapshotDB *db, SPSnapshot *snapshot);
+
+/**
+ * Releases a snapshot, its arrays and descriptors may no longer be used.
+ * If db or snapshot is NULL nothing happens.
+ */
+void spSnapshotDBRelease(SPSnapshotDB *db, SPSnapshot *snapshot);
+
+/**
+ * Publishes a new version with an image added after the existing ones. The
+ * database takes ownership of hist, sift and their points on success.
+ * The points must have the index of the new image (numOfImages of the
+ * latest version, which is returned).
+ *
+ * @param db - the target database
+ * @param hist - the 3 histograms of the image
+ * @param sift - the sift features of the image
+ * @param nFeatures - number of sift features
+ * @return the index of the new image, -1 if any of the pointer arguments is
+ *         NULL, nFeatures < 0, allocation failure occurred or the derived
+ *         structures cannot be created (nothing is published)
+ */
+int spSnapshotDBAppend(SPSnapshotDB *db, SPPoint **hist, SPPoint **sift, int nFeatures);
+
+/**
+ * Publishes a new version without the images flagged in removed (indices of
+ * the latest version). The following images are renumbered so indices stay
+ * consecutive. Descriptors of removed images are freed once no snapshot
+ * refers to them.
+ *
+ * @param db - the target database
+ * @param removed - a flag for each image of the latest version
+ * @param numOfImages - size of removed (must equal the number of images of
+ *                      the latest version, so a concurrent append is detected)
+ * @return the number of images left, -1 if any of the arguments is NULL,
+ *         numOfImages does not match, allocation failure occurred or the
+ *         derived structures cannot be created (nothing is published)
+ */
+int spSnapshotDBCompact(SPSnapshotDB *db, const char *removed, int numOfImages);
+
+/**
+ * A getter for the number of replaced versions not yet freed (because
+ * snapshots of them, or of earlier versions, may still be held)
+ *
+ * @param db - the source database
+ * @return the number of retired versions, 0 if db is NULL
+ */
+int spSnapshotDBNumOfRetired(SPSnapshotDB *db);
+
+#endif /* SP_SNAPSHOT_DB_H_ */
@@ -0,0 +1,275 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <new>
+#include "sp_snapshot_db.h"
+#include "sp_vocab_tree.h"
+#include "sp_sift_lsh.h"
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * Stress test of the snapshot database (see sp_snapshot_db), built with
+ * ThreadSanitizer by make sp_snapshot_test.
+ *
+ * Reader threads query snapshots while a writer thread keeps appending and
+ * removing images. Each version derives a vocabulary tree and an LSH database
+ * from its descriptors, as ex3 derives its search structures. Every query
+ * checks that the snapshot is consistent with its derived structures:
+ * - every point carries the index of its image in the snapshot
+ * - the derived structures were built for the images of the snapshot
+ * - the query image is the closest image by the vocabulary tree and holds
+ *   the closest feature of each of its features by the LSH search
+ *
+ * Prints a summary and returns 0 if all checks pass (and ThreadSanitizer
+ * reports no race), -1 otherwise.
+ */
+
+#define TEST_IMAGES 16
+#define TEST_MAX_IMAGES 32
+#define TEST_FEATURES 12
+#define TEST_DIM 128
+#define TEST_BINS 16
+#define TEST_K 3
+#define TEST_READERS 4
+// number of versions published by the writer
+#define TEST_UPDATES 20
+
+#define TEST_RESULT_MSG "Snapshots - %ld queries by %d readers, %d versions published, %d inconsistent - %s\n"
+#define TEST_CREATE_ERROR_MSG "An error occurred - the snapshot database cannot be created\n"
+#define TEST_UPDATE_ERROR_MSG "An error occurred - update %d failed\n"
+
+// the search structures derived from a version
+struct test_derived {
+	SPVocabTree *tree;
+	SPSiftLSH *lsh;
+	int numOfImages;   // of the version they were derived from
+};
+
+// state shared by the readers and the writer
+struct test_state {
+	SPSnapshotDB *db;
+	std::atomic<bool> done;        // the writer finished
+	std::atomic<long> queries;
+	std::atomic<int> inconsistent;
+};
+
+//Inner function freeing derived structures (see SPSnapshotDeriveFree)
+static void freeDerived(void *derived, void *arg) {
+	(void) arg;
+	test_derived *d = (test_derived*) derived;
+	if (d == NULL)
+		return;
+	spVocabTreeDestroy(d->tree);
+	spSiftLSHDestroy(d->lsh);
+	delete d;
+}
+
+//Inner function deriving the structures of a version (see SPSnapshotDerive)
+static void* derive(const SPSnapshot *version, void *arg) {
+	test_derived *d = new (std::nothrow) test_derived;
+	if (d == NULL)
+		return NULL;
+	d->numOfImages = version->numOfImages;
+	d->tree = spVocabTreeCreate(version->siftDB, version->nFeatures, version->numOfImages, 4, 2);
+	d->lsh = spSiftLSHCreate(version->siftDB, version->nFeatures, version->numOfImages,
+			128, 4, 50);
+	if (d->tree == NULL || d->lsh == NULL) {
+		freeDerived(d, arg);
+		return NULL;
+	}
+	return d;
+}
+
+//Inner function drawing the descriptors of an image (integer coordinates, as sift and histograms)
+static bool createImage(int index, unsigned int *seed, SPPoint ***hist, SPPoint ***sift) {
+	*hist = (SPPoint**) calloc(3, sizeof(SPPoint*));
+	*sift = (SPPoint**) calloc(TEST_FEATURES, sizeof(SPPoint*));
+	bool ok = *hist != NULL && *sift != NULL;
+	double data[TEST_DIM];
+	for (int c=0; c<3 && ok; c++) {
+		for (int b=0; b<TEST_BINS; b++)
+			data[b] = rand_r(seed)%100;
+		ok = ((*hist)[c] = spPointCreate(data, TEST_BINS, index)) != NULL;
+	}
+	for (int j=0; j<TEST_FEATURES && ok; j++) {
+		for (int d=0; d<TEST_DIM; d++)
+			data[d] = rand_r(seed)%64 + (index%4)*32;
+		ok = ((*sift)[j] = spPointCreate(data, TEST_DIM, index)) != NULL;
+	}
+	if (!ok) {
+		for (int c=0; *hist != NULL && c<3; c++)
+			spPointDestroy((*hist)[c]);
+		for (int j=0; *sift != NULL && j<TEST_FEATURES; j++)
+			spPointDestroy((*sift)[j]);
+		free(*hist);
+		free(*sift);
+	}
+	return ok;
+}
+
+//Inner function checking a snapshot by querying one of its images
+static bool checkSnapshot(const SPSnapshot *snapshot, int query, SPSearchScratch *scratch,
+		std::vector<double> &dists) {
+	const test_derived *derived = (const test_derived*) snapshot->derived;
+	int numOfImages = snapshot->numOfImages;
+	if (derived == NULL || derived->numOfImages != numOfImages)
+		return false;
+	for (int i=0; i<numOfImages; i++) {
+		for (int c=0; c<3; c++)
+			if (spPointGetIndex(snapshot->histDB[i][c]) != i)
+				return false;
+		for (int j=0; j<snapshot->nFeatures[i]; j++)
+			if (spPointGetIndex(snapshot->siftDB[i][j]) != i)
+				return false;
+	}
+
+	SPPoint **features = snapshot->siftDB[query];
+	int numOfFeatures = snapshot->nFeatures[query];
+	if (!spVocabTreeScore(derived->tree, features, numOfFeatures, NULL, dists.data(), scratch))
+		return false;
+	for (int i=0; i<numOfImages; i++)
+		if (dists[i] < dists[query] - 1e-9)
+			return false;
+	int closest[TEST_K];
+	for (int j=0; j<numOfFeatures; j++) {
+		int n = spSiftLSHSearch(derived->lsh, features[j], TEST_K, NULL, closest, scratch);
+		if (n <= 0 || closest[0] != query)
+			return false;
+		for (int m=1; m<n; m++)
+			if (closest[m] < 0 || closest[m] >= numOfImages)
+				return false;
+	}
+	return true;
+}
+
+//Inner function querying snapshots until the writer is done
+static void readSnapshots(test_state *state) {
+	SPSearchScratch scratch;
+	std::vector<double> dists(TEST_MAX_IMAGES);
+	long q = 0;
+	while (!state->done) {
+		SPSnapshot snapshot;
+		spSnapshotDBAcquire(state->db, &snapshot);
+		if (snapshot.numOfImages > 0 &&
+				!checkSnapshot(&snapshot, (int) (q % snapshot.numOfImages), &scratch, dists))
+			state->inconsistent++;
+		spSnapshotDBRelease(state->db, &snapshot);
+		q++;
+	}
+	state->queries += q;
+}
+
+//Inner function appending and removing images
+static int writeSnapshots(test_state *state) {
+	// returns the number of published versions, -1 if an update fails
+	unsigned int seed = 54321;
+	for (int u=0; u<TEST_UPDATES; u++) {
+		SPSnapshot snapshot;
+		spSnapshotDBAcquire(state->db, &snapshot);
+		int numOfImages = snapshot.numOfImages;
+		spSnapshotDBRelease(state->db, &snapshot);
+
+		int ret;
+		if (numOfImages < TEST_MAX_IMAGES && (u%3 != 2 || numOfImages <= TEST_K)) {
+			SPPoint **hist, **sift;
+			if (!createImage(numOfImages, &seed, &hist, &sift))
+				ret = -1;
+			else if ((ret = spSnapshotDBAppend(state->db, hist, sift, TEST_FEATURES)) == -1) {
+				for (int c=0; c<3; c++)
+					spPointDestroy(hist[c]);
+				for (int j=0; j<TEST_FEATURES; j++)
+					spPointDestroy(sift[j]);
+				free(hist);
+				free(sift);
+			}
+		}
+		else {
+			char removed[TEST_MAX_IMAGES] = {0};
+			removed[(u*7)%numOfImages] = 1;
+			ret = spSnapshotDBCompact(state->db, removed, numOfImages);
+		}
+		if (ret == -1) {
+			printf(TEST_UPDATE_ERROR_MSG, u);
+			return -1;
+		}
+	}
+	return TEST_UPDATES;
+}
+
+//Inner function running the writer and signaling the readers when it is done
+static void runWriter(test_state *state, int *versions) {
+	*versions = writeSnapshots(state);
+	state->done = true;
+}
+
+//Inner function creating the database of the first TEST_IMAGES images
+static SPSnapshotDB* createDatabase() {
+	SPPoint **histDB[TEST_IMAGES], **siftDB[TEST_IMAGES];
+	int nFeatures[TEST_IMAGES];
+	unsigned int seed = 12345;
+	int created = 0;
+	while (created < TEST_IMAGES && createImage(created, &seed, &histDB[created], &siftDB[created])) {
+		nFeatures[created] = TEST_FEATURES;
+		created++;
+	}
+	SPSnapshotDB *db = NULL;
+	if (created == TEST_IMAGES) {
+		SPSnapshot first = { histDB, siftDB, nFeatures, NULL, TEST_IMAGES, NULL, 0 };
+		void *derived = derive(&first, NULL);
+		if (derived != NULL) {
+			db = spSnapshotDBCreate(histDB, siftDB, nFeatures, NULL, TEST_IMAGES, derived,
+					derive, freeDerived, NULL);
+			if (db == NULL)
+				freeDerived(derived, NULL);
+		}
+	}
+	if (db == NULL)
+		for (int i=0; i<created; i++) {
+			for (int c=0; c<3; c++)
+				spPointDestroy(histDB[i][c]);
+			for (int j=0; j<TEST_FEATURES; j++)
+				spPointDestroy(siftDB[i][j]);
+			free(histDB[i]);
+			free(siftDB[i]);
+		}
+	return db;
+}
+
+int main() {
+	test_state state;
+	state.db = createDatabase();
+	if (state.db == NULL) {
+		printf("%s",TEST_CREATE_ERROR_MSG);
+		return -1;
+	}
+	state.done = false;
+	state.queries = 0;
+	state.inconsistent = 0;
+
+	int versions = -1;
+	std::vector<std::thread> readers;
+	std::thread writer;
+	try {
+		for (int r=0; r<TEST_READERS; r++)
+			readers.push_back(std::thread(readSnapshots, &state));
+		writer = std::thread(runWriter, &state, &versions);
+	}
+	catch (std::exception &) {
+		state.done = true;
+	}
+	if (writer.joinable())
+		writer.join();
+	for (size_t r=0; r<readers.size(); r++)
+		readers[r].join();
+
+	bool passed = versions == TEST_UPDATES && (int) readers.size() == TEST_READERS &&
+			state.inconsistent == 0 && state.queries > 0;
+	printf(TEST_RESULT_MSG, (long) state.queries, (int) readers.size(), versions,
+			(int) state.inconsistent, passed ? "PASS" : "FAIL");
+	spSnapshotDBDestroy(state.db);
+	return passed ? 0 : -1;
+}
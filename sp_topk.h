@@ -0,0 +1,63 @@
+#ifndef SP_TOPK_H_
+#define SP_TOPK_H_
+#include <cmath>
+#include <climits>
+
+/**
+ * SP Top K summary
+ * Keeps the K smallest (value, index) pairs seen so far, for a K known at
+ * compile time. Replaces a bounded priority queue in scans where K is small:
+ * the pairs live in fixed-size arrays (registers or the stack once the loops
+ * are unrolled), nothing is allocated and pushing is inlined.
+ *
+ * Pairs are ordered by value and then by index, exactly as in SPBPQueue, so
+ * the kept pairs are the same as after enqueuing them to an SPBPQueue of
+ * maximum size K.
+ *
+ * Most pushes are rejected by a single comparison with the current maximum.
+ * An accepted pair replaces the maximum and is moved to its place by one
+ * compare-exchange pass, written with conditional moves instead of branches.
+ */
+template <int K>
+struct SPTopK {
+	double value[K];  // sorted ascending (with the index as tie breaker)
+	int index[K];
+	long pushed;      // number of pairs pushed since the last clear
+
+	/** Removes all pairs **/
+	inline void clear() {
+		for (int i=0; i<K; i++) {
+			value[i] = HUGE_VAL; // sentinels, greater than any distance
+			index[i] = INT_MAX;
+		}
+		pushed = 0;
+	}
+
+	/** Pushes a pair, keeping it if it is one of the K smallest **/
+	inline void push(int idx, double v) {
+		pushed++;
+		if (v > value[K-1] || (v == value[K-1] && idx >= index[K-1]))
+			return;
+		value[K-1] = v;
+		index[K-1] = idx;
+		for (int j=K-1; j>0; j--) {
+			bool swap = value[j-1] > value[j] || (value[j-1] == value[j] && index[j-1] > index[j]);
+			double lowValue = swap ? value[j] : value[j-1];
+			double highValue = swap ? value[j-1] : value[j];
+			int lowIndex = swap ? index[j] : index[j-1];
+			int highIndex = swap ? index[j-1] : index[j];
+			value[j-1] = lowValue;
+			value[j] = highValue;
+			index[j-1] = lowIndex;
+			index[j] = highIndex;
+		}
+	}
+
+	/** Number of pairs kept **/
+	inline int size() const {
+		return pushed < K ? (int) pushed : K;
+	}
+};
+
+
+#endif /* SP_TOPK_H_ */
@@ -0,0 +1,332 @@
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include "sp_vocab_tree.h"
+#include "sp_distance_kernels.h"
+
+// maximum number of database features the tree is trained on
+#define SP_VOCAB_TRAIN_FEATURES 20000
+// number of k-means iterations at each node
+#define SP_VOCAB_KMEANS_ITERATIONS 5
+
+struct vocab_node {
+	int firstChild;   // index of the first child node (children are consecutive)
+	int numOfChildren;
+	int word;         // word of a leaf, -1 for inner nodes
+};
+
+struct vocab_posting {
+	int image;
+	double weight;    // normalized TF-IDF weight of the word in the image
+};
+
+struct sp_vocab_tree_t {
+	int dim;
+	int branching;
+	int depth;
+	int numOfImages;
+	std::vector<vocab_node> nodes;      // nodes[0] is the root
+	std::vector<double> centers;        // center of each node (dim each, unused for the root)
+	std::vector<double> idf;            // inverse document frequency of each word
+	std::vector<std::vector<vocab_posting> > postings; // images containing each word
+	long numOfPostings;
+};
+
+// the assignment step of k-means (see spL2Dispatch)
+struct vocab_assign_scan {
+	const std::vector<const double*> *points;
+	const std::vector<int> *members;
+	int k;
+	int dim;
+	const std::vector<double> *centers;
+	std::vector<int> *assignment;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		// assigns each member to its closest center
+		for (size_t i=0; i<members->size(); i++) {
+			double best = HUGE_VAL;
+			for (int c=0; c<k; c++) {
+				double dist = kernel((*points)[(*members)[i]], centers->data() + (size_t) c*dim);
+				if (dist < best) {
+					best = dist;
+					(*assignment)[i] = c;
+				}
+			}
+		}
+	}
+};
+
+static void kmeans(const std::vector<const double*> &points, const std::vector<int> &members,
+		int k, int dim, std::vector<double> &centers, std::vector<int> &assignment) {
+	// clusters members (indices into points) into k clusters
+	// centers start at k evenly spaced members, so training is deterministic
+	centers.assign((size_t) k*dim, 0);
+	for (int c=0; c<k; c++) {
+		const double *point = points[members[(size_t) c*members.size()/k]];
+		std::copy(point, point + dim, centers.begin() + (size_t) c*dim);
+	}
+	assignment.assign(members.size(), 0);
+	std::vector<long> counts(k);
+	vocab_assign_scan assign = { &points, &members, k, dim, &centers, &assignment };
+	for (int iteration=0; iteration<SP_VOCAB_KMEANS_ITERATIONS; iteration++) {
+		// assign each member to its closest center
+		spL2Dispatch(dim, assign);
+		// move each center to the mean of its members (empty clusters keep their center)
+		std::vector<double> sums((size_t) k*dim, 0);
+		std::fill(counts.begin(), counts.end(), 0);
+		for (size_t i=0; i<members.size(); i++) {
+			const double *point = points[members[i]];
+			double *sum = sums.data() + (size_t) assignment[i]*dim;
+			for (int d=0; d<dim; d++)
+				sum[d] += point[d];
+			counts[assignment[i]]++;
+		}
+		for (int c=0; c<k; c++)
+			if (counts[c] > 0)
+				for (int d=0; d<dim; d++)
+					centers[(size_t) c*dim+d] = sums[(size_t) c*dim+d]/counts[c];
+	}
+}
+
+static void buildNode(SPVocabTree *tree, int node, const std::vector<const double*> &points,
+		const std::vector<int> &members, int level) {
+	// makes node a leaf, or clusters its members and builds its children
+	if (level == tree->depth || (int) members.size() <= tree->branching) {
+		tree->nodes[node].word = (int) tree->postings.size();
+		tree->postings.push_back(std::vector<vocab_posting>());
+		return;
+	}
+
+	std::vector<double> centers;
+	std::vector<int> assignment;
+	kmeans(points, members, tree->branching, tree->dim, centers, assignment);
+
+	// one child for each non empty cluster
+	std::vector<std::vector<int> > clusters(tree->branching);
+	for (size_t i=0; i<members.size(); i++)
+		clusters[assignment[i]].push_back(members[i]);
+	int firstChild = (int) tree->nodes.size();
+	int numOfChildren = 0;
+	for (int c=0; c<tree->branching; c++) {
+		if (clusters[c].empty())
+			continue;
+		vocab_node child = { 0, 0, -1 };
+		tree->nodes.push_back(child);
+		tree->centers.insert(tree->centers.end(), centers.begin() + (size_t) c*tree->dim,
+				centers.begin() + (size_t) (c+1)*tree->dim);
+		numOfChildren++;
+	}
+	tree->nodes[node].firstChild = firstChild;
+	tree->nodes[node].numOfChildren = numOfChildren;
+	for (int c=0, child=firstChild; c<tree->branching; c++)
+		if (!clusters[c].empty())
+			buildNode(tree, child++, points, clusters[c], level + 1);
+}
+
+template <typename Kernel>
+static int quantize(const SPVocabTree *tree, const Kernel &kernel, const double *feature) {
+	// descends to the closest child at each level
+	int node = 0;
+	while (tree->nodes[node].word == -1) {
+		const vocab_node &parent = tree->nodes[node];
+		int best = parent.firstChild;
+		double bestDist = HUGE_VAL;
+		for (int child=parent.firstChild; child<parent.firstChild+parent.numOfChildren; child++) {
+			double dist = kernel(feature, tree->centers.data() + (size_t) child*tree->dim);
+			if (dist < bestDist) {
+				bestDist = dist;
+				best = child;
+			}
+		}
+		node = best;
+	}
+	return tree->nodes[node].word;
+}
+
+// the quantization of features (see spL2Dispatch)
+struct vocab_quantize_scan {
+	const SPVocabTree *tree;
+	SPPoint **features;
+	int numOfFeatures;
+	int *words;
+
+	template <typename Kernel>
+	void operator()(const Kernel &kernel) {
+		for (int i=0; i<numOfFeatures; i++)
+			words[i] = quantize(tree, kernel, spPointGetData(features[i]));
+	}
+};
+
+static void quantizeAll(const SPVocabTree *tree, SPPoint **features, int numOfFeatures,
+		int *words) {
+	// stores the word of each feature in words
+	vocab_quantize_scan scan = { tree, features, numOfFeatures, words };
+	spL2Dispatch(tree->dim, scan);
+}
+
+static void weightWords(SPVocabTree *tree, std::vector<int> &words,
+		std::vector<std::pair<int,double> > &histogram) {
+	// builds the normalized TF-IDF histogram (word, weight) of a list of words
+	histogram.clear();
+	std::sort(words.begin(), words.end());
+	double norm = 0;
+	for (size_t i=0; i<words.size(); ) {
+		size_t j = i;
+		while (j < words.size() && words[j] == words[i])
+			j++;
+		double weight = (j - i)*tree->idf[words[i]];
+		if (weight > 0) {
+			histogram.push_back(std::make_pair(words[i], weight));
+			norm += weight;
+		}
+		i = j;
+	}
+	for (size_t i=0; i<histogram.size(); i++)
+		histogram[i].second /= norm;
+}
+
+SPVocabTree* spVocabTreeCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int branching, int depth) {
+	if (siftDB == NULL || nFeatures == NULL || numOfImages <= 0 || branching <= 1 || depth <= 0)
+		return NULL;
+
+	SPVocabTree *res = new (std::nothrow) SPVocabTree;
+	if (res == NULL)
+		return NULL;
+	try {
+		res->dim = 0;
+		res->branching = branching;
+		res->depth = depth;
+		res->numOfImages = numOfImages;
+		res->numOfPostings = 0;
+
+		std::vector<const double*> points;
+		for (int i=0; i<numOfImages; i++)
+			for (int j=0; j<nFeatures[i]; j++)
+				points.push_back(spPointGetData(siftDB[i][j]));
+		if (points.empty()) {
+			delete res;
+			return NULL;
+		}
+		for (int i=0; i<numOfImages && res->dim == 0; i++)
+			if (nFeatures[i] > 0)
+				res->dim = spPointGetDimension(siftDB[i][0]);
+
+		// train on evenly spaced features
+		std::vector<int> sample;
+		size_t numOfSamples = std::min(points.size(), (size_t) SP_VOCAB_TRAIN_FEATURES);
+		for (size_t s=0; s<numOfSamples; s++)
+			sample.push_back((int) (s*points.size()/numOfSamples));
+		vocab_node root = { 0, 0, -1 };
+		res->nodes.push_back(root);
+		res->centers.assign(res->dim, 0);
+		buildNode(res, 0, points, sample, 0);
+
+		// words of every image
+		std::vector<std::vector<int> > imageWords(numOfImages);
+		std::vector<int> documentFrequency(res->postings.size(), 0);
+		for (int i=0; i<numOfImages; i++) {
+			imageWords[i].resize(nFeatures[i]);
+			if (nFeatures[i] > 0)
+				quantizeAll(res, siftDB[i], nFeatures[i], imageWords[i].data());
+			std::vector<int> distinct(imageWords[i]);
+			std::sort(distinct.begin(), distinct.end());
+			distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+			for (size_t w=0; w<distinct.size(); w++)
+				documentFrequency[distinct[w]]++;
+		}
+		res->idf.resize(res->postings.size());
+		for (size_t w=0; w<res->idf.size(); w++)
+			res->idf[w] = documentFrequency[w] > 0 ? log((double) numOfImages/documentFrequency[w]) : 0;
+
+		// inverted file
+		std::vector<std::pair<int,double> > histogram;
+		for (int i=0; i<numOfImages; i++) {
+			weightWords(res, imageWords[i], histogram);
+			for (size_t w=0; w<histogram.size(); w++) {
+				vocab_posting posting = { i, histogram[w].second };
+				res->postings[histogram[w].first].push_back(posting);
+				res->numOfPostings++;
+			}
+		}
+	}
+	catch (std::bad_alloc &) {
+		delete res;
+		return NULL;
+	}
+	return res;
+}
+
+void spVocabTreeDestroy(SPVocabTree *tree) {
+	delete tree;
+}
+
+int spVocabTreeNumOfWords(SPVocabTree *tree) {
+	if (tree == NULL)
+		return 0;
+	return (int) tree->postings.size();
+}
+
+long spVocabTreeNumOfPostings(SPVocabTree *tree) {
+	if (tree == NULL)
+		return 0;
+	return tree->numOfPostings;
+}
+
+long spVocabTreeMemoryBytes(SPVocabTree *tree) {
+	if (tree == NULL)
+		return 0;
+	long bytes = sizeof(*tree) + tree->nodes.capacity()*sizeof(vocab_node) +
+			tree->centers.capacity()*sizeof(double) + tree->idf.capacity()*sizeof(double) +
+			tree->postings.capacity()*sizeof(std::vector<vocab_posting>);
+	for (size_t w=0; w<tree->postings.size(); w++)
+		bytes += tree->postings[w].capacity()*sizeof(vocab_posting);
+	return bytes;
+}
+
+int spVocabTreeQuantize(SPVocabTree *tree, SPPoint *feature) {
+	if (tree == NULL || feature == NULL || spPointGetDimension(feature) != tree->dim)
+		return -1;
+	int word;
+	quantizeAll(tree, &feature, 1, &word);
+	return word;
+}
+
+bool spVocabTreeScore(SPVocabTree *tree, SPPoint **queryFeatures, int numOfQueryFeatures,
+		const char *selected, double *dists, SPSearchScratch *scratch) {
+	if (tree == NULL || queryFeatures == NULL || dists == NULL || scratch == NULL)
+		return false;
+
+	try {
+		for (int i=0; i<numOfQueryFeatures; i++)
+			if (spPointGetDimension(queryFeatures[i]) != tree->dim)
+				return false;
+		std::vector<int> &words = scratch->words;
+		words.resize(numOfQueryFeatures);
+		if (numOfQueryFeatures > 0)
+			quantizeAll(tree, queryFeatures, numOfQueryFeatures, words.data());
+		std::vector<std::pair<int,double> > &histogram = scratch->histogram;
+		weightWords(tree, words, histogram);
+
+		// |q - d|_1 = 2 + sum over common words of (|q_w - d_w| - q_w - d_w)
+		for (int i=0; i<tree->numOfImages; i++)
+			dists[i] = 2;
+		for (size_t w=0; w<histogram.size(); w++) {
+			double q = histogram[w].second;
+			const std::vector<vocab_posting> &list = tree->postings[histogram[w].first];
+			for (size_t p=0; p<list.size(); p++) {
+				if (selected != NULL && !selected[list[p].image])
+					continue;
+				double d = list[p].weight;
+				dists[list[p].image] += fabs(q - d) - q - d;
+			}
+		}
+	}
+	catch (std::bad_alloc &) {
+		return false;
+	}
+	return true;
+}
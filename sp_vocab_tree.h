@@ -0,0 +1,120 @@
+#ifndef SP_VOCAB_TREE_H_
+#define SP_VOCAB_TREE_H_
+#include "sp_search_scratch.h"
+
+extern "C" {
+	#include "SPPoint.h"
+}
+
+/**
+ * SP Vocabulary Tree summary
+ * A hierarchical k-means vocabulary of sift features ("visual words") with an
+ * inverted file mapping each word to the images containing it, for ranking
+ * images by their words instead of matching every query feature against
+ * every database feature.
+ *
+ * The tree is trained on (a sample of) the database features: the features are
+ * clustered into branching clusters, each cluster is clustered again, and so on
+ * for depth levels. The leaves are the words. A feature is quantized by
+ * descending from the root to the closest child at each level, which costs
+ * branching*depth distances.
+ *
+ * Images are described by TF-IDF weighted word histograms normalized to unit
+ * L1 norm, and compared by the L1 distance of their histograms (between 0 for
+ * identical and 2 for disjoint histograms). The distance is accumulated over
+ * the posting lists of the query words only, so scoring takes time
+ * proportional to the lengths of these lists rather than to the number of
+ * database features.
+ *
+ * The following functions are supported:
+ *
+ * spVocabTreeCreate          - Trains the tree and builds the inverted file
+ * spVocabTreeDestroy         - Frees all resources
+ * spVocabTreeNumOfWords      - A getter of the number of words
+ * spVocabTreeNumOfPostings   - A getter of the total length of the posting lists
+ * spVocabTreeMemoryBytes     - A getter of the memory used by the tree and inverted file
+ * spVocabTreeQuantize        - Finds the word of a feature
+ * spVocabTreeScore           - Computes the distance of a query image to all images
+ */
+
+/** Type for defining the vocabulary tree **/
+typedef struct sp_vocab_tree_t SPVocabTree;
+
+/**
+ * Trains a vocabulary tree on siftDB and builds the inverted file of
+ * all database images.
+ *
+ * @param siftDB - sift features of every image
+ * @param nFeatures - number of sift features of each image
+ * @param numOfImages - number of images
+ * @param branching - number of children of each node (must be > 1)
+ * @param depth - number of levels below the root (must be > 0)
+ * @return
+ * NULL in case any of the arrays is NULL, numOfImages <= 0, branching <= 1,
+ * depth <= 0, the database has no features or allocation failure occurred
+ * Otherwise, the new vocabulary tree
+ */
+SPVocabTree* spVocabTreeCreate(SPPoint ***siftDB, int *nFeatures, int numOfImages,
+		int branching, int depth);
+
+/**
+ * Frees all resources associated with the tree.
+ * If tree is NULL nothing happens.
+ */
+void spVocabTreeDestroy(SPVocabTree *tree);
+
+/**
+ * A getter for the number of words (leaves) of the tree
+ *
+ * @param tree - the source tree
+ * @return the number of words, 0 if tree is NULL
+ */
+int spVocabTreeNumOfWords(SPVocabTree *tree);
+
+/**
+ * A getter for the total length of the posting lists, i.e. the number of
+ * distinct (word, image) pairs in the database
+ *
+ * @param tree - the source tree
+ * @return the number of postings, 0 if tree is NULL
+ */
+long spVocabTreeNumOfPostings(SPVocabTree *tree);
+
+/**
+ * A getter for the memory used by the tree nodes, centers and posting lists
+ *
+ * @param tree - the source tree
+ * @return the number of bytes, 0 if tree is NULL
+ */
+long spVocabTreeMemoryBytes(SPVocabTree *tree);
+
+/**
+ * Finds the word of a feature
+ *
+ * @param tree - the source tree
+ * @param feature - the feature
+ * @return the word (between 0 and the number of words - 1), -1 if any of
+ *         the arguments is NULL or the feature dimension does not match
+ */
+int spVocabTreeQuantize(SPVocabTree *tree, SPPoint *feature);
+
+/**
+ * Computes the L1 distance between the normalized TF-IDF histogram of a query
+ * image and that of every database image (images sharing no word with the
+ * query are at distance 2)
+ *
+ * @param tree - the source tree
+ * @param queryFeatures - sift features of the query image
+ * @param numOfQueryFeatures - number of query features
+ * @param selected - if not NULL, only images i for which selected[i] is
+ *                   non zero are scored (the others are at distance 2)
+ * @param dists - an array of size numOfImages in which the distances are stored
+ * @param scratch - the scratch space of the search (see sp_search_scratch)
+ * @return false if any of tree, queryFeatures, dists, scratch is NULL, a feature
+ *         dimension does not match or allocation failure occurred, true otherwise
+ */
+bool spVocabTreeScore(SPVocabTree *tree, SPPoint **queryFeatures, int numOfQueryFeatures,
+		const char *selected, double *dists, SPSearchScratch *scratch);
+
+
+#endif /* SP_VOCAB_TREE_H_ */